@@ -51,7 +51,7 @@ extern size_t devicesStatCount;
 
 static char* serialBuffer = NULL;
 static char* tempBuffer = NULL;
-#define SERIAL_BUFFER_SIZE 64
+#define SERIAL_BUFFER_SIZE 128 // export filters need room
 
 unsigned long lastheap = 0;
 uint16_t lastscanduration = SCAN_DURATION;
@@ -62,9 +62,88 @@ BLEScan *pBLEScan;
 
 
 static uint16_t processedDevicesCount = 0;
+static uint32_t scanCallbacksCount = 0; // onResult() invocations during the current round
 bool foundDeviceToggler = true;
 
 
+enum ScanDuplicateModes {
+  SCAN_DUPL_OFF        = 0, // host stack sees every advert of every device
+  SCAN_DUPL_CONTROLLER = 1  // controller drops repeated adverts until the next scan enable
+};
+
+// the controller filter type (address or address+data) is set at controller init from sdkconfig
+#if defined CONFIG_SCAN_DUPLICATE_TYPE
+  #define SCAN_DUPL_BUILT_TYPE CONFIG_SCAN_DUPLICATE_TYPE
+#elif defined CONFIG_BTDM_SCAN_DUPL_TYPE
+  #define SCAN_DUPL_BUILT_TYPE CONFIG_BTDM_SCAN_DUPL_TYPE
+#else
+  #define SCAN_DUPL_BUILT_TYPE 0
+#endif
+
+static const char* ScanDuplTypeNames[3] = { "address", "adv data", "address+data" };
+
+struct ScanModeStats {
+  uint32_t millis      = 0; // time spent scanning
+  uint32_t discoveries = 0; // devices new to today's DB
+  uint32_t callbacks   = 0; // onResult() invocations
+};
+
+ScanModeStats ScanDuplStats[2];
+static ScanDuplicateModes scanRoundDuplMode = SCAN_DUPL_OFF; // mode of the last round, its discoveries are known after the pipeline
+
+// BLEScan doesn't expose scan_duplicate, so the controller scan is enabled with these
+// before BLEScan::start(), whose own params and enable are then refused by the controller
+static esp_ble_scan_params_t ControllerScanParams = {
+  .scan_type          = BLE_SCAN_TYPE_ACTIVE,
+  .own_addr_type      = BLE_ADDR_TYPE_PUBLIC,
+  .scan_filter_policy = BLE_SCAN_FILTER_ALLOW_ALL,
+  .scan_interval      = 0x50,
+  .scan_window        = 0x30,
+  .scan_duplicate     = BLE_SCAN_DUPLICATE_ENABLE
+};
+
+ScanController ScanTuner( MIN_SCAN_DURATION, MAX_SCAN_DURATION, MAX_DEVICES_PER_SCAN );
+ScanRoundMeasure ScanMeasure;
+ScanModeScheduler ScanScheduler;
+static unsigned long scanRoundStartMillis = 0; // first sighting timestamp for devices of the current round
+static unsigned long pipelineStartMillis = 0; // after-scan pipeline start, for load measurement
+static unsigned int  pipelineStartEntries = 0; // DB entries at pipeline start, for write rate
+static byte scanDurationBeforeBurst = 0; // SCAN_DURATION to restore after an active burst, 0 = no burst
+
+static volatile bool scanRoundComplete = true;
+static volatile bool gapScanParamsSet = false;
+static volatile bool gapScanStarted = false;
+
+// GAP completions that BLEScan doesn't forward
+static void onGapEvent( esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param ) {
+  switch( event ) {
+    case ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT: gapScanParamsSet = true; break;
+    case ESP_GAP_BLE_SCAN_START_COMPLETE_EVT:     gapScanStarted = true;   break;
+    default: break;
+  }
+}
+
+// waits for a GAP completion flag, false on timeout
+static bool waitForGap( volatile bool &flag, uint16_t timeout = 500 ) {
+  unsigned long start = millis();
+  while ( !flag ) {
+    if ( millis() - start > timeout ) return false;
+    vTaskDelay( 1 );
+  }
+  return true;
+}
+
+static void onScanRoundComplete( BLEScanResults results ) {
+  scanRoundComplete = true;
+}
+
+// use this instead of BLEScan::stop() so the scan task stops waiting
+static void stopScanRound() {
+  BLEDevice::getScan()->stop();
+  scanRoundComplete = true;
+}
+
+
 enum AfterScanSteps {
   POPULATE  = 0,
   IFEXISTS  = 1,
@@ -121,13 +200,21 @@ class FoundDeviceCallbacks: public BLEAdvertisedDeviceCallbacks {
 
     void onResult( BLEAdvertisedDevice advertisedDevice ) {
 
+      LatencyProbe latencyProbe( LATENCY_CALLBACK );
       devicesStatCount++; // raw stats for heapgraph
+      scanCallbacksCount++;
 
       bool scanShouldStop =  deviceHasPayload( advertisedDevice );
 
       if ( onScanDone  ) return;
 
+      if ( BLEDupFilter.absorb( advertisedDevice ) ) {
+        // repeat within DUPFILTER_WINDOW: hits/rssi counters were bumped, no need to store/populate again
+        return;
+      }
+
       if ( scan_cursor < MAX_DEVICES_PER_SCAN ) {
+        int64_t storeStart = esp_timer_get_time();
         log_i("will store advertisedDevice in cache #%d", scan_cursor);
         BLEDevHelper.store( BLEDevScanCache[scan_cursor], advertisedDevice );
         //bool is_random = strcmp( BLEDevScanCache[scan_cursor]->ouiname, "[random]" ) == 0;
@@ -152,6 +239,8 @@ class FoundDeviceCallbacks: public BLEAdvertisedDeviceCallbacks {
           scan_cursor++;
           processedDevicesCount++;
         }
+        BLEDupFilter.storeTime += esp_timer_get_time() - storeStart;
+        BLEDupFilter.storeCount++;
         if ( scan_cursor == MAX_DEVICES_PER_SCAN ) {
           onScanDone = true;
         }
@@ -159,11 +248,8 @@ class FoundDeviceCallbacks: public BLEAdvertisedDeviceCallbacks {
         onScanDone = true;
       }
       if ( onScanDone ) {
-        advertisedDevice.getScan()->stop();
+        stopScanRound(); // early stop is measured by ScanTuner through the arrival rate
         scan_cursor = 0;
-        if ( SCAN_DURATION - 1 >= MIN_SCAN_DURATION ) {
-          SCAN_DURATION--;
-        }
       }
       foundDeviceToggler = !foundDeviceToggler;
       if (foundDeviceToggler) {
@@ -174,7 +260,7 @@ class FoundDeviceCallbacks: public BLEAdvertisedDeviceCallbacks {
         BLEActivityIcon.setStatus( ICON_STATUS_ADV_SCAN );
       }
       if( scanShouldStop ) {
-        advertisedDevice.getScan()->stop();
+        stopScanRound();
       }
     }
 };
@@ -234,6 +320,11 @@ class BLEScanUtils {
         return;
       }
       WRITE_PERI_REG(RTC_CNTL_BROWN_OUT_REG, 0); //disable brownout detector
+      BLEDupFilter.init();
+      BLEIndex.init( DB.hasPsram );
+      if ( STORAGE_BACKEND == 1 && SightingLog.begin() ) {
+        Storage = &SightingLog;
+      }
       startSerialTask();
       startScanCB();
       UI.begin();
@@ -324,7 +415,7 @@ class BLEScanUtils {
       if ( scanTaskRunning ) {
         log_d("Stopping scan" );
         scanTaskRunning = false;
-        BLEDevice::getScan()->stop();
+        stopScanRound();
         while (!scanTaskStopped) {
           log_d("Waiting for scan to stop...");
           vTaskDelay(1000);
@@ -342,8 +433,11 @@ class BLEScanUtils {
     static void doRestart( void * param = NULL ) {
       // "restart now" command skips db replication
       if ( strcmp( "now", (const char*)param ) != 0 ) {
-        DB.updateDBFromCache( BLEDevRAMCache, false, false );
+        Storage->replicate( BLEDevRAMCache, false, false );
       }
+      Storage->flush();
+      Sightings.flush();
+      DB.memDBFlush(); // no-op unless the DB lives in PSRAM
       ESP.restart();
     }
 
@@ -502,6 +596,335 @@ class BLEScanUtils {
       if ( scanWasRunning ) startScanCB();
     }
 
+    static void dupFilterCB( void * param = NULL ) {
+      if( param != NULL ) {
+        if( strcmp( (const char*)param, "off" ) == 0 ) {
+          BLEDupFilter.setWindow( 0 );
+        } else {
+          BLEDupFilter.setWindow( atoi( (const char*) param ) );
+        }
+      }
+      BLEDupFilter.dumpStats();
+    }
+
+    static void scanDuplCB( void * param = NULL ) {
+      if( param != NULL ) {
+        char *args = (char*)param;
+        char *period;
+        char *mode = strtok_r( args, " ", &period );
+        if( mode != NULL && strcmp( mode, "on" ) == 0 ) {
+          ScanDuplMode = SCAN_DUPL_CONTROLLER;
+        } else if( mode != NULL && strcmp( mode, "off" ) == 0 ) {
+          ScanDuplMode = SCAN_DUPL_OFF;
+        }
+        if( period != NULL && atoi( period ) > 0 ) {
+          SCAN_DUPL_RESET_PERIOD = atoi( period );
+        }
+      }
+      Serial.printf("Controller duplicate filter: %s, by %s, reset every %ds\n",
+        ScanDuplMode == SCAN_DUPL_CONTROLLER ? "on" : "off",
+        ScanDuplTypeNames[SCAN_DUPL_BUILT_TYPE%3],
+        SCAN_DUPL_RESET_PERIOD
+      );
+      const char* modeNames[2] = { "off", "on" };
+      for( byte i=0; i<2; i++ ) {
+        float minutes = (float)ScanDuplStats[i].millis / 60000;
+        Serial.printf("  [filter %3s] scanned: %6ds, new devices: %6d (%.2f/mn), callbacks: %8d (%.2f/mn)\n",
+          modeNames[i],
+          ScanDuplStats[i].millis / 1000,
+          ScanDuplStats[i].discoveries,
+          minutes > 0 ? ScanDuplStats[i].discoveries / minutes : 0,
+          ScanDuplStats[i].callbacks,
+          minutes > 0 ? ScanDuplStats[i].callbacks / minutes : 0
+        );
+      }
+    }
+
+    static void scanStatsCB( void * param = NULL ) {
+      Serial.printf("[ScanTuner] %s, rounds: %d, arrival: %.2f/s, discovery: %.2f/s, load: %.0f%%, writes: %.2f/s\n",
+        ScanAdaptive ? "adaptive" : "frozen",
+        ScanTuner.rounds,
+        ScanTuner.arrivalRate,
+        ScanTuner.discoveryRate,
+        ScanTuner.load * 100,
+        ScanTuner.writeRate
+      );
+      Serial.printf("[ScanTuner] duration: %ds, interval: 0x%02x, window: 0x%02x, mode: %s\n",
+        SCAN_DURATION,
+        ScanInterval,
+        ScanWindow,
+        ScanActive ? "active" : "passive"
+      );
+      Serial.printf("[Scheduler] %s, active: %ds (%.1f%%), passive: %ds, bursts: %d, requests: %d, pending: %d\n",
+        ScanHybrid ? "hybrid" : "off",
+        ScanScheduler.activeMillis / 1000,
+        ScanScheduler.activeShare() * 100,
+        ScanScheduler.passiveMillis / 1000,
+        ScanScheduler.bursts,
+        ScanScheduler.requests,
+        ScanScheduler.pending()
+      );
+      Serial.printf("[Scheduler] discovery latency: avg %dms, max %dms (%d devices)\n",
+        ScanScheduler.averageLatency(),
+        ScanScheduler.latencyMax,
+        ScanScheduler.latencyCount
+      );
+      Serial.printf("[DB] batched lookups: %d, per-device queries saved: %d\n",
+        DB.batchQueries,
+        DB.batchAnswers
+      );
+    }
+
+    static void latencyCB( void * param = NULL ) {
+      if ( param != NULL && strcmp( (const char*)param, "reset" ) == 0 ) {
+        LatencyStats.reset();
+        Serial.println("Latency histograms cleared");
+      } else if ( param != NULL && strcmp( (const char*)param, "dump" ) == 0 ) {
+        xTaskCreatePinnedToCore(latencyDumpTask, "latencyDumpTask", 5000, NULL, 2, NULL, 1); /* last = Task Core */
+      } else {
+        LatencyStats.print();
+      }
+    }
+
+    static void latencyDumpTask( void * param = NULL ) {
+      isQuerying = true;
+      if ( LatencyStats.dump( BLE_FS, LATENCY_DUMP_PATH ) ) {
+        Serial.printf("Latency histograms saved to %s\n", LATENCY_DUMP_PATH );
+      } else {
+        Serial.printf("Latency histograms could not be saved to %s\n", LATENCY_DUMP_PATH );
+      }
+      isQuerying = false;
+      vTaskDelete( NULL );
+    }
+
+    static void dbProfileCB( void * param = NULL ) {
+      if ( param != NULL ) {
+        if ( strncmp( (const char*)param, "bench", 5 ) == 0 ) {
+          xTaskCreatePinnedToCore(dbBenchTask, "dbBenchTask", 8192, param, 2, NULL, 1); /* last = Task Core */
+          return;
+        }
+        for ( byte id = 0; id < DB_PROFILES_COUNT; id++ ) {
+          if ( strcmp( (const char*)param, DBProfiles[id].name ) == 0 ) {
+            DB.setProfile( id );
+            setPrefs();
+          }
+        }
+      }
+      const DBProfile &profile = DB.profile();
+      Serial.printf("DB profile: %s (journal: %s, sync: %s, cache: %dKB, temp_store: %d, page_size: %d, %s)%s\n",
+        profile.name,
+        profile.journal_mode,
+        profile.synchronous,
+        -DB.cacheSize( profile ),
+        profile.temp_store,
+        profile.page_size,
+        profile.persistent ? "persistent" : "reopened",
+        DB.inMemory ? " [inactive: DB is in PSRAM]" : ""
+      );
+      Serial.printf("WAL checkpoints: %d\n", DB.checkpoints );
+      DBStats.dumpStats();
+    }
+
+    static void dbBenchTask( void * param = NULL ) {
+      const char* rowsStr = strchr( (const char*)param, ' ' );
+      uint16_t rows = rowsStr != NULL ? atoi( rowsStr+1 ) : 0;
+      if ( rows == 0 ) rows = 100;
+      DB.benchProfiles( rows );
+      vTaskDelete( NULL );
+    }
+
+    static void dbStatsCB( void * param = NULL ) {
+      if ( param != NULL && strcmp( (const char*)param, "reset" ) == 0 ) {
+        DBStats.reset();
+      }
+      DBStats.dumpStats();
+      DBStats.dumpProfiles();
+      DBStats.dumpStatus( DB.inMemory ? DB.MemDB : DB.FileDB );
+      Serial.printf("[DBStats] soft heap limit: %dKB, memory releases: %d (%s)\n", (int)( DB.heapLimit / 1024 ), DB.memoryReleases, DB.canReleaseMemory ? "release + cache" : "cache only" );
+    }
+
+    static void recoveryCB( void * param = NULL ) {
+      Salvage.dumpStats();
+    }
+
+    static void syncCB( void * param = NULL ) {
+      RecordSync.dumpStats();
+    }
+
+    static void queryCB( void * param = NULL ) {
+      if ( param == NULL ) {
+        Serial.println("Usage: query vendors|manufs [n], query names|manufnames|ouinames, query seen <t1> <t2>, query rssi <min>, query stop");
+        return;
+      }
+      if ( strcmp( (const char*)param, "stop" ) == 0 ) {
+        Query.stop();
+        return;
+      }
+      if ( !Query.start( (const char*)param ) ) return;
+      if ( scanTaskRunning ) {
+        Serial.println("Query will run between scan rounds");
+      } else {
+        xTaskCreatePinnedToCore(queryTask, "queryTask", 8192, NULL, 2, NULL, 1); /* last = Task Core */
+      }
+    }
+
+    // drives the query while there are no scan rounds to do it
+    static void queryTask( void * param = NULL ) {
+      while ( Query.running() && !scanTaskRunning ) {
+        Query.step();
+        vTaskDelay( QUERY_PAGE_PAUSE );
+      }
+      vTaskDelete( NULL );
+    }
+
+    static void exportCB( void * param = NULL ) {
+      if ( param != NULL && strcmp( (const char*)param, "stop" ) == 0 ) {
+        Export.stopRequested = true;
+        return;
+      }
+      if ( !Export.prepare( (const char*)param ) ) {
+        Serial.println("An export is already running, use 'export stop' to abort it");
+        return;
+      }
+      xTaskCreatePinnedToCore(exportTask, "exportTask", 8192, NULL, 2, NULL, 1); /* last = Task Core */
+    }
+
+    static void exportTask( void * param = NULL ) {
+      while ( Export.snapshotRequested ) {
+        if ( scanTaskStopped ) {
+          Export.step(); // no scan rounds to do it
+        } else {
+          vTaskDelay( 100 );
+        }
+      }
+      Export.run();
+      vTaskDelete( NULL );
+    }
+
+    static void retentionCB( void * param = NULL ) {
+      if ( param != NULL && strcmp( (const char*)param, "run" ) == 0 ) {
+        Retention.trigger();
+        Serial.println("Retention pass will start after the current scan");
+      }
+      Retention.dumpStats();
+    }
+
+    static void sightingsCB( void * param = NULL ) {
+      if ( param != NULL && isdigit( ((const char*)param)[0] ) ) {
+        SIGHTINGS_INTERVAL = atoi( (const char*)param );
+      }
+      Sightings.dumpStats();
+    }
+
+    static void storageCB( void * param = NULL ) {
+      if ( param != NULL ) {
+        const char* args = (const char*)param;
+        if ( strncmp( args, "bench", 5 ) == 0 || strncmp( args, "compact ", 8 ) == 0 ) {
+          xTaskCreatePinnedToCore(storageTask, "storageTask", 8192, param, 2, NULL, 1); /* last = Task Core */
+          return;
+        }
+        if ( strcmp( args, "sqlite" ) == 0 && Storage != &SQLiteStorage ) {
+          SightingLog.end();
+          SightingLog.followsDB = false;
+          Storage = &SQLiteStorage;
+          STORAGE_BACKEND = 0;
+          setPrefs();
+        } else if ( strcmp( args, "log" ) == 0 && Storage != &SightingLog ) {
+          if ( SightingLog.begin() ) {
+            Storage = &SightingLog;
+            STORAGE_BACKEND = 1;
+            setPrefs();
+          }
+        }
+      }
+      Serial.printf("Storage backend: %s\n", Storage->name() );
+      if ( Storage == &SightingLog ) {
+        SightingLog.dumpStats();
+      }
+      DBStats.dumpStats();
+    }
+
+    static void storageTask( void * param = NULL ) {
+      const char* args = (const char*)param;
+      if ( strncmp( args, "compact ", 8 ) == 0 ) {
+        SightingLogBackend::compact( args + 8, Storage == &SightingLog ? SightingLog.path : NULL );
+      } else {
+        const char* rowsStr = strchr( args, ' ' );
+        uint16_t rows = rowsStr != NULL ? atoi( rowsStr+1 ) : 0;
+        if ( rows == 0 ) rows = 100;
+        DB.benchProfiles( rows );
+        SightingLogBackend::bench( rows );
+      }
+      vTaskDelete( NULL );
+    }
+
+    static void flushDBCB( void * param = NULL ) {
+      if ( !DB.inMemory ) {
+        Serial.printf("%s is not in PSRAM, nothing to flush\n", DB.BLEMacsDbFSPath );
+        return;
+      }
+      if ( param != NULL && isdigit( ((const char*)param)[0] ) ) {
+        MEMDB_MAX_LOSS = atoi( (const char*)param );
+      }
+      xTaskCreatePinnedToCore(flushDBTask, "flushDBTask", 5000, NULL, 2, NULL, 1); /* last = Task Core */
+    }
+
+    static void flushDBTask( void * param = NULL ) {
+      while ( isQuerying ) {
+        vTaskDelay(10);
+      }
+      if ( scanTaskRunning ) {
+        // the scan task writes to MemDB, the flush happens between two rounds
+        uint32_t flushes = DB.flushes;
+        DB.flushRequested = true;
+        while ( DB.flushRequested && scanTaskRunning ) {
+          vTaskDelay(100);
+        }
+        if ( DB.flushes == flushes ) {
+          Serial.println("Flush failed or scan stopped before it ran");
+        }
+      } else {
+        DB.memDBFlush();
+      }
+      Serial.printf("Flushes: %d, last: %d pages in %dms, max loss window: %ds\n", DB.flushes, DB.flushPages, DB.flushMillis, MEMDB_MAX_LOSS );
+      vTaskDelete( NULL );
+    }
+
+    static void findCB( void * param = NULL ) {
+      if ( param == NULL ) {
+        Serial.println("Usage: find <text>");
+        return;
+      }
+      xTaskCreatePinnedToCore(findTask, "findTask", 8192, param, 2, NULL, 1); /* last = Task Core */
+    }
+
+    static void findTask( void * param = NULL ) {
+      BLEIndex.find( (const char*)param );
+      vTaskDelete( NULL );
+    }
+
+    static void indexCB( void * param = NULL ) {
+      xTaskCreatePinnedToCore(indexTask, "indexTask", 5000, param, 2, NULL, 1); /* last = Task Core */
+    }
+
+    static void indexTask( void * param = NULL ) {
+      char address[MAC_LEN+1] = {'\0'}; // the serial buffer is reused by the next command
+      if ( param != NULL ) copy( address, (const char*)param, MAC_LEN );
+      while ( isQuerying ) {
+        vTaskDelay(10);
+      }
+      if ( param != NULL ) {
+        BLEIndexEntry entry;
+        if ( BLEIndex.lookup( address, entry ) ) {
+          Serial.printf("%s first seen: %d, last seen: %d, hits: %d\n", address, entry.first_seen, entry.last_seen, entry.hits );
+        } else {
+          Serial.printf("%s was never seen\n", address );
+        }
+      }
+      BLEIndex.dumpStats();
+      vTaskDelete( NULL );
+    }
+
     static void toggleEchoCB( void * param = NULL ) {
       Out.serialEcho = !Out.serialEcho;
       setPrefs();
@@ -614,6 +1037,22 @@ class BLEScanUtils {
         { "toggleEcho",    toggleEchoCB,           "Toggle BLECards in the Serial Console (persistent)" },
         { "dump",          startDumpCB,            "Dump returning BLE devices to the display and updates DB" },
         { "setBrightness", setBrightnessCB,        "Set brightness to [value] (0-255)" },
+        { "dupFilter",     dupFilterCB,            "Show duplicate filter stats, set window to [seconds] or 'off'" },
+        { "scanStats",     scanStatsCB,            "Show adaptive scan and passive/active scheduler stats" },
+        { "dbProfile",     dbProfileCB,            "Show or set DB profile [safe|balanced|fast], or [bench] them with [rows] inserts" },
+        { "dbstats",       dbStatsCB,              "Show sqlite I/O, per statement kind timings, memory and cache stats, or [reset] them" },
+        { "recovery",      recoveryCB,             "Show DB corruption recovery and salvage stats" },
+        { "sync",          syncCB,                 "Show the last record merge from a peer collector" },
+        { "query",         queryCB,                "Query the DB: vendors|manufs [n], names|manufnames|ouinames, seen <t1> <t2>, rssi <min>, stop" },
+        { "export",        exportCB,               "Stream a DB as [format=ndjson|csv] [file=] [from=] [to=] [vendor=] [rssi=], or [stop]" },
+        { "retention",     retentionCB,            "Show daily DB rollup/retention status, [run] a pass now" },
+        { "sightings",     sightingsCB,            "Show sightings stats, set downsampling interval to [seconds] (0 = off)" },
+        { "storage",       storageCB,              "Show or set storage backend [sqlite|log], [bench] both with [rows] inserts, [compact] a .log file" },
+        { "flushDB",       flushDBCB,              "Write the PSRAM DB to the SD now, set max loss window to [seconds]" },
+        { "find",          findCB,                 "Find devices by partial name/vendor <text> in the long-term index" },
+        { "index",         indexCB,                "Show long-term device index stats, or lookup [address]" },
+        { "latency",       latencyCB,              "Show per-stage latency histograms, [reset] them or [dump] them to " LATENCY_DUMP_PATH },
+        { "scanDupl",      scanDuplCB,             "Controller duplicate filter [on|off] [reset period], show discovery rates" },
         { "ls",            listDirCB,              "Show [dir] Content on the SD" },
         { "rm",            rmFileCB,               "Delete [file] from the SD" },
         { "restart",       restartCB,              "Restart BLECollector ('restart now' to skip replication)" },
@@ -653,6 +1092,9 @@ class BLEScanUtils {
         { "foundTimeServer",     foundTimeServer },
         { "RTCisRunning",        RTCisRunning },
         { "ForceBleTime",        ForceBleTime },
+        { "ScanAdaptive",        ScanAdaptive },
+        { "ScanHybrid",          ScanHybrid },
+        { "RetentionArchive",    RetentionArchive },
         { "DayChangeTrigger",    DayChangeTrigger },
         { "HourChangeTrigger",   HourChangeTrigger },
         { "fileSharingEnabled",  fileSharingEnabled },
@@ -772,10 +1214,17 @@ class BLEScanUtils {
         FoundDeviceCallback = new FoundDeviceCallbacks(); // collect/store BLE data
       }
       pBLEScan = BLEDevice::getScan(); //create new scan
+      BLEDevice::setCustomGapHandler( onGapEvent );
       pBLEScan->setAdvertisedDeviceCallbacks( FoundDeviceCallback );
-      pBLEScan->setActiveScan(true); //active scan uses more power, but get results faster
-      pBLEScan->setInterval(0x50); // 0x50
-      pBLEScan->setWindow(0x30); // 0x30
+      pBLEScan->setActiveScan( ScanActive ); //active scan uses more power, but get results faster
+      pBLEScan->setInterval( ScanInterval ); // 0x50
+      pBLEScan->setWindow( ScanWindow ); // 0x30
+      ScanParams initialParams;
+      initialParams.duration = SCAN_DURATION;
+      initialParams.interval = ScanInterval;
+      initialParams.window   = ScanWindow;
+      initialParams.active   = ScanActive;
+      ScanTuner.begin( initialParams );
     }
 
 
@@ -792,7 +1241,7 @@ class BLEScanUtils {
         if ( onAfterScanSteps( onAfterScanStep, scan_cursor ) ) continue;
         dumpStats("BeforeScan::");
         onBeforeScan();
-        pBLEScan->start(SCAN_DURATION);
+        scanRound( SCAN_DURATION );
         onAfterScan();
         //DB.maintain();
         dumpStats("AfterScan:::");
@@ -803,6 +1252,47 @@ class BLEScanUtils {
     }
 
 
+    static void scanRound( uint32_t duration ) {
+      unsigned long roundStart = millis();
+      scanRoundStartMillis = roundStart;
+      scanCallbacksCount = 0;
+      pBLEScan->setActiveScan( ScanActive );
+      pBLEScan->setInterval( ScanInterval );
+      pBLEScan->setWindow( ScanWindow );
+      if ( ScanDuplMode == SCAN_DUPL_OFF ) {
+        scanRoundComplete = false;
+        pBLEScan->start( duration ); // blocking
+      } else {
+        // each scan enable resets the controller filter: the round length is the per-device refresh cadence
+        if ( duration > SCAN_DUPL_RESET_PERIOD ) {
+          duration = SCAN_DUPL_RESET_PERIOD;
+        }
+        ControllerScanParams.scan_type     = ScanActive ? BLE_SCAN_TYPE_ACTIVE : BLE_SCAN_TYPE_PASSIVE;
+        ControllerScanParams.scan_interval = ScanInterval;
+        ControllerScanParams.scan_window   = ScanWindow;
+        // params once, then one enable, each confirmed before the next call
+        gapScanParamsSet = false;
+        esp_ble_gap_set_scan_params( &ControllerScanParams );
+        if ( !waitForGap( gapScanParamsSet ) ) log_e("Scan params not confirmed");
+        gapScanStarted = false;
+        esp_ble_gap_start_scanning( duration );
+        if ( !waitForGap( gapScanStarted ) ) log_e("Scan start not confirmed");
+        scanRoundComplete = false;
+        pBLEScan->start( duration, onScanRoundComplete, false ); // non blocking, only arms BLEScan for the results
+        while ( !scanRoundComplete ) {
+          vTaskDelay( 10 );
+        }
+      }
+      scanRoundComplete = true;
+      ScanMeasure.scanMillis = millis() - roundStart;
+      ScanMeasure.devices    = processedDevicesCount;
+      ScanScheduler.roundDone( ScanActive, ScanMeasure.scanMillis, millis() );
+      scanRoundDuplMode = (ScanDuplicateModes)ScanDuplMode;
+      ScanDuplStats[ScanDuplMode].millis    += millis() - roundStart;
+      ScanDuplStats[ScanDuplMode].callbacks += scanCallbacksCount;
+    }
+
+
     static bool onAfterScanSteps( byte &onAfterScanStep, uint16_t &scan_cursor ) {
       switch ( onAfterScanStep ) {
         case POPULATE: // 0
@@ -850,6 +1340,7 @@ class BLEScanUtils {
         log_w("empty addess");
         return true; // end of cache
       }
+      LatencyProbe latencyProbe( LATENCY_POPULATE );
       populate( BLEDevScanCache[_scan_cursor] );
       return true;
     }
@@ -865,7 +1356,12 @@ class BLEScanUtils {
         onScanPostPopulated = true;
         return false;
       }
+      LatencyProbe latencyProbe( LATENCY_IFEXISTS );
+      if ( _scan_cursor == 0 ) {
+        onScanBatchLookup();
+      }
       int deviceIndexIfExists = -1;
+      bool isUnseen = false;
       deviceIndexIfExists = getDeviceCacheIndex( BLEDevScanCache[_scan_cursor]->address );
       if ( deviceIndexIfExists > -1 ) {
         inCacheCount++;
@@ -888,7 +1384,7 @@ class BLEScanUtils {
           BLEDevHelper.copyItem( BLEDevScanCache[_scan_cursor], BLEDevRAMCache[nextCacheIndex] );
           log_i( "Device %d / %s is anonymous, won't be inserted", _scan_cursor, BLEDevScanCache[_scan_cursor]->address, BLEDevScanCache[_scan_cursor]->hits );
         } else {
-          deviceIndexIfExists = DB.deviceExists( BLEDevScanCache[_scan_cursor]->address ); // will load returning devices from DB if necessary
+          deviceIndexIfExists = Storage->exists( BLEDevScanCache[_scan_cursor]->address ); // will load returning devices from DB if necessary
           if (deviceIndexIfExists > -1) {
             uint16_t nextCacheIndex = BLEDevHelper.getNextCacheIndex( BLEDevRAMCache, BLEDevCacheIndex );
             BLEDevHelper.reset( BLEDevRAMCache[nextCacheIndex] );
@@ -907,14 +1403,47 @@ class BLEScanUtils {
           } else {
             // will be inserted after rendering
             BLEDevScanCache[_scan_cursor]->in_db = false;
-            log_i( "Device %d / %s is not in DB", _scan_cursor, BLEDevScanCache[_scan_cursor]->address );
+            BLEIndexEntry indexEntry;
+            if ( BLEIndex.lookup( BLEDevScanCache[_scan_cursor]->address, indexEntry ) ) {
+              log_i( "Device %d / %s is not in DB, seen before (first: %d, last: %d, hits: %d)", _scan_cursor, BLEDevScanCache[_scan_cursor]->address, indexEntry.first_seen, indexEntry.last_seen, indexEntry.hits );
+            } else {
+              isUnseen = true;
+              log_i( "Device %d / %s is not in DB", _scan_cursor, BLEDevScanCache[_scan_cursor]->address );
+            }
           }
         }
       }
+      if ( !ScanActive && ( isUnseen || isEmpty( BLEDevScanCache[_scan_cursor]->name ) || isEmpty( BLEDevScanCache[_scan_cursor]->uuid ) ) ) {
+        // a scan response may hold the missing fields
+        ScanScheduler.request( BLEDevScanCache[_scan_cursor]->address, scanRoundStartMillis );
+      }
       return true;
     }
 
 
+    // one DB query for all the devices of this round that aren't in the RAM cache,
+    // anonymous ones are looked up too since they're only populated one by one,
+    // devices the long-term index has never seen can't be in today's DB either
+    static void onScanBatchLookup() {
+      const char* addresses[MAX_DEVICES_PER_SCAN];
+      const char* unseen[MAX_DEVICES_PER_SCAN];
+      uint8_t count = 0, unseenCount = 0;
+      for ( uint16_t i = 0; i < devicesCount && i < MAX_DEVICES_PER_SCAN; i++ ) {
+        if ( isEmpty( BLEDevScanCache[i]->address ) ) continue;
+        if ( getDeviceCacheIndex( BLEDevScanCache[i]->address ) > -1 ) continue;
+        if ( BLEIndex.mayContain( BLEDevScanCache[i]->address ) ) {
+          addresses[count++] = BLEDevScanCache[i]->address;
+        } else {
+          unseen[unseenCount++] = BLEDevScanCache[i]->address;
+        }
+      }
+      Storage->prefetch( addresses, count );
+      for ( uint8_t i = 0; i < unseenCount; i++ ) {
+        DB.batchAbsent( unseen[i] );
+      }
+    }
+
+
     static bool onScanRender( uint16_t _scan_cursor ) {
       if ( onScanRendered ) {
         log_v("onScanRendered = true");
@@ -925,6 +1454,7 @@ class BLEScanUtils {
         onScanRendered = true;
         return false;
       }
+      LatencyProbe latencyProbe( LATENCY_RENDER );
       UI.BLECardTheme.setTheme( IN_CACHE_ANON );
       BLEDevTmp = BLEDevScanCache[_scan_cursor];
       UI.printBLECard( (BlueToothDeviceLink){.cacheIndex=_scan_cursor,.device=BLEDevTmp} ); // render
@@ -955,11 +1485,12 @@ class BLEScanUtils {
       if ( isEmpty( BLEDevScanCache[_scan_cursor]->address ) ) {
         return true;
       }
+      LatencyProbe latencyProbe( LATENCY_PROPAGATE );
       if ( BLEDevScanCache[_scan_cursor]->is_anonymous || BLEDevScanCache[_scan_cursor]->in_db ) { // don't DB-insert anon or duplicates
         sprintf( processMessage, processTemplateLong, "Released ", _scan_cursor + 1, " / ", devicesCount );
         if ( BLEDevScanCache[_scan_cursor]->is_anonymous ) AnonymousCacheHit++;
       } else {
-        if ( DB.insertBTDevice( BLEDevScanCache[_scan_cursor] ) == DBUtils::INSERTION_SUCCESS ) {
+        if ( Storage->insert( BLEDevScanCache[_scan_cursor] ) == DBUtils::INSERTION_SUCCESS ) {
           sprintf( processMessage, processTemplateLong, "Saved ", _scan_cursor + 1, " / ", devicesCount );
           log_d( "Device %d successfully inserted in DB", _scan_cursor );
           entries++;
@@ -968,14 +1499,65 @@ class BLEScanUtils {
           sprintf( processMessage, processTemplateLong, "Failed ", _scan_cursor + 1, " / ", devicesCount );
         }
       }
+      if ( !BLEDevScanCache[_scan_cursor]->is_anonymous && BLEDevScanCache[_scan_cursor]->in_db ) {
+        BLEIndex.touch( BLEDevScanCache[_scan_cursor]->address, BLEDevScanCache[_scan_cursor]->name, BLEDevScanCache[_scan_cursor]->ouiname, BLEDevScanCache[_scan_cursor]->manufname ); // long-term index follows the daily DB
+        Sightings.add( BLEDevScanCache[_scan_cursor]->address, BLEDevScanCache[_scan_cursor]->rssi );
+      }
       BLEDevHelper.reset( BLEDevScanCache[_scan_cursor] ); // discard
       UI.headerStats( processMessage );
       return true;
     }
 
 
+    // feeds the last round measurements to ScanTuner and applies the new scan parameters
+    static void tuneScanParams() {
+      if ( scan_rounds == 0 ) return; // nothing measured yet
+      ScanMeasure.processMillis = millis() - pipelineStartMillis;
+      ScanMeasure.dbWrites      = entries > pipelineStartEntries ? entries - pipelineStartEntries : 0;
+      ScanMeasure.newDevices    = ScanMeasure.dbWrites; // inserts = devices new to today's DB
+      ScanDuplStats[scanRoundDuplMode].discoveries += ScanMeasure.newDevices;
+      const ScanParams &params  = ScanTuner.next( ScanMeasure );
+      if ( scanDurationBeforeBurst > 0 ) {
+        SCAN_DURATION = scanDurationBeforeBurst; // the last round was a burst
+        scanDurationBeforeBurst = 0;
+      }
+      if ( ScanAdaptive ) {
+        SCAN_DURATION = params.duration;
+        ScanInterval  = params.interval;
+        ScanWindow    = params.window;
+        ScanActive    = params.active;
+      }
+      if ( ScanHybrid ) {
+        ScanActive = ScanScheduler.nextIsActive( ScanTuner.overloaded() );
+        if ( ScanActive && SCAN_DURATION > ScanScheduler.burstDuration ) {
+          scanDurationBeforeBurst = SCAN_DURATION;
+          SCAN_DURATION = ScanScheduler.burstDuration; // short active burst
+        }
+      }
+      if ( !ScanAdaptive && !ScanHybrid ) return;
+      log_i("[ScanTuner] arrival: %.2f/s, discovery: %.2f/s, load: %.0f%%, writes: %.2f/s => duration: %ds, window: 0x%02x/0x%02x, %s",
+        ScanTuner.arrivalRate,
+        ScanTuner.discoveryRate,
+        ScanTuner.load * 100,
+        ScanTuner.writeRate,
+        SCAN_DURATION,
+        ScanWindow,
+        ScanInterval,
+        ScanActive ? "active" : "passive"
+      );
+    }
+
     static void onBeforeScan() {
       DB.maintain();
+      Storage->flush();
+      Sightings.flush(); // one transaction for the previous round
+      Retention.step(); // bounded chunk of rollup/cleanup work
+      Query.step(); // one page of the running 'query', if any
+      Export.step(); // copies today's DB for a running 'export'
+      Salvage.step(); // merges rows rescued from a quarantined DB
+      DB.checkpoint(); // WAL profiles only
+      BLEIndex.flush(); // sightings from the previous round
+      tuneScanParams();
       UI.headerStats("Scan in progress");
       UI.startBlink();
       processedDevicesCount = 0;
@@ -1026,25 +1608,20 @@ class BLEScanUtils {
       UI.headerStats("Showing results ...");
       devicesCount = processedDevicesCount;
       BLEDevice::getScan()->clearResults();
-      if ( devicesCount < MAX_DEVICES_PER_SCAN ) {
-        if ( SCAN_DURATION + 1 < MAX_SCAN_DURATION ) {
-          SCAN_DURATION++;
-        }
-      } else if ( devicesCount > MAX_DEVICES_PER_SCAN ) {
-        if ( SCAN_DURATION - 1 >= MIN_SCAN_DURATION ) {
-          SCAN_DURATION--;
-        }
+      if ( devicesCount > MAX_DEVICES_PER_SCAN ) {
         log_w("Cache overflow (%d results vs %d slots), truncating results...", devicesCount, MAX_DEVICES_PER_SCAN);
         devicesCount = MAX_DEVICES_PER_SCAN;
-      } else {
-        // same amount
       }
       sessDevicesCount += devicesCount;
+      BLEDupFilter.flush(); // repeat counters to the RAM cache or the DB
       notInCacheCount = 0;
       inCacheCount = 0;
       onScanDone = true;
       scan_cursor = 0;
 
+      pipelineStartMillis  = millis();
+      pipelineStartEntries = entries;
+
       UI.update();
 
     }
@@ -1086,7 +1663,7 @@ class BLEScanUtils {
       lastheap = freeheap;
       lastscanduration = SCAN_DURATION;
 
-      log_i("%s[Scan#%02d][%s][Duration%s%d][Processed:%d of %d][Heap%s%d / %d] [Cache hits][BLEDevCards:%d][Anonymous:%d][Oui:%d][Vendor:%d]\n",
+      log_i("%s[Scan#%02d][%s][Duration%s%d][Processed:%d of %d][Heap%s%d / %d] [Cache hits][BLEDevCards:%d][Anonymous:%d][Oui:%d][Vendor:%d][Absorbed:%d]\n",
         prefixStr,
         scan_rounds,
         hhmmssString,
@@ -1100,7 +1677,8 @@ class BLEScanUtils {
         BLEDevCacheHit,
         AnonymousCacheHit,
         OuiCacheHit,
-        VendorCacheHit
+        VendorCacheHit,
+        BLEDupFilter.Filter.absorbed
        );
     }
 
@@ -1111,6 +1689,8 @@ class BLEScanUtils {
       Out.serialEcho   = preferences.getBool("serialEcho", true);
       UI.filterVendors = preferences.getBool("filterVendors", false);
       UI.brightness    = preferences.getUChar("brightness", BASE_BRIGHTNESS);
+      DB_PROFILE       = preferences.getUChar("dbProfile", DB_PROFILE);
+      STORAGE_BACKEND  = preferences.getUChar("storage", STORAGE_BACKEND);
       log_w("Defrosted brightness: %d", UI.brightness );
       preferences.end();
     }
@@ -1119,6 +1699,8 @@ class BLEScanUtils {
       preferences.putBool("serialEcho", Out.serialEcho);
       preferences.putBool("filterVendors", UI.filterVendors );
       preferences.putUChar("brightness", UI.brightness );
+      preferences.putUChar("dbProfile", DB_PROFILE );
+      preferences.putUChar("storage", STORAGE_BACKEND );
       preferences.end();
     }
 
@@ -149,6 +149,7 @@ BlueToothDevice** BLEDevRAMCache = NULL; // store returning devices here
 BlueToothDevice** BLEDevScanCache = NULL; // store scanned devices before analysis
 BlueToothDevice*  BLEDevTmp = NULL; // temporary placeholder used to render BLE Card, explicitly outside SPIram
 BlueToothDevice*  BLEDevDBCache = NULL; // temporary placeholder used to hold DB result
+BlueToothDevice*  BLEDevBatchCache[MAX_DEVICES_PER_SCAN]; // DB results from the batched lookup of a scan round
 
 static int BLEDEVCACHE_SIZE; // will be set after PSRam detection
 
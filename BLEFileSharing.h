@@ -31,6 +31,55 @@
 
 #define TICKS_TO_DELAY 1000
 
+/*
+ * File transfers are pipelined: the sender reads the file ahead in two
+ * FILESHARING_READ_BUFFSIZE buffers while writing MTU-sized chunks without
+ * response, within the credit window of FileSharingWindow.h (FS_OP_ACK
+ * every FILESHARING_ACK_INTERVAL bytes, FILESHARING_WINDOW bytes in flight).
+ * The client asks for a short connection interval and 251-byte link layer
+ * packets after connecting.
+ * Route messages are described in FileSharingProtocol.h, the DB check and
+ * the delta sync in FileSharingDelta.h.
+ */
+#define FILESHARING_READ_BUFFSIZE 4096
+
+/*
+ * The receiver never writes to the SD from the GATT callback: packets are
+ * copied into one of two FILERECEIVER_BUFFSIZE buffers and full buffers are
+ * handed to FileReceiverWriteTask, so the FAT sees a few large writes and
+ * the BT stack isn't stalled by the SD.
+ */
+#define FILERECEIVER_BUFFSIZE 16384 // multiple of the SD sector size
+
+/*
+ * Transfers are resumable: every data packet starts with a sequence number
+ * and the crc32 of its payload, and the receiver writes to "<file>.part"
+ * next to a "<file>.resume" holding the size and the crc32 of the first
+ * FILESHARING_FILEID_SIZE bytes of the source. After filename and size the
+ * sender sends FS_OP_FILEID with that crc and the receiver answers
+ * FS_OP_OFFSET, where the sender seeks to. A bad or missing packet makes the
+ * receiver notify FS_OP_NACK and drop everything until the sender
+ * restarts the handshake, at most FILESHARING_MAX_RETRIES times.
+ */
+#define FILESHARING_FILEID_SIZE   4096 // the sqlite header and its change counter
+#define FILESHARING_MAX_RETRIES   3
+#define FILERECEIVER_PART_EXT     ".part"
+#define FILERECEIVER_RESUME_EXT   ".resume"
+
+/*
+ * Full transfers can be LZSS compressed (see Compression.h): the sender sets
+ * FS_FLAG_LZSS in FS_OP_FILEID and the receiver accepts by setting it in
+ * FS_OP_OFFSET. Resume offsets stay in file bytes, each pass starts a new
+ * stream, ack credits count the bytes on air since the handshake.
+ */
+#ifndef FILESHARING_LZSS // override this from Settings.h
+#define FILESHARING_LZSS true // offer compressed transfers
+#endif
+
+// announced in FS_OP_HELLO, see FileSharingProtocol.h
+#define FILESHARING_CAPS ( FS_CAP_RESUME | FS_CAP_DELTA | FS_CAP_RECORDS | ( FILESHARING_LZSS ? FS_CAP_LZSS : 0 ) )
+#define FILESHARING_LS_BATCH 240 // ls entries per notification, fits the MTU the client asks for
+
 static BLEUUID FileSharingServiceUUID( "f59f6622-1540-0001-8d71-362b9e155667" ); // generated UUID for the service
 static BLEUUID FileSharingWriteUUID(   "f59f6622-1540-0002-8d71-362b9e155667" ); // characteristic to write file_chunk locally
 static BLEUUID FileSharingRouteUUID(   "f59f6622-1540-0003-8d71-362b9e155667" ); // characteristic to manage routing
@@ -89,6 +138,30 @@ static File   FileReceiver;
 static size_t FileReceiverExpectedSize = 0;
 static size_t FileReceiverReceivedSize = 0;
 static size_t FileReceiverProgress = 0;
+static FileSharingAcker FileReceiverAcks; // credit sent to the sender
+static LZSSDecoder* FileReceiverDecoder = NULL; // compressed stream
+static QueueHandle_t RecordSyncQueue = NULL; // decoded records for RecordSyncTask
+static volatile bool RecordSyncRunning = false;
+static char RecordSyncPeer[MAC_LEN+1] = {0};
+static volatile size_t FileReceiverWrittenSize = 0; // bytes on the SD
+static unsigned long FileReceiverStartedAt = 0;
+static char     FileReceiverPath[32] = {0}; // target, data goes to the .part file
+static uint16_t FileReceiverExpectedSeq = 0;
+static bool     FileReceiverDesync = false; // a chunk was lost, waiting for a new handshake
+
+static bool     FileReceiverDelta = false; // patching the target in place
+
+struct FileReceiverBuffer {
+  uint8_t* data = NULL;
+  size_t   len = 0;
+  size_t   pos = 0; // file offset of data[0]
+};
+
+static FileReceiverBuffer FileReceiverBuffers[2];
+static uint8_t FileReceiverCurrent = 0; // buffer being filled by onWrite()
+static QueueHandle_t FileReceiverFilledQueue = NULL;
+static QueueHandle_t FileReceiverEmptyQueue = NULL;
+static volatile bool FileReceiverWriterRunning = false;
 
 static bool isFileSharingClientConnected = false;
 static bool fileSharingServerTaskIsRunning = false;
@@ -110,16 +183,6 @@ static int checkVendorResponse = 0;
 static bool checkMacResponded = false;
 static int checkMacResponse = 0;
 
-const char* sizeMarker             = "size:";
-const char* dateTimeMarker         = "dateTime:";
-const char* closeMessage           = "close";
-const char* restartMessage         = "restart";
-const char* lsMessage              = "ls";
-const char* lsDoneMessage          = "lsdone";
-const char* checkVendorFileMessage = "checkBLEOUI";
-const char* checkMacFileMessage    = "checkMACOUI";
-const char* fileMarker             = "file:";
-
 
 /******************************************************
   BLE Time Client methods
@@ -395,19 +458,207 @@ static void TimeServerTask( void * param ) {
 
 byte receivedFiles = 0;
 
+void FileSharingSuspendFile();
+
+
+// flushes full buffers to the SD, a zero length buffer ends the task
+static void FileReceiverWriteTask( void * param ) {
+  uint8_t index;
+  while ( xQueueReceive( FileReceiverFilledQueue, &index, portMAX_DELAY ) == pdTRUE ) {
+    FileReceiverBuffer &buffer = FileReceiverBuffers[index];
+    if ( buffer.len == 0 ) break;
+    if ( FileReceiverDelta ) {
+      FileReceiver.seek( buffer.pos );
+    }
+    size_t written = FileReceiver.write( buffer.data, buffer.len );
+    if ( written != buffer.len ) {
+      log_e("SD write failed (%d / %d bytes)", written, buffer.len);
+    }
+    FileReceiverWrittenSize += written;
+    buffer.len = 0;
+    xQueueSend( FileReceiverEmptyQueue, &index, portMAX_DELAY );
+  }
+  FileReceiverWriterRunning = false;
+  vTaskDelete( NULL );
+}
+
+
+// hands the current buffer to the writer task and switches to the other one
+static void FileReceiverSwapBuffers() {
+  xQueueSend( FileReceiverFilledQueue, &FileReceiverCurrent, portMAX_DELAY );
+  // only waits when the SD is slower than the link for a whole buffer
+  xQueueReceive( FileReceiverEmptyQueue, &FileReceiverCurrent, portMAX_DELAY );
+}
+
+
+static bool FileReceiverBuffersAlloc() {
+  for ( uint8_t i = 0; i < 2; i++ ) {
+    if ( FileReceiverBuffers[i].data == NULL ) {
+      FileReceiverBuffers[i].data = (uint8_t*)heap_caps_malloc( FILERECEIVER_BUFFSIZE, MALLOC_CAP_DMA );
+    }
+    if ( FileReceiverBuffers[i].data == NULL ) {
+      FileReceiverBuffers[i].data = (uint8_t*)ps_malloc( FILERECEIVER_BUFFSIZE );
+    }
+    if ( FileReceiverBuffers[i].data == NULL ) return false;
+    FileReceiverBuffers[i].len = 0;
+  }
+  if ( FileReceiverFilledQueue == NULL ) {
+    FileReceiverFilledQueue = xQueueCreate( 2, sizeof( uint8_t ) );
+    FileReceiverEmptyQueue  = xQueueCreate( 2, sizeof( uint8_t ) );
+  }
+  xQueueReset( FileReceiverFilledQueue );
+  xQueueReset( FileReceiverEmptyQueue );
+  FileReceiverCurrent = 0;
+  uint8_t spare = 1;
+  xQueueSend( FileReceiverEmptyQueue, &spare, 0 );
+  return true;
+}
+
+
+static void FileReceiverBuffersFree() {
+  for ( uint8_t i = 0; i < 2; i++ ) {
+    free( FileReceiverBuffers[i].data );
+    FileReceiverBuffers[i].data = NULL;
+  }
+}
+
+
+// decompressor output, one byte into the current buffer
+static void FileReceiverPut( uint8_t b ) {
+  FileReceiverBuffer &buffer = FileReceiverBuffers[FileReceiverCurrent];
+  buffer.data[buffer.len++] = b;
+  FileReceiverReceivedSize++;
+  if ( buffer.len == FILERECEIVER_BUFFSIZE ) {
+    FileReceiverSwapBuffers();
+  }
+}
+
+
+// one message on the route characteristic
+static void FileSharingNotify( uint8_t op, const void* payload = NULL, uint16_t len = 0 ) {
+  uint8_t message[FILESHARING_MESSAGE_HEADER_SIZE + len];
+  uint8_t* out = FileSharingPutHeader( message, op, len );
+  if ( len > 0 ) memcpy( out, payload, len );
+  FileSharingRouteChar->setValue( message, sizeof(message) );
+  FileSharingRouteChar->notify();
+}
+
 
+static void FileSharingNotifyU32( uint8_t op, uint32_t value ) {
+  uint8_t payload[4];
+  FileSharingPutU32( payload, value );
+  FileSharingNotify( op, payload, sizeof(payload) );
+}
+
+
+// remembers the target, the file is opened by the FS_OP_FILEID handshake
 void FileSharingReceiveFile( const char* filename ) {
-  FileReceiverReceivedSize = 0;
-  FileReceiverProgress = 0;
-  FileReceiver = BLE_FS.open( filename, FILE_WRITE );
-  // receivedFiles
-  if( FileReceiverExpectedSize == FileReceiver.size() ) {
-    log_w("Files are identical, transferring is useless");
+  if ( FileReceiver ) {
+    FileSharingSuspendFile(); // the sender restarted
   }
+  copy( FileReceiverPath, filename, sizeof(FileReceiverPath)-1 );
+  log_v("Will receive %s", filename);
+}
+
+
+static void FileSharingNotifyOffset( uint32_t offset, uint8_t flags ) {
+  uint8_t payload[5];
+  FileSharingPutU32( payload, offset );
+  payload[4] = flags;
+  FileSharingNotify( FS_OP_OFFSET, payload, sizeof(payload) );
+}
+
+
+// opens (or reopens) the .part file, tells the sender where to resume
+void FileSharingResumeFile( uint32_t fileId, bool compressed ) {
+  if ( isEmpty( FileReceiverPath ) || FileReceiverExpectedSize == 0 ) {
+    log_e("fileid received before filename and size");
+    FileSharingNotifyOffset( 0, FS_FLAG_REFUSED );
+    return;
+  }
+  if ( FileReceiver ) {
+    FileSharingSuspendFile();
+  }
+  char partPath[40], resumePath[40], resumeId[32];
+  sprintf( partPath, "%s" FILERECEIVER_PART_EXT, FileReceiverPath );
+  sprintf( resumePath, "%s" FILERECEIVER_RESUME_EXT, FileReceiverPath );
+  sprintf( resumeId, "%d;%08x", FileReceiverExpectedSize, fileId );
+  size_t offset = 0;
+  File resumeFile = BLE_FS.open( resumePath );
+  if ( resumeFile ) {
+    char previousId[32] = {0};
+    resumeFile.read( (uint8_t*)previousId, sizeof(previousId)-1 );
+    resumeFile.close();
+    if ( strcmp( previousId, resumeId ) == 0 && BLE_FS.exists( partPath ) ) {
+      File partFile = BLE_FS.open( partPath );
+      offset = partFile.size();
+      partFile.close();
+    }
+  }
+  if ( offset == 0 || offset > FileReceiverExpectedSize ) {
+    offset = 0;
+    resumeFile = BLE_FS.open( resumePath, FILE_WRITE );
+    resumeFile.print( resumeId );
+    resumeFile.close();
+    FileReceiver = BLE_FS.open( partPath, FILE_WRITE );
+  } else {
+    log_w("Resuming %s at %d / %d", FileReceiverPath, offset, FileReceiverExpectedSize);
+    FileReceiver = BLE_FS.open( partPath, FILE_APPEND );
+  }
+  FileReceiverReceivedSize = offset;
+  FileReceiverWrittenSize = offset;
+  FileReceiverAcks.begin();
+  FileReceiverProgress = 0;
+  FileReceiverExpectedSeq = 0;
+  FileReceiverDesync = false;
+  FileReceiverDelta = false;
+  FileReceiverStartedAt = millis();
   if ( !FileReceiver ) {
-    log_e("Failed to create %s", filename);
+    log_e("Failed to create %s", partPath);
+    FileSharingNotifyOffset( 0, FS_FLAG_REFUSED );
+    return;
   }
-  log_v("Successfully opened %s for writing", filename);
+  if ( !FileReceiverBuffersAlloc() ) {
+    log_e("Can't allocate receive buffers");
+    FileReceiver.close();
+    FileSharingNotifyOffset( 0, FS_FLAG_REFUSED );
+    return;
+  }
+  if ( compressed ) {
+    FileReceiverDecoder = (LZSSDecoder*)malloc( sizeof( LZSSDecoder ) );
+    if ( FileReceiverDecoder != NULL ) {
+      LZSSDecoderInit( FileReceiverDecoder );
+    }
+  }
+  FileReceiverWriterRunning = true;
+  xTaskCreatePinnedToCore( FileReceiverWriteTask, "FileReceiverWriteTask", 2048, NULL, 5, NULL, 1 ); /* last = Task Core */
+  FileSharingNotifyOffset( offset, FileReceiverDecoder != NULL ? FS_FLAG_LZSS : 0 );
+  log_v("Successfully opened %s for writing", partPath);
+}
+
+
+// writes what's buffered and closes the .part file, keeps it for a resume
+static void FileReceiverDrain() {
+  // last partial buffer, then the end marker
+  if ( FileReceiverBuffers[FileReceiverCurrent].len > 0 ) {
+    FileReceiverSwapBuffers();
+  }
+  FileReceiverBuffers[FileReceiverCurrent].len = 0;
+  xQueueSend( FileReceiverFilledQueue, &FileReceiverCurrent, portMAX_DELAY );
+  while ( FileReceiverWriterRunning ) {
+    vTaskDelay(1);
+  }
+  FileReceiver.close();
+  FileReceiverBuffersFree();
+  free( FileReceiverDecoder );
+  FileReceiverDecoder = NULL;
+}
+
+
+void FileSharingSuspendFile() {
+  if ( !FileReceiver ) return;
+  FileReceiverDrain();
+  log_w("Suspended %s at %d / %d bytes", FileReceiverPath, FileReceiverWrittenSize, FileReceiverExpectedSize);
 }
 
 
@@ -416,14 +667,24 @@ void FileSharingCloseFile() {
     log_e("Nothing to close!");
     return;
   }
+  FileReceiverDrain();
+  unsigned long elapsed = millis() - FileReceiverStartedAt;
   takeMuxSemaphore();
-  FileReceiver.close();
-  if ( FileReceiverReceivedSize != FileReceiverExpectedSize ) {
-    log_e("Total size != expected size ( %d != %d )", FileReceiver.size(), FileReceiverExpectedSize);
-    Out.println( "Copy Failed, please try again." );
+  if ( FileReceiverReceivedSize != FileReceiverExpectedSize || FileReceiverWrittenSize != FileReceiverReceivedSize ) {
+    log_e("Total size != expected size ( %d received, %d written, %d expected )", FileReceiverReceivedSize, FileReceiverWrittenSize, FileReceiverExpectedSize);
+    Out.println( "Copy interrupted, will resume." );
   } else {
+    char partPath[40], resumePath[40];
+    sprintf( partPath, "%s" FILERECEIVER_PART_EXT, FileReceiverPath );
+    sprintf( resumePath, "%s" FILERECEIVER_RESUME_EXT, FileReceiverPath );
+    BLE_FS.remove( FileReceiverPath );
+    BLE_FS.rename( partPath, FileReceiverPath );
+    BLE_FS.remove( resumePath );
     Out.println( "Copy successful!" );
   }
+  char throughput[96];
+  sprintf( throughput, "%d bytes in %lu ms (%d bytes/s), %d bytes on air", FileReceiverWrittenSize, elapsed, elapsed > 0 ? (int)( ( (uint64_t)FileReceiverWrittenSize * 1000 ) / elapsed ) : 0, FileReceiverAcks.wire );
+  Out.println( throughput );
   giveMuxSemaphore();
   //TODO: sha256_sum
   FileReceiverExpectedSize = 0;
@@ -432,113 +693,432 @@ void FileSharingCloseFile() {
 }
 
 
+// sha256 of a whole file
+static bool FileSharingHashFile( const char* path, uint8_t digest[FILESHARING_DIGEST_SIZE] ) {
+  File file = BLE_FS.open( path );
+  uint8_t* block = (uint8_t*)malloc( FILESHARING_BLOCK_SIZE );
+  if ( !file || block == NULL ) {
+    if ( file ) file.close();
+    free( block );
+    return false;
+  }
+  FileSharingDigest( file, block, digest );
+  file.close();
+  free( block );
+  return true;
+}
+
+
+// hashes the local copy block by block, then opens it for patching
+static void FileSharingHashTask( void * param ) {
+  uint32_t blocks = 0;
+  File target = BLE_FS.open( FileReceiverPath );
+  uint8_t* block = (uint8_t*)malloc( FILESHARING_BLOCK_SIZE );
+  // a shorter source would need a truncate, leave that to a full transfer
+  if ( target && block != NULL && target.size() > 0 && target.size() <= FileReceiverExpectedSize ) {
+    blocks = FileSharingHashBlocks( target, block, []( const uint8_t* payload, size_t len ) {
+      FileSharingNotify( FS_OP_HASHES, payload, len );
+    });
+  }
+  if ( target ) target.close();
+  free( block );
+  if ( blocks > 0 ) {
+    char resumePath[40];
+    sprintf( resumePath, "%s" FILERECEIVER_RESUME_EXT, FileReceiverPath );
+    File resumeFile = BLE_FS.open( resumePath, FILE_WRITE ); // until verified
+    resumeFile.print( "delta" );
+    resumeFile.close();
+    FileReceiver = BLE_FS.open( FileReceiverPath, "r+" );
+    if ( !FileReceiver || !FileReceiverBuffersAlloc() ) {
+      log_e("Can't open %s for patching", FileReceiverPath);
+      if ( FileReceiver ) FileReceiver.close();
+      blocks = 0;
+    }
+  }
+  if ( blocks > 0 ) {
+    FileReceiverReceivedSize = 0;
+    FileReceiverWrittenSize = 0;
+    FileReceiverAcks.begin();
+    FileReceiverProgress = 0;
+    FileReceiverExpectedSeq = 0;
+    FileReceiverDesync = false;
+    FileReceiverStartedAt = millis();
+    FileReceiverWriterRunning = true;
+    xTaskCreatePinnedToCore( FileReceiverWriteTask, "FileReceiverWriteTask", 2048, NULL, 5, NULL, 1 ); /* last = Task Core */
+  } else {
+    FileReceiverDelta = false;
+  }
+  log_w("Sent %d block hashes of %s", blocks, FileReceiverPath);
+  FileSharingNotifyU32( FS_OP_HASHDONE, blocks );
+  vTaskDelete( NULL );
+}
+
+
+void FileSharingDeltaFile() {
+  if ( isEmpty( FileReceiverPath ) || FileReceiverExpectedSize == 0 ) {
+    log_e("delta received before filename and size");
+    FileSharingNotifyU32( FS_OP_HASHDONE, 0 );
+    return;
+  }
+  if ( FileReceiver ) {
+    FileSharingSuspendFile();
+  }
+  FileReceiverDelta = true;
+  xTaskCreatePinnedToCore( FileSharingHashTask, "FileSharingHashTask", 4096, NULL, 2, NULL, 1 ); /* last = Task Core */
+}
+
+
+static uint8_t FileSharingExpectedDigest[FILESHARING_DIGEST_SIZE];
+
+// flushes the patches and checks the whole file against the source's sha256
+static void FileSharingVerifyTask( void * param ) {
+  if ( FileReceiver ) {
+    FileReceiverDrain();
+  }
+  unsigned long elapsed = millis() - FileReceiverStartedAt;
+  uint8_t digest[FILESHARING_DIGEST_SIZE];
+  bool verified = !FileReceiverDesync
+    && FileReceiverWrittenSize == FileReceiverReceivedSize
+    && FileSharingHashFile( FileReceiverPath, digest )
+    && memcmp( digest, FileSharingExpectedDigest, sizeof(digest) ) == 0;
+  if ( verified ) {
+    char resumePath[40];
+    sprintf( resumePath, "%s" FILERECEIVER_RESUME_EXT, FileReceiverPath );
+    BLE_FS.remove( resumePath );
+  }
+  uint8_t answer = verified ? 1 : 0;
+  FileSharingNotify( FS_OP_VERIFY, &answer, sizeof(answer) );
+  char summary[80];
+  sprintf( summary, "Delta %s: %d bytes patched in %lu ms", verified ? "applied" : "failed", FileReceiverWrittenSize, elapsed );
+  takeMuxSemaphore();
+  Out.println( summary );
+  Out.println();
+  giveMuxSemaphore();
+  FileReceiverDelta = false;
+  FileReceiverExpectedSize = 0;
+  FileReceiverReceivedSize = 0;
+  FileReceiverProgress = 0;
+  vTaskDelete( NULL );
+}
+
+
+void FileSharingVerifyFile( const uint8_t* digest, size_t len ) {
+  if ( !FileReceiverDelta || len != sizeof(FileSharingExpectedDigest) ) {
+    log_e("Nothing to verify");
+    return;
+  }
+  memcpy( FileSharingExpectedDigest, digest, sizeof(FileSharingExpectedDigest) );
+  xTaskCreatePinnedToCore( FileSharingVerifyTask, "FileSharingVerifyTask", 4096, NULL, 2, NULL, 1 ); /* last = Task Core */
+}
+
+
+// FS_OP_CHECK payload, kept for FileSharingCheckTask
+static uint8_t  FileSharingCheckQuery[1 + FILESHARING_DIGEST_SIZE];
+static uint16_t FileSharingCheckQueryLen = 0;
+
+// a copy that checks out but differs from the client's still needs a (delta) sync
+static void FileSharingCheckTask( void * param ) {
+  FileSharingMessage query = { FS_OP_CHECK, FileSharingCheckQueryLen, FileSharingCheckQuery };
+  uint8_t answer[2] = { FileSharingU8( query ), 1 };
+  const char* path = NULL;
+  bool checksOut = false;
+  if ( answer[0] == FS_FILE_VENDORS ) {
+    path = BLE_VENDOR_NAMES_DB_FS_PATH;
+    checksOut = DB.checkVendorFile();
+  } else if ( answer[0] == FS_FILE_OUI ) {
+    path = MAC_OUI_NAMES_DB_FS_PATH;
+    checksOut = DB.checkOUIFile();
+  }
+  uint8_t digest[FILESHARING_DIGEST_SIZE];
+  if ( checksOut && FileSharingHashFile( path, digest ) && FileSharingSameDigest( query, 1, digest ) ) {
+    answer[1] = 0;
+  }
+  log_w("DB file #%d %s", answer[0], answer[1] ? "needs an update" : "is fine");
+  FileSharingNotify( FS_OP_CHECK_RESULT, answer, sizeof(answer) );
+  vTaskDelete( NULL );
+}
+
+
+// the whole file is hashed, off the BLE callback
+void FileSharingCheckFile( const FileSharingMessage &msg ) {
+  FileSharingCheckQueryLen = min( (size_t)msg.len, sizeof(FileSharingCheckQuery) );
+  memcpy( FileSharingCheckQuery, msg.payload, FileSharingCheckQueryLen );
+  xTaskCreatePinnedToCore( FileSharingCheckTask, "FileSharingCheckTask", 4096, NULL, 2, NULL, 1 ); /* last = Task Core */
+}
+
+
+static void FileSharingNotifyWatermark( bool accepted, uint32_t watermark ) {
+  uint8_t payload[5] = { accepted ? (uint8_t)1 : (uint8_t)0 };
+  FileSharingPutU32( payload + 1, watermark );
+  FileSharingNotify( FS_OP_WATERMARK, payload, sizeof(payload) );
+}
+
+
+// merges the records decoded by the route callback, see RecordSync.h
+static void RecordSyncTask( void * param ) {
+  uint32_t watermark = 0;
+  if ( !RecordSync.begin( RecordSyncPeer, watermark ) ) {
+    FileSharingNotifyWatermark( false, 0 );
+    RecordSyncRunning = false;
+    vTaskDelete( NULL );
+    return;
+  }
+  FileSharingNotifyWatermark( true, watermark );
+  SyncRecord record;
+  bool complete = false;
+  while ( xQueueReceive( RecordSyncQueue, &record, SYNC_TIMEOUT / portTICK_PERIOD_MS ) == pdTRUE ) {
+    if ( isEmpty( record.address ) ) { // syncdone
+      complete = true;
+      break;
+    }
+    RecordSync.merge( record );
+  }
+  RecordSync.end( record.updated_at, complete );
+  FileSharingNotifyU32( FS_OP_SYNCOK, RecordSync.received );
+  char summary[80];
+  sprintf( summary, "Merged %d records from %s (%d new)", RecordSync.received, RecordSyncPeer, RecordSync.inserted );
+  takeMuxSemaphore();
+  Out.println( summary );
+  Out.println();
+  giveMuxSemaphore();
+  RecordSyncRunning = false;
+  vTaskDelete( NULL );
+}
+
+
+void FileSharingSyncBegin( const char* peer ) {
+  if ( RecordSyncRunning ) {
+    log_e("Record sync already running");
+    FileSharingNotifyWatermark( false, 0 );
+    return;
+  }
+  if ( RecordSyncQueue == NULL ) {
+    RecordSyncQueue = xQueueCreate( SYNC_QUEUE_SIZE, sizeof( SyncRecord ) );
+  }
+  xQueueReset( RecordSyncQueue );
+  copy( RecordSyncPeer, peer, MAC_LEN );
+  RecordSyncRunning = true;
+  xTaskCreatePinnedToCore( RecordSyncTask, "RecordSyncTask", 8192, NULL, 2, NULL, 1 ); /* last = Task Core */
+}
+
+
 class FileSharingWriteCallbacks : public BLECharacteristicCallbacks {
     void onWrite( BLECharacteristic* WriterAgent ) {
       size_t len = WriterAgent->getDataLength();
-      if ( FileReceiverExpectedSize == 0 ) {
-        // no size was previously sent, can't calculate
+      if ( FileReceiverExpectedSize == 0 || !FileReceiver || !FileReceiverWriterRunning ) {
+        // no size/fileid was previously sent, can't calculate
         log_e("Ignored %d bytes", len);
         return;
       }
-      size_t progress = (((float)FileReceiverReceivedSize / (float)FileReceiverExpectedSize) * 100.00);
-      if ( FileReceiver ) {
-        FileReceiver.write( WriterAgent->getData(), len );
-        log_w("Wrote %d bytes", len);
-        FileReceiverReceivedSize += len;
-      } else {
-        // file write problem ?
-        log_e("Ignored %d bytes", len);
+      if ( FileReceiverDesync || len <= sizeof(FileSharingChunkHeader) ) {
+        return; // waiting for the sender to resume
       }
+      FileSharingChunkHeader header;
+      memcpy( &header, WriterAgent->getData(), sizeof(header) );
+      uint8_t* data = WriterAgent->getData() + sizeof(header);
+      size_t remaining = len - sizeof(header);
+      if ( header.seq != FileReceiverExpectedSeq || header.crc != crc32_le( 0, data, remaining ) ) {
+        // drop everything until the sender resumes from the last verified byte
+        log_e("Bad chunk #%d (expected #%d), asking to resume at %d", header.seq, FileReceiverExpectedSeq, FileReceiverReceivedSize);
+        FileReceiverDesync = true;
+        FileSharingNotifyU32( FS_OP_NACK, FileReceiverAcks.wire );
+        return;
+      }
+      FileReceiverExpectedSeq++;
+      size_t pos = FileReceiverReceivedSize;
+      if ( FileReceiverDelta ) {
+        // patches carry their own offset
+        uint32_t offset;
+        if ( !FileSharingPatch( data, remaining, offset ) ) return;
+        pos = offset;
+        FileReceiverBuffer &current = FileReceiverBuffers[FileReceiverCurrent];
+        if ( current.len > 0 && current.pos + current.len != pos ) {
+          FileReceiverSwapBuffers(); // not contiguous
+        }
+      }
+      size_t onAir = remaining;
+      if ( FileReceiverDecoder != NULL ) {
+        LZSSDecompress( FileReceiverDecoder, data, remaining, FileReceiverPut );
+        remaining = 0;
+      }
+      while ( remaining > 0 ) {
+        FileReceiverBuffer &buffer = FileReceiverBuffers[FileReceiverCurrent];
+        if ( buffer.len == 0 ) {
+          buffer.pos = pos;
+        }
+        size_t chunk = min( remaining, (size_t)( FILERECEIVER_BUFFSIZE - buffer.len ) );
+        memcpy( buffer.data + buffer.len, data, chunk );
+        buffer.len += chunk;
+        data += chunk;
+        pos += chunk;
+        remaining -= chunk;
+        FileReceiverReceivedSize += chunk;
+        if ( buffer.len == FILERECEIVER_BUFFSIZE ) {
+          FileReceiverSwapBuffers();
+        }
+      }
+      log_v("Buffered %d bytes", len);
+      size_t progress = ( (uint64_t)FileReceiverReceivedSize * 100 ) / FileReceiverExpectedSize;
       if ( FileReceiverProgress != progress ) {
         FileReceiverProgress = progress;
       }
+      // grant more credit to the sender
+      if ( FileReceiverAcks.received( onAir, FileReceiverReceivedSize >= FileReceiverExpectedSize ) ) {
+        FileSharingNotifyU32( FS_OP_ACK, FileReceiverAcks.wire );
+      }
     }
 };
 
 
-class FileSharingRouteCallbacks : public BLECharacteristicCallbacks {
-    void onWrite( BLECharacteristic* RouterAgent ) {
-      char routing[RouterAgent->getDataLength()] = {0};
-      memcpy( &routing, RouterAgent->getData(), RouterAgent->getDataLength() );
-      log_w("Received copy routing query: %s", routing);
-      if ( strstr(routing, sizeMarker) ) { // messages starting with "size:"
-        if ( strlen( routing ) > strlen( sizeMarker ) ) {
-          char* lenStr = substr( routing, strlen(sizeMarker), strlen(routing) - strlen(sizeMarker) );
-          FileReceiverExpectedSize = atoi( lenStr );
-          log_w( "Assigned size_t %d", FileReceiverExpectedSize );
-          free( lenStr );
-        }
-      } else if( strstr(routing, dateTimeMarker ) ) {
-        log_w("Received dateTimeMarker");
-        if ( strlen( routing ) > strlen( dateTimeMarker ) ) {
-          char* lenStr = substr( routing, strlen(dateTimeMarker), strlen(routing) - strlen(dateTimeMarker) );
-          log_w("Received time");
-          memcpy( &BLERemoteTime, lenStr, strlen( lenStr ) );
-          setBLETime();
-          free( lenStr );
-        }
-      } else if ( strcmp( routing, closeMessage ) == 0 ) { // file end
-        FileSharingCloseFile();
-      } else if ( strcmp( routing, restartMessage ) == 0 ) { // transfert finished
-        ESP.restart();
-      } else if ( strcmp( routing, checkVendorFileMessage ) == 0 ) {
-        if( !DB.checkVendorFile() ) {
-          log_w("Senting notification for Vendor DB update");
-          RouterAgent->setValue( (uint8_t*)(BLE_VENDOR_NAMES_DB_FS_PATH), strlen(BLE_VENDOR_NAMES_DB_FS_PATH));
-          RouterAgent->notify();
-        } else {
-          const char* resp = String( String(checkVendorFileMessage) + String("0") ).c_str();
-          log_w("Vendor DB file is fine, will send resp: %s", resp);
-          RouterAgent->setValue( (uint8_t*)resp, strlen(resp) );
-          RouterAgent->notify();
-        }
-      } else if ( strcmp( routing, checkMacFileMessage ) == 0 ) {
-        if( !DB.checkOUIFile() ) {
-          log_w("Senting notification for OUI DB update");
-          RouterAgent->setValue( (uint8_t*)(MAC_OUI_NAMES_DB_FS_PATH), strlen(MAC_OUI_NAMES_DB_FS_PATH));
-          RouterAgent->notify();
-        } else {
-          const char* resp = String( String(checkMacFileMessage) + String("0") ).c_str();
-          log_w("OUI DB file is fine, will send resp: %s", resp);
-          RouterAgent->setValue( (uint8_t*)resp, strlen(resp) );
-          RouterAgent->notify();
-        }
-      } else   if (strcmp(routing, lsMessage ) == 0) {
-        int filesCount = 0;
-        char strOut[32+64];
-        File root = BLE_FS.open("/");
-        if( root && root.isDirectory() ) {
-          File file = root.openNextFile();
-          while(file) {
-            if(!file.isDirectory()) {
-              if( String( file.name() ).endsWith(".db") ) {
-                *strOut = {0};
-                sprintf( strOut, "%s%s;%d", fileMarker, file.name(), file.size() );
-                log_w("Sending ls response[%d]: %s%s;%d", filesCount++, fileMarker, file.name(), file.size());
-                RouterAgent->setValue( (uint8_t*)strOut, strlen(strOut));
-                RouterAgent->notify();
-                if( filesCount > 30 ) break;
-              }
-            }
-            file.close();
-            file = root.openNextFile();
+// .db files with their size, as many entries per notification as fit
+static void FileSharingListFiles() {
+  static FileSharingFrame frame;
+  uint8_t entries[FILESHARING_LS_BATCH];
+  size_t len = 0;
+  int filesCount = 0;
+  File root = BLE_FS.open("/");
+  if( root && root.isDirectory() ) {
+    File file = root.openNextFile();
+    while(file) {
+      if(!file.isDirectory()) {
+        if( String( file.name() ).endsWith(".db") ) {
+          // u32 size, u8 name length, name
+          size_t nameLen = min( strlen( file.name() ), (size_t)64 );
+          if ( len + 5 + nameLen > sizeof(entries) ) {
+            FileSharingNotify( FS_OP_LS_ENTRIES, entries, len );
+            len = 0;
           }
-        }
-        RouterAgent->setValue( (uint8_t*)lsDoneMessage, strlen(lsDoneMessage));
-        RouterAgent->notify();
-      } else { // filenames
-        if ( strcmp( routing, BLE_VENDOR_NAMES_DB_FS_PATH ) == 0 ) {
-          FileSharingReceiveFile( BLE_VENDOR_NAMES_DB_FS_PATH );
-        }
-        if ( strcmp( routing, MAC_OUI_NAMES_DB_FS_PATH ) == 0 ) {
-          FileSharingReceiveFile( MAC_OUI_NAMES_DB_FS_PATH);
+          FileSharingPutU32( entries + len, file.size() );
+          entries[len + 4] = nameLen;
+          memcpy( entries + len + 5, file.name(), nameLen );
+          len += 5 + nameLen;
+          log_w("Listing file[%d]: %s;%d", filesCount++, file.name(), file.size());
+          if( filesCount > 30 ) break;
         }
       }
+      file.close();
+      file = root.openNextFile();
+    }
+  }
+  // last entries and the end in the same notification
+  frame.clear();
+  if ( len > 0 ) {
+    frame.put( FS_OP_LS_ENTRIES, entries, len );
+  }
+  frame.put( FS_OP_LS_DONE );
+  FileSharingRouteChar->setValue( frame.data, frame.len );
+  FileSharingRouteChar->notify();
+}
+
+
+static void FileSharingRoute( const FileSharingMessage &msg ) {
+  log_v("Received routing opcode 0x%02x (%d bytes)", msg.op, msg.len);
+  switch ( msg.op ) {
+    case FS_OP_RECORDS: {
+      // binary records, blocking here slows the sender down to the merge speed
+      const uint8_t* data = msg.payload;
+      size_t len = msg.len;
+      SyncRecord record;
+      size_t used;
+      while ( len > 0 && RecordSyncRunning && ( used = RecordSync.unpack( data, len, record ) ) > 0 ) {
+        xQueueSend( RecordSyncQueue, &record, portMAX_DELAY );
+        data += used;
+        len -= used;
+      }
+    }
+    break;
+    case FS_OP_HELLO:
+      log_w("Peer capabilities: 0x%02x", FileSharingU32( msg ));
+      FileSharingNotifyU32( FS_OP_HELLO, FILESHARING_CAPS );
+    break;
+    case FS_OP_FILE: {
+      char path[32];
+      if ( !FileSharingString( msg, path, sizeof(path) ) ) {
+        log_e("Filename too long");
+        break;
+      }
+      // only the known databases can be overwritten
+      if ( strcmp( path, BLE_VENDOR_NAMES_DB_FS_PATH ) == 0 ) {
+        FileSharingReceiveFile( BLE_VENDOR_NAMES_DB_FS_PATH );
+      } else if ( strcmp( path, MAC_OUI_NAMES_DB_FS_PATH ) == 0 ) {
+        FileSharingReceiveFile( MAC_OUI_NAMES_DB_FS_PATH );
+      } else {
+        log_e("Refusing unknown file %s", path);
+        FileReceiverPath[0] = '\0'; // a following FS_OP_FILEID gets refused
+        break;
+      }
       takeMuxSemaphore();
-      Out.println( routing );
+      Out.println( path );
       Out.println();
       giveMuxSemaphore();
+    }
+    break;
+    case FS_OP_SIZE:
+      FileReceiverExpectedSize = FileSharingU32( msg );
+      log_w( "Assigned size_t %d", FileReceiverExpectedSize );
+    break;
+    case FS_OP_TIME:
+      if ( msg.len == sizeof(bt_time_t) ) {
+        log_w("Received time");
+        memcpy( &BLERemoteTime, msg.payload, sizeof(bt_time_t) );
+        setBLETime();
+      }
+    break;
+    case FS_OP_FILEID:
+      FileSharingResumeFile( FileSharingU32( msg ), FILESHARING_LZSS && ( FileSharingU8( msg, 4 ) & FS_FLAG_LZSS ) );
+    break;
+    case FS_OP_DELTA:
+      FileSharingDeltaFile();
+    break;
+    case FS_OP_SHA256:
+      FileSharingVerifyFile( msg.payload, msg.len );
+    break;
+    case FS_OP_CLOSE: // file end
+      FileSharingCloseFile();
+    break;
+    case FS_OP_SYNC: {
+      char peer[MAC_LEN+1];
+      if ( FileSharingString( msg, peer, sizeof(peer) ) ) {
+        FileSharingSyncBegin( peer );
+      } else {
+        FileSharingNotifyWatermark( false, 0 );
+      }
+    }
+    break;
+    case FS_OP_SYNCDONE:
+      if ( RecordSyncRunning ) {
+        SyncRecord end; // empty address
+        end.updated_at = FileSharingU32( msg );
+        xQueueSend( RecordSyncQueue, &end, portMAX_DELAY );
+      }
+    break;
+    case FS_OP_CHECK:
+      FileSharingCheckFile( msg );
+    break;
+    case FS_OP_LS:
+      FileSharingListFiles();
+    break;
+    case FS_OP_RESTART: // transfert finished
+      DB.memDBFlush();
+      ESP.restart();
+    break;
+    default:
+      log_w("Unknown routing opcode 0x%02x", msg.op);
+  }
+}
 
+
+class FileSharingRouteCallbacks : public BLECharacteristicCallbacks {
+    void onWrite( BLECharacteristic* RouterAgent ) {
+      const uint8_t* data = RouterAgent->getData();
+      size_t len = RouterAgent->getDataLength();
+      FileSharingMessage msg;
+      while ( FileSharingParse( data, len, msg ) ) {
+        FileSharingRoute( msg );
+      }
+      if ( len > 0 ) {
+        log_e("Dropped %d bytes of routing data (protocol v%d expected)", len, FILESHARING_PROTO_VERSION);
+      }
     }
 };
 
@@ -565,6 +1145,7 @@ class FileSharingCallbacks : public BLEServerCallbacks {
       Out.println();
       giveMuxSemaphore();
       //BLEDevice::startAdvertising();
+      FileSharingSuspendFile(); // keep what was received for the next attempt
       fileSharingServerTaskShouldStop = true;
     }
 };
@@ -680,6 +1261,185 @@ static void FileSharingServerTask(void* p) {
 bool fileTransferInProgress = false;
 unsigned long fileSharingClientLastActivity = millis();
 unsigned long fileSharingClientTimeout = 10000;
+static volatile int32_t FileSenderResumeOffset = -1; // answer to FS_OP_FILEID, -1 until received, -2 = refused
+static volatile bool FileSenderCompressed = false; // the receiver accepted lzss
+static LZSSEncoder* FileSharingEncoder = NULL; // NULL when not compressing
+static volatile int32_t FileSenderRemoteBlocks = -1; // answer to FS_OP_DELTA, -1 until received
+static volatile int8_t FileSenderVerified = -1; // answer to FS_OP_SHA256, -1 until received
+static uint8_t* FileSenderRemoteHashes = NULL; // receiver's block hashes
+static volatile int64_t FileSenderWatermark = -2; // answer to FS_OP_SYNC, -2 until received, -1 = refused
+static volatile int32_t FileSenderSyncOk = -1; // answer to FS_OP_SYNCDONE, -1 until received
+static size_t FileSenderRemoteHashesMax = 0; // blocks that fit in FileSenderRemoteHashes
+static volatile int64_t FileSenderPeerCaps = -1; // answer to FS_OP_HELLO, -1 until received
+
+
+// one message on the route characteristic, with response
+static bool FileSharingRequest( BLERemoteCharacteristic* RemoteChar, uint8_t op, const void* payload = NULL, uint16_t len = 0 ) {
+  uint8_t message[FILESHARING_MESSAGE_HEADER_SIZE + len];
+  uint8_t* out = FileSharingPutHeader( message, op, len );
+  if ( len > 0 ) memcpy( out, payload, len );
+  return RemoteChar->writeValue( message, sizeof(message), true );
+}
+
+
+static bool FileSharingRequestU32( BLERemoteCharacteristic* RemoteChar, uint8_t op, uint32_t value ) {
+  uint8_t payload[4];
+  FileSharingPutU32( payload, value );
+  return FileSharingRequest( RemoteChar, op, payload, sizeof(payload) );
+}
+
+// read-ahead buffers, filled by FileSharingReadTask while the other one is sent
+struct FileSharingReadBuffer {
+  uint8_t data[LZSS_MAX_OUTPUT( FILESHARING_READ_BUFFSIZE )];
+  size_t  len = 0; // bytes to send
+  size_t  raw = 0; // file bytes they stand for, 0 = EOF
+};
+
+static FileSharingReadBuffer* FileSharingReadBuffers = NULL;
+static QueueHandle_t FileSharingFilledQueue = NULL;
+static QueueHandle_t FileSharingEmptyQueue = NULL;
+static File FileSharingReadFile;
+static volatile bool FileSharingReaderRunning = false;
+static volatile bool FileSharingReadAbort = false;
+
+static void FileSharingReadTask( void * param ) {
+  uint8_t index;
+  while ( xQueueReceive( FileSharingEmptyQueue, &index, portMAX_DELAY ) == pdTRUE ) {
+    if ( FileSharingReadAbort ) break;
+    FileSharingReadBuffer &buffer = FileSharingReadBuffers[index];
+    if ( FileSharingEncoder != NULL ) {
+      // compressing here overlaps with the radio
+      buffer.raw = FileSharingReadFile.read( FileSharingEncoder->data + FileSharingEncoder->prevLen, FILESHARING_READ_BUFFSIZE );
+      buffer.len = buffer.raw > 0 ? LZSSCompress( FileSharingEncoder, buffer.raw, FileSharingReadFile.available() == 0, buffer.data ) : 0;
+    } else {
+      buffer.raw = FileSharingReadFile.read( buffer.data, FILESHARING_READ_BUFFSIZE );
+      buffer.len = buffer.raw;
+    }
+    xQueueSend( FileSharingFilledQueue, &index, portMAX_DELAY );
+    if ( buffer.raw == 0 ) break; // EOF
+  }
+  FileSharingReaderRunning = false;
+  vTaskDelete( NULL );
+}
+
+// data chunks go to the write characteristic, without response
+struct FileSharingBLELink {
+  bool write( uint8_t* packet, size_t len ) { return FileSharingReadRemoteChar->writeValue( packet, len, false ); }
+  uint32_t millis() { return ::millis(); }
+  void wait() { vTaskDelay(1); }
+};
+
+static FileSharingBLELink FileSharingLink;
+static FileSharingWindowSender<FileSharingBLELink> FileSender( FileSharingLink );
+
+static void FileSharingLogSendError( FileSharingSendResult result, size_t sent, size_t totalsize ) {
+  switch ( result ) {
+    case FS_SEND_NACKED:       log_e("Receiver lost a chunk after %d bytes on air", FileSender.acked); break;
+    case FS_SEND_NO_CREDIT:    log_e("No credit from receiver after %d / %d bytes", sent, totalsize); break;
+    case FS_SEND_WRITE_FAILED: log_e("Failed to send at %d / %d", sent, totalsize); break;
+    default: break;
+  }
+}
+
+// crc32 of the first block, tells the receiver whether its .part is from the same file
+static uint32_t FileSharingFileId( File &file ) {
+  uint8_t* block = FileSharingReadBuffers[0].data;
+  size_t len = file.read( block, FILESHARING_FILEID_SIZE );
+  file.seek( 0 );
+  return crc32_le( 0, block, len );
+}
+
+
+// sends the file from where the receiver stands, false if it has to be resumed
+static bool FileSharingSendPass( BLERemoteCharacteristic* RemoteChar, const char* filename, size_t totalsize, uint32_t fileId, size_t chunkSize ) {
+  static FileSharingFrame frame;
+  // filename, size, local time and the question of where to start from, in one write
+  frame.clear();
+  frame.putString( FS_OP_FILE, filename );
+  frame.putU32( FS_OP_SIZE, totalsize );
+  frame.put( FS_OP_TIME, getBLETime(), sizeof(bt_time_t) );
+  frame.putU32( FS_OP_FILEID, fileId, true, FileSharingEncoder != NULL ? FS_FLAG_LZSS : 0 );
+  FileSenderResumeOffset = -1;
+  FileSender.begin();
+  FileSenderCompressed = false;
+  if ( !RemoteChar->writeValue( frame.data, frame.len, true ) ) {
+    log_e("Remote is unable to comply to %s filename query", filename);
+    return false;
+  }
+  unsigned long waitStart = millis();
+  while ( FileSenderResumeOffset == -1 && millis() - waitStart < FILESHARING_ACK_TIMEOUT ) {
+    vTaskDelay(10);
+  }
+  if ( FileSenderResumeOffset < 0 ) {
+    // nobody would store the chunks
+    log_e("Receiver %s %s", FileSenderResumeOffset == -1 ? "didn't answer for" : "can't write", filename);
+    return false;
+  }
+  size_t sent = FileSenderResumeOffset;
+  if ( sent > totalsize ) sent = 0;
+  if ( sent > 0 ) {
+    log_w("Resuming %s at %d / %d bytes", filename, sent, totalsize);
+  }
+  FileSharingReadFile.seek( sent );
+  // the reader only compresses when the receiver agreed
+  LZSSEncoder* encoder = FileSharingEncoder;
+  if ( encoder != NULL && !FileSenderCompressed ) {
+    FileSharingEncoder = NULL;
+  } else if ( encoder != NULL ) {
+    LZSSEncoderInit( encoder );
+  }
+
+  xQueueReset( FileSharingFilledQueue );
+  xQueueReset( FileSharingEmptyQueue );
+  for ( uint8_t i = 0; i < 2; i++ ) {
+    xQueueSend( FileSharingEmptyQueue, &i, 0 );
+  }
+  FileSender.begin();
+  FileSharingReadAbort = false;
+  FileSharingReaderRunning = true;
+  xTaskCreatePinnedToCore( FileSharingReadTask, "FileSharingReadTask", 2048, NULL, 5, NULL, 1 ); /* last = Task Core */
+
+  bool error = false;
+  int lastpercent = -1;
+  size_t resumedAt = sent;
+  unsigned long transferStart = millis();
+  uint8_t index;
+  while ( xQueueReceive( FileSharingFilledQueue, &index, portMAX_DELAY ) == pdTRUE ) {
+    FileSharingReadBuffer &buffer = FileSharingReadBuffers[index];
+    if ( buffer.raw == 0 ) break; // EOF
+    for ( size_t offset = 0; offset < buffer.len && !error; offset += chunkSize ) {
+      size_t len = min( chunkSize, buffer.len - offset );
+      fileSharingClientLastActivity = millis();
+      FileSharingSendResult result = FileSender.send( buffer.data + offset, len );
+      if ( result != FS_SEND_OK ) {
+        FileSharingLogSendError( result, sent, totalsize );
+        error = true;
+      }
+    }
+    if ( error ) break;
+    sent += buffer.raw;
+    xQueueSend( FileSharingEmptyQueue, &index, portMAX_DELAY );
+    int percent = totalsize > 0 ? ( (uint64_t)sent * 100 ) / totalsize : 100;
+    if ( lastpercent != percent ) {
+      takeMuxSemaphore();
+      UI.PrintProgressBar( (Out.width * percent) / 100 );
+      giveMuxSemaphore();
+      lastpercent = percent;
+    }
+  }
+  if ( error ) {
+    // wake the reader up so it quits before the file is rewound
+    FileSharingReadAbort = true;
+    xQueueSend( FileSharingEmptyQueue, &index, 0 );
+  }
+  while ( FileSharingReaderRunning ) {
+    vTaskDelay(1);
+  }
+  FileSharingEncoder = encoder;
+  unsigned long transferMillis = millis() - transferStart;
+  log_w("Pass finished: %d bytes in %d ms (%d bytes/s), %d bytes on air (%d%%)%s", sent - resumedAt, transferMillis, transferMillis > 0 ? ( ( sent - resumedAt ) * 1000 ) / transferMillis : 0, FileSender.wire, sent > resumedAt ? ( FileSender.wire * 100 ) / ( sent - resumedAt ) : 100, FileSender.windowed ? "" : ", receiver didn't ack" );
+  return !error && sent == totalsize;
+}
 
 
 void FileSharingSendFile( BLERemoteCharacteristic* RemoteChar, const char* filename ) {
@@ -688,122 +1448,322 @@ void FileSharingSendFile( BLERemoteCharacteristic* RemoteChar, const char* filen
     vTaskDelay( 1000 );
   }
 
-  if ( !RemoteChar->writeValue((uint8_t*)filename, strlen(filename), true) ) {
-    log_e("Remote is unable to comply to %s filename query", filename);
-    return;
-  }
-
   fileSharingSendFileError = false;
   fileTransferInProgress = true;
-  File fileToTransfer = BLE_FS.open( filename );
+  FileSharingReadFile = BLE_FS.open( filename );
 
-  if ( !fileToTransfer ) {
+  if ( !FileSharingReadFile ) {
     log_e("Can't open %s for reading", filename);
     fileSharingSendFileError = true;
     fileTransferInProgress = false;
     return;
   }
-  size_t totalsize = fileToTransfer.size();
-  size_t progress = totalsize;
+  size_t totalsize = FileSharingReadFile.size();
 
-  // send file size as string
-  char myTotalSize[32];
-  sprintf( myTotalSize, "%s%d", sizeMarker, totalsize );
-  RemoteChar->writeValue((uint8_t*)myTotalSize, strlen(myTotalSize), false);
+  // largest payload the negotiated MTU can carry in one write
+  size_t chunkSize = FileSharingChunkSize( FileSharingClient->getMTU() );
 
-  // send local datetime as a binary string
-  char myDateTimeMarker[strlen(dateTimeMarker)+sizeof(bt_time_t)+1];
-  const char* dateTimeAsChar = (const char*)getBLETime();
-  sprintf( myDateTimeMarker, "%s%s", dateTimeMarker, dateTimeAsChar );
-  RemoteChar->writeValue( myDateTimeMarker, strlen(dateTimeMarker)+sizeof(bt_time_t)+1 );
+  if ( FileSharingReadBuffers == NULL ) {
+    FileSharingReadBuffers = (FileSharingReadBuffer*)calloc( 2, sizeof( FileSharingReadBuffer ) );
+    FileSharingFilledQueue = xQueueCreate( 2, sizeof( uint8_t ) );
+    FileSharingEmptyQueue  = xQueueCreate( 2, sizeof( uint8_t ) );
+  }
+  if ( FileSharingReadBuffers == NULL ) {
+    log_e("Can't allocate read buffers");
+    FileSharingReadFile.close();
+    fileSharingSendFileError = true;
+    fileTransferInProgress = false;
+    return;
+  }
+  uint32_t fileId = FileSharingFileId( FileSharingReadFile );
+  if ( FILESHARING_LZSS && ( FileSenderPeerCaps & FS_CAP_LZSS ) ) {
+    FileSharingEncoder = (LZSSEncoder*)ps_malloc( sizeof( LZSSEncoder ) );
+    if ( FileSharingEncoder == NULL ) {
+      FileSharingEncoder = (LZSSEncoder*)malloc( sizeof( LZSSEncoder ) );
+    }
+  }
 
-  #define BLE_FILECOPY_BUFFSIZE 512
-  uint8_t buff[BLE_FILECOPY_BUFFSIZE];
-  uint32_t len = fileToTransfer.read( buff, BLE_FILECOPY_BUFFSIZE );
-  log_w("Starting transfert...");
+  log_w("Starting transfert (%d bytes chunks)...", chunkSize);
   UI.headerStats(filename);
   takeMuxSemaphore();
   UI.PrintProgressBar( 0 );
   giveMuxSemaphore();
-  int lastpercent = 0;
-  while ( len > 0 ) {
-    fileSharingClientLastActivity = millis();
-    progress -= len;
-    int percent = 100 - (((float)progress / (float)totalsize) * 100.00);
-    if ( !FileSharingReadRemoteChar->writeValue((uint8_t*)&buff, len, false) ) {
-      // transfert failed !
-      log_e("Failed to send %d bytes (%d percent done) %d / %d", len, percent, progress, totalsize);
-      fileSharingSendFileError = true;
-      break;
-    } else {
-      log_v("SUCCESS sending %d bytes (%d percent done) %d / %d", len, percent, progress, totalsize);
+  bool done = false;
+  for ( uint8_t attempt = 0; attempt <= FILESHARING_MAX_RETRIES && !done; attempt++ ) {
+    if ( !FileSharingClient->isConnected() ) break;
+    if ( attempt > 0 ) {
+      log_w("Resuming transfert, attempt %d / %d", attempt, FILESHARING_MAX_RETRIES);
     }
-    if ( lastpercent != percent ) {
-      takeMuxSemaphore();
-      UI.PrintProgressBar( (Out.width * percent) / 100 );
-      giveMuxSemaphore();
-      lastpercent = percent;
+    done = FileSharingSendPass( RemoteChar, filename, totalsize, fileId, chunkSize );
+  }
+  fileSharingSendFileError = !done;
+  free( FileSharingEncoder );
+  FileSharingEncoder = NULL;
+  takeMuxSemaphore();
+  UI.PrintProgressBar( 0 );
+  giveMuxSemaphore();
+
+  FileSharingReadFile.close();
+  if ( done ) {
+    UI.headerStats("[OK]");
+    FileSharingRequest( RemoteChar, FS_OP_CLOSE );
+  } else {
+    // the receiver keeps the .part file, the next session will resume
+    UI.headerStats("[Interrupted]");
+    log_e("Giving up on %s, will resume on next connection", filename);
+  }
+
+  fileTransferInProgress = false;
+}
+
+
+// patches the receiver's copy with the blocks that differ, false when a full transfer is needed
+static bool FileSharingSendDelta( BLERemoteCharacteristic* RemoteChar, const char* filename ) {
+  static FileSharingFrame frame;
+  File file = BLE_FS.open( filename );
+  if ( !file ) {
+    log_e("Can't open %s for reading", filename);
+    return false;
+  }
+  size_t totalsize = file.size();
+  size_t blocks = ( totalsize + FILESHARING_BLOCK_SIZE - 1 ) / FILESHARING_BLOCK_SIZE;
+  uint8_t* block = (uint8_t*)malloc( FILESHARING_BLOCK_SIZE );
+  FileSenderRemoteHashes = (uint8_t*)ps_calloc( blocks, FILESHARING_BLOCK_HASH_SIZE );
+  if ( FileSenderRemoteHashes == NULL ) {
+    FileSenderRemoteHashes = (uint8_t*)calloc( blocks, FILESHARING_BLOCK_HASH_SIZE );
+  }
+  bool error = blocks == 0 || block == NULL || FileSenderRemoteHashes == NULL;
+  FileSenderRemoteHashesMax = error ? 0 : blocks;
+  FileSenderRemoteBlocks = -1;
+
+  frame.clear();
+  frame.putString( FS_OP_FILE, filename );
+  frame.putU32( FS_OP_SIZE, totalsize );
+  frame.put( FS_OP_DELTA );
+  if ( !error && RemoteChar->writeValue( frame.data, frame.len, true ) ) {
+    // the receiver reads its whole copy from the SD
+    unsigned long waitStart = millis();
+    while ( FileSenderRemoteBlocks < 0 && millis() - waitStart < fileSharingClientTimeout ) {
       vTaskDelay(10);
     }
-    len = fileToTransfer.read( buff, BLE_FILECOPY_BUFFSIZE );
+  }
+  size_t remoteBlocks = FileSenderRemoteBlocks > 0 ? min( (size_t)FileSenderRemoteBlocks, blocks ) : 0;
+  if ( remoteBlocks == 0 ) {
+    log_w("No delta possible for %s", filename);
+    error = true;
+  }
+
+  size_t chunkSize = FileSharingChunkSize( FileSharingClient->getMTU(), BLE_LL_MAX_DATA_LEN, sizeof(uint32_t) );
+  uint8_t digest[FILESHARING_DIGEST_SIZE];
+  FileSharingBlockDiff diff;
+  diff.begin( FileSenderRemoteHashes, remoteBlocks );
+  FileSender.begin();
+  size_t sent = 0;
+  size_t patched = 0;
+  unsigned long transferStart = millis();
+  if ( !error ) {
+    UI.headerStats(filename);
+    takeMuxSemaphore();
+    UI.PrintProgressBar( 0 );
+    giveMuxSemaphore();
+  }
+  for ( size_t i = 0; i < blocks && !error; i++ ) {
+    size_t len = file.read( block, FILESHARING_BLOCK_SIZE );
+    if ( !diff.differs( block, len ) ) {
+      continue; // same page on both sides
+    }
+    patched++;
+    for ( size_t offset = 0; offset < len && !error; offset += chunkSize ) {
+      size_t chunk = min( chunkSize, len - offset );
+      uint32_t pos = i * FILESHARING_BLOCK_SIZE + offset; // patches carry their offset
+      fileSharingClientLastActivity = millis();
+      FileSharingSendResult result = FileSender.send( block + offset, chunk, (const uint8_t*)&pos, sizeof(pos) );
+      if ( result != FS_SEND_OK ) {
+        FileSharingLogSendError( result, sent, totalsize );
+        error = true;
+      } else {
+        sent += chunk;
+      }
+    }
+    takeMuxSemaphore();
+    UI.PrintProgressBar( (Out.width * (i + 1)) / blocks );
+    giveMuxSemaphore();
+  }
+  diff.finish( digest );
+  file.close();
+  free( block );
+  free( FileSenderRemoteHashes );
+  FileSenderRemoteHashes = NULL;
+  FileSenderRemoteHashesMax = 0;
+  if ( error ) return false;
+
+  // whole file check, the receiver answers FS_OP_VERIFY
+  FileSenderVerified = -1;
+  FileSharingRequest( RemoteChar, FS_OP_SHA256, digest, sizeof(digest) );
+  unsigned long waitStart = millis();
+  while ( FileSenderVerified < 0 && millis() - waitStart < fileSharingClientTimeout ) {
     vTaskDelay(10);
   }
+  unsigned long transferMillis = millis() - transferStart;
   takeMuxSemaphore();
   UI.PrintProgressBar( 0 );
   giveMuxSemaphore();
+  log_w("Delta sync of %s: %d / %d blocks, %d bytes in %d ms, %s", filename, patched, blocks, sent, transferMillis, FileSenderVerified == 1 ? "verified" : "NOT verified");
+  return FileSenderVerified == 1;
+}
 
-  UI.headerStats("[OK]");
-  log_w("Transfer finished!");
-  fileToTransfer.close();
-
-  RemoteChar->writeValue((uint8_t*)closeMessage, strlen(closeMessage), true);
 
+// delta sync when the receiver has a copy, full (resumable) transfer otherwise
+void FileSharingSyncFile( BLERemoteCharacteristic* RemoteChar, const char* filename ) {
+  while( fileTransferInProgress ) {
+    log_w("Waiting for current transfert to finish");
+    vTaskDelay( 1000 );
+  }
+  fileTransferInProgress = true;
+  bool patched = ( FileSenderPeerCaps & FS_CAP_DELTA ) && FileSharingSendDelta( RemoteChar, filename );
   fileTransferInProgress = false;
+  if ( patched ) {
+    UI.headerStats("[OK]");
+    return;
+  }
+  FileSharingSendFile( RemoteChar, filename );
+}
+
+
+// sends the rows changed since the receiver last merged this collector
+static void FileSharingSyncRecords( BLERemoteCharacteristic* RemoteChar ) {
+  static uint8_t packet[512]; // max attribute length
+  if ( !( FileSenderPeerCaps & FS_CAP_RECORDS ) ) return;
+  std::string address = BLEDevice::getAddress().toString();
+  FileSenderWatermark = -2;
+  if ( !FileSharingRequest( RemoteChar, FS_OP_SYNC, address.c_str(), address.length() ) ) return;
+  unsigned long waitStart = millis();
+  while ( FileSenderWatermark == -2 && millis() - waitStart < fileSharingClientTimeout ) {
+    vTaskDelay(10);
+  }
+  if ( FileSenderWatermark < 0 ) {
+    log_w("Peer doesn't merge records");
+    return;
+  }
+  uint32_t watermark = FileSenderWatermark;
+  uint32_t newWatermark = watermark;
+  uint16_t mtu = FileSharingClient->getMTU();
+  size_t room = min( (size_t)( mtu > ATT_HEADER_SIZE ? mtu - ATT_HEADER_SIZE : 20 ), sizeof( packet ) );
+  // one FS_OP_RECORDS message per write, its header is filled when sending
+  size_t markerLen = FILESHARING_MESSAGE_HEADER_SIZE;
+  size_t len = markerLen;
+  uint32_t records = 0;
+  uint32_t packets = 0;
+  bool error = false;
+  unsigned long syncStart = millis();
+  if ( RecordSync.changesBegin( watermark ) ) {
+    SyncRecord record;
+    while ( !error && RecordSync.nextChange( record ) ) {
+      size_t used = RecordSync.pack( record, packet + len, room - len );
+      if ( used == 0 && len > markerLen ) {
+        // full, send it and start the next one
+        FileSharingPutHeader( packet, FS_OP_RECORDS, len - markerLen );
+        error = !RemoteChar->writeValue( packet, len, true );
+        packets++;
+        len = markerLen;
+        used = RecordSync.pack( record, packet + len, room - len );
+      }
+      if ( used == 0 ) continue; // not a mac address
+      len += used;
+      records++;
+      if ( record.updated_at > newWatermark ) newWatermark = record.updated_at;
+      fileSharingClientLastActivity = millis();
+    }
+    RecordSync.changesEnd();
+  }
+  if ( !error && len > markerLen ) {
+    FileSharingPutHeader( packet, FS_OP_RECORDS, len - markerLen );
+    error = !RemoteChar->writeValue( packet, len, true );
+    packets++;
+  }
+  if ( error ) {
+    // the receiver keeps its watermark, next sync sends these again
+    log_e("Record sync interrupted after %d records", records);
+    return;
+  }
+  FileSenderSyncOk = -1;
+  FileSharingRequestU32( RemoteChar, FS_OP_SYNCDONE, newWatermark );
+  waitStart = millis();
+  while ( FileSenderSyncOk < 0 && millis() - waitStart < fileSharingClientTimeout ) {
+    vTaskDelay(10);
+  }
+  log_w("Sent %d records changed since %u in %d packets, %d ms, peer merged %d", records, watermark, packets, millis() - syncStart, FileSenderSyncOk);
 }
 
 
 static void FileSharingRouterCallbacks( BLERemoteCharacteristic* RemoteChar, uint8_t* pData, size_t length, bool isNotify ) {
-  char routing[512] = {0};
-  memcpy( &routing, pData, length );
+  const uint8_t* data = pData;
+  FileSharingMessage msg;
   fileSharingClientLastActivity = millis();
-  if (strcmp(routing, BLE_VENDOR_NAMES_DB_FS_PATH) == 0) {
-    FileSharingSendFile( RemoteChar, BLE_VENDOR_NAMES_DB_FS_PATH );
-    checkVendorResponded = true;
-  } else if (strcmp(routing, MAC_OUI_NAMES_DB_FS_PATH) == 0) {
-    FileSharingSendFile( RemoteChar, MAC_OUI_NAMES_DB_FS_PATH );
-    checkMacResponded = true;
-  } else if ( strstr(routing, fileMarker ) ) {
-    if ( strlen( routing ) > strlen( fileMarker ) ) {
-      char* fileNameSize = substr( routing, strlen(fileMarker), strlen(routing) - strlen(fileMarker) );
-      int pos = strpos(fileNameSize, ";", 0);
-      char* fileNameStr = substr( fileNameSize, 0, pos );
-      char* fileSizeStr = substr( fileNameSize, pos+1,  strlen(fileNameSize) - (pos+1) );
-      //size_t fileSize = atoi( fileSizeStr );
-      log_w( "remote file: %s (%s bytes)", fileNameStr, fileSizeStr );
-      free( fileNameSize );
-      free( fileNameStr );
-      free( fileSizeStr );
-    }
-    // TODO: add to array
-  } else if (strcmp(routing, lsDoneMessage ) == 0) {
-    log_w("remote ls done");
-    lsDone = true;
-  } else if ( strstr(routing, checkMacFileMessage) ) {
-    char* resp = substr( routing, strlen(routing)-1, 1 );
-    log_w("checkMacFileMessage response: %s", resp);
-    checkMacResponded = true;
-    checkMacResponse = atoi( resp );
-    free( resp );
-  } else if ( strstr(routing, checkVendorFileMessage) ) {
-    char* resp = substr( routing, strlen(routing)-1, 1 );
-    log_w("checkVendorFileMessage response: %s", resp);
-    checkVendorResponded = true;
-    checkVendorResponse = atoi( resp );
-    free( resp );
-  } else if (strcmp(routing, "quit" ) == 0) {
-    fileSharingClientTaskIsRunning = false;
-  } else {
-    log_w("Received unknown routing query: %s", routing);
+  while ( FileSharingParse( data, length, msg ) ) {
+    switch ( msg.op ) {
+      case FS_OP_ACK:
+        FileSender.onAck( FileSharingU32( msg ) );
+      break;
+      case FS_OP_NACK:
+        FileSender.onNack( FileSharingU32( msg ) );
+      break;
+      case FS_OP_OFFSET:
+        FileSenderCompressed = FileSharingU8( msg, 4 ) & FS_FLAG_LZSS;
+        FileSenderResumeOffset = ( FileSharingU8( msg, 4 ) & FS_FLAG_REFUSED ) ? -2 : (int32_t)FileSharingU32( msg );
+      break;
+      case FS_OP_HASHES: {
+        if ( !FileSharingStoreHashes( msg, FileSenderRemoteHashes, FileSenderRemoteHashesMax ) ) {
+          log_e("Unexpected block hashes");
+        }
+      }
+      break;
+      case FS_OP_HASHDONE:
+        FileSenderRemoteBlocks = FileSharingU32( msg );
+      break;
+      case FS_OP_VERIFY:
+        FileSenderVerified = FileSharingU8( msg );
+      break;
+      case FS_OP_WATERMARK:
+        FileSenderWatermark = FileSharingU8( msg ) ? (int64_t)FileSharingU32( msg, 1 ) : -1;
+      break;
+      case FS_OP_SYNCOK:
+        FileSenderSyncOk = FileSharingU32( msg );
+      break;
+      case FS_OP_HELLO:
+        FileSenderPeerCaps = FileSharingU32( msg );
+      break;
+      case FS_OP_CHECK_RESULT:
+        // sent by FileSharingClientTask: waiting for acks here would block their delivery
+        log_w("DB file #%d check response: %d", FileSharingU8( msg ), FileSharingU8( msg, 1 ));
+        if ( FileSharingU8( msg ) == FS_FILE_VENDORS ) {
+          checkVendorResponse = FileSharingU8( msg, 1 );
+          checkVendorResponded = true;
+        } else if ( FileSharingU8( msg ) == FS_FILE_OUI ) {
+          checkMacResponse = FileSharingU8( msg, 1 );
+          checkMacResponded = true;
+        }
+      break;
+      case FS_OP_LS_ENTRIES:
+        // u32 size, u8 name length, name
+        for ( uint16_t pos = 0; pos + 5 <= msg.len && pos + 5 + msg.payload[pos+4] <= msg.len; pos += 5 + msg.payload[pos+4] ) {
+          log_w( "remote file: %.*s (%d bytes)", msg.payload[pos+4], (const char*)msg.payload + pos + 5, FileSharingU32( msg, pos ) );
+        }
+        // TODO: add to array
+      break;
+      case FS_OP_LS_DONE:
+        log_w("remote ls done");
+        lsDone = true;
+      break;
+      case FS_OP_QUIT:
+        fileSharingClientTaskIsRunning = false;
+      break;
+      default:
+        log_w("Received unknown routing opcode 0x%02x", msg.op);
+    }
+  }
+  if ( length > 0 ) {
+    log_e("Dropped %d bytes of routing data (protocol v%d expected)", length, FILESHARING_PROTO_VERSION);
   }
 };
 
@@ -863,6 +1823,16 @@ static void FileSharingClientTask( void * param ) {
     return;
   }
   log_w("[Heap: %06d] Connected to address %s", freeheap, fileServerBLEAddress.c_str());
+  // shortest connection interval, no slave latency: throughput over power
+  esp_ble_conn_update_params_t connParams;
+  memcpy( connParams.bda, FileSharingClient->getPeerAddress().getNative(), sizeof(esp_bd_addr_t) );
+  connParams.min_int = 6; // x 1.25ms
+  connParams.max_int = 12; // x 1.25ms
+  connParams.latency = 0;
+  connParams.timeout = 500; // x 10ms
+  esp_ble_gap_update_conn_params( &connParams );
+  // 251-byte link layer packets: an MTU-sized chunk takes 3 packets instead of 20
+  esp_ble_gap_set_pkt_data_len( connParams.bda, BLE_LL_MAX_DATA_LEN );
   BLESharingRemoteService = FileSharingClient->getService( FileSharingServiceUUID );
   if (BLESharingRemoteService == nullptr) {
     log_e("Failed to find our FileSharingServiceUUID: %s", FileSharingServiceUUID.toString().c_str());
@@ -893,11 +1863,29 @@ static void FileSharingClientTask( void * param ) {
   }
   FileSharingRouterRemoteChar->registerForNotify( FileSharingRouterCallbacks );
 
+  // peers on another protocol version don't answer the hello
+  FileSenderPeerCaps = -1;
+  if ( FileSharingRequestU32( FileSharingRouterRemoteChar, FS_OP_HELLO, FILESHARING_CAPS ) ) {
+    unsigned long helloStart = millis();
+    while( FileSenderPeerCaps < 0 && millis() - helloStart < fileSharingClientTimeout ) {
+      vTaskDelay(100);
+    }
+  }
+  if ( FileSenderPeerCaps < 0 ) {
+    log_e("Peer doesn't speak file sharing protocol v%d, disconnecting", FILESHARING_PROTO_VERSION);
+    FileSharingClient->disconnect();
+    UI.headerStats("Incompatible :-(");
+    stopFileSharingClient();
+    vTaskDelete( NULL );
+    return;
+  }
+  log_w("Peer capabilities: 0x%02x", (uint32_t)FileSenderPeerCaps);
+
   UI.headerStats("Connected :-)");
 
   /*
   lsDone = false;
-  if ( FileSharingRouterRemoteChar->writeValue((uint8_t*)lsMessage, strlen(lsMessage), true) ) {
+  if ( FileSharingRequest( FileSharingRouterRemoteChar, FS_OP_LS ) ) {
     UI.headerStats("Discussing :-)");
   }
   while( ! lsDone ) {
@@ -905,31 +1893,44 @@ static void FileSharingClientTask( void * param ) {
   }
   */
   log_w("Sending checkdb query");
+  // u8 FS_FILE_*, sha256 of the local copy: same size isn't same content
+  uint8_t query[1 + FILESHARING_DIGEST_SIZE] = { FS_FILE_VENDORS };
+  size_t queryLen = FileSharingHashFile( BLE_VENDOR_NAMES_DB_FS_PATH, query + 1 ) ? sizeof(query) : 1;
   checkVendorResponded = false;
-  if( FileSharingRouterRemoteChar->writeValue((uint8_t*)checkMacFileMessage, strlen(checkMacFileMessage), true) ) {
-    log_w("Sent checkMacFileMessage query");
-    while( !checkVendorResponded && fileSharingClientLastActivity + fileSharingClientTimeout < millis() ) {
+  checkVendorResponse = 0;
+  if( FileSharingRequest( FileSharingRouterRemoteChar, FS_OP_CHECK, query, queryLen ) ) {
+    log_w("Sent vendor DB check query");
+    unsigned long queryStart = millis();
+    while( !checkVendorResponded && millis() - queryStart < fileSharingClientTimeout ) {
       vTaskDelay(100);
     }
-    //log_w("Vendor response: %d", checkVendorResponse);
-    FileSharingSendFile( FileSharingRouterRemoteChar, BLE_VENDOR_NAMES_DB_FS_PATH );
-    log_w("Sent checkMacFileMessage query");
+    // no answer: send anyway, like before the check existed
+    if( checkVendorResponse || !checkVendorResponded ) {
+      FileSharingSyncFile( FileSharingRouterRemoteChar, BLE_VENDOR_NAMES_DB_FS_PATH );
+    }
   } else {
     log_e("Failed to send checkdb query");
   }
 
+  query[0] = FS_FILE_OUI;
+  queryLen = FileSharingHashFile( MAC_OUI_NAMES_DB_FS_PATH, query + 1 ) ? sizeof(query) : 1;
   checkMacResponded = false;
-  if( FileSharingRouterRemoteChar->writeValue((uint8_t*)checkVendorFileMessage, strlen(checkVendorFileMessage), true) ) {
-    log_w("Sent checkVendorFileMessage query");
-    while( !checkMacResponded && fileSharingClientLastActivity + fileSharingClientTimeout < millis() ) {
+  checkMacResponse = 0;
+  if( FileSharingRequest( FileSharingRouterRemoteChar, FS_OP_CHECK, query, queryLen ) ) {
+    log_w("Sent OUI DB check query");
+    unsigned long queryStart = millis();
+    while( !checkMacResponded && millis() - queryStart < fileSharingClientTimeout ) {
       vTaskDelay(100);
     }
-    //log_w("Mac response: %d", checkMacResponse);
-    FileSharingSendFile( FileSharingRouterRemoteChar, MAC_OUI_NAMES_DB_FS_PATH );
+    if( checkMacResponse || !checkMacResponded ) {
+      FileSharingSyncFile( FileSharingRouterRemoteChar, MAC_OUI_NAMES_DB_FS_PATH );
+    }
   } else {
     log_e("Failed to send checkdb query");
   }
 
+  FileSharingSyncRecords( FileSharingRouterRemoteChar );
+
   while( fileSharingClientTaskIsRunning ) {
     if( fileSharingClientLastActivity + fileSharingClientTimeout < millis() ) break;
     else {
@@ -0,0 +1,198 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * Software duplicate-advert filter
+ *
+ * Most adverts received during a scan come from devices that were already
+ * stored a few seconds ago. Instead of sending them through store()/reset()
+ * and the string copy path again, the MAC + payload hash is checked against
+ * the rotating Bloom filters of DupFilter.h. A match only bumps the
+ * hits/rssi/last-seen counters of the device.
+ *
+ * BLEScan already drops repeats within a round, so every absorbed advert is
+ * a device stored in an earlier round. After the round its counters get
+ * what the pipeline would have done: merged into BLEDevRAMCache when the
+ * device is there, else added to its row through Storage->addHits(); then
+ * BLEIndex.touch() and Sightings.add() for non-anonymous devices.
+ *
+ * Memory footprint is fixed: 2 x DUPFILTER_BITS bits + DUPFILTER_COUNTERS_SIZE counters.
+ *
+ */
+
+#define DUPFILTER_FLUSH_SIZE 32 // counters taken at once, on the scan task stack
+
+
+class BLEDupFilterUtils {
+  public:
+
+    bool enabled = true;
+
+    // statistics, see also Filter.checked/absorbed/collisions/rotations
+    uint32_t flushed   = 0; // counters merged into BLEDevRAMCache
+    uint32_t stored    = 0; // counters added to the collector DB
+    uint32_t unmatched = 0; // counters with no cache entry nor DB row (e.g. anonymous devices)
+    int64_t  storeTime = 0; // us spent in the full store path
+    uint32_t storeCount = 0;
+    int64_t  filterTime = 0; // us spent in the filter
+
+    DupFilter Filter;
+
+    void init() {
+      // always in heap: this is checked from the BLE callback
+      Filter.windowMillis = DUPFILTER_WINDOW*1000;
+      if( !Filter.init( millis() ) ) {
+        log_e("[ERROR][%d] can't allocate duplicate filter, disabling", freeheap);
+        enabled = false;
+      }
+    }
+
+    // returns true if the advert is a repeat within the window and was absorbed
+    bool absorb( BLEAdvertisedDevice &advertisedDevice ) {
+      if( !enabled ) return false;
+      int64_t start = esp_timer_get_time();
+      BLEAddress address = advertisedDevice.getAddress();
+      bool isRepeat = Filter.absorb( (uint8_t*)address.getNative(), payloadHash( advertisedDevice ), advertisedDevice.getRSSI(), millis() );
+      filterTime += esp_timer_get_time() - start;
+      return isRepeat;
+    }
+
+    // applies the repeat counters, run this from the scan task after the round
+    void flush() {
+      BLEDupCounter pending[DUPFILTER_FLUSH_SIZE];
+      uint16_t count, batches = 0;
+      do { // bounded: leftovers bumped meanwhile wait for the next round
+        count = Filter.take( pending, DUPFILTER_FLUSH_SIZE );
+        for( uint16_t i=0; i<count; i++ ) {
+          apply( pending[i] );
+        }
+      } while( count == DUPFILTER_FLUSH_SIZE && ++batches < DUPFILTER_COUNTERS_SIZE/DUPFILTER_FLUSH_SIZE );
+    }
+
+    void setWindow( uint16_t seconds ) {
+      DUPFILTER_WINDOW = seconds;
+      Filter.windowMillis = seconds*1000;
+      enabled = seconds > 0;
+      Filter.clear( millis() );
+    }
+
+    // estimated us saved by skipping the store path on absorbed adverts
+    int64_t timeSaved() {
+      if( storeCount == 0 ) return 0;
+      return ( Filter.absorbed * (storeTime / storeCount) ) - filterTime;
+    }
+
+    void dumpStats() {
+      Serial.printf("[DupFilter] %s, window: %ds, checked: %d, absorbed: %d (%.1f%%), flushed: %d, stored: %d, unmatched: %d, collisions: %d, rotations: %d\n",
+        enabled ? "enabled" : "disabled",
+        DUPFILTER_WINDOW,
+        Filter.checked,
+        Filter.absorbed,
+        Filter.checked > 0 ? (float)Filter.absorbed*100/Filter.checked : 0,
+        flushed,
+        stored,
+        unmatched,
+        Filter.collisions,
+        Filter.rotations
+      );
+      Serial.printf("[DupFilter] fill: %.2f%%, est. false positives: %.4f%%, store path: %lld us avg, filter: %lld us total, saved: ~%lld us\n",
+        Filter.fillRatio()*100,
+        Filter.falsePositiveRate()*100,
+        storeCount > 0 ? storeTime / storeCount : 0,
+        filterTime,
+        timeSaved()
+      );
+    }
+
+  private:
+
+    // what the after-scan pipeline would have done with these repeats
+    void apply( BLEDupCounter &counter ) {
+      char address[MAC_LEN+1];
+      sprintf( address, "%02x:%02x:%02x:%02x:%02x:%02x",
+        counter.mac[0], counter.mac[1], counter.mac[2],
+        counter.mac[3], counter.mac[4], counter.mac[5]
+      );
+      bool is_anonymous = false;
+      int cacheIndex = -1;
+      for( uint16_t j=0; j<BLEDEVCACHE_SIZE; j++ ) {
+        if( strcmp( address, BLEDevRAMCache[j]->address ) == 0 ) {
+          cacheIndex = j;
+          break;
+        }
+      }
+      if( cacheIndex > -1 ) {
+        BLEDevRAMCache[cacheIndex]->hits += counter.hits;
+        BLEDevRAMCache[cacheIndex]->rssi  = counter.rssi;
+        if( TimeIsSet ) {
+          BLEDevRAMCache[cacheIndex]->updated_at = nowDateTime;
+        }
+        is_anonymous = BLEDevRAMCache[cacheIndex]->is_anonymous;
+        flushed++;
+      } else if( Storage->addHits( address, counter.hits, counter.rssi ) ) {
+        stored++; // fell out of the RAM cache, same path as a returning device
+      } else {
+        unmatched++;
+        return;
+      }
+      if( !is_anonymous ) {
+        BLEIndex.touch( address );
+        Sightings.add( address, counter.rssi );
+      }
+    }
+
+    static uint32_t fnv1a( const std::string &str, uint32_t hash ) {
+      return DupFilter::fnv1a( (const uint8_t*)str.data(), str.length(), hash );
+    }
+
+    // hashes the fields store() would copy, so a payload change gets a full pass
+    static uint32_t payloadHash( BLEAdvertisedDevice &advertisedDevice ) {
+      uint32_t hash = 2166136261UL;
+      if ( advertisedDevice.haveName() ) {
+        hash = fnv1a( advertisedDevice.getName(), hash );
+      }
+      if ( advertisedDevice.haveAppearance() ) {
+        uint16_t appearance = advertisedDevice.getAppearance();
+        hash = DupFilter::fnv1a( (const uint8_t*)&appearance, sizeof(appearance), hash );
+      }
+      if ( advertisedDevice.haveManufacturerData() ) {
+        hash = fnv1a( advertisedDevice.getManufacturerData(), hash );
+      }
+      if ( advertisedDevice.haveServiceUUID() ) {
+        hash = fnv1a( advertisedDevice.getServiceUUID().toString(), hash );
+      }
+      return hash;
+    }
+
+};
+
+
+BLEDupFilterUtils BLEDupFilter;
@@ -0,0 +1,588 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * Long-term device index
+ *
+ * The collector DB rotates every day (ble-YYYY-MM-DD.db) so deviceExists()
+ * has no memory of the previous days. This index keeps one row per MAC
+ * address across all days (first_seen, last_seen, hits) in a separate
+ * SQLite file, with a Bloom filter in front of it:
+ *
+ *   - Bloom says "never seen": new device, no DB query at all (not even the daily one)
+ *   - Bloom says "maybe": one indexed SELECT on the persistent handle (page cache)
+ *
+ * Updates are queued during the scan round and written in one transaction
+ * before the next one. The Bloom filter is updated immediately so a device
+ * inserted in the daily DB is never reported as unseen.
+ * The index is built from the existing daily DB files when it doesn't exist.
+ *
+ * Device names (name, ouiname, manufname) are kept in the same file with a
+ * trigram side table (lowercase, 3 chars, one row per trigram and address)
+ * maintained on flush() when a label changes. The last 1 and 2 chars of each
+ * label are stored as shorter grams, so every substring of 1-2 chars is the
+ * prefix of some gram, short labels included. find() intersects the needle's
+ * trigrams (a gram prefix range for 1-2 chars) and checks the labels for
+ * the full substring, so partial name searches across all days never scan
+ * the daily files and stay within FIND_MAX_TRIGRAMS index range lookups.
+ *
+ */
+
+#define BLEINDEX_DB_FILE        "ble-index.db"
+#define BLEINDEX_DB_SQLITE_PATH "/" BLE_FS_TYPE "/" BLEINDEX_DB_FILE
+#define BLEINDEX_DB_FS_PATH     "/" BLEINDEX_DB_FILE
+#define BLEINDEX_BLOOM_PSRAM_BITS (1<<20) // 128KB, ~100K devices at 1% false positives
+#define BLEINDEX_BLOOM_HEAP_BITS  (1<<15) // 4KB, ~3K devices at 1% false positives
+#define BLEINDEX_HASHES 5
+#define BLEINDEX_PENDING_SIZE (MAX_DEVICES_PER_SCAN*2)
+#define FIND_MAX_TRIGRAMS 6 // needle trigrams used for the lookup, longer needles are checked on the labels
+#define FIND_MAX_RESULTS 20
+#define BLEINDEX_GRAMS_VERSION 1 // PRAGMA user_version once the label tails are indexed
+
+#define indexCreateTableQuery "CREATE TABLE IF NOT EXISTS devices( address TEXT PRIMARY KEY, first_seen INTEGER, last_seen INTEGER, hits INTEGER )"
+#define indexAddressesQuery   "SELECT address FROM devices"
+#define indexLookupTemplate   "SELECT first_seen, last_seen, hits FROM devices WHERE address='%s'"
+#define indexInsertQuery      "INSERT OR IGNORE INTO devices(address, first_seen, last_seen, hits) VALUES( ?1, ?2, ?2, 0 )"
+#define indexUpdateQuery      "UPDATE devices SET last_seen=?2, hits=hits+1 WHERE address=?1"
+#define indexImportQuery      "INSERT INTO import SELECT address, strftime('%s', created_at), strftime('%s', updated_at), hits FROM daily.blemacs"
+#define indexMergeImportQuery "INSERT OR REPLACE INTO devices SELECT address, MIN(first_seen), MAX(last_seen), SUM(hits) FROM import GROUP BY address"
+#define labelsCreateTablesQuery "CREATE TABLE IF NOT EXISTS labels( address TEXT PRIMARY KEY, name TEXT, ouiname TEXT, manufname TEXT ); \
+CREATE TABLE IF NOT EXISTS trigrams( tri TEXT, address TEXT, PRIMARY KEY( tri, address ) ) WITHOUT ROWID; \
+CREATE INDEX IF NOT EXISTS trigrams_address ON trigrams(address)"
+#define labelsImportQuery     "INSERT OR REPLACE INTO labels SELECT address, name, ouiname, manufname FROM daily.blemacs WHERE TRIM(name)!='' OR TRIM(ouiname)!='' OR TRIM(manufname)!=''"
+#define labelsUpsertQuery     "INSERT INTO labels VALUES( ?1, ?2, ?3, ?4 ) ON CONFLICT( address ) DO UPDATE SET name=excluded.name, ouiname=excluded.ouiname, manufname=excluded.manufname \
+WHERE name IS NOT excluded.name OR ouiname IS NOT excluded.ouiname OR manufname IS NOT excluded.manufname"
+#define trigramsDeleteQuery   "DELETE FROM trigrams WHERE address=?1"
+#define trigramsInsertQuery   "INSERT OR IGNORE INTO trigrams VALUES( ?1, ?2 )"
+// %s = trigram conditions, %d = trigrams count, %d = max results
+#define findTemplate "SELECT l.address, l.name, l.ouiname, l.manufname, d.last_seen FROM labels l LEFT JOIN devices d ON d.address=l.address \
+WHERE l.address IN ( SELECT address FROM trigrams WHERE %s GROUP BY address HAVING COUNT(DISTINCT tri)>=%d ) \
+AND ( instr(lower(l.name), ?1) OR instr(lower(l.ouiname), ?1) OR instr(lower(l.manufname), ?1) ) ORDER BY d.last_seen DESC LIMIT %d"
+
+
+struct BLEIndexEntry {
+  uint32_t first_seen = 0;
+  uint32_t last_seen  = 0;
+  uint32_t hits       = 0;
+};
+
+struct BLEIndexPending {
+  char     address[MAC_LEN+1];
+  uint32_t seen = 0;
+  bool     labeled = false;
+  char     name[MAX_FIELD_LEN+1];
+  char     ouiname[MAX_FIELD_LEN+1];
+  char     manufname[MAX_FIELD_LEN+1];
+};
+
+
+class BLEIndexUtils {
+  public:
+
+    bool enabled = false;
+
+    // statistics
+    uint32_t indexed        = 0; // rows loaded in the Bloom filter + rows added since
+    uint32_t lookups        = 0;
+    uint32_t bloomSkips     = 0; // lookups answered by the Bloom filter alone
+    uint32_t found          = 0; // returning devices
+    uint32_t falsePositives = 0; // Bloom said maybe, index said no
+    uint32_t updates        = 0;
+    uint32_t flushes        = 0;
+    uint32_t relabels       = 0; // label changes, trigrams rebuilt
+    uint32_t finds          = 0;
+    uint32_t findMillis     = 0; // last find()
+
+    bool init( bool hasPsram ) {
+      indexMux = xSemaphoreCreateRecursiveMutex(); // touch() also comes from the record sync task
+      bloomBits = hasPsram ? BLEINDEX_BLOOM_PSRAM_BITS : BLEINDEX_BLOOM_HEAP_BITS;
+      bloom = (uint8_t*)( hasPsram ? ps_calloc( bloomBits/8, 1 ) : calloc( bloomBits/8, 1 ) );
+      if( bloom == NULL ) {
+        log_e("[ERROR][%d] can't allocate index Bloom filter, disabling", freeheap);
+        return false;
+      }
+      isQuerying = true;
+      bool needsImport = !BLE_FS.exists( BLEINDEX_DB_FS_PATH );
+      int rc = sqlite3_open( BLEINDEX_DB_SQLITE_PATH, &IndexDB );
+      isQuerying = false;
+      if( rc ) {
+        log_e("Can't open database %s", BLEINDEX_DB_SQLITE_PATH);
+        free( bloom );
+        bloom = NULL;
+        return false;
+      }
+      DBStats.watch( IndexDB );
+      exec( indexCreateTableQuery );
+      if( needsImport ) {
+        import();
+      }
+      bool needsLabels = exec( "SELECT 1 FROM labels LIMIT 1", NULL, true ) != SQLITE_OK;
+      exec( labelsCreateTablesQuery );
+      exec( "PRAGMA user_version", UserVersionCallback );
+      if( needsLabels ) {
+        importLabels(); // index files created before the labels table
+      } else if( userVersion < BLEINDEX_GRAMS_VERSION ) {
+        reindexLabels(); // index files created before the label tails
+      }
+      if( userVersion < BLEINDEX_GRAMS_VERSION ) {
+        char pragma[32];
+        sprintf( pragma, "PRAGMA user_version=%d", BLEINDEX_GRAMS_VERSION );
+        exec( pragma );
+      }
+      exec( indexAddressesQuery, BloomLoadCallback );
+      enabled = true;
+      log_w("Device index: %d addresses loaded, Bloom fill: %.2f%%", indexed, fillRatio()*100);
+      return true;
+    }
+
+    // false = never seen, no I/O involved
+    bool mayContain( const char* address ) {
+      if( !enabled ) return true; // can't tell
+      uint32_t h1, h2;
+      hash( address, h1, h2 );
+      for( uint8_t i=0; i<BLEINDEX_HASHES; i++ ) {
+        uint32_t bit = (h1 + i*h2) % bloomBits;
+        if( ( bloom[bit>>3] & (1<<(bit&7)) ) == 0 ) return false;
+      }
+      return true;
+    }
+
+    // true if the device was seen before (on any day), entry is filled
+    bool lookup( const char* address, BLEIndexEntry &entry ) {
+      if( !enabled ) return false;
+      lookups++;
+      if( !mayContain( address ) ) {
+        bloomSkips++;
+        return false;
+      }
+      lock();
+      char query[sizeof(indexLookupTemplate) + MAC_LEN];
+      sprintf( query, indexLookupTemplate, address );
+      lookupResult = &entry;
+      lookupFound = false;
+      exec( query, LookupCallback );
+      lookupResult = NULL;
+      // the latest sighting may still be in the pending queue
+      for( uint8_t i=0; i<pendingCount; i++ ) {
+        if( strcmp( Pending[i].address, address ) != 0 ) continue;
+        if( !lookupFound ) {
+          entry.first_seen = Pending[i].seen;
+          entry.hits = 0;
+          lookupFound = true;
+        }
+        entry.last_seen = Pending[i].seen;
+        entry.hits++;
+        break;
+      }
+      unlock();
+      if( lookupFound ) {
+        found++;
+      } else {
+        falsePositives++;
+      }
+      return lookupFound;
+    }
+
+    // queues a sighting, written on the next flush(), labels feed find()
+    void touch( const char* address, const char* name = NULL, const char* ouiname = NULL, const char* manufname = NULL ) {
+      if( !enabled || isEmpty( address ) ) return;
+      lock();
+      for( uint8_t i=0; i<pendingCount; i++ ) {
+        if( strcmp( Pending[i].address, address ) == 0 ) { // once per round
+          unlock();
+          return;
+        }
+      }
+      if( pendingCount >= BLEINDEX_PENDING_SIZE ) {
+        flush();
+      }
+      BLEIndexPending &pending = Pending[pendingCount];
+      copy( pending.address, address, MAC_LEN+1 );
+      pending.seen = nowDateTime.unixtime();
+      pending.labeled = !isEmpty( name ) || !isEmpty( ouiname ) || !isEmpty( manufname );
+      if( pending.labeled ) {
+        copy( pending.name, isEmpty( name ) ? "" : name, MAX_FIELD_LEN );
+        copy( pending.ouiname, isEmpty( ouiname ) ? "" : ouiname, MAX_FIELD_LEN );
+        copy( pending.manufname, isEmpty( manufname ) ? "" : manufname, MAX_FIELD_LEN );
+      }
+      pendingCount++;
+      if( !mayContain( address ) ) {
+        add( address );
+        indexed++;
+      }
+      unlock();
+    }
+
+    // writes the queued sightings in a single transaction
+    void flush() {
+      if( !enabled || pendingCount == 0 ) return;
+      lock();
+      sqlite3_stmt *insertStmt = NULL, *updateStmt = NULL;
+      if( sqlite3_prepare_v2( IndexDB, indexInsertQuery, -1, &insertStmt, NULL ) != SQLITE_OK
+       || sqlite3_prepare_v2( IndexDB, indexUpdateQuery, -1, &updateStmt, NULL ) != SQLITE_OK ) {
+        log_e("Can't prepare index updates: %s", sqlite3_errmsg( IndexDB ) );
+        sqlite3_finalize( insertStmt );
+        sqlite3_finalize( updateStmt );
+        pendingCount = 0; // touch() needs the room
+        unlock();
+        return;
+      }
+      exec( "BEGIN" );
+      isQuerying = true;
+      for( uint8_t i=0; i<pendingCount; i++ ) {
+        sqlite3_stmt *stmts[2] = { insertStmt, updateStmt };
+        for( uint8_t j=0; j<2; j++ ) {
+          sqlite3_bind_text( stmts[j], 1, Pending[i].address, -1, SQLITE_STATIC );
+          sqlite3_bind_int64( stmts[j], 2, Pending[i].seen );
+          sqlite3_step( stmts[j] );
+          sqlite3_reset( stmts[j] );
+        }
+        updates++;
+        if( Pending[i].labeled ) {
+          label( Pending[i].address, Pending[i].name, Pending[i].ouiname, Pending[i].manufname );
+        }
+      }
+      sqlite3_finalize( insertStmt );
+      sqlite3_finalize( updateStmt );
+      isQuerying = false;
+      exec( "COMMIT" );
+      pendingCount = 0;
+      flushes++;
+      unlock();
+    }
+
+    // prints the devices whose labels contain needle (case insensitive)
+    void find( const char* needle ) {
+      if( !enabled || isEmpty( needle ) ) return;
+      lock();
+      findLocked( needle );
+      unlock();
+    }
+
+    float fillRatio() {
+      if( bloom == NULL ) return 0;
+      uint32_t bitsSet = 0;
+      for( uint32_t i=0; i<bloomBits/8; i++ ) {
+        bitsSet += __builtin_popcount( bloom[i] );
+      }
+      return (float)bitsSet / bloomBits;
+    }
+
+    void dumpStats() {
+      Serial.printf("[Index] %s, %s, devices: %d, Bloom: %dKB (fill %.2f%%)\n",
+        enabled ? "enabled" : "disabled",
+        BLEINDEX_DB_FS_PATH,
+        indexed,
+        bloomBits/8/1024,
+        fillRatio()*100
+      );
+      Serial.printf("[Index] lookups: %d, Bloom skips: %d, returning: %d, false positives: %d, updates: %d in %d transactions, pending: %d\n",
+        lookups,
+        bloomSkips,
+        found,
+        falsePositives,
+        updates,
+        flushes,
+        pendingCount
+      );
+      Serial.printf("[Index] label changes: %d, finds: %d, last find: %d ms\n", relabels, finds, findMillis );
+    }
+
+  private:
+
+    sqlite3* IndexDB = NULL; // kept open, the page cache makes repeated lookups cheap
+    xSemaphoreHandle indexMux = NULL; // Pending and IndexDB
+    uint8_t* bloom = NULL;
+    uint32_t bloomBits = 0;
+    BLEIndexPending Pending[BLEINDEX_PENDING_SIZE];
+    uint8_t  pendingCount = 0;
+    BLEIndexEntry* lookupResult = NULL;
+    bool lookupFound = false;
+    uint32_t userVersion = 0;
+
+    void lock() {
+      if( indexMux ) xSemaphoreTakeRecursive( indexMux, portMAX_DELAY );
+    }
+
+    void unlock() {
+      if( indexMux ) xSemaphoreGiveRecursive( indexMux );
+    }
+
+    void findLocked( const char* needle ) {
+      unsigned long start = millis();
+      char lowered[MAX_FIELD_LEN+1];
+      lower( lowered, needle, MAX_FIELD_LEN );
+      size_t len = strlen( lowered );
+      // trigram conditions, or a prefix range on the grams for short needles
+      char conditions[FIND_MAX_TRIGRAMS*12+16] = {'\0'};
+      char trigrams[FIND_MAX_TRIGRAMS][4];
+      uint8_t trigramsCount = 0;
+      if( len < 3 ) {
+        sprintf( conditions, "tri>=?2 AND tri<?3" );
+      } else {
+        // spread the lookups over the whole needle
+        uint8_t available = len - 2;
+        uint8_t wanted = available < FIND_MAX_TRIGRAMS ? available : FIND_MAX_TRIGRAMS;
+        for( uint8_t i=0; i<wanted; i++ ) {
+          uint8_t pos = wanted > 1 ? i * ( available - 1 ) / ( wanted - 1 ) : 0;
+          memcpy( trigrams[trigramsCount], lowered + pos, 3 );
+          trigrams[trigramsCount][3] = '\0';
+          sprintf( conditions + strlen( conditions ), "%stri=?%d", trigramsCount == 0 ? "" : " OR ", trigramsCount + 2 );
+          trigramsCount++;
+        }
+      }
+      char query[sizeof(findTemplate) + sizeof(conditions) + 8];
+      // duplicate trigrams (e.g. "aaaa") are counted once by COUNT(DISTINCT)
+      uint8_t distinct = 0;
+      for( uint8_t i=0; i<trigramsCount; i++ ) {
+        bool seen = false;
+        for( uint8_t j=0; j<i; j++ ) {
+          if( strcmp( trigrams[i], trigrams[j] ) == 0 ) seen = true;
+        }
+        if( !seen ) distinct++;
+      }
+      sprintf( query, findTemplate, conditions, len < 3 ? 1 : distinct, FIND_MAX_RESULTS );
+      sqlite3_stmt *stmt;
+      isQuerying = true;
+      if( sqlite3_prepare_v2( IndexDB, query, -1, &stmt, NULL ) != SQLITE_OK ) {
+        isQuerying = false;
+        log_e("find failed: %s", sqlite3_errmsg( IndexDB ) );
+        return;
+      }
+      sqlite3_bind_text( stmt, 1, lowered, -1, SQLITE_STATIC );
+      char upper[3] = {'\0'}; // end of the prefix range
+      if( len < 3 ) {
+        copy( upper, lowered, len );
+        upper[len-1]++;
+        sqlite3_bind_text( stmt, 2, lowered, -1, SQLITE_STATIC );
+        sqlite3_bind_text( stmt, 3, upper, -1, SQLITE_STATIC );
+      }
+      for( uint8_t i=0; i<trigramsCount; i++ ) {
+        sqlite3_bind_text( stmt, i+2, trigrams[i], -1, SQLITE_STATIC );
+      }
+      uint8_t results = 0;
+      while( sqlite3_step( stmt ) == SQLITE_ROW ) {
+        Serial.printf("%s  %-24s %-24s %-24s last seen: %d\n",
+          (const char*)sqlite3_column_text( stmt, 0 ),
+          sqlite3_column_text( stmt, 1 ) ? (const char*)sqlite3_column_text( stmt, 1 ) : "",
+          sqlite3_column_text( stmt, 2 ) ? (const char*)sqlite3_column_text( stmt, 2 ) : "",
+          sqlite3_column_text( stmt, 3 ) ? (const char*)sqlite3_column_text( stmt, 3 ) : "",
+          sqlite3_column_int( stmt, 4 )
+        );
+        results++;
+      }
+      sqlite3_finalize( stmt );
+      isQuerying = false;
+      finds++;
+      findMillis = millis() - start;
+      Serial.printf("[Index] '%s': %d result(s)%s in %d ms\n", needle, results, results == FIND_MAX_RESULTS ? " (truncated)" : "", findMillis );
+    }
+
+    // errors are reported to DB.error() unless silent
+    int exec( const char* sql, int (*callback)(void*,int,char**,char**) = NULL, bool silent = false ) {
+      isQuerying = true;
+      int rc = sqlite3_exec( IndexDB, sql, callback, (void*)this, &zErrMsg );
+      isQuerying = false;
+      if( rc != SQLITE_OK ) {
+        log_e("Index query failed (%s): %s", zErrMsg ? zErrMsg : "unknown error", sql);
+        if( !silent ) DB.error( zErrMsg );
+        sqlite3_free( zErrMsg );
+      }
+      return rc;
+    }
+
+    // one-time migration: aggregates every daily DB file found on the card
+    void import() {
+      UI.headerStats("Indexing DB files");
+      exec( "CREATE TABLE IF NOT EXISTS import( address TEXT, first_seen INTEGER, last_seen INTEGER, hits INTEGER )" );
+      forEachDailyDB( indexImportQuery );
+      exec( indexMergeImportQuery );
+      exec( "DROP TABLE import" );
+      UI.headerStats(" ");
+    }
+
+    // one-time migration: latest labels of every device, then their trigrams
+    void importLabels() {
+      UI.headerStats("Indexing names");
+      exec( labelsCreateTablesQuery );
+      forEachDailyDB( labelsImportQuery );
+      reindexLabels();
+    }
+
+    // (re)builds the grams of every label
+    void reindexLabels() {
+      UI.headerStats("Indexing names");
+      exec( "DELETE FROM trigrams" );
+      sqlite3_stmt *stmt;
+      if( sqlite3_prepare_v2( IndexDB, "SELECT address, name, ouiname, manufname FROM labels", -1, &stmt, NULL ) == SQLITE_OK ) {
+        exec( "BEGIN" );
+        while( sqlite3_step( stmt ) == SQLITE_ROW ) {
+          indexTrigrams(
+            (const char*)sqlite3_column_text( stmt, 0 ),
+            (const char*)sqlite3_column_text( stmt, 1 ),
+            (const char*)sqlite3_column_text( stmt, 2 ),
+            (const char*)sqlite3_column_text( stmt, 3 )
+          );
+        }
+        exec( "COMMIT" );
+        sqlite3_finalize( stmt );
+      }
+      UI.headerStats(" ");
+    }
+
+    // runs query once per daily DB file, attached as 'daily'
+    void forEachDailyDB( const char* dailyQuery ) {
+      DB.releaseCollectorDB(); // today's file may be held in exclusive mode
+      File root = BLE_FS.open("/");
+      if( !root || !root.isDirectory() ) return;
+      char query[128];
+      File file = root.openNextFile();
+      while( file ) {
+        const char* fileName = file.name();
+        const char* baseName = strrchr( fileName, '/' ) ? strrchr( fileName, '/' )+1 : fileName;
+        bool isCollectorDB = ( strncmp( baseName, "ble-", 4 ) == 0 && strcmp( baseName, BLEINDEX_DB_FILE ) != 0 && strcmp( baseName, BLE_VENDOR_NAMES_DB_FILE ) != 0 )
+                          || strcmp( baseName, BLE_COLLECTOR_DB_FILE ) == 0;
+        if( isCollectorDB && strstr( baseName, ".db" ) != NULL ) {
+          log_w("Indexing %s", baseName);
+          sprintf( query, "ATTACH DATABASE '/%s/%s' AS daily", BLE_FS_TYPE, baseName );
+          // a broken daily file must not flag the current collector DB for reset
+          if( exec( query, NULL, true ) == SQLITE_OK ) {
+            exec( dailyQuery, NULL, true );
+            exec( "DETACH DATABASE daily", NULL, true );
+          }
+        }
+        file = root.openNextFile();
+      }
+    }
+
+    // stores the labels, trigrams are rebuilt only when they changed
+    void label( const char* address, const char* name, const char* ouiname, const char* manufname ) {
+      sqlite3_stmt *stmt;
+      if( sqlite3_prepare_v2( IndexDB, labelsUpsertQuery, -1, &stmt, NULL ) != SQLITE_OK ) return;
+      sqlite3_bind_text( stmt, 1, address, -1, SQLITE_STATIC );
+      sqlite3_bind_text( stmt, 2, name, -1, SQLITE_STATIC );
+      sqlite3_bind_text( stmt, 3, ouiname, -1, SQLITE_STATIC );
+      sqlite3_bind_text( stmt, 4, manufname, -1, SQLITE_STATIC );
+      bool changed = sqlite3_step( stmt ) == SQLITE_DONE && sqlite3_changes( IndexDB ) > 0;
+      sqlite3_finalize( stmt );
+      if( !changed ) return;
+      if( sqlite3_prepare_v2( IndexDB, trigramsDeleteQuery, -1, &stmt, NULL ) == SQLITE_OK ) {
+        sqlite3_bind_text( stmt, 1, address, -1, SQLITE_STATIC );
+        sqlite3_step( stmt );
+        sqlite3_finalize( stmt );
+      }
+      indexTrigrams( address, name, ouiname, manufname );
+      relabels++;
+    }
+
+    void indexTrigrams( const char* address, const char* name, const char* ouiname, const char* manufname ) {
+      sqlite3_stmt *stmt;
+      if( sqlite3_prepare_v2( IndexDB, trigramsInsertQuery, -1, &stmt, NULL ) != SQLITE_OK ) return;
+      sqlite3_bind_text( stmt, 2, address, -1, SQLITE_STATIC );
+      const char* labels[3] = { name, ouiname, manufname };
+      char lowered[MAX_FIELD_LEN+1];
+      char trigram[4] = {'\0'};
+      for( uint8_t l=0; l<3; l++ ) {
+        if( isEmpty( labels[l] ) ) continue;
+        lower( lowered, labels[l], MAX_FIELD_LEN );
+        size_t len = strlen( lowered );
+        for( size_t i=0; i<len; i++ ) {
+          // full trigrams, then the 2 and 1 char tails
+          uint8_t gramLen = i+3 <= len ? 3 : len - i;
+          memcpy( trigram, lowered + i, gramLen );
+          sqlite3_bind_text( stmt, 1, trigram, gramLen, SQLITE_TRANSIENT );
+          sqlite3_step( stmt );
+          sqlite3_reset( stmt );
+        }
+      }
+      sqlite3_finalize( stmt );
+    }
+
+    static void lower( char* dst, const char* src, size_t maxlen ) {
+      size_t i = 0;
+      for( ; i<maxlen && src[i]; i++ ) {
+        dst[i] = tolower( (uint8_t)src[i] );
+      }
+      dst[i] = '\0';
+    }
+
+    void add( const char* address ) {
+      uint32_t h1, h2;
+      hash( address, h1, h2 );
+      for( uint8_t i=0; i<BLEINDEX_HASHES; i++ ) {
+        uint32_t bit = (h1 + i*h2) % bloomBits;
+        bloom[bit>>3] |= (1<<(bit&7));
+      }
+    }
+
+    // FNV-1a + double hashing
+    static void hash( const char* address, uint32_t &h1, uint32_t &h2 ) {
+      h1 = 2166136261UL;
+      h2 = 0x5bd1e995UL;
+      for( const char* c=address; *c; c++ ) {
+        h1 = ( h1 ^ (uint8_t)*c ) * 16777619UL;
+        h2 = ( h2 ^ (uint8_t)*c ) * 16777619UL;
+      }
+      h2 |= 1; // odd step
+    }
+
+    static int BloomLoadCallback( void *self, int argc, char **argv, char **azColName ) {
+      if( argc > 0 && argv[0] ) {
+        ((BLEIndexUtils*)self)->add( argv[0] );
+        ((BLEIndexUtils*)self)->indexed++;
+      }
+      return 0;
+    }
+
+    static int UserVersionCallback( void *self, int argc, char **argv, char **azColName ) {
+      if( argc > 0 && argv[0] ) {
+        ((BLEIndexUtils*)self)->userVersion = strtoul( argv[0], NULL, 10 );
+      }
+      return 0;
+    }
+
+    static int LookupCallback( void *self, int argc, char **argv, char **azColName ) {
+      BLEIndexUtils *index = (BLEIndexUtils*)self;
+      if( index->lookupResult == NULL ) return 0;
+      for( int i = 0; i < argc; i++ ) {
+        uint32_t val = argv[i] ? strtoul( argv[i], NULL, 10 ) : 0;
+        if( strcmp( azColName[i], "first_seen" ) == 0 ) index->lookupResult->first_seen = val;
+        else if( strcmp( azColName[i], "last_seen" ) == 0 ) index->lookupResult->last_seen = val;
+        else if( strcmp( azColName[i], "hits" ) == 0 ) index->lookupResult->hits = val;
+      }
+      index->lookupFound = true;
+      return 0;
+    }
+
+};
+
+
+BLEIndexUtils BLEIndex;
@@ -0,0 +1,673 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * Storage backends
+ *
+ * The scan pipeline stores devices through the Storage pointer instead of
+ * calling DBUtils directly:
+ *
+ *   - SQLiteStorage: the blemacs table in today's ble-YYYY-MM-DD.db (default)
+ *   - SightingLog: fixed-size CRC-protected records appended to today's
+ *     ble-YYYY-MM-DD.log in 4KB blocks, with an in-RAM address index
+ *
+ * Log files are turned into the blemacs schema with the 'storage compact'
+ * serial command, which replays them into the matching .db file.
+ *
+ */
+
+#include <rom/crc.h>
+
+#define SIGHTING_MAGIC 0xB1E5
+#define SIGHTING_VERSION 1
+#define SIGHTING_RECORD_SIZE 256
+#define SIGHTING_BLOCK_SIZE 4096
+#define SIGHTING_RECORDS_PER_BLOCK (SIGHTING_BLOCK_SIZE/SIGHTING_RECORD_SIZE)
+#define SIGHTING_INDEX_PSRAM_SIZE 8192 // addresses
+#define SIGHTING_INDEX_HEAP_SIZE 512 // addresses
+#define SIGHTING_LOG_EXT ".log"
+#define BENCH_LOG_FS_PATH "/bench" SIGHTING_LOG_EXT
+
+enum SightingTypes {
+  SIGHTING_INSERT = 1,
+  SIGHTING_DELETE = 2
+};
+
+struct __attribute__((packed)) SightingRecord {
+  uint16_t magic;
+  uint8_t  version;
+  uint8_t  type; // SightingTypes
+  uint32_t seq; // record number in the file
+  uint8_t  mac[6];
+  uint8_t  addr_type;
+  uint8_t  reserved;
+  int16_t  rssi;
+  uint16_t appearance;
+  int32_t  manufid;
+  uint32_t created_at;
+  uint32_t updated_at;
+  uint32_t hits;
+  char     name[MAX_FIELD_LEN+1];
+  char     ouiname[MAX_FIELD_LEN+1];
+  char     manufname[MAX_FIELD_LEN+1];
+  char     uuid[MAX_FIELD_LEN+1];
+  uint8_t  padding[SIGHTING_RECORD_SIZE - 36 - 4*(MAX_FIELD_LEN+1) - 4];
+  uint32_t crc; // crc32_le of the previous bytes
+};
+
+static_assert( sizeof(SightingRecord) == SIGHTING_RECORD_SIZE, "SightingRecord must fill its slot" );
+
+#define SIGHTING_INDEX_EMPTY   0xffffffff
+#define SIGHTING_INDEX_DELETED 0xfffffffe
+
+struct SightingIndexItem {
+  uint8_t  mac[6];
+  uint32_t seq = SIGHTING_INDEX_EMPTY;
+};
+
+
+class BLEStorageBackend {
+  public:
+    virtual const char* name() = 0;
+    virtual bool begin() { return true; }
+    // same return values as DBUtils::insertBTDevice()
+    virtual DBUtils::DBMessage insert( BlueToothDevice *CacheItem ) = 0;
+    // same return values as DBUtils::deviceExists(), found devices are loaded in BLEDevDBCache
+    virtual int exists( const char* address ) = 0;
+    virtual void remove( const char* address ) = 0;
+    // not really an update, more of a delete+reinsert
+    virtual DBUtils::DBMessage update( BlueToothDevice *CacheItem ) {
+      remove( CacheItem->address );
+      return insert( CacheItem );
+    }
+    // repeats absorbed by the duplicate filter, false if the device isn't stored
+    virtual bool addHits( const char* address, uint16_t hits, int rssi ) {
+      if( exists( address ) < 0 ) return false; // loads BLEDevDBCache
+      BLEDevDBCache->hits += hits;
+      BLEDevDBCache->rssi  = rssi;
+      if( TimeIsSet ) {
+        BLEDevDBCache->updated_at = nowDateTime;
+      }
+      return update( BLEDevDBCache ) == DBUtils::INSERTION_SUCCESS;
+    }
+    // batched exists() for a scan round
+    virtual void prefetch( const char** addresses, uint8_t count ) { }
+    // run between scan rounds and before restarting
+    virtual void flush() { }
+
+    void updateItemFromCache( BlueToothDevice* CacheItem ) {
+      if( update( CacheItem ) != DBUtils::INSERTION_SUCCESS ) {
+        // whoops
+        Serial.printf("[BUMMER] Failed to re-insert device %s\n", CacheItem->address);
+        UI.headerStats("Updated failed");
+      } else {
+        UI.headerStats("Updated item");
+      }
+    }
+
+    // writes the RAM cache back, e.g. before a restart
+    bool replicate( BlueToothDevice** SourceCache, bool showBLECards = true, bool resetAfter = true ) {
+      UI.headerStats("DB replicating...");
+      UI.PrintProgressBar( Out.width );
+      for(uint16_t i=0; i<BLEDEVCACHE_SIZE ;i++) {
+        vTaskDelay(5);
+
+        float percent = i*100 / BLEDEVCACHE_SIZE;
+        UI.PrintProgressBar( (Out.width * percent) / 100 );
+
+        if( isEmpty( SourceCache[i]->address ) ) continue;
+        if( SourceCache[i]->is_anonymous ) {
+          if( resetAfter ) {
+            BLEDevHelper.reset( SourceCache[i] );
+          }
+          continue;
+        }
+        BLEDevTmp = SourceCache[i];
+        if( showBLECards ) {
+          UI.printBLECard( (BlueToothDeviceLink){.cacheIndex=i,.device=BLEDevTmp}/*BLEDevTmp*/ ); // render
+        }
+        updateItemFromCache( SourceCache[i] );
+
+        vTaskDelay(5);
+
+        if( resetAfter ) {
+          BLEDevHelper.reset( SourceCache[i] );
+        }
+      }
+      DB.cacheState();
+      UI.cacheStats();
+      UI.PrintProgressBar( Out.width );
+      UI.headerStats(" ");
+      return true;
+    }
+};
+
+
+class SQLiteStorageBackend : public BLEStorageBackend {
+  public:
+    const char* name() { return "sqlite"; }
+    DBUtils::DBMessage insert( BlueToothDevice *CacheItem ) { return DB.insertBTDevice( CacheItem ); }
+    int exists( const char* address ) { return DB.deviceExistsBatched( address ); }
+    void remove( const char* address ) { DB.deleteBLEDevice( address ); }
+    bool addHits( const char* address, uint16_t hits, int rssi ) { return DB.addHits( address, hits, rssi ); }
+    void prefetch( const char** addresses, uint8_t count ) { DB.devicesExist( addresses, count ); }
+};
+
+
+class SightingLogBackend : public BLEStorageBackend {
+  public:
+
+    char path[32] = {'\0'};
+    bool followsDB = false; // reopens on day rotation
+
+    // statistics
+    uint32_t records      = 0; // appended since boot
+    uint32_t blockWrites  = 0;
+    uint64_t bytesWritten = 0; // includes partial block rewrites
+    uint32_t crcErrors    = 0; // found while loading
+    uint32_t indexFull    = 0; // addresses that didn't fit in the index
+
+    ~SightingLogBackend() {
+      end();
+      free( block );
+      free( index );
+    }
+
+    const char* name() { return "log"; }
+
+    bool begin() {
+      char logPath[32];
+      logPathFromDB( DB.BLEMacsDbFSPath, logPath );
+      followsDB = begin( logPath, DB.hasPsram ? SIGHTING_INDEX_PSRAM_SIZE : SIGHTING_INDEX_HEAP_SIZE );
+      return followsDB;
+    }
+
+    // opens (or creates) a log file and rebuilds the index from its valid records
+    bool begin( const char* logPath, uint16_t indexSize ) {
+      end();
+      copy( path, logPath, sizeof(path)-1 );
+      if( block == NULL ) {
+        block = (uint8_t*)calloc( SIGHTING_BLOCK_SIZE, 1 );
+      }
+      if( index == NULL || indexCapacity != indexSize ) {
+        free( index );
+        indexCapacity = indexSize;
+        index = (SightingIndexItem*)( DB.hasPsram ? ps_calloc( indexCapacity, sizeof(SightingIndexItem) ) : calloc( indexCapacity, sizeof(SightingIndexItem) ) );
+      }
+      if( block == NULL || index == NULL ) {
+        log_e("[ERROR][%d] can't allocate sighting log buffers", freeheap);
+        return false;
+      }
+      for( uint16_t i=0; i<indexCapacity; i++ ) index[i].seq = SIGHTING_INDEX_EMPTY;
+      nextSeq = 0;
+      isQuerying = true;
+      if( !BLE_FS.exists( path ) ) {
+        File created = BLE_FS.open( path, FILE_WRITE );
+        created.close();
+      }
+      file = BLE_FS.open( path, "r+" );
+      if( !file ) {
+        isQuerying = false;
+        log_e("Can't open %s", path);
+        return false;
+      }
+      load();
+      isQuerying = false;
+      log_w("Sighting log %s: %d records, %d CRC errors", path, nextSeq, crcErrors);
+      return true;
+    }
+
+    void end() {
+      if( !file ) return;
+      if( blockFill > 0 && blockDirty ) {
+        writeBlock();
+      }
+      file.close();
+    }
+
+    DBUtils::DBMessage insert( BlueToothDevice *CacheItem ) {
+      if( !file ) return DBUtils::INSERTION_FAILED;
+      if( CacheItem->appearance==0
+       && isEmpty( CacheItem->name )
+       && isEmpty( CacheItem->uuid )
+       && isEmpty( CacheItem->ouiname )
+       && isEmpty( CacheItem->manufname )
+       ) {
+        return DBUtils::INSERTION_IGNORED; // same rule as the SQLite backend
+      }
+      SightingRecord record;
+      fromDevice( CacheItem, record );
+      record.type = SIGHTING_INSERT;
+      if( !append( record ) ) {
+        CacheItem->in_db = false;
+        return DBUtils::INSERTION_FAILED;
+      }
+      indexSet( record.mac, record.seq );
+      CacheItem->in_db = true;
+      return DBUtils::INSERTION_SUCCESS;
+    }
+
+    int exists( const char* address ) {
+      results = 0;
+      uint8_t mac[6];
+      if( !parseMac( address, mac ) ) return -1;
+      int32_t slot = indexFind( mac );
+      if( slot < 0 ) return -1;
+      SightingRecord record;
+      if( !read( index[slot].seq, record ) ) return -2;
+      toDevice( record, BLEDevDBCache );
+      results = 1;
+      return BLEDevCacheIndex;
+    }
+
+    void remove( const char* address ) {
+      SightingRecord record;
+      memset( &record, 0, sizeof(record) );
+      if( !parseMac( address, record.mac ) ) return;
+      record.type = SIGHTING_DELETE;
+      if( append( record ) ) {
+        int32_t slot = indexFind( record.mac );
+        if( slot >= 0 ) index[slot].seq = SIGHTING_INDEX_DELETED;
+      }
+    }
+
+    // writes the partial block, padded (it will be rewritten when more records arrive)
+    void flush() {
+      if( followsDB ) {
+        char logPath[32];
+        logPathFromDB( DB.BLEMacsDbFSPath, logPath );
+        if( strcmp( logPath, path ) != 0 ) {
+          begin(); // day changed, flushes and closes the previous log
+          return;
+        }
+      }
+      if( !file || blockFill == 0 || !blockDirty ) return;
+      writeBlock();
+    }
+
+    float writeAmplification() {
+      if( records == 0 ) return 0;
+      return (float)bytesWritten / ( records * SIGHTING_RECORD_SIZE );
+    }
+
+    void dumpStats() {
+      Serial.printf("[SightingLog] %s, records: %d (%d since boot), blocks written: %d (%lluKB), write amplification: %.2f, CRC errors: %d, index: %d slots (%d overflows)\n",
+        path,
+        nextSeq,
+        records,
+        blockWrites,
+        bytesWritten / 1024,
+        writeAmplification(),
+        crcErrors,
+        indexCapacity,
+        indexFull
+      );
+    }
+
+    // replays a log file into the blemacs table of the matching .db file, in order
+    static bool compact( const char* logPath, const char* activeLogPath = NULL ) {
+      char dbFsPath[32], dbSqlitePath[48], query[512], address[MAC_LEN+1], created[20], updated[20];
+      copy( dbFsPath, logPath, 31 );
+      char* ext = strrchr( dbFsPath, '.' );
+      if( ext == NULL || strcmp( ext, SIGHTING_LOG_EXT ) != 0 ) {
+        Serial.printf("%s is not a sighting log\n", logPath);
+        return false;
+      }
+      *ext = '\0';
+      strcat( dbFsPath, ".db" );
+      if( activeLogPath != NULL && strcmp( logPath, activeLogPath ) == 0 ) {
+        Serial.printf("%s is in use, switch to the sqlite backend first\n", logPath);
+        return false;
+      }
+      if( strcmp( dbFsPath, DB.BLEMacsDbFSPath ) == 0 ) {
+        if( DB.inMemory ) {
+          Serial.printf("%s is held in PSRAM, can't compact into it\n", dbFsPath);
+          return false;
+        }
+        DB.releaseCollectorDB();
+      }
+      sprintf( dbSqlitePath, "/%s%s", BLE_FS_TYPE, dbFsPath );
+      isQuerying = true;
+      File log = BLE_FS.open( logPath );
+      if( !log ) {
+        isQuerying = false;
+        Serial.printf("Can't open %s\n", logPath);
+        return false;
+      }
+      sqlite3 *db;
+      if( sqlite3_open( dbSqlitePath, &db ) != SQLITE_OK ) {
+        log.close();
+        isQuerying = false;
+        Serial.printf("Can't open %s\n", dbSqlitePath);
+        return false;
+      }
+      sqlite3_exec( db, createTableQuery, NULL, NULL, NULL );
+      sqlite3_exec( db, createIndexQuery, NULL, NULL, NULL );
+      sqlite3_exec( db, "BEGIN", NULL, NULL, NULL );
+      SightingRecord record;
+      uint32_t replayed = 0, failed = 0;
+      while( log.read( (uint8_t*)&record, SIGHTING_RECORD_SIZE ) == SIGHTING_RECORD_SIZE && isValid( record ) ) {
+        formatMac( record.mac, address );
+        if( record.type == SIGHTING_DELETE ) {
+          sprintf( query, "DELETE FROM blemacs WHERE address='%s'", address );
+        } else {
+          DateTime createdAt( record.created_at ), updatedAt( record.updated_at );
+          sprintf( created, YYYYMMDD_HHMMSS_Tpl, createdAt.year(), createdAt.month(), createdAt.day(), createdAt.hour(), createdAt.minute(), createdAt.second() );
+          sprintf( updated, YYYYMMDD_HHMMSS_Tpl, updatedAt.year(), updatedAt.month(), updatedAt.day(), updatedAt.hour(), updatedAt.minute(), updatedAt.second() );
+          DBUtils::clean( record.name );
+          DBUtils::clean( record.ouiname );
+          DBUtils::clean( record.manufname );
+          DBUtils::clean( record.uuid );
+          sprintf( query, insertQueryTemplate,
+            record.appearance,
+            record.name,
+            address,
+            record.ouiname,
+            record.rssi,
+            record.manufid,
+            record.manufname,
+            record.uuid,
+            created,
+            updated,
+            record.hits
+          );
+        }
+        if( sqlite3_exec( db, query, NULL, NULL, NULL ) == SQLITE_OK ) {
+          replayed++;
+        } else {
+          failed++;
+        }
+        if( ( replayed + failed ) % 64 == 0 ) { // bounded transactions, let the other tasks breathe
+          sqlite3_exec( db, "COMMIT; BEGIN", NULL, NULL, NULL );
+          vTaskDelay(1);
+        }
+      }
+      sqlite3_exec( db, "COMMIT", NULL, NULL, NULL );
+      sqlite3_close( db );
+      log.close();
+      char donePath[40];
+      sprintf( donePath, "%s.done", logPath );
+      BLE_FS.rename( logPath, donePath );
+      isQuerying = false;
+      Serial.printf("Compacted %s into %s: %d records replayed, %d failed, log renamed to %s\n", logPath, dbFsPath, replayed, failed, donePath);
+      return failed == 0;
+    }
+
+    // same rows as DBUtils::benchProfiles(), to compare records/s and bytes written per record
+    static void bench( uint16_t rows ) {
+      SightingLogBackend *benchLog = new SightingLogBackend();
+      BlueToothDevice *device = (BlueToothDevice*)calloc( 1, sizeof( BlueToothDevice ) );
+      BLEDevHelper.init( device, false );
+      isQuerying = true;
+      BLE_FS.remove( BENCH_LOG_FS_PATH );
+      isQuerying = false;
+      if( !benchLog->begin( BENCH_LOG_FS_PATH, SIGHTING_INDEX_HEAP_SIZE ) ) {
+        Serial.println("[Bench] log      failed");
+      } else {
+        int64_t start = esp_timer_get_time();
+        for( uint16_t i=0; i<rows; i++ ) {
+          BLEDevHelper.reset( device );
+          sprintf( device->address, "00:00:00:00:%02x:%02x", i>>8, i&0xff );
+          BLEDevHelper.set( device, "name", "bench" );
+          BLEDevHelper.set( device, "ouiname", "[bench]" );
+          BLEDevHelper.set( device, "rssi", -80 );
+          BLEDevHelper.set( device, "hits", (int)i );
+          benchLog->insert( device );
+        }
+        benchLog->flush();
+        int64_t elapsed = esp_timer_get_time() - start;
+        Serial.printf("[Bench] %-8s %d rows in %lldms: %.1f inserts/s, block writes: %d (%lluKB, %llu bytes/row), write amplification: %.2f\n",
+          "log",
+          rows,
+          elapsed / 1000,
+          elapsed > 0 ? rows * 1000000.0 / elapsed : 0,
+          benchLog->blockWrites,
+          benchLog->bytesWritten / 1024,
+          benchLog->bytesWritten / rows,
+          benchLog->writeAmplification()
+        );
+      }
+      delete benchLog;
+      isQuerying = true;
+      BLE_FS.remove( BENCH_LOG_FS_PATH );
+      isQuerying = false;
+      free( device->name );
+      free( device->address );
+      free( device->ouiname );
+      free( device->manufname );
+      free( device->uuid );
+      free( device );
+    }
+
+    static void logPathFromDB( const char* dbPath, char* logPath ) {
+      copy( logPath, dbPath, 31 );
+      char* ext = strrchr( logPath, '.' );
+      if( ext != NULL ) *ext = '\0';
+      strcat( logPath, SIGHTING_LOG_EXT );
+    }
+
+    // validates a record in place
+    static bool isValid( const SightingRecord &record ) {
+      return record.magic == SIGHTING_MAGIC
+          && record.version == SIGHTING_VERSION
+          && record.crc == crc32_le( 0, (const uint8_t*)&record, sizeof(SightingRecord)-sizeof(uint32_t) );
+    }
+
+    static void formatMac( const uint8_t* mac, char* address ) {
+      sprintf( address, "%02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5] );
+    }
+
+    static bool parseMac( const char* address, uint8_t* mac ) {
+      if( isEmpty( address ) ) return false;
+      return sscanf( address, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5] ) == 6;
+    }
+
+  private:
+
+    File file;
+    uint8_t* block = NULL; // current (last) block of the file
+    uint32_t blockNo = 0;
+    uint16_t blockFill = 0; // records in the current block
+    bool     blockDirty = false;
+    uint32_t nextSeq = 0;
+    SightingIndexItem* index = NULL;
+    uint16_t indexCapacity = 0;
+
+    // scans the file until the first invalid record, which marks the end of the log
+    void load() {
+      crcErrors = 0;
+      blockNo = 0;
+      blockFill = 0;
+      blockDirty = false;
+      memset( block, 0xff, SIGHTING_BLOCK_SIZE );
+      size_t fileSize = file.size();
+      while( (size_t)blockNo * SIGHTING_BLOCK_SIZE < fileSize ) {
+        file.seek( blockNo * SIGHTING_BLOCK_SIZE );
+        size_t len = file.read( block, SIGHTING_BLOCK_SIZE );
+        blockFill = 0;
+        for( uint16_t i=0; i*SIGHTING_RECORD_SIZE < len; i++ ) {
+          SightingRecord *record = (SightingRecord*)( block + i*SIGHTING_RECORD_SIZE );
+          if( !isValid( *record ) ) {
+            if( record->magic != 0xffff ) crcErrors++; // torn write, the rest of the log is dropped
+            memset( block + i*SIGHTING_RECORD_SIZE, 0xff, SIGHTING_BLOCK_SIZE - i*SIGHTING_RECORD_SIZE );
+            return;
+          }
+          if( record->type == SIGHTING_DELETE ) {
+            int32_t slot = indexFind( record->mac );
+            if( slot >= 0 ) index[slot].seq = SIGHTING_INDEX_DELETED;
+          } else {
+            indexSet( record->mac, record->seq );
+          }
+          nextSeq = record->seq + 1;
+          blockFill++;
+        }
+        if( blockFill < SIGHTING_RECORDS_PER_BLOCK ) {
+          memset( block + blockFill*SIGHTING_RECORD_SIZE, 0xff, SIGHTING_BLOCK_SIZE - blockFill*SIGHTING_RECORD_SIZE );
+          return; // partial last block
+        }
+        blockNo++;
+      }
+      // file ends on a block boundary
+      blockFill = 0;
+      memset( block, 0xff, SIGHTING_BLOCK_SIZE );
+    }
+
+    bool append( SightingRecord &record ) {
+      if( !file ) return false;
+      record.magic   = SIGHTING_MAGIC;
+      record.version = SIGHTING_VERSION;
+      record.seq     = nextSeq;
+      record.crc     = crc32_le( 0, (const uint8_t*)&record, sizeof(SightingRecord)-sizeof(uint32_t) );
+      memcpy( block + blockFill*SIGHTING_RECORD_SIZE, &record, SIGHTING_RECORD_SIZE );
+      blockFill++;
+      blockDirty = true;
+      nextSeq++;
+      records++;
+      if( blockFill == SIGHTING_RECORDS_PER_BLOCK ) {
+        if( !writeBlock() ) return false;
+        blockNo++;
+        blockFill = 0;
+        memset( block, 0xff, SIGHTING_BLOCK_SIZE );
+      }
+      return true;
+    }
+
+    // always a full, aligned block write
+    bool writeBlock() {
+      isQuerying = true;
+      file.seek( blockNo * SIGHTING_BLOCK_SIZE );
+      size_t written = file.write( block, SIGHTING_BLOCK_SIZE );
+      file.flush();
+      isQuerying = false;
+      blockWrites++;
+      bytesWritten += written;
+      blockDirty = false;
+      if( written != SIGHTING_BLOCK_SIZE ) {
+        log_e("Short write on %s block #%d: %d bytes", path, blockNo, written);
+        return false;
+      }
+      return true;
+    }
+
+    bool read( uint32_t seq, SightingRecord &record ) {
+      uint32_t recordBlock = seq / SIGHTING_RECORDS_PER_BLOCK;
+      if( recordBlock == blockNo ) {
+        memcpy( &record, block + ( seq % SIGHTING_RECORDS_PER_BLOCK )*SIGHTING_RECORD_SIZE, SIGHTING_RECORD_SIZE );
+      } else {
+        isQuerying = true;
+        file.seek( (size_t)seq * SIGHTING_RECORD_SIZE );
+        size_t len = file.read( (uint8_t*)&record, SIGHTING_RECORD_SIZE );
+        isQuerying = false;
+        if( len != SIGHTING_RECORD_SIZE ) return false;
+      }
+      return isValid( record );
+    }
+
+    static uint32_t macHash( const uint8_t* mac ) {
+      uint32_t hash = 2166136261UL;
+      for( uint8_t i=0; i<6; i++ ) {
+        hash = ( hash ^ mac[i] ) * 16777619UL;
+      }
+      return hash;
+    }
+
+    int32_t indexFind( const uint8_t* mac ) {
+      if( index == NULL ) return -1;
+      uint32_t slot = macHash( mac ) % indexCapacity;
+      for( uint16_t probe=0; probe<indexCapacity; probe++ ) {
+        SightingIndexItem &item = index[(slot+probe)%indexCapacity];
+        if( item.seq == SIGHTING_INDEX_EMPTY ) return -1;
+        if( item.seq != SIGHTING_INDEX_DELETED && memcmp( item.mac, mac, 6 ) == 0 ) return (slot+probe)%indexCapacity;
+      }
+      return -1;
+    }
+
+    void indexSet( const uint8_t* mac, uint32_t seq ) {
+      if( index == NULL ) return;
+      int32_t found = indexFind( mac );
+      if( found >= 0 ) {
+        index[found].seq = seq; // most recent record wins
+        return;
+      }
+      uint32_t slot = macHash( mac ) % indexCapacity;
+      for( uint16_t probe=0; probe<indexCapacity; probe++ ) {
+        SightingIndexItem &item = index[(slot+probe)%indexCapacity];
+        if( item.seq == SIGHTING_INDEX_EMPTY || item.seq == SIGHTING_INDEX_DELETED ) {
+          memcpy( item.mac, mac, 6 );
+          item.seq = seq;
+          return;
+        }
+      }
+      indexFull++; // exists() will miss it, the compactor still gets it
+    }
+
+    static void fromDevice( BlueToothDevice *CacheItem, SightingRecord &record ) {
+      memset( &record, 0, sizeof(record) );
+      parseMac( CacheItem->address, record.mac );
+      record.addr_type  = CacheItem->addr_type;
+      record.rssi       = CacheItem->rssi;
+      record.appearance = CacheItem->appearance;
+      record.manufid    = CacheItem->manufid;
+      record.created_at = CacheItem->created_at.unixtime();
+      record.updated_at = CacheItem->updated_at.unixtime();
+      record.hits       = CacheItem->hits;
+      copy( record.name,      CacheItem->name,      MAX_FIELD_LEN );
+      copy( record.ouiname,   CacheItem->ouiname,   MAX_FIELD_LEN );
+      copy( record.manufname, CacheItem->manufname, MAX_FIELD_LEN );
+      copy( record.uuid,      CacheItem->uuid,      MAX_FIELD_LEN );
+    }
+
+    // same outcome as DBUtils::BLEDevDBCacheCallback()
+    static void toDevice( const SightingRecord &record, BlueToothDevice *CacheItem ) {
+      char address[MAC_LEN+1];
+      formatMac( record.mac, address );
+      BLEDevHelper.reset( CacheItem );
+      BLEDevHelper.set( CacheItem, "address",    address );
+      BLEDevHelper.set( CacheItem, "appearance", (int)record.appearance );
+      BLEDevHelper.set( CacheItem, "rssi",       (int)record.rssi );
+      BLEDevHelper.set( CacheItem, "manufid",    (int)record.manufid );
+      BLEDevHelper.set( CacheItem, "hits",       (int)record.hits );
+      BLEDevHelper.set( CacheItem, "name",       record.name );
+      BLEDevHelper.set( CacheItem, "ouiname",    record.ouiname );
+      BLEDevHelper.set( CacheItem, "manufname",  record.manufname );
+      BLEDevHelper.set( CacheItem, "uuid",       record.uuid );
+      BLEDevHelper.set( CacheItem, "created_at", DateTime( record.created_at ) );
+      BLEDevHelper.set( CacheItem, "updated_at", DateTime( record.updated_at ) );
+      BLEDevHelper.set( CacheItem, "in_db", true );
+      BLEDevHelper.set( CacheItem, "is_anonymous", false );
+    }
+
+};
+
+
+SQLiteStorageBackend SQLiteStorage;
+SightingLogBackend SightingLog;
+BLEStorageBackend* Storage = &SQLiteStorage;
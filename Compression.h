@@ -0,0 +1,212 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * LZSS stream codec for BLE file sharing
+ *
+ * Flag byte for each group of 8 tokens, LSB first, 1 = literal byte,
+ * 0 = match of 2 or 3 bytes:
+ *   b0 = ( distance - 1 ) & 0xff
+ *   b1 = ( distance - 1 ) >> 8 | code << 4
+ *   code 0..14 => length 3..17, code 15 => length 18 + b2
+ * The window is LZSS_WINDOW bytes, so the decoder needs a 4KB ring plus a
+ * few bytes of state and accepts input split anywhere. The encoder works on
+ * blocks of up to LZSS_WINDOW bytes (matches may reach into the previous
+ * block) and keeps the pending flag group across blocks until flushed.
+ *
+ */
+
+#define LZSS_WINDOW     4096 // distance fits 12 bits
+#define LZSS_MIN_MATCH  3
+#define LZSS_MAX_MATCH  ( 18 + 255 )
+#define LZSS_HASH_SIZE  2048
+#define LZSS_MAX_CHAIN  32 // candidates tried per position, speed vs ratio
+#define LZSS_MAX_OUTPUT( n ) ( (n) + (n) / 8 + 32 ) // worst case for n input bytes, incl. a pending group
+
+
+struct LZSSEncoder {
+  uint8_t  data[2 * LZSS_WINDOW]; // previous block + current block
+  size_t   prevLen;
+  int16_t  head[LZSS_HASH_SIZE];
+  int16_t  prev[2 * LZSS_WINDOW];
+  uint8_t  group[1 + 8 * 3]; // flag byte + up to 8 tokens
+  uint8_t  groupLen;
+  uint8_t  groupBit;
+};
+
+
+struct LZSSDecoder {
+  uint8_t  window[LZSS_WINDOW];
+  uint16_t pos; // next byte in window
+  uint8_t  flags;
+  uint8_t  flagBits; // tokens left in the current group
+  uint8_t  token[3];
+  uint8_t  tokenLen;
+};
+
+
+static void LZSSEncoderInit( LZSSEncoder* e ) {
+  e->prevLen = 0;
+  e->groupLen = 0;
+  e->groupBit = 0;
+}
+
+
+static inline uint16_t LZSSHash( const uint8_t* p ) {
+  return ( ( p[0] << 6 ) ^ ( p[1] << 3 ) ^ p[2] ) & ( LZSS_HASH_SIZE - 1 );
+}
+
+
+static inline void LZSSInsert( LZSSEncoder* e, size_t p, size_t total ) {
+  if ( p + LZSS_MIN_MATCH > total ) return;
+  uint16_t h = LZSSHash( e->data + p );
+  e->prev[p] = e->head[h];
+  e->head[h] = p;
+}
+
+
+// appends a token to the pending group, moves full groups to out
+static inline void LZSSToken( LZSSEncoder* e, const uint8_t* token, uint8_t len, bool literal, uint8_t* out, size_t &outLen ) {
+  if ( e->groupBit == 0 ) {
+    e->group[0] = 0;
+    e->groupLen = 1;
+  }
+  if ( literal ) e->group[0] |= 1 << e->groupBit;
+  memcpy( e->group + e->groupLen, token, len );
+  e->groupLen += len;
+  if ( ++e->groupBit == 8 ) {
+    memcpy( out + outLen, e->group, e->groupLen );
+    outLen += e->groupLen;
+    e->groupBit = 0;
+  }
+}
+
+
+/*
+ * Compresses the n bytes already copied at e->data + e->prevLen ( n <= LZSS_WINDOW ),
+ * last = true flushes the pending group. Returns the bytes written to out,
+ * out must hold LZSS_MAX_OUTPUT( n ).
+ */
+static size_t LZSSCompress( LZSSEncoder* e, size_t n, bool last, uint8_t* out ) {
+  size_t total = e->prevLen + n;
+  size_t outLen = 0;
+  memset( e->head, 0xff, sizeof( e->head ) );
+  for ( size_t p = 0; p < e->prevLen; p++ ) {
+    LZSSInsert( e, p, total );
+  }
+  size_t i = e->prevLen;
+  while ( i < total ) {
+    size_t best = 0, distance = 0;
+    size_t maxLen = total - i < LZSS_MAX_MATCH ? total - i : LZSS_MAX_MATCH;
+    if ( maxLen >= LZSS_MIN_MATCH ) {
+      int16_t candidate = e->head[LZSSHash( e->data + i )];
+      for ( uint8_t depth = 0; candidate >= 0 && i - candidate <= LZSS_WINDOW && depth < LZSS_MAX_CHAIN; depth++ ) {
+        size_t len = 0;
+        while ( len < maxLen && e->data[candidate + len] == e->data[i + len] ) len++;
+        if ( len > best ) {
+          best = len;
+          distance = i - candidate;
+          if ( len == maxLen ) break;
+        }
+        candidate = e->prev[candidate];
+      }
+    }
+    if ( best >= LZSS_MIN_MATCH ) {
+      uint8_t token[3];
+      uint8_t code = best - LZSS_MIN_MATCH < 15 ? best - LZSS_MIN_MATCH : 15;
+      token[0] = ( distance - 1 ) & 0xff;
+      token[1] = ( ( distance - 1 ) >> 8 ) | ( code << 4 );
+      token[2] = best - 18;
+      LZSSToken( e, token, code == 15 ? 3 : 2, false, out, outLen );
+      for ( size_t p = i; p < i + best; p++ ) {
+        LZSSInsert( e, p, total );
+      }
+      i += best;
+    } else {
+      LZSSToken( e, e->data + i, 1, true, out, outLen );
+      LZSSInsert( e, i, total );
+      i++;
+    }
+  }
+  if ( last && e->groupBit > 0 ) {
+    memcpy( out + outLen, e->group, e->groupLen );
+    outLen += e->groupLen;
+    e->groupBit = 0;
+  }
+  // keep one window of history for the next block
+  size_t keep = total < LZSS_WINDOW ? total : LZSS_WINDOW;
+  memmove( e->data, e->data + total - keep, keep );
+  e->prevLen = keep;
+  return outLen;
+}
+
+
+static void LZSSDecoderInit( LZSSDecoder* d ) {
+  memset( d->window, 0, sizeof( d->window ) );
+  d->pos = 0;
+  d->flagBits = 0;
+  d->tokenLen = 0;
+}
+
+
+// decodes len bytes, emit() gets every output byte
+template<typename Emit>
+static void LZSSDecompress( LZSSDecoder* d, const uint8_t* in, size_t len, Emit emit ) {
+  for ( size_t i = 0; i < len; i++ ) {
+    uint8_t b = in[i];
+    if ( d->flagBits == 0 ) {
+      d->flags = b;
+      d->flagBits = 8;
+      continue;
+    }
+    if ( d->flags & 1 ) {
+      d->window[d->pos] = b;
+      d->pos = ( d->pos + 1 ) & ( LZSS_WINDOW - 1 );
+      emit( b );
+    } else {
+      d->token[d->tokenLen++] = b;
+      if ( d->tokenLen < 2 ) continue;
+      uint8_t code = d->token[1] >> 4;
+      if ( code == 15 && d->tokenLen < 3 ) continue;
+      uint16_t distance = ( d->token[0] | ( ( d->token[1] & 0x0f ) << 8 ) ) + 1;
+      size_t matchLen = code == 15 ? 18 + d->token[2] : code + LZSS_MIN_MATCH;
+      for ( size_t k = 0; k < matchLen; k++ ) {
+        uint8_t c = d->window[( d->pos - distance ) & ( LZSS_WINDOW - 1 )];
+        d->window[d->pos] = c;
+        d->pos = ( d->pos + 1 ) & ( LZSS_WINDOW - 1 );
+        emit( c );
+      }
+      d->tokenLen = 0;
+    }
+    d->flags >>= 1;
+    d->flagBits--;
+  }
+}
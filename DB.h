@@ -95,8 +95,41 @@ static char colValue[32] = {'\0'}; // search result
 #define testVendorNamesQuery "SELECT SUBSTR(vendor,0,32)  FROM 'ble-oui' LIMIT 10"
 #define testOUIQuery "SELECT * FROM 'oui-light' limit 10"
 static char insertQuery[512]; // stack overflow ? pray that 256 is enough :D
+#define MEMDB_PAGE_SIZE 4096 // sqlite default
+#define MEMDB_PAGECACHE_SIZE 2*1024*1024 // PSRAM reserved for the page cache, holds the in-memory DB
+#define MEMDB_BACKUP_STEP 16 // pages per sqlite3_backup_step(), yields between steps
+#define SQLITE_HEAP_LIMIT_PSRAM 1024*1024 // soft limit for sqlite's own allocations (page cache excluded)
+#define SQLITE_HEAP_LIMIT_HEAP 64*1024 // soft limit without PSRAM, the BT stack needs the rest
+#define SQLITE_HEAP_PRESSURE 90 // percent of the soft limit, maintain() releases memory above it
+#define SQLITE_CACHE_SHARE 50 // percent of the soft limit a connection's page cache may use
+#define SQLITE_CACHE_MIN_KB 8 // releaseMemory() doesn't shrink the page cache below this
+#define QUARANTINE_DIR "/quarantine" // corrupt collector files go there, see recoverDB()
+#define probeSchemaQuery "SELECT " BLEMAC_INSERT_FIELDNAMES " FROM blemacs LIMIT 0"
+#define BENCH_DB_FS_PATH "/bench.db"
+#define BENCH_DB_SQLITE_PATH "/" BLE_FS_TYPE BENCH_DB_FS_PATH
+
+// durability/performance profiles for the collector DB, applied on open
+struct DBProfile {
+  const char* name;
+  const char* journal_mode;
+  const char* synchronous;
+  int  cache_size; // negative = KB, capped by the memory budget, see cacheSize()
+  byte temp_store; // 0 = default, 1 = file, 2 = memory
+  int  page_size; // only applies to new DB files
+  bool persistent; // keep the connection open between queries (required for WAL)
+};
+
+static const DBProfile DBProfiles[] = {
+  { "safe",     "DELETE", "FULL",   -64,   1, MEMDB_PAGE_SIZE, false }, // sqlite defaults, reopened on every query
+  { "balanced", "WAL",    "NORMAL", -256,  2, MEMDB_PAGE_SIZE, true  }, // one sync per checkpoint, checkpointed between scans
+  { "fast",     "MEMORY", "OFF",    -1024, 2, MEMDB_PAGE_SIZE, true  }  // no sync at all, a crash may corrupt the DB
+};
+#define DB_PROFILES_COUNT (sizeof(DBProfiles)/sizeof(DBProfiles[0]))
 #define searchDeviceTemplate "SELECT " BLEMAC_SELECT_FIELDNAMES " FROM blemacs WHERE address='%s'"
 static char searchDeviceQuery[160];
+#define searchDevicesTemplate "SELECT " BLEMAC_SELECT_FIELDNAMES " FROM blemacs WHERE address IN (%s)"
+static char searchDevicesQuery[sizeof(searchDevicesTemplate) + MAX_DEVICES_PER_SCAN*(MAC_LEN+3)];
+#define createIndexQuery "CREATE INDEX IF NOT EXISTS blemacs_address ON blemacs(address)"
 #define vendorRequestTpl "SELECT vendor FROM 'ble-oui' WHERE id='%d'"
 #define OUIRequestTpl "SELECT * FROM 'oui-light' WHERE Assignment=UPPER('%s');"
 
@@ -186,6 +219,55 @@ OUIPsramCacheStruct** OuiPsramCache = NULL;
 #define BLE_VENDOR_NAMES_DB_FS_SIZE      73728 // change this according to the file size
 
 
+/*
+ * sqlite allocator in PSRAM: keeps the internal heap for the BT stack.
+ * Every block is prefixed with its size (xSize needs it), falls back to
+ * the internal heap only while it stays above min_free_heap.
+ */
+#define PSRAM_MEM_HEADER 8 // keeps 8-byte alignment
+
+static void *psramMalloc( int size ) {
+  uint8_t *block = (uint8_t*)ps_malloc( size + PSRAM_MEM_HEADER );
+  if( block == NULL && freeheap > min_free_heap + size ) {
+    block = (uint8_t*)malloc( size + PSRAM_MEM_HEADER );
+  }
+  if( block == NULL ) return NULL;
+  *(int*)block = size;
+  return block + PSRAM_MEM_HEADER;
+}
+static void psramFree( void *ptr ) {
+  if( ptr == NULL ) return;
+  free( (uint8_t*)ptr - PSRAM_MEM_HEADER );
+}
+static int psramSize( void *ptr ) {
+  if( ptr == NULL ) return 0;
+  return *(int*)( (uint8_t*)ptr - PSRAM_MEM_HEADER );
+}
+static void *psramRealloc( void *ptr, int size ) {
+  void *resized = psramMalloc( size );
+  if( resized == NULL ) return NULL;
+  memcpy( resized, ptr, min( size, psramSize( ptr ) ) );
+  psramFree( ptr );
+  return resized;
+}
+static int psramRoundup( int size ) {
+  return ( size + 7 ) & ~7;
+}
+static int psramInitMem( void *appData ) { return SQLITE_OK; }
+static void psramShutdownMem( void *appData ) { }
+
+static const sqlite3_mem_methods PsramMemMethods = {
+  psramMalloc,
+  psramFree,
+  psramRealloc,
+  psramSize,
+  psramRoundup,
+  psramInitMem,
+  psramShutdownMem,
+  NULL
+};
+
+
 class DBUtils {
   public:
 
@@ -228,6 +310,10 @@ class DBUtils {
 
 
     bool isOOM = false; // for stability
+    int64_t heapLimit = 0; // sqlite soft heap limit, see memSetup()
+    uint16_t memoryReleases = 0; // times maintain() had to shrink sqlite memory
+    int cacheLimitKB = 0; // page cache cap lowered by releaseMemory(), 0 = budget only
+    bool canReleaseMemory = false; // sqlite3_release_memory() is a no-op without SQLITE_ENABLE_MEMORY_MANAGEMENT
     bool isCorrupt = false; // for maintenance
     bool hasPsram = false;
     bool needsPruning = false;
@@ -236,6 +322,31 @@ class DBUtils {
     bool needsRestart = false;
     bool initDone = false;
 
+    sqlite3 *FileDB = NULL; // persistent connection to the collector DB file, see DBProfile
+    uint32_t checkpoints = 0;
+
+    // in-memory collector DB, see memDBOpen()
+    bool inMemory = false;
+    sqlite3 *MemDB = NULL;
+    unsigned long lastFlush = 0; // millis()
+    bool flushRequested = false; // 'flushdb' while the scan task owns MemDB, served by maintain()
+    uint32_t flushes = 0;
+    uint32_t flushPages = 0; // pages written by the last flush
+    uint32_t flushMillis = 0; // duration of the last flush
+
+    // corruption recovery, see recoverDB()
+    bool salvagePending = false; // a quarantined file waits for Salvage
+    char quarantinePath[48] = {'\0'};
+    uint16_t recoveries = 0;
+    uint32_t recoveryMillis = 0; // collection downtime of the last recovery
+
+    // batched lookup state, see devicesExist()
+    char batchAddresses[MAX_DEVICES_PER_SCAN][MAC_LEN+1];
+    bool batchFound[MAX_DEVICES_PER_SCAN];
+    uint8_t batchSize = 0;
+    uint32_t batchQueries = 0; // one per scan round
+    uint32_t batchAnswers = 0; // deviceExists() calls saved
+
 
     bool init() {
       while(SDSetup()==false) {
@@ -260,17 +371,32 @@ class DBUtils {
       }
 
       initial_free_heap = freeheap;
+      memSetup(); // must happen before sqlite3_initialize()
+      #if MEMDB_ENABLED
+        if( hasPsram ) {
+          pageCacheSetup(); // must happen before sqlite3_initialize()
+        }
+      #endif
+      DBStats.init();
       isQuerying = true;
+      sqlite3_initialize();
+      canReleaseMemory = sqlite3_compileoption_used( "ENABLE_MEMORY_MANAGEMENT" );
+      sqlite3_soft_heap_limit64( heapLimit ); // initializes sqlite too, so only after every sqlite3_config()
       if( !BLE_FS.exists( BLEMacsDbFSPath ) ) {
         log_w("%s DB does not exist", BLEMacsDbFSPath);
-        sqlite3_initialize();
         createDB(); // only if no exists
       } else {
         log_d("%s DB file already exists", BLEMacsDbFSPath);
-        sqlite3_initialize();
+        createIndex(); // older DB files don't have it
       }
       isQuerying = false;
 
+      #if MEMDB_ENABLED
+        if( hasPsram ) {
+          memDBOpen();
+        }
+      #endif
+
       entries = getEntries();
 
       return cacheWarmup();
@@ -278,6 +404,7 @@ class DBUtils {
 
 
     void setBLEDBPath() {
+      releaseCollectorDB();
       if( TimeIsSet ) {
         //DateTime epoch = RTC.now();
         DateTime epoch = DateTime(year(), month(), day(), hour(), minute(), second());
@@ -333,6 +460,13 @@ class DBUtils {
           log_e("Critical DB file %s is corrupted (expected: %d, found: %d), aborting", fileName, expectedSize, size);
           ret = false;
         }
+        // left by an unfinished BLE transfer or delta sync
+        char resumePath[40];
+        sprintf( resumePath, "%s.resume", fileName );
+        if( ret && BLE_FS.exists( resumePath ) ) {
+          log_e("Critical DB file %s has an unfinished transfer", fileName);
+          ret = false;
+        }
       }
       isQuerying = false;
       return ret;
@@ -443,40 +577,53 @@ class DBUtils {
       BLEDevDBCache = (BlueToothDevice*)calloc(1, sizeof( BlueToothDevice ) );
       BLEDevHelper.init( BLEDevTmp, false ); // false = make sure the copy placeholder isn't using SPI ram
       BLEDevHelper.init( BLEDevDBCache, false ); // false = make sure the copy placeholder isn't using SPI ram
+      for(uint16_t i=0; i<MAX_DEVICES_PER_SCAN; i++) {
+        BLEDevBatchCache[i] = (BlueToothDevice*)calloc(1, sizeof( BlueToothDevice ) );
+        BLEDevHelper.init( BLEDevBatchCache[i], false );
+      }
       return true;
     }
 
 
     bool maintain() {
+      LatencyProbe latencyProbe( LATENCY_DB_MAINTAIN );
       bool ret = true;
       if( isOOM ) {
         isOOM = false;
-        log_e("[DB OOM], please run pruneDB and restart manually before it crashes...");
+        log_e("[DB OOM] shrinking sqlite memory (%d bytes used)", (int)sqlite3_memory_used() );
+        releaseMemory( true );
         ret = false;
+      } else if( heapLimit > 0 && sqlite3_memory_used() > heapLimit * SQLITE_HEAP_PRESSURE / 100 ) {
+        releaseMemory( false );
       }
-      if( isCorrupt ) {
+      if( isCorrupt || needsReset ) {
         isCorrupt = false;
-        log_e("[I/O ERROR] a DB file is corrupt, please run fsck on this SD card");
-        ret = false;
+        needsReset = false;
+        if( !recoverDB() ) {
+          log_e("[I/O ERROR] a DB file is corrupt, please run fsck on this SD card");
+          ret = false;
+        }
       }
       if( needsPruning ) {
         needsPruning = false;
         pruneDB();
       }
-      if( needsReset ) {
-        needsReset = true;
-        resetDB();
-      }
       if( DayChangeTrigger ) {
         log_w("Day changed, will generate new DB filename");
         DBneedsReplication = true;
         HourChangeTrigger = false;
         DayChangeTrigger = false;
+        memDBClose(); // yesterday's data goes to yesterday's file
         setBLEDBPath();
         if( !BLE_FS.exists( BLEMacsDbFSPath ) ) {
           log_w("%s DB does not exist, will create", BLEMacsDbFSPath);
           createDB();
         }
+        #if MEMDB_ENABLED
+          if( hasPsram ) {
+            memDBOpen();
+          }
+        #endif
       }
       if( HourChangeTrigger ) {
         // try to adjust time if available
@@ -487,7 +634,7 @@ class DBUtils {
         #endif
         log_w("Hour changed, will trigger replication");
 
-
+        memDBFlush();
         DBneedsReplication = true;
         HourChangeTrigger = false;
         DayChangeTrigger = false;
@@ -496,9 +643,14 @@ class DBUtils {
       if( DBneedsReplication ) {
         log_w("Replicating DB");
         DBneedsReplication = false;
-        //updateDBFromCache( BLEDevRAMCache, false, false );
+        //Storage->replicate( BLEDevRAMCache, false, false );
+      }
+      if( inMemory && ( flushRequested || ( MEMDB_MAX_LOSS > 0 && millis() - lastFlush > MEMDB_MAX_LOSS*1000 ) ) ) {
+        memDBFlush();
       }
+      flushRequested = false;
       if( needsRestart ) {
+        memDBFlush();
         ESP.restart();
         while(1) { ; };
       }
@@ -543,13 +695,39 @@ class DBUtils {
      int rc = 1;
       switch(dbName) {
         case BLE_COLLECTOR_DB: // will be created upon first boot
-          rc = sqlite3_open( dbcollection[dbName].sqlitepath/*"/sdcard/blemacs.db"*/, &BLECollectorDB);
+          if( inMemory ) {
+            // persistent handle, no SD access
+            BLECollectorDB = MemDB;
+            isQuerying = false;
+            rc = SQLITE_OK;
+          } else if( profile().persistent ) {
+            rc = SQLITE_OK;
+            if( FileDB == NULL ) {
+              rc = sqlite3_open( dbcollection[dbName].sqlitepath, &FileDB );
+              if( rc == SQLITE_OK ) {
+                applyProfile( FileDB, profile() );
+                DBStats.watch( FileDB );
+              } else {
+                sqlite3_close( FileDB );
+                FileDB = NULL;
+              }
+            }
+            BLECollectorDB = FileDB;
+          } else {
+            rc = sqlite3_open( dbcollection[dbName].sqlitepath/*"/sdcard/blemacs.db"*/, &BLECollectorDB);
+            if( rc == SQLITE_OK ) {
+              applyProfile( BLECollectorDB, profile() );
+              DBStats.watch( BLECollectorDB );
+            }
+          }
         break;
         case MAC_OUI_NAMES_DB: // https://code.wireshark.org/review/gitweb?p=wireshark.git;a=blob_plain;f=manuf
           rc = sqlite3_open( dbcollection[dbName].sqlitepath /*"/sdcard/mac-oui-light.db"*/, &OUIVendorsDB);
+          if( rc == SQLITE_OK ) DBStats.watch( OUIVendorsDB );
         break;
         case BLE_VENDOR_NAMES_DB: // https://www.bluetooth.com/specifications/assigned-numbers/company-identifiers
           rc = sqlite3_open( dbcollection[dbName].sqlitepath /*"/sdcard/ble-oui.db"*/, &BLEVendorsDB);
+          if( rc == SQLITE_OK ) DBStats.watch( BLEVendorsDB );
         break;
         default: log_e("Can't open null DB"); UI.SetDBStateIcon(-1); isQuerying = false; return rc;
       }
@@ -577,7 +755,7 @@ class DBUtils {
     void close(DBName dbName) {
       UI.SetDBStateIcon(0);
       switch(dbName) {
-        case BLE_COLLECTOR_DB:    sqlite3_close(BLECollectorDB); break;
+        case BLE_COLLECTOR_DB:    if( !inMemory && BLECollectorDB != FileDB ) sqlite3_close(BLECollectorDB); break;
         case MAC_OUI_NAMES_DB:    sqlite3_close(OUIVendorsDB); break;
         case BLE_VENDOR_NAMES_DB: sqlite3_close(BLEVendorsDB); break;
         default: /* duh ! */ log_e("Can't open null DB");
@@ -599,6 +777,7 @@ class DBUtils {
 
     // checks if a BLE Device exists, returns its cache index if found
     int deviceExists(const char* address) {
+      LatencyProbe latencyProbe( LATENCY_DB_EXISTS );
       results = 0;
       if( isEmpty( address ) || strlen( address ) > MAC_LEN+1 || strlen( address ) < 17 || address[0]==3) {
         log_w("Cowardly refusing to perform an empty or invalid request : %s / %s", address, currentBLEAddress);
@@ -619,6 +798,76 @@ class DBUtils {
       return results>0 ? BLEDevCacheIndex : -1;
     }
 
+    // looks up a whole scan round at once, results are held in BLEDevBatchCache
+    // until the next call, and served by deviceExistsBatched()
+    int devicesExist( const char** addresses, uint8_t count ) {
+      LatencyProbe latencyProbe( LATENCY_DB_EXISTS_BATCH );
+      batchSize = 0;
+      results = 0;
+      if( isOOM || count == 0 ) return 0;
+      char inList[MAX_DEVICES_PER_SCAN*(MAC_LEN+3)] = {'\0'};
+      for( uint8_t i=0; i<count && batchSize<MAX_DEVICES_PER_SCAN; i++ ) {
+        const char* address = addresses[i];
+        if( isEmpty( address ) || strlen( address ) != MAC_LEN || strchr( address, '\'' ) ) {
+          continue; // deviceExists() will refuse it anyway
+        }
+        copy( batchAddresses[batchSize], address, MAC_LEN+1 );
+        batchFound[batchSize] = false;
+        if( batchSize > 0 ) strcat( inList, "," );
+        strcat( inList, "'" );
+        strcat( inList, address );
+        strcat( inList, "'" );
+        batchSize++;
+      }
+      if( batchSize == 0 ) return 0;
+      sprintf(searchDevicesQuery, searchDevicesTemplate, "%s", "%s", inList);
+      open(BLE_COLLECTOR_DB);
+      int rc = sqlite3_exec(BLECollectorDB, searchDevicesQuery, BLEDevBatchCallback, (void*)this, &zErrMsg);
+      if (rc != SQLITE_OK) {
+        error(zErrMsg);
+        sqlite3_free(zErrMsg);
+        close(BLE_COLLECTOR_DB);
+        batchSize = 0; // fall back to per-device lookups
+        return -2;
+      }
+      close(BLE_COLLECTOR_DB);
+      batchQueries++;
+      log_d("Batch lookup: %d found out of %d", results, batchSize);
+      return results;
+    }
+
+    // adds an address known to be absent (e.g. never seen by BLEIndex) to the current batch
+    void batchAbsent(const char* address) {
+      if( batchSize >= MAX_DEVICES_PER_SCAN ) return;
+      copy( batchAddresses[batchSize], address, MAC_LEN+1 );
+      batchFound[batchSize] = false;
+      batchSize++;
+    }
+
+    // same result as deviceExists(), without touching the DB when the address was part of the last batch
+    int deviceExistsBatched(const char* address) {
+      for( uint8_t i=0; i<batchSize; i++ ) {
+        if( strcmp( batchAddresses[i], address ) != 0 ) continue;
+        batchAnswers++;
+        if( !batchFound[i] ) {
+          results = 0;
+          return -1;
+        }
+        results = 1;
+        BLEDevHelper.copyItem( BLEDevBatchCache[i], BLEDevDBCache );
+        return BLEDevCacheIndex;
+      }
+      return deviceExists( address );
+    }
+
+    // the DB row changed since the batch lookup, next deviceExistsBatched() will query it again
+    void forgetBatched(const char* address) {
+      for( uint8_t i=0; i<batchSize; i++ ) {
+        if( strcmp( batchAddresses[i], address ) != 0 ) continue;
+        batchAddresses[i][0] = '\0';
+      }
+    }
+
     // make a copy of the DB to psram to save the SD ^_^
     void loadVendorsToPSRam() {
       results = 0;
@@ -680,6 +929,7 @@ class DBUtils {
         needsReset = true;
       } else if (strcmp(zErrMsg, "out of memory")==0) {
         isOOM = true;
+        DBStats.oom();
       } else if(strcmp(zErrMsg, "disk I/O error")==0) {
         isCorrupt = true; // TODO: rename the DB file and create a new DB
       } else if(strstr("no such column", zErrMsg)) {
@@ -707,6 +957,7 @@ class DBUtils {
 
 
     DBMessage insertBTDevice( BlueToothDevice *CacheItem) {
+      LatencyProbe latencyProbe( LATENCY_DB_INSERT );
       if(isOOM) {
         // cowardly refusing to use DB when OOM
         return DB_IS_OOM;
@@ -720,6 +971,7 @@ class DBUtils {
         // cowardly refusing to insert empty result
         return INSERTION_IGNORED;
       }
+      forgetBatched( CacheItem->address );
       open(BLE_COLLECTOR_DB, false);
 
       clean( CacheItem->name );
@@ -762,6 +1014,8 @@ class DBUtils {
     }
 
     void deleteBLEDevice( const char* address ) {
+      LatencyProbe latencyProbe( LATENCY_DB_DELETE );
+      forgetBatched( address );
       char deleteItemStr[64];
       const char* deleteTpl = "DELETE FROM blemacs WHERE address='%s'";
       sprintf(deleteItemStr, deleteTpl, address );
@@ -770,7 +1024,31 @@ class DBUtils {
       close(BLE_COLLECTOR_DB);
     }
 
+    // in place update for the duplicate filter counters, false if the device has no row
+    bool addHits( const char* address, uint16_t hits, int rssi ) {
+      LatencyProbe latencyProbe( LATENCY_DB_INSERT );
+      if( isOOM ) return false;
+      forgetBatched( address );
+      char updateItemStr[160];
+      if( TimeIsSet ) {
+        sprintf(YYYYMMDD_HHMMSS_Str, YYYYMMDD_HHMMSS_Tpl,
+          nowDateTime.year(), nowDateTime.month(), nowDateTime.day(),
+          nowDateTime.hour(), nowDateTime.minute(), nowDateTime.second()
+        );
+        const char* updateTpl = "UPDATE blemacs SET hits=hits+%d, rssi=%d, updated_at='%s.000000' WHERE address='%s'";
+        snprintf(updateItemStr, sizeof(updateItemStr), updateTpl, hits, rssi, YYYYMMDD_HHMMSS_Str, address );
+      } else {
+        const char* updateTpl = "UPDATE blemacs SET hits=hits+%d, rssi=%d WHERE address='%s'";
+        snprintf(updateItemStr, sizeof(updateItemStr), updateTpl, hits, rssi, address );
+      }
+      open(BLE_COLLECTOR_DB, false);
+      bool updated = DBExec( BLECollectorDB, updateItemStr ) == SQLITE_OK && sqlite3_changes( BLECollectorDB ) > 0;
+      close(BLE_COLLECTOR_DB);
+      return updated;
+    }
+
     void getVendor(uint16_t devid, char *dest) {
+      LatencyProbe latencyProbe( LATENCY_DB_VENDOR );
       if( hasPsram ) {
         getPsramVendor(devid, dest);
       } else {
@@ -780,6 +1058,7 @@ class DBUtils {
 
 
     void getOUI(const char* mac, char* dest) {
+      LatencyProbe latencyProbe( LATENCY_DB_OUI );
       if( hasPsram ) {
         getPsramOUI(mac, dest);
       } else {
@@ -789,6 +1068,7 @@ class DBUtils {
 
 
     unsigned int getEntries(bool _display_results = false) {
+      LatencyProbe latencyProbe( LATENCY_DB_ENTRIES );
       open(BLE_COLLECTOR_DB);
       if (_display_results) {
         DBExec( BLECollectorDB, allEntriesQuery );
@@ -801,9 +1081,364 @@ class DBUtils {
     }
 
 
+    const DBProfile &profile() {
+      return DBProfiles[ DB_PROFILE < DB_PROFILES_COUNT ? DB_PROFILE : 1 ];
+    }
+
+    // the profile's cache size, within the share of the soft heap limit (negative = KB)
+    int cacheSize( const DBProfile &dbProfile ) {
+      int kb = -dbProfile.cache_size;
+      int budgetKB = (int)( heapLimit * SQLITE_CACHE_SHARE / 100 / 1024 );
+      if( budgetKB > 0 && kb > budgetKB ) kb = budgetKB;
+      if( cacheLimitKB > 0 && kb > cacheLimitKB ) kb = cacheLimitKB;
+      return -kb;
+    }
+
+    void applyProfile( sqlite3* db, const DBProfile &dbProfile ) {
+      char pragmas[256];
+      sprintf( pragmas, "PRAGMA page_size=%d; PRAGMA cache_size=%d; PRAGMA temp_store=%d; PRAGMA synchronous=%s; PRAGMA locking_mode=%s; PRAGMA journal_mode=%s;",
+        dbProfile.page_size,
+        cacheSize( dbProfile ),
+        dbProfile.temp_store,
+        dbProfile.synchronous,
+        strcmp( dbProfile.journal_mode, "WAL" ) == 0 ? "EXCLUSIVE" : "NORMAL", // no shared memory for the WAL index
+        dbProfile.journal_mode
+      );
+      int rc = sqlite3_exec( db, pragmas, NULL, NULL, &zErrMsg );
+      if (rc != SQLITE_OK) {
+        error(zErrMsg);
+        sqlite3_free(zErrMsg);
+      }
+    }
+
+    // switches profile, the next open() applies it
+    void setProfile( byte id ) {
+      if( id >= DB_PROFILES_COUNT ) return;
+      releaseCollectorDB();
+      DB_PROFILE = id;
+      cacheLimitKB = 0;
+      log_w("DB profile: %s", profile().name);
+    }
+
+    // closes the persistent connection (checkpoints and releases the exclusive lock)
+    void releaseCollectorDB() {
+      if( FileDB == NULL ) return;
+      isQuerying = true;
+      sqlite3_close( FileDB );
+      FileDB = NULL;
+      isQuerying = false;
+    }
+
+    // WAL profiles keep today's file locked while the collector runs
+    bool collectorIsExclusive() {
+      return !inMemory && strcmp( profile().journal_mode, "WAL" ) == 0;
+    }
+
+    // run between scan rounds, moves the WAL content to the DB file
+    void checkpoint() {
+      if( FileDB == NULL || strcmp( profile().journal_mode, "WAL" ) != 0 ) return;
+      isQuerying = true;
+      int rc = sqlite3_wal_checkpoint_v2( FileDB, NULL, SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL );
+      isQuerying = false;
+      if( rc != SQLITE_OK ) {
+        log_e("WAL checkpoint failed: %s", sqlite3_errmsg( FileDB ) );
+        return;
+      }
+      checkpoints++;
+    }
+
+    // inserts dummy rows in a scratch DB with each profile, using the same open/close pattern as the collector
+    void benchProfiles( uint16_t rows ) {
+      char query[512];
+      for( byte id=0; id<DB_PROFILES_COUNT; id++ ) {
+        const DBProfile &dbProfile = DBProfiles[id];
+        isQuerying = true;
+        BLE_FS.remove( BENCH_DB_FS_PATH );
+        sqlite3 *benchDB = NULL;
+        uint32_t syncs = DBStats.syncs, writes = DBStats.writes;
+        uint64_t bytesWritten = DBStats.bytesWritten;
+        int64_t start = esp_timer_get_time();
+        bool failed = false;
+        for( uint16_t i=0; i<rows && !failed; i++ ) {
+          if( benchDB == NULL ) {
+            if( sqlite3_open( BENCH_DB_SQLITE_PATH, &benchDB ) != SQLITE_OK ) {
+              failed = true;
+              break;
+            }
+            applyProfile( benchDB, dbProfile );
+            if( i == 0 ) {
+              sqlite3_exec( benchDB, createTableQuery, NULL, NULL, NULL );
+              sqlite3_exec( benchDB, createIndexQuery, NULL, NULL, NULL );
+            }
+          }
+          sprintf( query, insertQueryTemplate, 0, "bench", "00:00:00:00:00:00", "[bench]", -80, -1, "", "", "2019-01-01 00:00:00", "2019-01-01 00:00:00", i );
+          if( sqlite3_exec( benchDB, query, NULL, NULL, NULL ) != SQLITE_OK ) {
+            failed = true;
+          }
+          if( !dbProfile.persistent ) {
+            sqlite3_close( benchDB );
+            benchDB = NULL;
+          }
+        }
+        if( benchDB != NULL ) {
+          sqlite3_close( benchDB );
+        }
+        int64_t elapsed = esp_timer_get_time() - start;
+        BLE_FS.remove( BENCH_DB_FS_PATH );
+        isQuerying = false;
+        if( failed ) {
+          Serial.printf("[Bench] %-8s failed\n", dbProfile.name);
+          continue;
+        }
+        Serial.printf("[Bench] %-8s %d rows in %lldms: %.1f inserts/s, syncs: %d, writes: %d (%lluKB, %llu bytes/row)\n",
+          dbProfile.name,
+          rows,
+          elapsed / 1000,
+          elapsed > 0 ? rows * 1000000.0 / elapsed : 0,
+          DBStats.syncs - syncs,
+          DBStats.writes - writes,
+          ( DBStats.bytesWritten - bytesWritten ) / 1024,
+          ( DBStats.bytesWritten - bytesWritten ) / rows
+        );
+        vTaskDelay(10);
+      }
+    }
+
+    // allocator and memory budget, the page cache is set by pageCacheSetup()
+    // and the soft limit is applied by init() once everything is configured
+    void memSetup() {
+      if( hasPsram ) {
+        if( sqlite3_config( SQLITE_CONFIG_MALLOC, &PsramMemMethods ) != SQLITE_OK ) {
+          log_e("Can't set the PSRAM allocator, was sqlite3_initialize() already called ?");
+        }
+        heapLimit = SQLITE_HEAP_LIMIT_PSRAM;
+      } else {
+        sqlite3_config( SQLITE_CONFIG_LOOKASIDE, 64, 16 ); // default is 1200 slots per connection
+        heapLimit = SQLITE_HEAP_LIMIT_HEAP;
+      }
+      log_w("sqlite memory: %s allocator, soft limit %dKB", hasPsram ? "PSRAM" : "heap", (int)( heapLimit / 1024 ) );
+    }
+
+    // frees unused cache pages, when forced (after an OOM) the in-memory DB
+    // is given back to the SD and the page cache is halved. Without
+    // SQLITE_ENABLE_MEMORY_MANAGEMENT the pressure step halves the cache too,
+    // the global release call frees nothing.
+    void releaseMemory( bool force ) {
+      int64_t used = sqlite3_memory_used();
+      if( canReleaseMemory ) {
+        sqlite3_release_memory( 0x7fffffff );
+      }
+      if( FileDB != NULL ) {
+        sqlite3_db_release_memory( FileDB );
+      }
+      if( force && inMemory ) {
+        log_w("Moving %s back to the SD to free memory", BLEMacsDbFSPath);
+        memDBClose();
+      }
+      bool shrunk = false;
+      if( force || !canReleaseMemory ) {
+        int current = -cacheSize( profile() );
+        cacheLimitKB = max( current / 2, SQLITE_CACHE_MIN_KB );
+        shrunk = cacheLimitKB < current;
+        if( shrunk && FileDB != NULL ) {
+          char pragma[48];
+          sprintf( pragma, "PRAGMA cache_size=%d", -cacheLimitKB );
+          sqlite3_exec( FileDB, pragma, NULL, NULL, NULL ); // shrinking the cache frees the pages above it
+        }
+      }
+      int released = used - sqlite3_memory_used();
+      if( released > 0 || shrunk ) {
+        memoryReleases++;
+      }
+      log_w("Released %d bytes of sqlite memory, %d bytes in use, cache limit %dKB", released, (int)sqlite3_memory_used(), -cacheSize( profile() ) );
+    }
+
+    // PSRAM page cache, pages of the in-memory DB are allocated from here
+    void pageCacheSetup() {
+      int headerSize = 0;
+      sqlite3_config( SQLITE_CONFIG_PCACHE_HDRSZ, &headerSize );
+      int slotSize = MEMDB_PAGE_SIZE + headerSize;
+      int slots = MEMDB_PAGECACHE_SIZE / slotSize;
+      void* pageCache = ps_malloc( slots * slotSize );
+      if( pageCache == NULL ) {
+        log_e("Can't allocate %d bytes of PSRAM for the page cache", slots * slotSize);
+        return;
+      }
+      if( sqlite3_config( SQLITE_CONFIG_PAGECACHE, pageCache, slotSize, slots ) != SQLITE_OK ) {
+        log_e("Can't set the page cache, was sqlite3_initialize() already called ?");
+        free( pageCache );
+        return;
+      }
+      log_w("Page cache: %d slots of %d bytes in PSRAM", slots, slotSize);
+    }
+
+    // copies src into dst, MEMDB_BACKUP_STEP pages at a time
+    int backup( sqlite3* dst, sqlite3* src, bool yield=true ) {
+      sqlite3_backup *pBackup = sqlite3_backup_init( dst, "main", src, "main" );
+      if( pBackup == NULL ) {
+        log_e("Backup init failed: %s", sqlite3_errmsg( dst ) );
+        return SQLITE_ERROR;
+      }
+      int rc;
+      do {
+        rc = sqlite3_backup_step( pBackup, MEMDB_BACKUP_STEP );
+        if( yield && ( rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED ) ) {
+          vTaskDelay(1);
+        }
+      } while( rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED );
+      flushPages = sqlite3_backup_pagecount( pBackup );
+      sqlite3_backup_finish( pBackup );
+      return rc == SQLITE_DONE ? SQLITE_OK : rc;
+    }
+
+    // loads today's DB file into a persistent in-memory DB
+    void memDBOpen() {
+      releaseCollectorDB(); // the backup needs its own connection
+      if( sqlite3_open( ":memory:", &MemDB ) != SQLITE_OK ) {
+        log_e("Can't open in-memory DB, using %s", BLEMacsDbFSPath);
+        MemDB = NULL;
+        return;
+      }
+      sqlite3 *fileDB;
+      isQuerying = true;
+      int rc = sqlite3_open( BLEMacsDbSQLitePath, &fileDB );
+      if( rc == SQLITE_OK ) {
+        rc = backup( MemDB, fileDB, false );
+      }
+      sqlite3_close( fileDB );
+      isQuerying = false;
+      if( rc != SQLITE_OK ) {
+        log_e("Can't load %s in memory, using the SD", BLEMacsDbFSPath);
+        sqlite3_close( MemDB );
+        MemDB = NULL;
+        return;
+      }
+      inMemory = true;
+      DBStats.watch( MemDB );
+      lastFlush = millis();
+      log_w("%s loaded in PSRAM (%d pages)", BLEMacsDbFSPath, flushPages);
+    }
+
+    // writes the in-memory DB to the SD file
+    bool memDBFlush() {
+      if( !inMemory ) return true;
+      unsigned long start = millis();
+      sqlite3 *fileDB;
+      isQuerying = true;
+      int rc = sqlite3_open( BLEMacsDbSQLitePath, &fileDB );
+      if( rc == SQLITE_OK ) {
+        rc = backup( fileDB, MemDB );
+      }
+      sqlite3_close( fileDB );
+      isQuerying = false;
+      lastFlush = millis();
+      if( rc != SQLITE_OK ) {
+        log_e("Flushing %s failed (%d)", BLEMacsDbFSPath, rc);
+        return false;
+      }
+      flushes++;
+      flushMillis = millis() - start;
+      log_w("Flushed %s to SD: %d pages in %dms", BLEMacsDbFSPath, flushPages, flushMillis);
+      return true;
+    }
+
+    // copies today's DB to a scratch file, for readers that can't share the collector's connection
+    bool snapshot( const char* sqlitePath ) {
+      if( open( BLE_COLLECTOR_DB ) != SQLITE_OK ) return false;
+      sqlite3 *dst;
+      isQuerying = true;
+      int rc = sqlite3_open( sqlitePath, &dst );
+      if( rc == SQLITE_OK ) {
+        rc = backup( dst, BLECollectorDB );
+      }
+      if( rc == SQLITE_OK ) {
+        // the copied header keeps the WAL flag, a plain rollback journal can be opened read-only
+        rc = sqlite3_exec( dst, "PRAGMA locking_mode=EXCLUSIVE; PRAGMA journal_mode=DELETE;", NULL, NULL, NULL );
+      }
+      sqlite3_close( dst );
+      close( BLE_COLLECTOR_DB );
+      if( rc != SQLITE_OK ) {
+        log_e("Snapshot of %s failed (%d)", BLEMacsDbFSPath, rc);
+        return false;
+      }
+      return true;
+    }
+
+    // flushes and releases the in-memory DB, the SD file is used until the next memDBOpen()
+    void memDBClose() {
+      if( !inMemory ) return;
+      memDBFlush();
+      inMemory = false;
+      sqlite3_close( MemDB );
+      MemDB = NULL;
+    }
+
+    // checks the collector DB without going through error()
+    bool collectorIsHealthy() {
+      if( open(BLE_COLLECTOR_DB) != SQLITE_OK ) return false;
+      bool healthy = false;
+      sqlite3_stmt *stmt;
+      if( sqlite3_prepare_v2( BLECollectorDB, "PRAGMA quick_check(1)", -1, &stmt, NULL ) == SQLITE_OK ) {
+        healthy = sqlite3_step( stmt ) == SQLITE_ROW && strcmp( (const char*)sqlite3_column_text( stmt, 0 ), "ok" ) == 0;
+        sqlite3_finalize( stmt );
+      }
+      if( healthy && sqlite3_prepare_v2( BLECollectorDB, probeSchemaQuery, -1, &stmt, NULL ) == SQLITE_OK ) {
+        sqlite3_finalize( stmt );
+      } else if( healthy ) {
+        // a missing table is fixed by createDB(), an outdated schema isn't
+        healthy = strstr( sqlite3_errmsg( BLECollectorDB ), "no such table" ) != NULL;
+      }
+      close(BLE_COLLECTOR_DB);
+      return healthy;
+    }
+
+    // moves a broken collector DB to QUARANTINE_DIR and starts a fresh one
+    // in place, rows are salvaged later from the quarantined file (see Salvage.h)
+    // returns false when the DB is fine (the error came from another file)
+    bool recoverDB() {
+      unsigned long start = millis();
+      if( collectorIsHealthy() ) {
+        createDB(); // no-op unless the table is missing
+        return false;
+      }
+      log_e("Collector DB %s is broken, quarantining it", BLEMacsDbFSPath);
+      releaseCollectorDB();
+      if( inMemory ) {
+        // don't flush a broken copy over the SD file
+        inMemory = false;
+        sqlite3_close( MemDB );
+        MemDB = NULL;
+      }
+      isQuerying = true;
+      if( !BLE_FS.exists( QUARANTINE_DIR ) ) {
+        BLE_FS.mkdir( QUARANTINE_DIR );
+      }
+      sprintf( quarantinePath, QUARANTINE_DIR "/%lu-%s", millis()/1000, BLEMacsDbFSPath+1 );
+      bool moved = BLE_FS.rename( BLEMacsDbFSPath, quarantinePath );
+      if( !moved ) {
+        log_e("Can't move %s to %s, deleting it", BLEMacsDbFSPath, quarantinePath);
+        BLE_FS.remove( BLEMacsDbFSPath );
+      }
+      isQuerying = false;
+      batchSize = 0;
+      createDB();
+      #if MEMDB_ENABLED
+        if( hasPsram ) {
+          memDBOpen();
+        }
+      #endif
+      entries = 0;
+      salvagePending = moved;
+      recoveries++;
+      recoveryMillis = millis() - start;
+      log_w("Recovered %s in %d ms", BLEMacsDbFSPath, recoveryMillis);
+      return true;
+    }
+
     void resetDB() {
       Serial.println("Re-creating database :");
       Serial.println( BLEMacsDbFSPath );
+      releaseCollectorDB();
       isQuerying = true;
       BLE_FS.remove( BLEMacsDbFSPath );
       isQuerying = false;
@@ -818,9 +1453,17 @@ class DBUtils {
       log_d("created %s if no exists:  : %s", BLEMacsDbSQLitePath, createTableQuery);
       DBExec( BLECollectorDB, createTableQuery ) ;
       close(BLE_COLLECTOR_DB);
+      createIndex();
       UI.headerStats(" ");
     }
 
+    // address lookups (deviceExists, devicesExist) need this
+    void createIndex() {
+      open(BLE_COLLECTOR_DB, false);
+      DBExec( BLECollectorDB, createIndexQuery );
+      close(BLE_COLLECTOR_DB);
+    }
+
     void dropDB() {
       UI.headerStats("Dropping DB");
       open(BLE_COLLECTOR_DB, false);
@@ -835,6 +1478,7 @@ class DBUtils {
       open(BLE_COLLECTOR_DB, false);
       DBExec(BLECollectorDB, pruneTableQuery );
       close(BLE_COLLECTOR_DB);
+      batchSize = 0;
       entries = getEntries();
       prune_trigger = 0;
       UI.headerStats("DB Pruned");
@@ -871,54 +1515,6 @@ class DBUtils {
       return true;
     }
 
-    void updateItemFromCache( BlueToothDevice* CacheItem ) {
-      // not really an update, more of a delete+reinsert
-      deleteBLEDevice( CacheItem->address );
-      if( insertBTDevice( CacheItem ) != INSERTION_SUCCESS ) {
-        // whoops
-        Serial.printf("[BUMMER] Failed to re-insert device %s\n", CacheItem->address);
-        UI.headerStats("Updated failed");
-      } else {
-        UI.headerStats("Updated item");
-      }
-    }
-
-    bool updateDBFromCache( BlueToothDevice** SourceCache, bool showBLECards = true, bool resetAfter = true ) {
-      UI.headerStats("DB replicating...");
-      UI.PrintProgressBar( Out.width );
-      for(uint16_t i=0; i<BLEDEVCACHE_SIZE ;i++) {
-        vTaskDelay(5);
-
-        float percent = i*100 / BLEDEVCACHE_SIZE;
-        UI.PrintProgressBar( (Out.width * percent) / 100 );
-
-        if( isEmpty( SourceCache[i]->address ) ) continue;
-        if( SourceCache[i]->is_anonymous ) {
-          if( resetAfter ) {
-            BLEDevHelper.reset( SourceCache[i] );
-          }
-          continue;
-        }
-        BLEDevTmp = SourceCache[i];
-        if( showBLECards ) {
-          UI.printBLECard( (BlueToothDeviceLink){.cacheIndex=i,.device=BLEDevTmp}/*BLEDevTmp*/ ); // render
-        }
-        updateItemFromCache( SourceCache[i] );
-
-        vTaskDelay(5);
-
-        if( resetAfter ) {
-          BLEDevHelper.reset( SourceCache[i] );
-        }
-      }
-      cacheState();
-      UI.cacheStats();
-      UI.PrintProgressBar( Out.width );
-      UI.headerStats(" ");
-      return true;
-    }
-
-
   private:
 
     static void VendorHeapCacheSet(uint16_t cacheindex, int devid, const char* manufname) {
@@ -1131,6 +1727,33 @@ class DBUtils {
       return 0;
     }
 
+    // loads a batch of DB entries into BLEDevBatchCache, matched by address
+    static int BLEDevBatchCallback( void *dbUtils, int argc, char **argv, char **azColName) {
+      DBUtils *self = (DBUtils*)dbUtils;
+      const char* address = NULL;
+      for (int i = 0; i < argc; i++) {
+        if( strcmp( azColName[i], "address" ) == 0 ) {
+          address = argv[i];
+          break;
+        }
+      }
+      if( address == NULL ) return 0;
+      for( uint8_t j=0; j<self->batchSize; j++ ) {
+        if( self->batchFound[j] || strcmp( self->batchAddresses[j], address ) != 0 ) continue;
+        results++;
+        BLEDevHelper.reset( BLEDevBatchCache[j] ); // avoid mixing new and old data
+        for (int i = 0; i < argc; i++) {
+          BLEDevHelper.set( BLEDevBatchCache[j], azColName[i], argv[i] ? argv[i] : '\0' );
+        }
+        BLEDevHelper.set( BLEDevBatchCache[j], "in_db", true );
+        BLEDevHelper.set( BLEDevBatchCache[j], "is_anonymous", false );
+        self->batchFound[j] = true;
+        return 0;
+      }
+      log_e("Duplicate or unexpected batch result, ignoring: %s", address);
+      return 0;
+    }
+
     // loads a DB entry into a VendorPsramCache struct
     static int VendorDBCallback(void *dataVendor, int argc, char **argv, char **azColName) {
       results++;
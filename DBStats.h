@@ -0,0 +1,307 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * SQLite I/O counters
+ *
+ * A thin VFS registered as the default one, forwarding everything to the
+ * platform VFS while counting reads, writes and syncs (fsync) so the DB
+ * profiles (see DBProfiles in DB.h) can be compared on real hardware.
+ * Only version 1 io methods are exposed: WAL works in exclusive locking
+ * mode only (no shared memory), which is what the DB profiles use.
+ *
+ * watch() also hooks sqlite3_trace_v2() on a connection to time statements
+ * per kind (first SQL keyword), and remembers the kind of the last statement
+ * started so out of memory errors can be pinned on a query pattern.
+ * 'dbstats' prints everything along with sqlite3_status() and
+ * sqlite3_db_status() figures, the heap graph overlays sqlite memory use.
+ *
+ */
+
+enum SQLKinds {
+  SQL_SELECT = 0,
+  SQL_INSERT,
+  SQL_UPDATE,
+  SQL_DELETE,
+  SQL_PRAGMA,
+  SQL_SCHEMA, // CREATE, DROP, ALTER
+  SQL_OTHER, // ATTACH, BEGIN, COMMIT, ...
+  SQL_KINDS_COUNT
+};
+
+static const char* SQLKindNames[SQL_KINDS_COUNT] = { "select", "insert", "update", "delete", "pragma", "schema", "other" };
+
+struct SQLKindStats {
+  uint32_t count    = 0;
+  uint64_t totalUs  = 0;
+  uint32_t maxUs    = 0;
+  uint32_t ooms     = 0; // out of memory errors while this kind was running
+  char     slowest[48] = {'\0'}; // SQL head of the slowest statement
+};
+
+class DBStatsUtils {
+  public:
+
+    bool enabled = false;
+
+    // I/O counters, never reset: take a snapshot and diff
+    uint32_t opens        = 0;
+    uint32_t reads        = 0;
+    uint32_t writes       = 0;
+    uint32_t syncs        = 0;
+    uint64_t bytesRead    = 0;
+    uint64_t bytesWritten = 0;
+
+    // statement profiles, see watch()
+    SQLKindStats Kinds[SQL_KINDS_COUNT];
+    SQLKinds lastKind = SQL_OTHER; // last statement started
+    uint32_t ooms = 0;
+
+    void init();
+    void watch( sqlite3 *db );
+
+    static SQLKinds kindOf( const char* sql ) {
+      if( sql == NULL ) return SQL_OTHER;
+      while( *sql == ' ' || *sql == '\n' || *sql == '(' ) sql++;
+      if( strncasecmp( sql, "SELECT", 6 ) == 0 || strncasecmp( sql, "WITH", 4 ) == 0 ) return SQL_SELECT;
+      if( strncasecmp( sql, "INSERT", 6 ) == 0 || strncasecmp( sql, "REPLACE", 7 ) == 0 ) return SQL_INSERT;
+      if( strncasecmp( sql, "UPDATE", 6 ) == 0 ) return SQL_UPDATE;
+      if( strncasecmp( sql, "DELETE", 6 ) == 0 ) return SQL_DELETE;
+      if( strncasecmp( sql, "PRAGMA", 6 ) == 0 ) return SQL_PRAGMA;
+      if( strncasecmp( sql, "CREATE", 6 ) == 0 || strncasecmp( sql, "DROP", 4 ) == 0 || strncasecmp( sql, "ALTER", 5 ) == 0 ) return SQL_SCHEMA;
+      return SQL_OTHER;
+    }
+
+    void profile( const char* sql, uint64_t ns ) {
+      SQLKindStats &kind = Kinds[kindOf( sql )];
+      uint32_t us = ns / 1000;
+      kind.count++;
+      kind.totalUs += us;
+      if( us >= kind.maxUs ) {
+        kind.maxUs = us;
+        snprintf( kind.slowest, sizeof(kind.slowest), "%s", sql );
+      }
+    }
+
+    // called by DB.error() on "out of memory"
+    void oom() {
+      ooms++;
+      Kinds[lastKind].ooms++;
+    }
+
+    // sqlite heap in use, sampled by the heap graph
+    static uint32_t memoryUsed() {
+      return sqlite3_memory_used();
+    }
+
+    void reset() {
+      for( uint8_t i=0; i<SQL_KINDS_COUNT; i++ ) {
+        Kinds[i] = SQLKindStats();
+      }
+      ooms = 0;
+      sqlite3_memory_highwater( 1 );
+    }
+
+    void dumpProfiles() {
+      Serial.printf("[DBStats] %8s %8s %10s %10s %6s  %s\n", "kind", "count", "avg(us)", "max(us)", "ooms", "slowest");
+      for( uint8_t i=0; i<SQL_KINDS_COUNT; i++ ) {
+        if( Kinds[i].count == 0 && Kinds[i].ooms == 0 ) continue;
+        Serial.printf("[DBStats] %8s %8d %10llu %10d %6d  %s\n",
+          SQLKindNames[i],
+          Kinds[i].count,
+          Kinds[i].count > 0 ? Kinds[i].totalUs / Kinds[i].count : 0,
+          Kinds[i].maxUs,
+          Kinds[i].ooms,
+          Kinds[i].slowest
+        );
+      }
+    }
+
+    void dumpStatus( sqlite3 *db ) {
+      int cur, hiwtr;
+      sqlite3_status( SQLITE_STATUS_MEMORY_USED, &cur, &hiwtr, 0 );
+      Serial.printf("[DBStats] memory: %dKB (max %dKB), ooms: %d\n", cur / 1024, hiwtr / 1024, ooms );
+      sqlite3_status( SQLITE_STATUS_MALLOC_SIZE, &cur, &hiwtr, 0 );
+      Serial.printf("[DBStats] largest malloc: %d bytes\n", hiwtr );
+      sqlite3_status( SQLITE_STATUS_PAGECACHE_USED, &cur, &hiwtr, 0 );
+      Serial.printf("[DBStats] page cache slots: %d used (max %d)", cur, hiwtr );
+      sqlite3_status( SQLITE_STATUS_PAGECACHE_OVERFLOW, &cur, &hiwtr, 0 );
+      Serial.printf(", overflow: %d bytes (max %d)\n", cur, hiwtr );
+      if( db == NULL ) {
+        Serial.println("[DBStats] collector DB isn't held open, no connection stats");
+        return;
+      }
+      int used, hits, misses, lookaside;
+      sqlite3_db_status( db, SQLITE_DBSTATUS_CACHE_USED, &used, &hiwtr, 0 );
+      sqlite3_db_status( db, SQLITE_DBSTATUS_CACHE_HIT, &hits, &hiwtr, 0 );
+      sqlite3_db_status( db, SQLITE_DBSTATUS_CACHE_MISS, &misses, &hiwtr, 0 );
+      sqlite3_db_status( db, SQLITE_DBSTATUS_LOOKASIDE_USED, &lookaside, &hiwtr, 0 );
+      Serial.printf("[DBStats] collector connection: cache %dKB, hits: %d, misses: %d, hit ratio: %d%%, lookaside: %d slots\n",
+        used / 1024,
+        hits,
+        misses,
+        hits + misses > 0 ? hits * 100 / ( hits + misses ) : 100,
+        lookaside
+      );
+    }
+
+    void dumpStats() {
+      Serial.printf("[DBStats] %s, opens: %d, reads: %d (%lluKB), writes: %d (%lluKB), syncs: %d\n",
+        enabled ? "counting" : "disabled",
+        opens,
+        reads,
+        bytesRead / 1024,
+        writes,
+        bytesWritten / 1024,
+        syncs
+      );
+    }
+
+};
+
+
+DBStatsUtils DBStats;
+
+
+struct CountingFile {
+  sqlite3_file base; // must be first
+  sqlite3_file *real; // platform file, allocated right after this struct
+};
+
+static sqlite3_vfs *PlatformVfs = NULL;
+static sqlite3_vfs CountingVfs;
+
+#define realFile(f) (((CountingFile*)f)->real)
+
+static int countingClose( sqlite3_file *f ) {
+  return realFile(f)->pMethods->xClose( realFile(f) );
+}
+static int countingRead( sqlite3_file *f, void *buf, int amount, sqlite3_int64 offset ) {
+  DBStats.reads++;
+  DBStats.bytesRead += amount;
+  return realFile(f)->pMethods->xRead( realFile(f), buf, amount, offset );
+}
+static int countingWrite( sqlite3_file *f, const void *buf, int amount, sqlite3_int64 offset ) {
+  DBStats.writes++;
+  DBStats.bytesWritten += amount;
+  return realFile(f)->pMethods->xWrite( realFile(f), buf, amount, offset );
+}
+static int countingTruncate( sqlite3_file *f, sqlite3_int64 size ) {
+  return realFile(f)->pMethods->xTruncate( realFile(f), size );
+}
+static int countingSync( sqlite3_file *f, int flags ) {
+  DBStats.syncs++;
+  return realFile(f)->pMethods->xSync( realFile(f), flags );
+}
+static int countingFileSize( sqlite3_file *f, sqlite3_int64 *size ) {
+  return realFile(f)->pMethods->xFileSize( realFile(f), size );
+}
+static int countingLock( sqlite3_file *f, int lock ) {
+  return realFile(f)->pMethods->xLock( realFile(f), lock );
+}
+static int countingUnlock( sqlite3_file *f, int lock ) {
+  return realFile(f)->pMethods->xUnlock( realFile(f), lock );
+}
+static int countingCheckReservedLock( sqlite3_file *f, int *out ) {
+  return realFile(f)->pMethods->xCheckReservedLock( realFile(f), out );
+}
+static int countingFileControl( sqlite3_file *f, int op, void *arg ) {
+  return realFile(f)->pMethods->xFileControl( realFile(f), op, arg );
+}
+static int countingSectorSize( sqlite3_file *f ) {
+  return realFile(f)->pMethods->xSectorSize( realFile(f) );
+}
+static int countingDeviceCharacteristics( sqlite3_file *f ) {
+  return realFile(f)->pMethods->xDeviceCharacteristics( realFile(f) );
+}
+
+static const sqlite3_io_methods CountingIoMethods = {
+  1, // iVersion
+  countingClose,
+  countingRead,
+  countingWrite,
+  countingTruncate,
+  countingSync,
+  countingFileSize,
+  countingLock,
+  countingUnlock,
+  countingCheckReservedLock,
+  countingFileControl,
+  countingSectorSize,
+  countingDeviceCharacteristics
+};
+
+static int countingOpen( sqlite3_vfs *vfs, const char *name, sqlite3_file *f, int flags, int *outFlags ) {
+  CountingFile *file = (CountingFile*)f;
+  file->real = (sqlite3_file*)&file[1];
+  int rc = PlatformVfs->xOpen( PlatformVfs, name, file->real, flags, outFlags );
+  file->base.pMethods = file->real->pMethods ? &CountingIoMethods : NULL;
+  if( rc == SQLITE_OK ) DBStats.opens++;
+  return rc;
+}
+
+#undef realFile
+
+
+static int traceCallback( unsigned type, void *ctx, void *p, void *x ) {
+  switch( type ) {
+    case SQLITE_TRACE_STMT:
+      DBStats.lastKind = DBStatsUtils::kindOf( sqlite3_sql( (sqlite3_stmt*)p ) );
+    break;
+    case SQLITE_TRACE_PROFILE:
+      DBStats.profile( sqlite3_sql( (sqlite3_stmt*)p ), *(sqlite3_uint64*)x );
+    break;
+  }
+  return 0;
+}
+
+
+// times every statement run on this connection
+void DBStatsUtils::watch( sqlite3 *db ) {
+  if( db == NULL ) return;
+  sqlite3_trace_v2( db, SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE, traceCallback, NULL );
+}
+
+
+// initializes sqlite, run sqlite3_config() calls before this
+void DBStatsUtils::init() {
+  PlatformVfs = sqlite3_vfs_find( NULL );
+  if( PlatformVfs == NULL ) {
+    log_e("No default VFS, I/O won't be counted");
+    return;
+  }
+  CountingVfs = *PlatformVfs; // everything but xOpen is forwarded as is
+  CountingVfs.zName    = "counting";
+  CountingVfs.szOsFile = sizeof(CountingFile) + PlatformVfs->szOsFile;
+  CountingVfs.xOpen    = countingOpen;
+  CountingVfs.pNext    = NULL;
+  enabled = sqlite3_vfs_register( &CountingVfs, 1 ) == SQLITE_OK;
+}
@@ -385,6 +385,9 @@ static uint32_t initial_free_heap = freeheap;
 static uint32_t heap_tolerance = 20000; // how much memory under min_free_heap the sketch can go and recover without restarting itself
 static uint32_t *heapmap = NULL;//[HEAPMAP_BUFFLEN] = {0}; // stores the history of heapmap values
 static uint16_t heapindex = 0; // index in the circular buffer
+static uint32_t *sqlmemmap = NULL; // sqlite memory use at each heapmap sample
+static uint8_t  *oommap = NULL; // sqlite out of memory errors since the previous sample
+static uint32_t lastooms = 0;
 
 size_t devicesStatCount = 0;    // how many devices found since last measure
 unsigned long lastDeviceStatCount = 0; // when the last devices count reset was made
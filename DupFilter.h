@@ -0,0 +1,212 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * Duplicate-advert filter core
+ *
+ * Two rotating Bloom filters (current and previous generation) keyed on
+ * MAC + payload hash, and repeat counters hashed by MAC. A repeat only
+ * bumps its counter; the counters are taken out by the scan task after the
+ * round, under the same lock the BLE callback bumps them with.
+ *
+ * A repeat that finds its DUPFILTER_PROBES counter slots held by other MACs
+ * is not absorbed: it takes the full store path so its hit isn't lost.
+ *
+ * No Arduino dependency on purpose (time is passed in): it can be
+ * benchmarked on the host, see test/DupFilterTest.cpp.
+ *
+ */
+
+#ifndef DUPFILTER_BITS // override this from Settings.h
+#define DUPFILTER_BITS 16384 // bits per generation, 2 generations => 4KB
+#endif
+#ifndef DUPFILTER_COUNTERS_SIZE // override this from Settings.h
+#define DUPFILTER_COUNTERS_SIZE 256 // slots for repeat counters, ~devices per round
+#endif
+#define DUPFILTER_PROBES 4 // slots tried per MAC (linear probing)
+#define DUPFILTER_HASHES 3 // k hash functions, ~0.5% false positives per generation at 1000 devices
+
+
+struct BLEDupCounter {
+  uint8_t  mac[6];
+  uint16_t hits      = 0; // repeats since last take()
+  int      rssi      = 0; // last seen rssi
+  uint32_t last_seen = 0; // ms timestamp of last repeat
+};
+
+
+class DupFilter {
+  public:
+
+    uint32_t windowMillis = 60000; // a device gets a full pass at most once per window (up to twice)
+
+    // statistics
+    uint32_t checked    = 0; // adverts submitted to the filter
+    uint32_t absorbed   = 0; // adverts that only bumped counters
+    uint32_t collisions = 0; // repeats sent to the store path, their counter slot was taken
+    uint32_t rotations  = 0;
+
+    ~DupFilter() {
+      free( generation[0] );
+      free( generation[1] );
+    }
+
+    bool init( uint32_t now ) {
+      generation[0] = (uint8_t*)calloc( DUPFILTER_BITS/8, sizeof(uint8_t) );
+      generation[1] = (uint8_t*)calloc( DUPFILTER_BITS/8, sizeof(uint8_t) );
+      lastRotation = now;
+      return generation[0] != NULL && generation[1] != NULL;
+    }
+
+    // returns true if the advert is a repeat within the window and was absorbed
+    bool absorb( const uint8_t* mac, uint32_t payloadHash, int rssi, uint32_t now ) {
+      if( generation[0] == NULL || generation[1] == NULL ) return false;
+      checked++;
+      rotateIfNeeded( now );
+      uint32_t h1 = fnv1a( mac, 6 );
+      uint32_t h2 = fnv1a( mac, 6, payloadHash ) | 1; // odd step for double hashing
+      bool isRepeat = test( generation[current], h1, h2 ) || test( generation[current^1], h1, h2 );
+      if( !isRepeat ) {
+        insert( generation[current], h1, h2 );
+        return false;
+      }
+      // don't re-insert: the device will get a full pass once its generation expires
+      if( !bump( mac, h1, rssi, now ) ) {
+        collisions++;
+        return false;
+      }
+      absorbed++;
+      return true;
+    }
+
+    // moves the pending counters to out[] and clears them, returns how many were copied
+    uint16_t take( BLEDupCounter* out, uint16_t size ) {
+      uint16_t count = 0;
+      portENTER_CRITICAL( &countersMux );
+      for( uint16_t i=0; i<DUPFILTER_COUNTERS_SIZE && count<size; i++ ) {
+        if( Counters[i].hits == 0 ) continue;
+        out[count++] = Counters[i];
+        Counters[i].hits = 0;
+      }
+      portEXIT_CRITICAL( &countersMux );
+      return count;
+    }
+
+    void clear( uint32_t now ) {
+      if( generation[0] == NULL || generation[1] == NULL ) return;
+      memset( generation[0], 0, DUPFILTER_BITS/8 );
+      memset( generation[1], 0, DUPFILTER_BITS/8 );
+      lastRotation = now;
+    }
+
+    // fraction of bits set in the current (or previous) generation
+    float fillRatio( bool previous = false ) {
+      if( generation[0] == NULL || generation[1] == NULL ) return 0;
+      uint8_t* bits = generation[ previous ? current^1 : current ];
+      uint32_t bitsSet = 0;
+      for( uint16_t i=0; i<DUPFILTER_BITS/8; i++ ) {
+        bitsSet += __builtin_popcount( bits[i] );
+      }
+      return (float)bitsSet / DUPFILTER_BITS;
+    }
+
+    // estimated false-positive rate: (fill ratio)^k per generation, a fresh MAC is checked against both
+    float falsePositiveRate() {
+      float fill = fillRatio(), previousFill = fillRatio( true );
+      float p = fill * fill * fill; // DUPFILTER_HASHES
+      float q = previousFill * previousFill * previousFill;
+      return 1 - ( 1 - p ) * ( 1 - q );
+    }
+
+    static uint32_t fnv1a( const uint8_t* data, size_t len, uint32_t hash = 2166136261UL ) {
+      for( size_t i=0; i<len; i++ ) {
+        hash ^= data[i];
+        hash *= 16777619UL;
+      }
+      return hash;
+    }
+
+  private:
+
+    uint8_t* generation[2] = { NULL, NULL };
+    uint8_t  current = 0;
+    uint32_t lastRotation = 0;
+    BLEDupCounter Counters[DUPFILTER_COUNTERS_SIZE];
+    portMUX_TYPE countersMux = portMUX_INITIALIZER_UNLOCKED; // bump() runs in the BLE callback, take() in the scan task
+
+    static bool test( uint8_t* bits, uint32_t h1, uint32_t h2 ) {
+      for( uint8_t i=0; i<DUPFILTER_HASHES; i++ ) {
+        uint32_t bit = (h1 + i*h2) % DUPFILTER_BITS;
+        if( ( bits[bit>>3] & (1<<(bit&7)) ) == 0 ) return false;
+      }
+      return true;
+    }
+
+    static void insert( uint8_t* bits, uint32_t h1, uint32_t h2 ) {
+      for( uint8_t i=0; i<DUPFILTER_HASHES; i++ ) {
+        uint32_t bit = (h1 + i*h2) % DUPFILTER_BITS;
+        bits[bit>>3] |= (1<<(bit&7));
+      }
+    }
+
+    void rotateIfNeeded( uint32_t now ) {
+      if( now - lastRotation < windowMillis ) return;
+      // previous generation expires, current becomes previous
+      current ^= 1;
+      memset( generation[current], 0, DUPFILTER_BITS/8 );
+      lastRotation = now;
+      rotations++;
+    }
+
+    // false when the probed slots hold other MACs' pending hits (or the MAC's counter is full)
+    bool bump( const uint8_t* mac, uint32_t macHash, int rssi, uint32_t now ) {
+      BLEDupCounter* counter = NULL;
+      portENTER_CRITICAL( &countersMux );
+      for( uint8_t i=0; i<DUPFILTER_PROBES; i++ ) {
+        BLEDupCounter &slot = Counters[(macHash + i) % DUPFILTER_COUNTERS_SIZE];
+        if( slot.hits == 0 ) {
+          if( counter == NULL ) counter = &slot; // first free slot, unless the MAC is further
+        } else if( memcmp( slot.mac, mac, 6 ) == 0 ) {
+          counter = slot.hits < 0xffff ? &slot : NULL;
+          break;
+        }
+      }
+      if( counter != NULL ) {
+        memcpy( counter->mac, mac, 6 );
+        counter->hits++;
+        counter->rssi      = rssi;
+        counter->last_seen = now;
+      }
+      portEXIT_CRITICAL( &countersMux );
+      return counter != NULL;
+    }
+
+};
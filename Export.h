@@ -0,0 +1,336 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * Streaming export
+ *
+ * 'export' streams blemacs rows from any daily DB to the serial port, one
+ * sqlite3_step() at a time through a small output buffer, so the heap
+ * doesn't grow with the DB size. Output is framed by marker lines so the
+ * host can pipe it to a file:
+ *
+ *   #export-begin file=/ble-2019-05-01.db format=ndjson
+ *   {"address":"aa:bb:cc:dd:ee:ff","name":"...",...}
+ *   #export-end rows=1234 ms=5678
+ *
+ * Arguments (any order): file=<name.db> format=ndjson|csv from=<unixtime>
+ * to=<unixtime> vendor=<text> rssi=<min rssi>, or 'stop'. Values with
+ * spaces go between double quotes: vendor="Apple, Inc."
+ *
+ * The collector keeps writing today's DB from the scan task (in PSRAM, or
+ * locked by a WAL connection), so today's rows are read from a copy
+ * (EXPORT_SNAPSHOT_FS_PATH) taken between two scan rounds and removed when
+ * the export ends.
+ *
+ */
+
+#define EXPORT_ARGS_SIZE 128 // matches SERIAL_BUFFER_SIZE
+#define EXPORT_BUFFER_SIZE 512
+#define EXPORT_FLUSH_LEVEL 384 // flush when the buffer is this full
+#define EXPORT_BUSY_TIMEOUT 2000 // ms, the collector may hold today's file
+#define EXPORT_SNAPSHOT_FILE "export.db" // copy of today's DB when the collector holds it
+#define EXPORT_SNAPSHOT_FS_PATH "/" EXPORT_SNAPSHOT_FILE
+#define EXPORT_SNAPSHOT_SQLITE_PATH "/" BLE_FS_TYPE "/" EXPORT_SNAPSHOT_FILE
+
+#define exportQuery "SELECT appearance, name, address, ouiname, rssi, manufid, manufname, uuid, \
+strftime('%s', created_at) AS created_at, strftime('%s', updated_at) AS updated_at, hits FROM blemacs \
+WHERE CAST(strftime('%s', updated_at) AS INTEGER) >= ?1 AND CAST(strftime('%s', created_at) AS INTEGER) <= ?2 AND rssi >= ?3 \
+AND ( ?4 IS NULL OR ouiname LIKE ?4 OR manufname LIKE ?4 )"
+#define EXPORT_COLUMNS 11
+
+enum ExportFormats {
+  EXPORT_NDJSON = 0,
+  EXPORT_CSV
+};
+
+
+class ExportUtils {
+  public:
+
+    bool running = false;
+    bool stopRequested = false;
+    bool snapshotRequested = false; // served by step() between scan rounds
+    bool snapshotDone = false;
+
+    // parses the arguments, the serial buffer is reused by the next command
+    bool prepare( const char* args ) {
+      if( running ) return false;
+      running = true;
+      stopRequested = false;
+      format = EXPORT_NDJSON;
+      vendor[0] = '\0';
+      from = 0;
+      to = 0xffffffff;
+      minRssi = -1000;
+      copy( fsPath, DB.BLEMacsDbFSPath, sizeof(fsPath)-1 );
+
+      char argsBuffer[EXPORT_ARGS_SIZE];
+      copy( argsBuffer, args == NULL ? "" : args, EXPORT_ARGS_SIZE-1 );
+      char *cursor = argsBuffer;
+      char *token = nextArg( cursor );
+      while( token != NULL ) {
+        if( strncmp( token, "file=", 5 ) == 0 ) {
+          snprintf( fsPath, sizeof(fsPath), "%s%s", token[5] == '/' ? "" : "/", token+5 );
+        } else if( strcmp( token, "format=csv" ) == 0 ) {
+          format = EXPORT_CSV;
+        } else if( strncmp( token, "from=", 5 ) == 0 ) {
+          from = atol( token+5 );
+        } else if( strncmp( token, "to=", 3 ) == 0 ) {
+          to = atol( token+3 );
+        } else if( strncmp( token, "vendor=", 7 ) == 0 ) {
+          snprintf( vendor, sizeof(vendor), "%%%s%%", token+7 );
+        } else if( strncmp( token, "rssi=", 5 ) == 0 ) {
+          minRssi = atoi( token+5 );
+        }
+        token = nextArg( cursor );
+      }
+      // the scan task owns today's DB, read a copy made between scan rounds
+      snapshotDone = false;
+      snapshotRequested = strcmp( fsPath, DB.BLEMacsDbFSPath ) == 0 && ( DB.inMemory || DB.collectorIsExclusive() );
+      return true;
+    }
+
+    // called between scan rounds, or by the export task when the scan is stopped
+    void step() {
+      if( !snapshotRequested ) return;
+      snapshotRequested = false;
+      snapshotOK = DB.snapshot( EXPORT_SNAPSHOT_SQLITE_PATH );
+      snapshotDone = true;
+    }
+
+    void run() {
+      sqlite3 *db = NULL;
+      bool fromSnapshot = snapshotDone;
+      if( fromSnapshot && !snapshotOK ) {
+        Serial.printf("#export-error cannot copy %s\n", fsPath);
+        removeSnapshot();
+        running = false;
+        return;
+      }
+      const char* readPath = fromSnapshot ? EXPORT_SNAPSHOT_FS_PATH : fsPath;
+      char sqlitePath[48];
+      sprintf( sqlitePath, "/%s%s", BLE_FS_TYPE, readPath );
+      isQuerying = true;
+      bool exists = BLE_FS.exists( readPath );
+      isQuerying = false;
+      if( !exists || sqlite3_open_v2( sqlitePath, &db, SQLITE_OPEN_READONLY, NULL ) != SQLITE_OK ) {
+        Serial.printf("#export-error cannot open %s\n", fsPath);
+        if( db ) sqlite3_close( db );
+        if( fromSnapshot ) removeSnapshot();
+        running = false;
+        return;
+      }
+      sqlite3_busy_timeout( db, EXPORT_BUSY_TIMEOUT );
+
+      sqlite3_stmt *stmt;
+      if( sqlite3_prepare_v2( db, exportQuery, -1, &stmt, NULL ) != SQLITE_OK ) {
+        Serial.printf("#export-error %s\n", sqlite3_errmsg( db ) );
+        sqlite3_close( db );
+        if( fromSnapshot ) removeSnapshot();
+        running = false;
+        return;
+      }
+      sqlite3_bind_int64( stmt, 1, from );
+      sqlite3_bind_int64( stmt, 2, to );
+      sqlite3_bind_int( stmt, 3, minRssi );
+      if( vendor[0] != '\0' ) {
+        sqlite3_bind_text( stmt, 4, vendor, -1, SQLITE_STATIC );
+      } else {
+        sqlite3_bind_null( stmt, 4 );
+      }
+
+      bool serialEcho = Out.serialEcho;
+      Out.serialEcho = false; // keep BLECards out of the stream
+      unsigned long start = millis();
+      uint32_t rows = 0;
+      bufferLen = 0;
+      Serial.printf("#export-begin file=%s format=%s\n", fsPath, format == EXPORT_CSV ? "csv" : "ndjson");
+      if( format == EXPORT_CSV ) {
+        for( uint8_t i=0; i<EXPORT_COLUMNS; i++ ) {
+          append( i == 0 ? "" : "," );
+          append( sqlite3_column_name( stmt, i ) );
+        }
+        append( "\n" );
+      }
+      int rc;
+      while( !stopRequested ) {
+        isQuerying = true;
+        rc = sqlite3_step( stmt );
+        isQuerying = false;
+        if( rc != SQLITE_ROW ) break;
+        if( format == EXPORT_CSV ) {
+          appendCSVRow( stmt );
+        } else {
+          appendJSONRow( stmt );
+        }
+        rows++;
+      }
+      flush();
+      sqlite3_finalize( stmt );
+      sqlite3_close( db );
+      if( fromSnapshot ) removeSnapshot();
+      Out.serialEcho = serialEcho;
+      if( stopRequested ) {
+        Serial.printf("#export-end rows=%d ms=%d stopped\n", rows, millis() - start);
+      } else if( rc != SQLITE_DONE ) {
+        Serial.printf("#export-end rows=%d ms=%d error=%s\n", rows, millis() - start, sqlite3_errstr( rc ) );
+      } else {
+        Serial.printf("#export-end rows=%d ms=%d\n", rows, millis() - start);
+      }
+      running = false;
+    }
+
+  private:
+
+    ExportFormats format = EXPORT_NDJSON;
+    char fsPath[32];
+    char vendor[MAX_FIELD_LEN+3] = {'\0'};
+    int64_t from = 0, to = 0xffffffff;
+    int minRssi = -1000;
+    bool snapshotOK = false;
+    char buffer[EXPORT_BUFFER_SIZE];
+    uint16_t bufferLen = 0;
+
+    // splits on spaces outside double quotes, the quotes are dropped
+    static char* nextArg( char* &cursor ) {
+      while( *cursor == ' ' ) cursor++;
+      if( *cursor == '\0' ) return NULL;
+      char *arg = cursor;
+      char *out = cursor;
+      bool quoted = false;
+      for( ; *cursor != '\0'; cursor++ ) {
+        if( *cursor == '"' ) {
+          quoted = !quoted;
+        } else if( *cursor == ' ' && !quoted ) {
+          cursor++;
+          break;
+        } else {
+          *out++ = *cursor;
+        }
+      }
+      *out = '\0';
+      return arg;
+    }
+
+    void removeSnapshot() {
+      isQuerying = true;
+      BLE_FS.remove( EXPORT_SNAPSHOT_FS_PATH );
+      isQuerying = false;
+    }
+
+    // waits for room in the UART TX buffer instead of blocking in Serial.write()
+    void flush() {
+      uint16_t sent = 0;
+      while( sent < bufferLen ) {
+        int room = Serial.availableForWrite();
+        if( room <= 0 ) {
+          vTaskDelay(1);
+          continue;
+        }
+        uint16_t chunk = min( (int)( bufferLen - sent ), room );
+        Serial.write( (const uint8_t*)buffer + sent, chunk );
+        sent += chunk;
+      }
+      bufferLen = 0;
+    }
+
+    void append( const char* str, uint16_t len ) {
+      while( len > 0 ) {
+        uint16_t chunk = min( len, (uint16_t)( EXPORT_BUFFER_SIZE - bufferLen ) );
+        memcpy( buffer + bufferLen, str, chunk );
+        bufferLen += chunk;
+        str += chunk;
+        len -= chunk;
+        if( bufferLen >= EXPORT_FLUSH_LEVEL ) flush();
+      }
+    }
+
+    void append( const char* str ) {
+      if( str == NULL ) return;
+      append( str, strlen( str ) );
+    }
+
+    void appendEscaped( const char* str, char quote, bool json ) {
+      if( str == NULL ) return;
+      char escaped[8];
+      for( const char* c=str; *c; c++ ) {
+        if( *c == quote ) {
+          if( json ) append( "\\\"", 2 );
+          else append( "\"\"", 2 );
+        } else if( json && *c == '\\' ) {
+          append( "\\\\", 2 );
+        } else if( json && (uint8_t)*c < 0x20 ) {
+          sprintf( escaped, "\\u%04x", (uint8_t)*c );
+          append( escaped );
+        } else {
+          append( c, 1 );
+        }
+      }
+    }
+
+    void appendJSONRow( sqlite3_stmt *stmt ) {
+      append( "{" );
+      for( uint8_t i=0; i<EXPORT_COLUMNS; i++ ) {
+        if( i > 0 ) append( "," );
+        append( "\"" );
+        append( sqlite3_column_name( stmt, i ) );
+        append( "\":" );
+        if( sqlite3_column_type( stmt, i ) == SQLITE_NULL ) {
+          append( "null" );
+        } else if( sqlite3_column_type( stmt, i ) == SQLITE_INTEGER || i == 8 || i == 9 ) { // timestamps come as text
+          append( (const char*)sqlite3_column_text( stmt, i ) );
+        } else {
+          append( "\"" );
+          appendEscaped( (const char*)sqlite3_column_text( stmt, i ), '"', true );
+          append( "\"" );
+        }
+      }
+      append( "}\n" );
+    }
+
+    void appendCSVRow( sqlite3_stmt *stmt ) {
+      for( uint8_t i=0; i<EXPORT_COLUMNS; i++ ) {
+        if( i > 0 ) append( "," );
+        if( sqlite3_column_type( stmt, i ) == SQLITE_TEXT && i != 8 && i != 9 ) {
+          append( "\"" );
+          appendEscaped( (const char*)sqlite3_column_text( stmt, i ), '"', false );
+          append( "\"" );
+        } else {
+          append( (const char*)sqlite3_column_text( stmt, i ) );
+        }
+      }
+      append( "\n" );
+    }
+
+};
+
+
+ExportUtils Export;
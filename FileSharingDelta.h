@@ -0,0 +1,163 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * File sharing delta sync
+ *
+ * Before sending a DB file, the client sends FS_OP_CHECK with the sha256 of
+ * its copy; the server answers that it needs the file when its own copy is
+ * missing, has the wrong size or a different sha256.
+ *
+ * Delta sync: when the receiver already has a version of the file, the
+ * sender sends filename, size and FS_OP_DELTA. The receiver answers with the
+ * truncated sha256 of each FILESHARING_BLOCK_SIZE block of its copy in
+ * FS_OP_HASHES notifications (uint16 first block + hashes), then
+ * FS_OP_HASHDONE. The sender only streams the blocks that differ, each
+ * packet payload starting with its uint32 file offset, and the receiver
+ * patches the file in place. FS_OP_SHA256 of the whole source ends the
+ * sync, the receiver answers FS_OP_VERIFY. Anything but a verified file
+ * makes the sender fall back to a full transfer.
+ *
+ * No Arduino dependency on purpose: files are a template parameter providing
+ * read( buf, len ), seek( pos ) and write( buf, len ) like fs::File, so
+ * test/FileSharingDeltaTest.cpp can run the exchange between two processes.
+ * sha256 comes from mbedtls (ESP-IDF).
+ *
+ */
+
+#define FILESHARING_BLOCK_SIZE        4096 // sqlite page size
+#define FILESHARING_BLOCK_HASH_SIZE   16 // truncated sha256
+#define FILESHARING_HASHES_PER_NOTIFY 9 // keeps FS_OP_HASHES notifications under 160 bytes
+#define FILESHARING_DIGEST_SIZE       32 // whole file sha256
+
+
+// sha256 of a file from its current position, block is FILESHARING_BLOCK_SIZE bytes of scratch
+template <typename FileT>
+static void FileSharingDigest( FileT &file, uint8_t* block, uint8_t digest[FILESHARING_DIGEST_SIZE] ) {
+  mbedtls_sha256_context ctx;
+  mbedtls_sha256_init( &ctx );
+  mbedtls_sha256_starts( &ctx, 0 );
+  size_t len;
+  while ( ( len = file.read( block, FILESHARING_BLOCK_SIZE ) ) > 0 ) {
+    mbedtls_sha256_update( &ctx, block, len );
+  }
+  mbedtls_sha256_finish( &ctx, digest );
+  mbedtls_sha256_free( &ctx );
+}
+
+
+// true when a message carries the same sha256 at payload offset at
+static bool FileSharingSameDigest( const FileSharingMessage &msg, uint16_t at, const uint8_t digest[FILESHARING_DIGEST_SIZE] ) {
+  return msg.len >= at + FILESHARING_DIGEST_SIZE && memcmp( msg.payload + at, digest, FILESHARING_DIGEST_SIZE ) == 0;
+}
+
+
+// receiver: hashes each block of its copy, emit( payload, len ) gets the
+// FS_OP_HASHES payloads, returns the number of blocks
+template <typename FileT, typename Emit>
+static uint32_t FileSharingHashBlocks( FileT &file, uint8_t* block, Emit emit ) {
+  // uint16 first block, then the hashes
+  uint8_t payload[sizeof(uint16_t) + FILESHARING_HASHES_PER_NOTIFY * FILESHARING_BLOCK_HASH_SIZE];
+  uint8_t hashes = 0;
+  uint8_t digest[32];
+  uint32_t blocks = 0;
+  size_t len;
+  while ( ( len = file.read( block, FILESHARING_BLOCK_SIZE ) ) > 0 ) {
+    if ( hashes == 0 ) {
+      payload[0] = blocks;
+      payload[1] = blocks >> 8;
+    }
+    mbedtls_sha256( block, len, digest, 0 );
+    memcpy( payload + sizeof(uint16_t) + hashes * FILESHARING_BLOCK_HASH_SIZE, digest, FILESHARING_BLOCK_HASH_SIZE );
+    hashes++;
+    blocks++;
+    if ( hashes == FILESHARING_HASHES_PER_NOTIFY ) {
+      emit( payload, sizeof(payload) );
+      hashes = 0;
+    }
+  }
+  if ( hashes > 0 ) {
+    emit( payload, sizeof(uint16_t) + hashes * FILESHARING_BLOCK_HASH_SIZE );
+  }
+  return blocks;
+}
+
+
+// sender: copies an FS_OP_HASHES payload into hashes, false when it doesn't fit maxBlocks
+static bool FileSharingStoreHashes( const FileSharingMessage &msg, uint8_t* hashes, size_t maxBlocks ) {
+  uint16_t first = FileSharingU16( msg );
+  size_t count = msg.len > sizeof(uint16_t) ? ( msg.len - sizeof(uint16_t) ) / FILESHARING_BLOCK_HASH_SIZE : 0;
+  if ( hashes == NULL || first + count > maxBlocks ) return false;
+  memcpy( hashes + first * FILESHARING_BLOCK_HASH_SIZE, msg.payload + sizeof(uint16_t), count * FILESHARING_BLOCK_HASH_SIZE );
+  return true;
+}
+
+
+// sender: compares the source blocks, in order, with the receiver's hashes
+// while hashing the whole source for FS_OP_SHA256
+struct FileSharingBlockDiff {
+  mbedtls_sha256_context ctx;
+  const uint8_t* remote = NULL;
+  size_t remoteBlocks = 0;
+  size_t next = 0; // block index
+
+  void begin( const uint8_t* remoteHashes, size_t blocks ) {
+    remote = remoteHashes;
+    remoteBlocks = blocks;
+    next = 0;
+    mbedtls_sha256_init( &ctx );
+    mbedtls_sha256_starts( &ctx, 0 );
+  }
+
+  // true when the next block has to be sent
+  bool differs( const uint8_t* block, size_t len ) {
+    uint8_t digest[32];
+    mbedtls_sha256_update( &ctx, block, len );
+    mbedtls_sha256( block, len, digest, 0 );
+    size_t i = next++;
+    return i >= remoteBlocks || memcmp( digest, remote + i * FILESHARING_BLOCK_HASH_SIZE, FILESHARING_BLOCK_HASH_SIZE ) != 0;
+  }
+
+  void finish( uint8_t digest[FILESHARING_DIGEST_SIZE] ) {
+    mbedtls_sha256_finish( &ctx, digest );
+    mbedtls_sha256_free( &ctx );
+  }
+};
+
+
+// receiver: splits a patch into its file offset and data, false when it has no data
+static bool FileSharingPatch( uint8_t* &data, size_t &len, uint32_t &offset ) {
+  if ( len <= sizeof(offset) ) return false;
+  memcpy( &offset, data, sizeof(offset) );
+  data += sizeof(offset);
+  len  -= sizeof(offset);
+  return true;
+}
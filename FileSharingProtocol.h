@@ -0,0 +1,205 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * File sharing route protocol
+ *
+ * Everything on the route characteristic (writes from the client and
+ * notifications from the server) is a sequence of messages:
+ *
+ *   u8 version | u8 opcode | u16 payload length (LE) | payload
+ *
+ * so one characteristic value can carry several messages (filename, size,
+ * time and file id in a single write, a batch of ls entries and the ls end
+ * in a single notification). FileSharingParse() walks a buffer in place,
+ * payloads point into it and nothing is allocated. Integers are little
+ * endian, strings are not terminated (the length says where they end).
+ *
+ * The client sends FS_OP_HELLO with its capabilities right after connecting,
+ * the server answers with its own. Optional features (delta sync, LZSS,
+ * record merge) are only used when both sides announce them, a peer that
+ * doesn't answer the hello speaks another version and is left alone.
+ *
+ * Data chunks still go through the write characteristic, see BLEFileSharing.h.
+ *
+ */
+
+#define FILESHARING_PROTO_VERSION 1
+#define FILESHARING_MESSAGE_HEADER_SIZE 4
+#define FILESHARING_FRAME_SIZE 512 // max attribute length
+
+enum FileSharingOpcodes {
+  FS_OP_HELLO = 0x01,     // u32 capabilities, both ways
+  FS_OP_QUIT,             // server: the client can disconnect
+  FS_OP_RESTART,          // client: transfers finished, restart
+  FS_OP_TIME,             // bt_time_t, as is
+  FS_OP_LS,               // client: list the .db files
+  FS_OP_LS_ENTRIES,       // server: { u32 size, u8 len, name } * n
+  FS_OP_LS_DONE,          // server
+  FS_OP_CHECK,            // client: u8 FS_FILE_*, sha256 of its copy
+  FS_OP_CHECK_RESULT,     // server: u8 FS_FILE_*, u8 needed (missing, wrong size or other sha256)
+  FS_OP_FILE = 0x10,      // client: path of the file that follows
+  FS_OP_SIZE,             // client: u32 file size
+  FS_OP_FILEID,           // client: u32 crc32 of the first block, u8 FS_FLAG_*
+  FS_OP_OFFSET,           // server: u32 resume offset, u8 FS_FLAG_* accepted or FS_FLAG_REFUSED
+  FS_OP_ACK,              // server: u32 bytes on air
+  FS_OP_NACK,             // server: u32 bytes on air, a chunk was lost
+  FS_OP_CLOSE,            // client: the whole file was sent
+  FS_OP_DELTA = 0x20,     // client: send the block hashes
+  FS_OP_HASHES,           // server: u16 first block, hashes
+  FS_OP_HASHDONE,         // server: u32 blocks
+  FS_OP_SHA256,           // client: 32 bytes
+  FS_OP_VERIFY,           // server: u8 verified
+  FS_OP_SYNC = 0x30,      // client: own address
+  FS_OP_RECORDS,          // client: packed SyncRecords
+  FS_OP_SYNCDONE,         // client: u32 watermark
+  FS_OP_WATERMARK,        // server: u8 accepted, u32 watermark
+  FS_OP_SYNCOK            // server: u32 records
+};
+
+enum FileSharingFiles {
+  FS_FILE_VENDORS = 0, // ble-oui.db
+  FS_FILE_OUI     = 1  // mac-oui-light.db
+};
+
+#define FS_CAP_RESUME  0x01
+#define FS_CAP_DELTA   0x02
+#define FS_CAP_LZSS    0x04
+#define FS_CAP_RECORDS 0x08
+
+#define FS_FLAG_LZSS    0x01
+#define FS_FLAG_REFUSED 0x80 // FS_OP_OFFSET: the receiver can't store the file
+
+
+struct FileSharingMessage {
+  uint8_t        op;
+  uint16_t       len;
+  const uint8_t* payload; // points into the parsed buffer
+};
+
+
+// next message of data, false at the end or on a malformed/other version frame
+static bool FileSharingParse( const uint8_t* &data, size_t &len, FileSharingMessage &msg ) {
+  if ( len < FILESHARING_MESSAGE_HEADER_SIZE ) return false;
+  if ( data[0] != FILESHARING_PROTO_VERSION ) return false;
+  uint16_t payloadLen = data[2] | ( data[3] << 8 );
+  if ( len - FILESHARING_MESSAGE_HEADER_SIZE < payloadLen ) return false;
+  msg.op      = data[1];
+  msg.len     = payloadLen;
+  msg.payload = data + FILESHARING_MESSAGE_HEADER_SIZE;
+  data += FILESHARING_MESSAGE_HEADER_SIZE + payloadLen;
+  len  -= FILESHARING_MESSAGE_HEADER_SIZE + payloadLen;
+  return true;
+}
+
+
+static inline uint32_t FileSharingU32( const FileSharingMessage &msg, uint16_t at = 0 ) {
+  if ( msg.len < at + 4 ) return 0;
+  const uint8_t* p = msg.payload + at;
+  return p[0] | ( p[1] << 8 ) | ( p[2] << 16 ) | ( (uint32_t)p[3] << 24 );
+}
+
+
+static inline uint16_t FileSharingU16( const FileSharingMessage &msg, uint16_t at = 0 ) {
+  if ( msg.len < at + 2 ) return 0;
+  return msg.payload[at] | ( msg.payload[at+1] << 8 );
+}
+
+
+static inline uint8_t FileSharingU8( const FileSharingMessage &msg, uint16_t at = 0 ) {
+  return msg.len > at ? msg.payload[at] : 0;
+}
+
+
+// copies a string payload, false if it doesn't fit
+static bool FileSharingString( const FileSharingMessage &msg, char* out, size_t size ) {
+  if ( msg.len >= size ) return false;
+  memcpy( out, msg.payload, msg.len );
+  out[msg.len] = '\0';
+  return true;
+}
+
+
+static inline void FileSharingPutU32( uint8_t* out, uint32_t value ) {
+  out[0] = value;
+  out[1] = value >> 8;
+  out[2] = value >> 16;
+  out[3] = value >> 24;
+}
+
+
+// writes a message header, returns where the payload goes
+static inline uint8_t* FileSharingPutHeader( uint8_t* out, uint8_t op, uint16_t payloadLen ) {
+  out[0] = FILESHARING_PROTO_VERSION;
+  out[1] = op;
+  out[2] = payloadLen;
+  out[3] = payloadLen >> 8;
+  return out + FILESHARING_MESSAGE_HEADER_SIZE;
+}
+
+
+// accumulates messages for one write or notification
+struct FileSharingFrame {
+  uint8_t data[FILESHARING_FRAME_SIZE];
+  size_t  len = 0;
+
+  // reserves a message, returns where its payload goes (NULL if it doesn't fit)
+  uint8_t* add( uint8_t op, uint16_t payloadLen ) {
+    if ( len + FILESHARING_MESSAGE_HEADER_SIZE + payloadLen > sizeof( data ) ) return NULL;
+    uint8_t* payload = FileSharingPutHeader( data + len, op, payloadLen );
+    len += FILESHARING_MESSAGE_HEADER_SIZE + payloadLen;
+    return payload;
+  }
+
+  bool put( uint8_t op, const void* payload = NULL, uint16_t payloadLen = 0 ) {
+    uint8_t* out = add( op, payloadLen );
+    if ( out == NULL ) return false;
+    if ( payloadLen > 0 ) memcpy( out, payload, payloadLen );
+    return true;
+  }
+
+  bool putString( uint8_t op, const char* str ) {
+    return put( op, str, strlen( str ) );
+  }
+
+  // u32, followed by a u8 when withByte
+  bool putU32( uint8_t op, uint32_t value, bool withByte = false, uint8_t byte = 0 ) {
+    uint8_t* out = add( op, withByte ? 5 : 4 );
+    if ( out == NULL ) return false;
+    FileSharingPutU32( out, value );
+    if ( withByte ) out[4] = byte;
+    return true;
+  }
+
+  void clear() {
+    len = 0;
+  }
+};
@@ -0,0 +1,178 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * File sharing credit window
+ *
+ * Data chunks are written without response, each one prefixed with a
+ * FileSharingChunkHeader (sequence number + crc32 of the payload). The
+ * sender keeps at most a window of unacknowledged bytes in flight; the
+ * receiver grants credit by notifying FS_OP_ACK with the bytes on air so far
+ * every ack interval, and FS_OP_NACK when a chunk is missing or corrupt.
+ * Bytes on air only count the data: not the chunk header, nor the offset
+ * that prefixes delta patches.
+ *
+ * A sender that gets no credit at all within the ack timeout is talking to
+ * a receiver that never acks, and sends the rest unthrottled.
+ *
+ * No Arduino dependency on purpose: the link is a template parameter
+ * providing write( packet, len ) (without response), millis() and wait()
+ * (yield a tick), so test/FileSharingWindowTest.cpp can drive it over a
+ * simulated BLE link. crc32_le() comes from the ESP32 ROM (rom/crc.h).
+ *
+ */
+
+#ifndef FILESHARING_WINDOW // override this from Settings.h
+#define FILESHARING_WINDOW        16384 // bytes in flight
+#endif
+#ifndef FILESHARING_ACK_INTERVAL // override this from Settings.h
+#define FILESHARING_ACK_INTERVAL  4096
+#endif
+#define FILESHARING_ACK_TIMEOUT   2000 // ms without credit before giving up on acks
+#define FILESHARING_MAX_PACKET    517 // max MTU
+#define ATT_HEADER_SIZE     3   // opcode + handle
+#define L2CAP_HEADER_SIZE   4   // length + channel
+#define BLE_LL_MAX_DATA_LEN 251 // link layer payload with data length extension
+
+struct __attribute__((packed)) FileSharingChunkHeader {
+  uint16_t seq;
+  uint32_t crc; // crc32_le( 0, payload )
+};
+
+enum FileSharingSendResult {
+  FS_SEND_OK = 0,
+  FS_SEND_NACKED,       // the receiver lost a chunk, resume from the handshake
+  FS_SEND_NO_CREDIT,    // the receiver stopped acking
+  FS_SEND_WRITE_FAILED  // the link refused the packet
+};
+
+
+template <typename Link>
+class FileSharingWindowSender {
+  public:
+
+    volatile size_t acked  = 0;     // credit granted by the receiver (bytes on air)
+    volatile bool   nacked = false; // the receiver lost a chunk
+    bool     windowed = true;       // false once the receiver is known not to ack
+    uint16_t seq  = 0;
+    size_t   wire = 0;              // bytes on air since begin()
+
+    FileSharingWindowSender( Link &_link ) : link( _link ) { }
+
+    // after each handshake, the receiver restarts counting too
+    void begin() {
+      acked    = 0;
+      nacked   = false;
+      windowed = true;
+      seq      = 0;
+      wire     = 0;
+    }
+
+    // route notifications, called from the notify callback
+    void onAck( size_t bytes )  { acked = bytes; }
+    void onNack( size_t bytes ) { acked = bytes; nacked = true; }
+
+    // one chunk: header, prefix (not counted as bytes on air), then len data bytes
+    FileSharingSendResult send( const uint8_t* data, size_t len, const uint8_t* prefix = NULL, size_t prefixLen = 0 ) {
+      if ( sizeof(FileSharingChunkHeader) + prefixLen + len > FILESHARING_MAX_PACKET ) return FS_SEND_WRITE_FAILED;
+      if ( nacked ) return FS_SEND_NACKED;
+      FileSharingSendResult result = waitCredit( len );
+      if ( result != FS_SEND_OK ) return result;
+      uint8_t* payload = packet + sizeof(FileSharingChunkHeader);
+      if ( prefixLen > 0 ) memcpy( payload, prefix, prefixLen );
+      memcpy( payload + prefixLen, data, len );
+      FileSharingChunkHeader header = { seq, crc32_le( 0, payload, prefixLen + len ) };
+      memcpy( packet, &header, sizeof(header) );
+      if ( !link.write( packet, sizeof(header) + prefixLen + len ) ) return FS_SEND_WRITE_FAILED;
+      wire += len;
+      seq++;
+      return FS_SEND_OK;
+    }
+
+  private:
+
+    Link &link;
+    uint8_t packet[FILESHARING_MAX_PACKET];
+
+    // waits until the receiver has room for len more bytes
+    FileSharingSendResult waitCredit( size_t len ) {
+      if ( !windowed ) return FS_SEND_OK;
+      uint32_t waitStart = link.millis();
+      while ( wire + len > acked + FILESHARING_WINDOW ) {
+        if ( nacked ) return FS_SEND_NACKED;
+        if ( link.millis() - waitStart > FILESHARING_ACK_TIMEOUT ) {
+          if ( acked == 0 ) {
+            windowed = false; // receiver doesn't ack, sending unthrottled
+            return FS_SEND_OK;
+          }
+          return FS_SEND_NO_CREDIT;
+        }
+        link.wait();
+      }
+      return FS_SEND_OK;
+    }
+
+};
+
+
+// largest data chunk for the MTU, trimmed so a write fills whole link layer
+// packets: 517 bytes would go as 251 + 251 + 19, the runt costs most of a
+// packet's air time
+static size_t FileSharingChunkSize( uint16_t mtu, uint16_t llPayload = BLE_LL_MAX_DATA_LEN, size_t prefixLen = 0 ) {
+  size_t overhead = ATT_HEADER_SIZE + sizeof(FileSharingChunkHeader) + prefixLen;
+  if ( mtu > FILESHARING_MAX_PACKET ) mtu = FILESHARING_MAX_PACKET;
+  if ( mtu <= overhead + 20 ) return 20 - sizeof(FileSharingChunkHeader) - prefixLen;
+  size_t onLink = L2CAP_HEADER_SIZE + mtu;
+  if ( onLink > llPayload ) onLink -= onLink % llPayload;
+  return onLink - L2CAP_HEADER_SIZE - overhead;
+}
+
+
+// receiver side: counts the bytes on air and says when to grant credit
+struct FileSharingAcker {
+  size_t wire  = 0; // bytes on air since the handshake
+  size_t acked = 0; // last credit sent
+
+  void begin() {
+    wire  = 0;
+    acked = 0;
+  }
+
+  // true when FS_OP_ACK( wire ) is due, complete forces the last one
+  bool received( size_t len, bool complete ) {
+    wire += len;
+    if ( wire - acked >= FILESHARING_ACK_INTERVAL || complete ) {
+      acked = wire;
+      return true;
+    }
+    return false;
+  }
+};
@@ -0,0 +1,182 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * Latency histograms
+ *
+ * Fixed-bucket log2 histograms (in us, from esp_timer_get_time) for the
+ * after-scan pipeline steps, the BLE callback, and the DB calls.
+ * Bucket n counts durations in [2^n, 2^(n+1)[ us, the last one also holds
+ * everything above.
+ *
+ * Binary dump format (little endian, version 1), stable across builds so a
+ * host tool can diff two dumps:
+ *
+ *   header : "BLEH" | uint16 version | uint16 probes | uint16 buckets | uint16 reserved | char[64] build signature
+ *   probes : char[16] name | uint32 count | uint64 sum_us | uint32 min_us | uint32 max_us | uint32[buckets] counts
+ *
+ * New probes must be appended to LatencyProbes, never inserted.
+ *
+ */
+
+#define LATENCY_BUCKETS 24 // 1us .. 8s+
+#define LATENCY_DUMP_VERSION 1
+#define LATENCY_DUMP_PATH "/latency.bin"
+
+enum LatencyProbes {
+  LATENCY_POPULATE = 0,
+  LATENCY_IFEXISTS,
+  LATENCY_RENDER,
+  LATENCY_PROPAGATE,
+  LATENCY_CALLBACK,
+  LATENCY_DB_EXISTS,
+  LATENCY_DB_INSERT,
+  LATENCY_DB_DELETE,
+  LATENCY_DB_OUI,
+  LATENCY_DB_VENDOR,
+  LATENCY_DB_ENTRIES,
+  LATENCY_DB_MAINTAIN,
+  LATENCY_DB_EXISTS_BATCH,
+  LATENCY_PROBES_COUNT
+};
+
+static const char* LatencyProbeNames[LATENCY_PROBES_COUNT] = {
+  "populate",
+  "ifexists",
+  "render",
+  "propagate",
+  "callback",
+  "db.exists",
+  "db.insert",
+  "db.delete",
+  "db.oui",
+  "db.vendor",
+  "db.entries",
+  "db.maintain",
+  "db.batch"
+};
+
+struct LatencyHistogram {
+  uint32_t count = 0;
+  uint64_t sum   = 0;
+  uint32_t min   = 0xffffffff;
+  uint32_t max   = 0;
+  uint32_t buckets[LATENCY_BUCKETS] = {0};
+};
+
+
+class LatencyStatsUtils {
+  public:
+
+    LatencyHistogram Histograms[LATENCY_PROBES_COUNT];
+
+    void record( LatencyProbes probe, uint32_t us ) {
+      LatencyHistogram &h = Histograms[probe];
+      uint8_t bucket = us < 2 ? 0 : 31 - __builtin_clz( us );
+      if( bucket >= LATENCY_BUCKETS ) bucket = LATENCY_BUCKETS-1;
+      h.buckets[bucket]++;
+      h.count++;
+      h.sum += us;
+      if( us < h.min ) h.min = us;
+      if( us > h.max ) h.max = us;
+    }
+
+    void reset() {
+      for( uint8_t i=0; i<LATENCY_PROBES_COUNT; i++ ) {
+        Histograms[i] = LatencyHistogram();
+      }
+    }
+
+    void print() {
+      Serial.printf("\n%-12s %8s %10s %10s %10s  log2(us) buckets\n", "probe", "count", "avg(us)", "min(us)", "max(us)");
+      for( uint8_t i=0; i<LATENCY_PROBES_COUNT; i++ ) {
+        LatencyHistogram &h = Histograms[i];
+        if( h.count == 0 ) continue;
+        Serial.printf("%-12s %8d %10llu %10d %10d ", LatencyProbeNames[i], h.count, h.sum / h.count, h.min, h.max );
+        // print the non-empty range only
+        int8_t first = -1, last = -1;
+        for( uint8_t b=0; b<LATENCY_BUCKETS; b++ ) {
+          if( h.buckets[b] == 0 ) continue;
+          if( first == -1 ) first = b;
+          last = b;
+        }
+        Serial.printf(" [2^%d]", first);
+        for( int8_t b=first; b<=last; b++ ) {
+          Serial.printf(" %d", h.buckets[b]);
+        }
+        Serial.println();
+      }
+      Serial.println();
+    }
+
+    bool dump( fs::FS &fs, const char* path ) {
+      File file = fs.open( path, FILE_WRITE );
+      if( !file ) {
+        log_e("Can't open %s for writing", path);
+        return false;
+      }
+      uint16_t header[4] = { LATENCY_DUMP_VERSION, LATENCY_PROBES_COUNT, LATENCY_BUCKETS, 0 };
+      char signature[64] = {0};
+      snprintf( signature, sizeof(signature), "%s", BUILDSIGNATURE );
+      file.write( (const uint8_t*)"BLEH", 4 );
+      file.write( (const uint8_t*)header, sizeof(header) );
+      file.write( (const uint8_t*)signature, sizeof(signature) );
+      for( uint8_t i=0; i<LATENCY_PROBES_COUNT; i++ ) {
+        LatencyHistogram &h = Histograms[i];
+        char name[16] = {0};
+        snprintf( name, sizeof(name), "%s", LatencyProbeNames[i] );
+        uint32_t min = h.count > 0 ? h.min : 0;
+        file.write( (const uint8_t*)name, sizeof(name) );
+        file.write( (const uint8_t*)&h.count, sizeof(h.count) );
+        file.write( (const uint8_t*)&h.sum, sizeof(h.sum) );
+        file.write( (const uint8_t*)&min, sizeof(min) );
+        file.write( (const uint8_t*)&h.max, sizeof(h.max) );
+        file.write( (const uint8_t*)h.buckets, sizeof(h.buckets) );
+      }
+      file.close();
+      return true;
+    }
+
+};
+
+
+LatencyStatsUtils LatencyStats;
+
+
+// measures the enclosing scope
+struct LatencyProbe {
+  LatencyProbes probe;
+  int64_t start;
+  LatencyProbe( LatencyProbes _probe ) : probe( _probe ), start( esp_timer_get_time() ) { }
+  ~LatencyProbe() {
+    LatencyStats.record( probe, (uint32_t)( esp_timer_get_time() - start ) );
+  }
+};
@@ -0,0 +1,273 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * Query console
+ *
+ * 'query' runs canned queries on today's collector DB:
+ *
+ *   query vendors [n]     top-n OUI vendors by device count
+ *   query manufs [n]      top-n BLE manufacturers by device count
+ *   query names           distinct device names (also: manufnames, ouinames)
+ *   query seen <t1> <t2>  devices seen between two unix times
+ *   query rssi <min>      devices whose last rssi is >= min
+ *   query stop            abort the running query
+ *
+ * The index each query needs is created on first use. Results come in pages
+ * of QUERY_PAGE_SIZE rows, one page per step(), and step() runs between scan
+ * rounds (or from the query task when the scan is stopped) so a large DB
+ * never holds the scan for more than a page. Pages are keyed on the sort
+ * columns of the last row printed (WHERE key > last), so each page costs
+ * one index range and rows inserted meanwhile don't shift the next page.
+ *
+ */
+
+#define QUERY_PAGE_SIZE 16
+#define QUERY_DEFAULT_TOP 10
+#define QUERY_PAGE_PAUSE 50 // ms between pages when the scan is stopped
+
+// %s = key condition, then " ORDER BY <order> LIMIT <page size>" is appended
+#define topOuinameQuery   "SELECT ouiname, COUNT(*) AS devices FROM blemacs WHERE TRIM(ouiname)!='' GROUP BY ouiname HAVING %s"
+#define topManufnameQuery "SELECT manufname, COUNT(*) AS devices FROM blemacs WHERE TRIM(manufname)!='' GROUP BY manufname HAVING %s"
+#define distinctNameQuery      "SELECT DISTINCT name FROM blemacs WHERE TRIM(name)!='' AND ( %s )"
+#define distinctManufnameQuery "SELECT DISTINCT manufname FROM blemacs WHERE TRIM(manufname)!='' AND ( %s )"
+#define distinctOuinameQuery   "SELECT DISTINCT ouiname FROM blemacs WHERE TRIM(ouiname)!='' AND ( %s )"
+#define seenBetweenQuery  "SELECT address, name, ouiname, manufname, rssi, updated_at FROM blemacs WHERE updated_at BETWEEN datetime(?1, 'unixepoch') AND datetime(?2, 'unixepoch') AND ( %s )"
+#define rssiAboveQuery    "SELECT address, name, ouiname, manufname, rssi, updated_at FROM blemacs WHERE rssi >= ?1 AND ( %s )"
+
+
+enum QueryStates {
+  QUERY_IDLE = 0,
+  QUERY_INDEXING,
+  QUERY_PAGING
+};
+
+struct QueryTpl {
+  const char* name;
+  const char* query;
+  const char* index; // created on demand
+  uint8_t     params; // bound as ?1, ?2
+  bool        top; // ?1 is the total rows count, not bound
+  const char* order; // unique sort key
+  const char* after; // rows after the last key, bound as ?3, ?4
+  int8_t      keys[2]; // columns holding the key, -1 = unused
+};
+
+static const QueryTpl Queries[] = {
+  { "vendors",    topOuinameQuery,        "CREATE INDEX IF NOT EXISTS blemacs_ouiname ON blemacs(ouiname)",       1, true,
+    "devices DESC, ouiname",   "devices < ?3 OR ( devices = ?3 AND ouiname > ?4 )",     { 1, 0 } },
+  { "manufs",     topManufnameQuery,      "CREATE INDEX IF NOT EXISTS blemacs_manufname ON blemacs(manufname)",   1, true,
+    "devices DESC, manufname", "devices < ?3 OR ( devices = ?3 AND manufname > ?4 )",   { 1, 0 } },
+  { "names",      distinctNameQuery,      "CREATE INDEX IF NOT EXISTS blemacs_name ON blemacs(name)",             0, false,
+    "name",                    "name > ?3",                                             { 0, -1 } },
+  { "manufnames", distinctManufnameQuery, "CREATE INDEX IF NOT EXISTS blemacs_manufname ON blemacs(manufname)",   0, false,
+    "manufname",               "manufname > ?3",                                        { 0, -1 } },
+  { "ouinames",   distinctOuinameQuery,   "CREATE INDEX IF NOT EXISTS blemacs_ouiname ON blemacs(ouiname)",       0, false,
+    "ouiname",                 "ouiname > ?3",                                          { 0, -1 } },
+  { "seen",       seenBetweenQuery,       "CREATE INDEX IF NOT EXISTS blemacs_updated_at ON blemacs(updated_at)", 2, false,
+    "updated_at, address",     "updated_at > ?3 OR ( updated_at = ?3 AND address > ?4 )", { 5, 0 } },
+  { "rssi",       rssiAboveQuery,         "CREATE INDEX IF NOT EXISTS blemacs_rssi ON blemacs(rssi)",             1, false,
+    "rssi DESC, address",      "rssi < ?3 OR ( rssi = ?3 AND address > ?4 )",          { 4, 0 } },
+};
+
+#define QUERIES_COUNT ( sizeof(Queries) / sizeof(Queries[0]) )
+
+
+class QueryUtils {
+  public:
+
+    QueryStates state = QUERY_IDLE;
+
+    bool running() {
+      return state != QUERY_IDLE;
+    }
+
+    // parses "<name> [param] [param]", the query starts on the next step()
+    bool start( const char* args ) {
+      if( running() ) {
+        Serial.printf("Query '%s' is still running, use 'query stop' to abort it\n", current->name);
+        return false;
+      }
+      char name[16] = {'\0'};
+      long long p1 = 0, p2 = 0;
+      int found = sscanf( args, "%15s %lld %lld", name, &p1, &p2 );
+      current = NULL;
+      for( uint8_t i=0; i<QUERIES_COUNT; i++ ) {
+        if( strcmp( name, Queries[i].name ) == 0 ) {
+          current = &Queries[i];
+          break;
+        }
+      }
+      if( current == NULL ) {
+        Serial.printf("Unknown query '%s', available:", name);
+        for( uint8_t i=0; i<QUERIES_COUNT; i++ ) {
+          Serial.printf(" %s", Queries[i].name);
+        }
+        Serial.println();
+        return false;
+      }
+      if( found - 1 < current->params ) {
+        if( current->top ) {
+          p1 = QUERY_DEFAULT_TOP;
+        } else {
+          Serial.printf("Query '%s' needs %d parameter(s)\n", current->name, current->params);
+          return false;
+        }
+      }
+      params[0] = p1;
+      params[1] = p2;
+      clearKey();
+      offset = 0;
+      pages = 0;
+      sqlMillis = 0;
+      startMillis = millis();
+      state = QUERY_INDEXING;
+      return true;
+    }
+
+    void stop() {
+      if( !running() ) return;
+      Serial.printf("Query '%s' aborted after %u rows\n", current->name, offset);
+      clearKey();
+      state = QUERY_IDLE;
+    }
+
+    // one bounded chunk of work: the index creation, or a single page
+    void step() {
+      switch( state ) {
+        case QUERY_IDLE: return;
+        case QUERY_INDEXING: {
+          unsigned long start = millis();
+          DB.open( DBUtils::BLE_COLLECTOR_DB, false );
+          DB.DBExec( DB.BLECollectorDB, current->index );
+          DB.close( DBUtils::BLE_COLLECTOR_DB );
+          indexMillis = millis() - start;
+          sqlMillis += indexMillis;
+          state = QUERY_PAGING;
+        }
+        break;
+        case QUERY_PAGING: {
+          int limit = QUERY_PAGE_SIZE;
+          if( current->top && params[0] - offset < limit ) {
+            limit = params[0] > offset ? params[0] - offset : 0;
+          }
+          if( limit == 0 || page( limit ) < limit ) {
+            Serial.printf("[%s] %u rows, %u pages, sql: %lu ms (index: %lu ms), total: %lu ms\n",
+              current->name,
+              offset,
+              pages,
+              sqlMillis,
+              indexMillis,
+              millis() - startMillis
+            );
+            clearKey();
+            state = QUERY_IDLE;
+          }
+        }
+        break;
+      }
+    }
+
+  private:
+
+    const QueryTpl* current = NULL;
+    long long params[2];
+    uint32_t offset = 0;
+    uint16_t pages = 0;
+    unsigned long startMillis = 0;
+    unsigned long sqlMillis = 0;
+    unsigned long indexMillis = 0;
+    sqlite3_value* lastKey[2] = { NULL, NULL }; // sort key of the last row printed
+    char pageQuery[640];
+
+    void clearKey() {
+      for( uint8_t i=0; i<2; i++ ) {
+        sqlite3_value_free( lastKey[i] );
+        lastKey[i] = NULL;
+      }
+    }
+
+    // prints up to limit rows following the last key, returns how many
+    int page( int limit ) {
+      unsigned long start = millis();
+      sprintf( pageQuery, current->query, offset == 0 ? "1" : current->after );
+      sprintf( pageQuery + strlen( pageQuery ), " ORDER BY %s LIMIT %d", current->order, limit );
+      DB.open( DBUtils::BLE_COLLECTOR_DB );
+      sqlite3_stmt *stmt;
+      if( sqlite3_prepare_v2( DB.BLECollectorDB, pageQuery, -1, &stmt, NULL ) != SQLITE_OK ) {
+        Serial.printf("[%s] %s\n", current->name, sqlite3_errmsg( DB.BLECollectorDB ) );
+        DB.close( DBUtils::BLE_COLLECTOR_DB );
+        return 0;
+      }
+      for( uint8_t i=0; i<current->params && !current->top; i++ ) {
+        sqlite3_bind_int64( stmt, i+1, params[i] );
+      }
+      if( offset > 0 ) {
+        for( uint8_t i=0; i<2; i++ ) {
+          if( lastKey[i] != NULL ) sqlite3_bind_value( stmt, i+3, lastKey[i] );
+        }
+      }
+      int rows = 0;
+      int cols = sqlite3_column_count( stmt );
+      if( offset == 0 ) {
+        for( int i=0; i<cols; i++ ) {
+          Serial.printf( i == 0 ? "%s" : " | %s", sqlite3_column_name( stmt, i ) );
+        }
+        Serial.println();
+      }
+      while( sqlite3_step( stmt ) == SQLITE_ROW ) {
+        for( int i=0; i<cols; i++ ) {
+          const char* value = (const char*)sqlite3_column_text( stmt, i );
+          Serial.printf( i == 0 ? "%s" : " | %s", value == NULL ? "" : value );
+        }
+        Serial.println();
+        rows++;
+        if( rows == limit ) {
+          // copied before the statement is finalized
+          for( uint8_t i=0; i<2; i++ ) {
+            if( current->keys[i] < 0 ) continue;
+            sqlite3_value_free( lastKey[i] );
+            lastKey[i] = sqlite3_value_dup( sqlite3_column_value( stmt, current->keys[i] ) );
+          }
+        }
+      }
+      sqlite3_finalize( stmt );
+      DB.close( DBUtils::BLE_COLLECTOR_DB );
+      sqlMillis += millis() - start;
+      offset += rows;
+      pages++;
+      return rows;
+    }
+
+};
+
+
+QueryUtils Query;
@@ -0,0 +1,384 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * Record-level merge sync between collectors
+ *
+ * A collector connecting to a file sharing peer sends the blemacs rows of
+ * its current DB updated since the peer's watermark, as compact binary
+ * records (see pack()). The receiver merges them into its own current DB
+ * in transactions of SYNC_BATCH_SIZE rows:
+ *
+ *   - hits are summed: sync_hits keeps what each peer already contributed
+ *     per address, only the difference is added, so resending is harmless
+ *   - created_at keeps the earliest, updated_at the latest
+ *   - name, ouiname, manufname, uuid, appearance and manufid only fill
+ *     empty fields, like BlueToothDeviceHelper::mergeItems()
+ *
+ * Only hits observed locally are sent (hits minus what peers contributed in
+ * sync_hits), and rows that only came from peers aren't sent at all, so a
+ * row relayed through a third collector is never counted twice.
+ *
+ * The watermark (sender's latest updated_at) is stored per peer address in
+ * sync_peers. Both tables live in the collector DB, so they follow the
+ * daily rotation along with the rows they describe.
+ *
+ */
+
+#define SYNC_BATCH_SIZE 64 // rows per transaction
+#define SYNC_QUEUE_SIZE 16 // decoded records waiting for the merge task
+#define SYNC_TIMEOUT 10000 // ms without records before the merge gives up
+
+#define syncCreateTablesQuery "CREATE TABLE IF NOT EXISTS sync_peers( peer TEXT PRIMARY KEY, watermark INTEGER ); \
+CREATE TABLE IF NOT EXISTS sync_hits( peer TEXT, address TEXT, hits INTEGER, PRIMARY KEY( peer, address ) ) WITHOUT ROWID; \
+CREATE INDEX IF NOT EXISTS sync_hits_address ON sync_hits(address)"
+#define syncWatermarkQuery    "SELECT watermark FROM sync_peers WHERE peer=?1"
+#define syncSetWatermarkQuery "INSERT OR REPLACE INTO sync_peers VALUES( ?1, ?2 )"
+#define syncPeerHitsQuery     "SELECT hits FROM sync_hits WHERE peer=?1 AND address=?2"
+#define syncSetPeerHitsQuery  "INSERT OR REPLACE INTO sync_hits VALUES( ?1, ?2, ?3 )"
+// dates are written in the insertQueryTemplate format
+// ?1 address, ?2 hits to add, ?3 created_at, ?4 updated_at, ?5 appearance, ?6 name, ?7 ouiname, ?8 rssi, ?9 manufid, ?10 manufname, ?11 uuid
+#define syncUpdateQuery "UPDATE blemacs SET hits=hits+?2, \
+created_at=MIN(created_at, strftime('%Y-%m-%d %H:%M:%S.000000', ?3, 'unixepoch')), \
+updated_at=MAX(updated_at, strftime('%Y-%m-%d %H:%M:%S.000000', ?4, 'unixepoch')), \
+appearance=CASE WHEN appearance=0 THEN ?5 ELSE appearance END, \
+name=CASE WHEN TRIM(IFNULL(name,''))='' THEN ?6 ELSE name END, \
+ouiname=CASE WHEN TRIM(IFNULL(ouiname,''))='' THEN ?7 ELSE ouiname END, \
+manufid=CASE WHEN manufid=-1 THEN ?9 ELSE manufid END, \
+manufname=CASE WHEN TRIM(IFNULL(manufname,''))='' THEN ?10 ELSE manufname END, \
+uuid=CASE WHEN TRIM(IFNULL(uuid,''))='' THEN ?11 ELSE uuid END \
+WHERE address=?1"
+#define syncInsertQuery "INSERT INTO blemacs(" BLEMAC_INSERT_FIELDNAMES ") VALUES( ?5, ?6, ?1, ?7, ?8, ?9, ?10, ?11, \
+strftime('%Y-%m-%d %H:%M:%S.000000', ?3, 'unixepoch'), strftime('%Y-%m-%d %H:%M:%S.000000', ?4, 'unixepoch'), ?2 )"
+#define syncLocalHits "( hits - IFNULL( ( SELECT SUM(s.hits) FROM sync_hits s WHERE s.address=blemacs.address ), 0 ) )"
+#define syncChangesQuery "SELECT appearance, name, address, ouiname, rssi, manufid, manufname, uuid, \
+CAST(strftime('%s', created_at) AS INTEGER), CAST(strftime('%s', updated_at) AS INTEGER), " syncLocalHits " FROM blemacs \
+WHERE CAST(strftime('%s', updated_at) AS INTEGER) >= ?1 AND " syncLocalHits " > 0 ORDER BY updated_at"
+
+
+// on air: header, then name, ouiname, manufname and uuid without terminators
+struct __attribute__((packed)) SyncRecordHeader {
+  uint8_t  mac[6];
+  uint16_t appearance;
+  int8_t   rssi;
+  int16_t  manufid;
+  uint32_t created_at;
+  uint32_t updated_at;
+  uint32_t hits;
+  uint8_t  lens[4];
+};
+
+
+struct SyncRecord {
+  char     address[MAC_LEN+1] = {0}; // empty = end of sync
+  uint16_t appearance = 0;
+  int8_t   rssi       = 0;
+  int16_t  manufid    = -1;
+  uint32_t created_at = 0;
+  uint32_t updated_at = 0; // watermark when address is empty
+  uint32_t hits       = 0;
+  char     name[MAX_FIELD_LEN+1]      = {0};
+  char     ouiname[MAX_FIELD_LEN+1]   = {0};
+  char     manufname[MAX_FIELD_LEN+1] = {0};
+  char     uuid[MAX_FIELD_LEN+1]      = {0};
+};
+
+
+class RecordSyncUtils {
+  public:
+
+    // statistics, last sync
+    uint32_t received = 0;
+    uint32_t merged   = 0; // existing rows updated
+    uint32_t inserted = 0;
+    uint32_t batches  = 0;
+    uint32_t syncMillis = 0;
+
+    // bytes used by r in out, 0 when it doesn't fit in room
+    static size_t pack( const SyncRecord &r, uint8_t* out, size_t room ) {
+      const char* fields[4] = { r.name, r.ouiname, r.manufname, r.uuid };
+      SyncRecordHeader header;
+      unsigned int mac[6];
+      if( sscanf( r.address, "%02x:%02x:%02x:%02x:%02x:%02x", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5] ) != 6 ) return 0;
+      size_t size = sizeof( header );
+      for( uint8_t i=0; i<6; i++ ) header.mac[i] = mac[i];
+      for( uint8_t i=0; i<4; i++ ) {
+        header.lens[i] = strlen( fields[i] );
+        size += header.lens[i];
+      }
+      if( size > room ) return 0;
+      header.appearance = r.appearance;
+      header.rssi       = r.rssi;
+      header.manufid    = r.manufid;
+      header.created_at = r.created_at;
+      header.updated_at = r.updated_at;
+      header.hits       = r.hits;
+      memcpy( out, &header, sizeof( header ) );
+      out += sizeof( header );
+      for( uint8_t i=0; i<4; i++ ) {
+        memcpy( out, fields[i], header.lens[i] );
+        out += header.lens[i];
+      }
+      return size;
+    }
+
+    // bytes read from in, 0 when malformed
+    static size_t unpack( const uint8_t* in, size_t len, SyncRecord &r ) {
+      char* fields[4] = { r.name, r.ouiname, r.manufname, r.uuid };
+      SyncRecordHeader header;
+      if( len < sizeof( header ) ) return 0;
+      memcpy( &header, in, sizeof( header ) );
+      size_t size = sizeof( header );
+      for( uint8_t i=0; i<4; i++ ) {
+        if( header.lens[i] > MAX_FIELD_LEN ) return 0;
+        size += header.lens[i];
+      }
+      if( size > len ) return 0;
+      sprintf( r.address, "%02x:%02x:%02x:%02x:%02x:%02x", header.mac[0], header.mac[1], header.mac[2], header.mac[3], header.mac[4], header.mac[5] );
+      r.appearance = header.appearance;
+      r.rssi       = header.rssi;
+      r.manufid    = header.manufid;
+      r.created_at = header.created_at;
+      r.updated_at = header.updated_at;
+      r.hits       = header.hits;
+      in += sizeof( header );
+      for( uint8_t i=0; i<4; i++ ) {
+        memcpy( fields[i], in, header.lens[i] );
+        fields[i][header.lens[i]] = '\0';
+        in += header.lens[i];
+      }
+      return size;
+    }
+
+    /*
+     * Sender side
+     */
+
+    bool changesBegin( uint32_t watermark ) {
+      if( DB.open( DBUtils::BLE_COLLECTOR_DB ) != SQLITE_OK ) return false;
+      // sync_hits is created by the first merge received
+      if( sqlite3_exec( DB.BLECollectorDB, syncCreateTablesQuery, NULL, NULL, NULL ) != SQLITE_OK
+       || sqlite3_prepare_v2( DB.BLECollectorDB, syncChangesQuery, -1, &changesStmt, NULL ) != SQLITE_OK ) {
+        log_e("Can't prepare changes query: %s", sqlite3_errmsg( DB.BLECollectorDB ) );
+        DB.close( DBUtils::BLE_COLLECTOR_DB );
+        return false;
+      }
+      sqlite3_bind_int64( changesStmt, 1, watermark );
+      return true;
+    }
+
+    bool nextChange( SyncRecord &r ) {
+      if( changesStmt == NULL || sqlite3_step( changesStmt ) != SQLITE_ROW ) return false;
+      r = SyncRecord(); // copy() leaves NULL and empty columns untouched
+      r.appearance = sqlite3_column_int( changesStmt, 0 );
+      copy( r.name, (const char*)sqlite3_column_text( changesStmt, 1 ), MAX_FIELD_LEN );
+      copy( r.address, (const char*)sqlite3_column_text( changesStmt, 2 ), MAC_LEN );
+      copy( r.ouiname, (const char*)sqlite3_column_text( changesStmt, 3 ), MAX_FIELD_LEN );
+      r.rssi = sqlite3_column_int( changesStmt, 4 );
+      r.manufid = sqlite3_column_int( changesStmt, 5 );
+      copy( r.manufname, (const char*)sqlite3_column_text( changesStmt, 6 ), MAX_FIELD_LEN );
+      copy( r.uuid, (const char*)sqlite3_column_text( changesStmt, 7 ), MAX_FIELD_LEN );
+      r.created_at = sqlite3_column_int64( changesStmt, 8 );
+      r.updated_at = sqlite3_column_int64( changesStmt, 9 );
+      r.hits = sqlite3_column_int( changesStmt, 10 );
+      return true;
+    }
+
+    void changesEnd() {
+      sqlite3_finalize( changesStmt );
+      changesStmt = NULL;
+      DB.close( DBUtils::BLE_COLLECTOR_DB );
+    }
+
+    /*
+     * Receiver side
+     */
+
+    bool begin( const char* peerAddress, uint32_t &watermark ) {
+      received = 0;
+      merged = 0;
+      inserted = 0;
+      batches = 0;
+      inTransaction = false;
+      startedAt = millis();
+      watermark = 0;
+      copy( peer, peerAddress, MAC_LEN );
+      if( DB.open( DBUtils::BLE_COLLECTOR_DB, false ) != SQLITE_OK ) return false;
+      sqlite3* db = DB.BLECollectorDB;
+      if( sqlite3_exec( db, syncCreateTablesQuery, NULL, NULL, NULL ) != SQLITE_OK
+       || sqlite3_prepare_v2( db, syncPeerHitsQuery, -1, &peerHitsStmt, NULL ) != SQLITE_OK
+       || sqlite3_prepare_v2( db, syncSetPeerHitsQuery, -1, &setPeerHitsStmt, NULL ) != SQLITE_OK
+       || sqlite3_prepare_v2( db, syncUpdateQuery, -1, &updateStmt, NULL ) != SQLITE_OK
+       || sqlite3_prepare_v2( db, syncInsertQuery, -1, &insertStmt, NULL ) != SQLITE_OK ) {
+        log_e("Can't prepare sync queries: %s", sqlite3_errmsg( db ) );
+        finalize();
+        return false;
+      }
+      sqlite3_stmt* stmt;
+      if( sqlite3_prepare_v2( db, syncWatermarkQuery, -1, &stmt, NULL ) == SQLITE_OK ) {
+        sqlite3_bind_text( stmt, 1, peer, -1, SQLITE_STATIC );
+        if( sqlite3_step( stmt ) == SQLITE_ROW ) {
+          watermark = sqlite3_column_int64( stmt, 0 );
+        }
+        sqlite3_finalize( stmt );
+      }
+      return true;
+    }
+
+    void merge( const SyncRecord &r ) {
+      sqlite3* db = DB.BLECollectorDB;
+      if( !inTransaction ) {
+        sqlite3_exec( db, "BEGIN", NULL, NULL, NULL );
+        inTransaction = true;
+      }
+      received++;
+      // what this peer already added for this address
+      uint32_t contributed = 0;
+      sqlite3_bind_text( peerHitsStmt, 1, peer, -1, SQLITE_STATIC );
+      sqlite3_bind_text( peerHitsStmt, 2, r.address, -1, SQLITE_STATIC );
+      if( sqlite3_step( peerHitsStmt ) == SQLITE_ROW ) {
+        contributed = sqlite3_column_int64( peerHitsStmt, 0 );
+      }
+      sqlite3_reset( peerHitsStmt );
+      // a lower count means the peer started a new DB
+      uint32_t added = r.hits >= contributed ? r.hits - contributed : r.hits;
+
+      bindRecord( updateStmt, r, added );
+      sqlite3_step( updateStmt );
+      sqlite3_reset( updateStmt );
+      if( sqlite3_changes( db ) > 0 ) {
+        merged++;
+      } else {
+        bindRecord( insertStmt, r, added );
+        if( sqlite3_step( insertStmt ) == SQLITE_DONE ) {
+          inserted++;
+          // onScanBatchLookup() skips the DB for addresses the device index has never seen
+          BLEIndex.touch( r.address, r.name, r.ouiname, r.manufname );
+        }
+        sqlite3_reset( insertStmt );
+      }
+
+      sqlite3_bind_text( setPeerHitsStmt, 1, peer, -1, SQLITE_STATIC );
+      sqlite3_bind_text( setPeerHitsStmt, 2, r.address, -1, SQLITE_STATIC );
+      sqlite3_bind_int64( setPeerHitsStmt, 3, r.hits );
+      sqlite3_step( setPeerHitsStmt );
+      sqlite3_reset( setPeerHitsStmt );
+
+      if( received % SYNC_BATCH_SIZE == 0 ) {
+        commit();
+      }
+    }
+
+    // complete = false keeps the previous watermark, merged rows stay (resending is harmless)
+    void end( uint32_t watermark, bool complete ) {
+      sqlite3* db = DB.BLECollectorDB;
+      if( complete ) {
+        if( !inTransaction ) {
+          sqlite3_exec( db, "BEGIN", NULL, NULL, NULL );
+          inTransaction = true;
+        }
+        sqlite3_stmt* stmt;
+        if( sqlite3_prepare_v2( db, syncSetWatermarkQuery, -1, &stmt, NULL ) == SQLITE_OK ) {
+          sqlite3_bind_text( stmt, 1, peer, -1, SQLITE_STATIC );
+          sqlite3_bind_int64( stmt, 2, watermark );
+          sqlite3_step( stmt );
+          sqlite3_finalize( stmt );
+        }
+      }
+      if( inTransaction ) commit();
+      finalize();
+      syncMillis = millis() - startedAt;
+      if( inserted > 0 ) {
+        entries = DB.getEntries();
+      }
+    }
+
+    void dumpStats() {
+      Serial.printf("[Sync] last peer: %s, received: %d, merged: %d, inserted: %d, transactions: %d, %d ms\n",
+        isEmpty( peer ) ? "none" : peer,
+        received,
+        merged,
+        inserted,
+        batches,
+        syncMillis
+      );
+    }
+
+  private:
+
+    char peer[MAC_LEN+1] = {0};
+    bool inTransaction = false;
+    unsigned long startedAt = 0;
+    sqlite3_stmt* changesStmt = NULL;
+    sqlite3_stmt* peerHitsStmt = NULL;
+    sqlite3_stmt* setPeerHitsStmt = NULL;
+    sqlite3_stmt* updateStmt = NULL;
+    sqlite3_stmt* insertStmt = NULL;
+
+    void bindRecord( sqlite3_stmt* stmt, const SyncRecord &r, uint32_t hits ) {
+      sqlite3_bind_text( stmt, 1, r.address, -1, SQLITE_STATIC );
+      sqlite3_bind_int64( stmt, 2, hits );
+      sqlite3_bind_int64( stmt, 3, r.created_at );
+      sqlite3_bind_int64( stmt, 4, r.updated_at );
+      sqlite3_bind_int( stmt, 5, r.appearance );
+      sqlite3_bind_text( stmt, 6, r.name, -1, SQLITE_STATIC );
+      sqlite3_bind_text( stmt, 7, r.ouiname, -1, SQLITE_STATIC );
+      sqlite3_bind_int( stmt, 8, r.rssi );
+      sqlite3_bind_int( stmt, 9, r.manufid );
+      sqlite3_bind_text( stmt, 10, r.manufname, -1, SQLITE_STATIC );
+      sqlite3_bind_text( stmt, 11, r.uuid, -1, SQLITE_STATIC );
+    }
+
+    void commit() {
+      if( sqlite3_exec( DB.BLECollectorDB, "COMMIT", NULL, NULL, NULL ) != SQLITE_OK ) {
+        log_e("Sync commit failed: %s", sqlite3_errmsg( DB.BLECollectorDB ) );
+        sqlite3_exec( DB.BLECollectorDB, "ROLLBACK", NULL, NULL, NULL );
+      }
+      inTransaction = false;
+      batches++;
+    }
+
+    void finalize() {
+      sqlite3_finalize( peerHitsStmt );
+      sqlite3_finalize( setPeerHitsStmt );
+      sqlite3_finalize( updateStmt );
+      sqlite3_finalize( insertStmt );
+      peerHitsStmt = NULL;
+      setPeerHitsStmt = NULL;
+      updateStmt = NULL;
+      insertStmt = NULL;
+      DB.close( DBUtils::BLE_COLLECTOR_DB );
+    }
+
+};
+
+
+RecordSyncUtils RecordSync;
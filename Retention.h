@@ -0,0 +1,382 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * Retention and rollup
+ *
+ * Daily collector files (ble-YYYY-MM-DD.db) are rolled up into weekly and
+ * monthly per-device summaries (first/last seen, total hits, max rssi) kept
+ * in /ble-summary.db, then removed (or moved to /archive) when they're older
+ * than RETENTION_MAX_AGE days or when the daily files exceed
+ * RETENTION_MAX_SIZE MB. Files that weren't rolled up are never removed.
+ *
+ * step() runs between scan rounds and does a bounded amount of work:
+ * a few directory entries, RETENTION_CHUNK rows, or one file removal.
+ * Each chunk commits with the file's progress, so a reboot in the middle of
+ * a file resumes after the last committed chunk instead of counting its
+ * hits twice.
+ *
+ */
+
+#define RETENTION_DB_FILE        "ble-summary.db"
+#define RETENTION_DB_SQLITE_PATH "/" BLE_FS_TYPE "/" RETENTION_DB_FILE
+#define RETENTION_ARCHIVE_DIR    "/archive"
+#define RETENTION_MAX_FILES 64 // daily files considered per pass
+#define RETENTION_DIR_STEP 8 // directory entries per step
+#define RETENTION_CHUNK 200 // blemacs rows per step
+#define RETENTION_CHECK_INTERVAL 600000 // ms between passes
+
+#define retentionCreateTablesQuery "CREATE TABLE IF NOT EXISTS weekly( period TEXT, address TEXT, first_seen INTEGER, last_seen INTEGER, hits INTEGER, max_rssi INTEGER, PRIMARY KEY( period, address ) ); \
+CREATE TABLE IF NOT EXISTS monthly( period TEXT, address TEXT, first_seen INTEGER, last_seen INTEGER, hits INTEGER, max_rssi INTEGER, PRIMARY KEY( period, address ) ); \
+CREATE TABLE IF NOT EXISTS rolled( file TEXT PRIMARY KEY, rows INTEGER, rolled_at INTEGER ); \
+CREATE TABLE IF NOT EXISTS rolling( file TEXT PRIMARY KEY, last_rowid INTEGER )"
+// %s = table, %s = strftime period format, %s = file date, %u = first rowid, %u = last rowid
+#define retentionRollupTemplate "INSERT INTO %s SELECT strftime('%s', '%s'), address, MIN(strftime('%%s', created_at)), MAX(strftime('%%s', updated_at)), SUM(hits), MAX(rssi) \
+FROM daily.blemacs WHERE rowid > %u AND rowid <= %u GROUP BY address \
+ON CONFLICT( period, address ) DO UPDATE SET first_seen=MIN(first_seen, excluded.first_seen), last_seen=MAX(last_seen, excluded.last_seen), hits=hits+excluded.hits, max_rssi=MAX(max_rssi, excluded.max_rssi)"
+
+
+enum RetentionStates {
+  RETENTION_IDLE = 0,
+  RETENTION_SCAN,
+  RETENTION_ROLLUP,
+  RETENTION_RETIRE
+};
+
+static const char* RetentionStateNames[] = { "idle", "scanning", "rolling up", "retiring" };
+
+struct RetentionFile {
+  char     name[24]; // e.g. ble-2019-05-01.db
+  uint32_t date = 0; // YYYYMMDD
+  uint32_t size = 0;
+  bool     rolled = false;
+};
+
+
+class RetentionUtils {
+  public:
+
+    RetentionStates state = RETENTION_IDLE;
+
+    // statistics
+    uint32_t passes  = 0;
+    uint32_t rolled  = 0; // files rolled up
+    uint32_t chunks  = 0; // RETENTION_CHUNK rows each
+    uint32_t removed = 0; // files deleted or archived
+    uint64_t freed   = 0; // bytes
+
+    // call between scan rounds
+    void step() {
+      switch( state ) {
+        case RETENTION_IDLE:
+          if( lastPass == 0 || millis() - lastPass > RETENTION_CHECK_INTERVAL ) {
+            beginScan();
+          }
+        break;
+        case RETENTION_SCAN:   scanStep();   break;
+        case RETENTION_ROLLUP: rollupStep(); break;
+        case RETENTION_RETIRE: retireStep(); break;
+      }
+    }
+
+    // next step() starts a new pass
+    void trigger() {
+      lastPass = 0;
+    }
+
+    void dumpStats() {
+      Serial.printf("[Retention] %s, max age: %dd, max size: %dMB, %s, passes: %d, rolled: %d files (%d chunks), removed: %d files (%lluKB)\n",
+        RetentionStateNames[state],
+        RETENTION_MAX_AGE,
+        RETENTION_MAX_SIZE,
+        RetentionArchive ? "archiving" : "deleting",
+        passes,
+        rolled,
+        chunks,
+        removed,
+        freed / 1024
+      );
+      for( uint8_t i=0; i<filesCount; i++ ) {
+        Serial.printf("  %-20s %8dKB %s\n", Files[i].name, Files[i].size / 1024, Files[i].rolled ? "rolled up" : "pending" );
+      }
+    }
+
+  private:
+
+    RetentionFile Files[RETENTION_MAX_FILES];
+    uint8_t  filesCount = 0;
+    uint8_t  cursor = 0; // file being processed
+    uint32_t lastRowId = 0; // rollup progress in the current file
+    bool     fileStarted = false; // lastRowId was loaded from the rolling table
+    unsigned long lastPass = 0;
+    File     root;
+
+    void beginScan() {
+      isQuerying = true;
+      root = BLE_FS.open("/");
+      isQuerying = false;
+      if( !root || !root.isDirectory() ) {
+        lastPass = millis();
+        return;
+      }
+      filesCount = 0;
+      state = RETENTION_SCAN;
+    }
+
+    // collects the daily files, except today's
+    void scanStep() {
+      isQuerying = true;
+      for( uint8_t i=0; i<RETENTION_DIR_STEP; i++ ) {
+        File file = root.openNextFile();
+        if( !file ) {
+          root.close();
+          isQuerying = false;
+          sortFiles();
+          cursor = 0;
+          lastRowId = 0;
+          fileStarted = false;
+          state = RETENTION_ROLLUP;
+          return;
+        }
+        const char* fileName = file.name();
+        const char* baseName = strrchr( fileName, '/' ) ? strrchr( fileName, '/' )+1 : fileName;
+        int y, m, d;
+        if( filesCount < RETENTION_MAX_FILES
+         && sscanf( baseName, "ble-%4d-%2d-%2d.db", &y, &m, &d ) == 3
+         && strlen( baseName ) == strlen("ble-YYYY-MM-DD.db")
+         && strcmp( baseName, DB.BLEMacsDbFSPath+1 ) != 0 ) { // today's file is in use
+          RetentionFile &entry = Files[filesCount++];
+          copy( entry.name, baseName, sizeof(entry.name)-1 );
+          entry.date   = y*10000 + m*100 + d;
+          entry.size   = file.size();
+          entry.rolled = false;
+        }
+      }
+      isQuerying = false;
+    }
+
+    // oldest first
+    void sortFiles() {
+      for( uint8_t i=1; i<filesCount; i++ ) {
+        RetentionFile item = Files[i];
+        int8_t j = i-1;
+        while( j >= 0 && Files[j].date > item.date ) {
+          Files[j+1] = Files[j];
+          j--;
+        }
+        Files[j+1] = item;
+      }
+    }
+
+    // rolls RETENTION_CHUNK rows of the current file into the weekly and monthly tables
+    void rollupStep() {
+      if( cursor >= filesCount ) {
+        cursor = 0;
+        state = RETENTION_RETIRE;
+        return;
+      }
+      RetentionFile &file = Files[cursor];
+      sqlite3 *summaryDB;
+      char query[1024];
+      isQuerying = true;
+      if( sqlite3_open( RETENTION_DB_SQLITE_PATH, &summaryDB ) != SQLITE_OK ) {
+        isQuerying = false;
+        log_e("Can't open %s, retention paused", RETENTION_DB_SQLITE_PATH);
+        sqlite3_close( summaryDB );
+        finishPass();
+        return;
+      }
+      DBStats.watch( summaryDB );
+      if( !fileStarted ) {
+        exec( summaryDB, retentionCreateTablesQuery );
+        sprintf( query, "SELECT rows FROM rolled WHERE file='%s'", file.name );
+        found = false;
+        exec( summaryDB, query, FoundCallback );
+        if( found ) { // rolled up by a previous pass
+          file.rolled = true;
+          nextFile( summaryDB );
+          return;
+        }
+        // interrupted by a reboot ?
+        sprintf( query, "SELECT last_rowid FROM rolling WHERE file='%s'", file.name );
+        lastRowId = 0;
+        exec( summaryDB, query, LastRowIdCallback );
+        if( lastRowId > 0 ) {
+          log_w("Resuming the rollup of %s after rowid %u", file.name, lastRowId);
+        }
+        fileStarted = true;
+      }
+      sprintf( query, "ATTACH DATABASE '/%s/%s' AS daily", BLE_FS_TYPE, file.name );
+      if( exec( summaryDB, query ) != SQLITE_OK ) {
+        nextFile( summaryDB ); // unreadable, will never be removed
+        return;
+      }
+      char fileDate[11];
+      sprintf( fileDate, "%04d-%02d-%02d", file.date/10000, (file.date/100)%100, file.date%100 );
+      uint32_t chunkEnd = lastRowId + RETENTION_CHUNK;
+      exec( summaryDB, "BEGIN" );
+      sprintf( query, retentionRollupTemplate, "weekly", "%Y-W%W", fileDate, lastRowId, chunkEnd );
+      bool ok = exec( summaryDB, query ) == SQLITE_OK;
+      sprintf( query, retentionRollupTemplate, "monthly", "%Y-%m", fileDate, lastRowId, chunkEnd );
+      ok = ok && exec( summaryDB, query ) == SQLITE_OK;
+      // any rows left ?
+      sprintf( query, "SELECT rowid FROM daily.blemacs WHERE rowid > %u LIMIT 1", chunkEnd );
+      found = false;
+      ok = ok && exec( summaryDB, query, FoundCallback ) == SQLITE_OK;
+      if( !ok ) {
+        exec( summaryDB, "ROLLBACK" );
+        exec( summaryDB, "DETACH DATABASE daily" );
+        nextFile( summaryDB );
+        return;
+      }
+      if( found ) {
+        sprintf( query, "INSERT OR REPLACE INTO rolling( file, last_rowid ) VALUES( '%s', %u )", file.name, chunkEnd );
+        ok = exec( summaryDB, query ) == SQLITE_OK;
+      } else {
+        sprintf( query, "INSERT OR REPLACE INTO rolled( file, rows, rolled_at ) VALUES( '%s', (SELECT COUNT(*) FROM daily.blemacs), %u )", file.name, nowDateTime.unixtime() );
+        ok = exec( summaryDB, query ) == SQLITE_OK;
+        sprintf( query, "DELETE FROM rolling WHERE file='%s'", file.name );
+        ok = ok && exec( summaryDB, query ) == SQLITE_OK;
+      }
+      if( !ok ) { // the chunk and its progress go together
+        exec( summaryDB, "ROLLBACK" );
+        exec( summaryDB, "DETACH DATABASE daily" );
+        nextFile( summaryDB );
+        return;
+      }
+      exec( summaryDB, "COMMIT" );
+      exec( summaryDB, "DETACH DATABASE daily" );
+      chunks++;
+      if( found ) {
+        lastRowId = chunkEnd;
+        sqlite3_close( summaryDB );
+        isQuerying = false;
+        return;
+      }
+      log_w("Rolled up %s", file.name);
+      file.rolled = true;
+      rolled++;
+      nextFile( summaryDB );
+    }
+
+    void nextFile( sqlite3 *summaryDB ) {
+      sqlite3_close( summaryDB );
+      isQuerying = false;
+      cursor++;
+      lastRowId = 0;
+      fileStarted = false;
+    }
+
+    // removes one file per step, oldest first, rolled up files only
+    void retireStep() {
+      uint64_t totalSize = 0;
+      for( uint8_t i=0; i<filesCount; i++ ) {
+        totalSize += Files[i].size;
+      }
+      uint32_t today = 0;
+      if( TimeIsSet ) {
+        today = nowDateTime.year()*10000 + nowDateTime.month()*100 + nowDateTime.day();
+      }
+      for( uint8_t i=0; i<filesCount; i++ ) {
+        RetentionFile &file = Files[i];
+        if( !file.rolled || file.size == 0 ) continue;
+        bool tooOld = false;
+        if( today > 0 && RETENTION_MAX_AGE > 0 ) {
+          DateTime fileDate( file.date/10000, (file.date/100)%100, file.date%100, 0, 0, 0 );
+          tooOld = ( nowDateTime.unixtime() - fileDate.unixtime() ) / 86400 > RETENTION_MAX_AGE;
+        }
+        bool tooBig = RETENTION_MAX_SIZE > 0 && totalSize > (uint64_t)RETENTION_MAX_SIZE*1024*1024;
+        if( !tooOld && !tooBig ) continue;
+        retire( file );
+        return;
+      }
+      finishPass();
+    }
+
+    void retire( RetentionFile &file ) {
+      char path[32], archivePath[48];
+      sprintf( path, "/%s", file.name );
+      isQuerying = true;
+      bool done;
+      if( RetentionArchive ) {
+        if( !BLE_FS.exists( RETENTION_ARCHIVE_DIR ) ) {
+          BLE_FS.mkdir( RETENTION_ARCHIVE_DIR );
+        }
+        sprintf( archivePath, RETENTION_ARCHIVE_DIR "/%s", file.name );
+        done = BLE_FS.rename( path, archivePath );
+      } else {
+        done = BLE_FS.remove( path );
+      }
+      isQuerying = false;
+      if( !done ) {
+        log_e("Can't %s %s", RetentionArchive ? "archive" : "remove", path);
+        file.rolled = false; // skip it for this pass
+        return;
+      }
+      log_w("%s %s (%d KB)", RetentionArchive ? "Archived" : "Removed", path, file.size / 1024);
+      removed++;
+      freed += file.size;
+      file.size = 0;
+    }
+
+    void finishPass() {
+      state = RETENTION_IDLE;
+      lastPass = millis();
+      passes++;
+    }
+
+    bool found = false;
+
+    int exec( sqlite3 *db, const char* sql, int (*callback)(void*,int,char**,char**) = NULL ) {
+      int rc = sqlite3_exec( db, sql, callback, (void*)this, &zErrMsg );
+      if( rc != SQLITE_OK ) {
+        log_e("Retention query failed (%s): %s", zErrMsg ? zErrMsg : "unknown error", sql);
+        sqlite3_free( zErrMsg );
+      }
+      return rc;
+    }
+
+    static int FoundCallback( void *self, int argc, char **argv, char **azColName ) {
+      ((RetentionUtils*)self)->found = true;
+      return 0;
+    }
+
+    static int LastRowIdCallback( void *self, int argc, char **argv, char **azColName ) {
+      if( argc > 0 && argv[0] ) {
+        ((RetentionUtils*)self)->lastRowId = strtoul( argv[0], NULL, 10 );
+      }
+      return 0;
+    }
+
+};
+
+
+RetentionUtils Retention;
@@ -0,0 +1,248 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * Salvage
+ *
+ * When DB.recoverDB() quarantines a broken collector file, the readable rows
+ * are copied back in two stages:
+ *
+ * - extract: a background task ATTACHes the quarantined file to a scratch
+ *   DB and copies blemacs rowid ranges, SALVAGE_CHUNK rows at a time. When a
+ *   range hits a bad page, its rows are retried one by one so only the rows
+ *   stored on unreadable pages are lost. The collector DB is never touched.
+ * - merge: between scan rounds, step() moves SALVAGE_CHUNK scratch rows into
+ *   the collector DB, skipping addresses collected since the recovery.
+ *
+ */
+
+#define SALVAGE_CHUNK 100 // rows per range
+#define SALVAGE_MIN_ROW_SIZE 32 // bytes, bounds the rowid walk when MAX(rowid) is unreadable
+
+// %s = field names, %s = field names, %u = first rowid, %u = last rowid
+#define salvageExtractTemplate "INSERT INTO blemacs(%s) SELECT %s FROM broken.blemacs WHERE rowid > %u AND rowid <= %u"
+#define salvageMergeTemplate "INSERT INTO main.blemacs(%s) SELECT %s FROM salvage.blemacs WHERE rowid > %u AND rowid <= %u AND address NOT IN (SELECT address FROM main.blemacs)"
+// %u = first rowid, %u = last rowid, the rows salvageMergeTemplate is about to insert
+#define salvageNewRowsTemplate "SELECT address, name, ouiname, manufname FROM salvage.blemacs WHERE rowid > %u AND rowid <= %u AND address NOT IN (SELECT address FROM main.blemacs)"
+
+
+enum SalvageStates {
+  SALVAGE_IDLE = 0,
+  SALVAGE_EXTRACT,
+  SALVAGE_MERGE
+};
+
+static const char* SalvageStateNames[] = { "idle", "extracting", "merging" };
+
+
+class SalvageUtils {
+  public:
+
+    volatile SalvageStates state = SALVAGE_IDLE;
+
+    // statistics, last run
+    uint32_t extracted = 0; // rows copied out of the quarantined file
+    uint32_t lost = 0; // rowids in unreadable ranges
+    uint32_t merged = 0; // rows added to the collector DB
+    uint32_t extractMillis = 0;
+
+    // call between scan rounds
+    void step() {
+      switch( state ) {
+        case SALVAGE_IDLE:
+          if( DB.salvagePending ) {
+            DB.salvagePending = false;
+            begin( DB.quarantinePath );
+          }
+        break;
+        case SALVAGE_EXTRACT: /* salvageTask is busy */ break;
+        case SALVAGE_MERGE: mergeStep(); break;
+      }
+    }
+
+    void dumpStats() {
+      Serial.printf("[Recovery] recoveries: %d, last downtime: %d ms\n", DB.recoveries, DB.recoveryMillis );
+      if( isEmpty( sourcePath ) ) return;
+      Serial.printf("[Salvage] %s, source: %s, extracted: %d rows in %d ms, lost: %d rowids, merged: %d rows\n",
+        SalvageStateNames[state],
+        sourcePath,
+        extracted,
+        extractMillis,
+        lost,
+        merged
+      );
+    }
+
+  private:
+
+    char sourcePath[48] = {'\0'}; // quarantined file
+    char scratchPath[56] = {'\0'}; // sourcePath + ".salvage"
+    char query[768];
+    uint32_t lastRowId = 0; // merge progress
+    uint32_t maxRowId = 0;
+
+    void begin( const char* quarantinePath ) {
+      copy( sourcePath, quarantinePath, sizeof(sourcePath)-1 );
+      sprintf( scratchPath, "%s.salvage", sourcePath );
+      extracted = 0;
+      lost = 0;
+      merged = 0;
+      lastRowId = 0;
+      state = SALVAGE_EXTRACT;
+      xTaskCreatePinnedToCore( salvageTask, "salvageTask", 8192, this, 1, NULL, 1 ); /* last = Task Core */
+    }
+
+    static void salvageTask( void * param ) {
+      SalvageUtils* salvage = (SalvageUtils*)param;
+      if( salvage->extract() ) {
+        salvage->state = SALVAGE_MERGE;
+      } else {
+        salvage->state = SALVAGE_IDLE;
+      }
+      vTaskDelete( NULL );
+    }
+
+    // runs in salvageTask, only touches the quarantined and scratch files
+    bool extract() {
+      unsigned long start = millis();
+      char sqlitePath[64];
+      sprintf( sqlitePath, "/%s%s", BLE_FS_TYPE, scratchPath );
+      BLE_FS.remove( scratchPath ); // leftover from an interrupted run
+      sqlite3 *scratchDB;
+      if( sqlite3_open( sqlitePath, &scratchDB ) != SQLITE_OK ) {
+        log_e("Can't create %s", scratchPath);
+        sqlite3_close( scratchDB );
+        return false;
+      }
+      sqlite3_exec( scratchDB, "PRAGMA synchronous=OFF", NULL, NULL, NULL ); // scratch data
+      sqlite3_exec( scratchDB, createTableQuery, NULL, NULL, NULL );
+      sprintf( query, "ATTACH DATABASE '/%s%s' AS broken", BLE_FS_TYPE, sourcePath );
+      if( sqlite3_exec( scratchDB, query, NULL, NULL, NULL ) != SQLITE_OK ) {
+        log_e("Can't attach %s: %s, nothing to salvage", sourcePath, sqlite3_errmsg( scratchDB ) );
+        sqlite3_close( scratchDB );
+        BLE_FS.remove( scratchPath );
+        return false;
+      }
+      uint32_t lastRow = readMaxRowId( scratchDB, "broken.blemacs" );
+      if( lastRow == 0 ) {
+        File source = BLE_FS.open( sourcePath );
+        lastRow = source.size() / SALVAGE_MIN_ROW_SIZE;
+        source.close();
+        log_w("Can't read the last rowid of %s, walking %d rowids", sourcePath, lastRow);
+      }
+      for( uint32_t from = 0; from < lastRow; from += SALVAGE_CHUNK ) {
+        if( copyRange( scratchDB, from, from + SALVAGE_CHUNK ) ) {
+          extracted += sqlite3_changes( scratchDB );
+        } else {
+          // bad page somewhere in the range, keep what can be read
+          for( uint32_t rowid = from + 1; rowid <= from + SALVAGE_CHUNK; rowid++ ) {
+            if( copyRange( scratchDB, rowid - 1, rowid ) ) {
+              extracted += sqlite3_changes( scratchDB );
+            } else {
+              lost++;
+            }
+          }
+        }
+        vTaskDelay(1);
+      }
+      sqlite3_exec( scratchDB, "DETACH DATABASE broken", NULL, NULL, NULL );
+      sqlite3_close( scratchDB );
+      extractMillis = millis() - start;
+      log_w("Salvaged %d rows from %s (%d lost) in %d ms", extracted, sourcePath, lost, extractMillis);
+      if( extracted == 0 ) {
+        BLE_FS.remove( scratchPath );
+        return false;
+      }
+      maxRowId = extracted; // fresh table, rowids are 1..extracted
+      return true;
+    }
+
+    bool copyRange( sqlite3* scratchDB, uint32_t from, uint32_t to ) {
+      sprintf( query, salvageExtractTemplate, BLEMAC_INSERT_FIELDNAMES, BLEMAC_INSERT_FIELDNAMES, from, to );
+      return sqlite3_exec( scratchDB, query, NULL, NULL, NULL ) == SQLITE_OK;
+    }
+
+    static uint32_t readMaxRowId( sqlite3* db, const char* table ) {
+      char maxQuery[64];
+      sprintf( maxQuery, "SELECT MAX(rowid) FROM %s", table );
+      uint32_t maxRowId = 0;
+      sqlite3_stmt *stmt;
+      if( sqlite3_prepare_v2( db, maxQuery, -1, &stmt, NULL ) == SQLITE_OK ) {
+        if( sqlite3_step( stmt ) == SQLITE_ROW ) {
+          maxRowId = sqlite3_column_int( stmt, 0 );
+        }
+        sqlite3_finalize( stmt );
+      }
+      return maxRowId;
+    }
+
+    // runs on the scan task, like every other collector DB write
+    void mergeStep() {
+      DB.open( DBUtils::BLE_COLLECTOR_DB, false );
+      sprintf( query, "ATTACH DATABASE '/%s%s' AS salvage", BLE_FS_TYPE, scratchPath );
+      if( sqlite3_exec( DB.BLECollectorDB, query, NULL, NULL, NULL ) != SQLITE_OK ) {
+        log_e("Can't attach %s: %s", scratchPath, sqlite3_errmsg( DB.BLECollectorDB ) );
+        DB.close( DBUtils::BLE_COLLECTOR_DB );
+        state = SALVAGE_IDLE;
+        return;
+      }
+      // onScanBatchLookup() trusts the device index, it must know every row merged here
+      sprintf( query, salvageNewRowsTemplate, lastRowId, lastRowId + SALVAGE_CHUNK );
+      sqlite3_stmt *stmt;
+      if( sqlite3_prepare_v2( DB.BLECollectorDB, query, -1, &stmt, NULL ) == SQLITE_OK ) {
+        while( sqlite3_step( stmt ) == SQLITE_ROW ) {
+          BLEIndex.touch( (const char*)sqlite3_column_text( stmt, 0 ), (const char*)sqlite3_column_text( stmt, 1 ), (const char*)sqlite3_column_text( stmt, 2 ), (const char*)sqlite3_column_text( stmt, 3 ) );
+        }
+        sqlite3_finalize( stmt );
+      }
+      sprintf( query, salvageMergeTemplate, BLEMAC_INSERT_FIELDNAMES, BLEMAC_INSERT_FIELDNAMES, lastRowId, lastRowId + SALVAGE_CHUNK );
+      if( sqlite3_exec( DB.BLECollectorDB, query, NULL, NULL, NULL ) == SQLITE_OK ) {
+        merged += sqlite3_changes( DB.BLECollectorDB );
+      } else {
+        log_e("Merging salvaged rows failed: %s", sqlite3_errmsg( DB.BLECollectorDB ) );
+      }
+      sqlite3_exec( DB.BLECollectorDB, "DETACH DATABASE salvage", NULL, NULL, NULL );
+      DB.close( DBUtils::BLE_COLLECTOR_DB );
+      lastRowId += SALVAGE_CHUNK;
+      if( lastRowId >= maxRowId ) {
+        isQuerying = true;
+        BLE_FS.remove( scratchPath );
+        isQuerying = false;
+        entries = DB.getEntries();
+        log_w("Merged %d salvaged rows into %s, %s kept for inspection", merged, DB.BLEMacsDbFSPath, sourcePath);
+        state = SALVAGE_IDLE;
+      }
+    }
+
+};
+
+
+SalvageUtils Salvage;
@@ -0,0 +1,305 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * Adaptive scan parameters
+ *
+ * Replaces the SCAN_DURATION +1/-1 nudges with a feedback controller fed
+ * with per-round measurements (smoothed with an EWMA):
+ *
+ *  - arrival rate: devices stored per second of scan
+ *  - discovery rate: devices new to the DB per second of round
+ *  - load: share of the round spent in the after-scan pipeline (CPU + DB)
+ *
+ * Duration is steered toward the time needed to fill all the scan slots at
+ * the current arrival rate (a longer round would drop devices). The interval
+ * is tuned for the discovery rate (new devices per second of round, pipeline
+ * included; returning devices don't count) by hill climbing: each interval
+ * is held for a few rounds, the climb keeps its direction while the pooled
+ * rate improves, and turns back with a smaller step when it drops. The duty cycle
+ * (window/interval) and active mode are reduced when the pipeline load
+ * exceeds its budget.
+ *
+ * No Arduino dependency on purpose: it can be driven on the host by a
+ * simulated arrival process.
+ *
+ */
+
+struct ScanRoundMeasure {
+  uint32_t scanMillis    = 0; // time spent scanning
+  uint32_t processMillis = 0; // time spent in the after-scan pipeline (populate/exists/render/propagate)
+  uint16_t devices       = 0; // devices stored during the scan
+  uint16_t dbWrites      = 0; // DB insertions during the pipeline
+  uint16_t newDevices    = 0; // addresses new to the DB this round
+};
+
+struct ScanParams {
+  uint16_t duration = 20;   // seconds
+  uint16_t interval = 0x50; // 0.625ms units
+  uint16_t window   = 0x30; // 0.625ms units
+  bool     active   = true;
+};
+
+
+class ScanController {
+  public:
+
+    float alpha        = 0.3;  // EWMA smoothing factor
+    float gain         = 0.5;  // how fast duration moves toward its target
+    float maxLoad      = 0.5;  // pipeline time budget (share of the round)
+    float maxDBWrites  = 2.0;  // DB writes per second budget
+    float minDuty      = 0.25; // lowest window/interval ratio
+    float maxDuty      = 1.0;  // highest window/interval ratio
+    float intervalStep = 0.1;  // relative interval change per round, the sign is the direction
+    float minIntervalStep = 0.02; // smallest step once the climb oscillates around the peak
+    float maxIntervalStep = 0.1;  // largest step while the rate keeps improving
+    uint16_t dwellRounds  = 3;    // rounds per interval before judging it
+    uint16_t minInterval = 0x20; // 20ms
+    uint16_t maxInterval = 0xA0; // 100ms
+
+    float arrivalRate  = 0; // smoothed devices per scan second
+    float discoveryRate = 0; // smoothed new devices per round second (scan + pipeline)
+    float load         = 0; // smoothed pipeline share
+    float writeRate    = 0; // smoothed DB writes per round second
+    float duty         = 0.6; // current window/interval ratio
+    bool  isOverloaded = false; // pipeline or DB over budget on the last round
+    uint32_t rounds    = 0;
+
+    ScanController( uint16_t _minDuration, uint16_t _maxDuration, uint16_t _slots ) :
+      minDuration( _minDuration ), maxDuration( _maxDuration ), slots( _slots ) { }
+
+    void begin( const ScanParams &initial ) {
+      params = initial;
+      duty = (float)params.window / params.interval;
+      durationF = params.duration;
+      intervalF = params.interval;
+    }
+
+    const ScanParams &next( const ScanRoundMeasure &m ) {
+      float scanSeconds  = m.scanMillis > 0 ? m.scanMillis / 1000.0 : 0.001;
+      float roundSeconds = ( m.scanMillis + m.processMillis ) / 1000.0;
+      if( roundSeconds <= 0 ) roundSeconds = 0.001;
+
+      smooth( arrivalRate,   m.devices / scanSeconds );
+      smooth( discoveryRate, m.newDevices / roundSeconds );
+      smooth( load,          m.processMillis / 1000.0 / roundSeconds );
+      smooth( writeRate,     m.dbWrites / roundSeconds );
+      rounds++;
+
+      // duration: time to fill all slots at the current arrival rate, with some margin
+      float target = maxDuration;
+      if( arrivalRate > 0 ) {
+        target = ( slots / arrivalRate ) * 1.2;
+      }
+      durationF += gain * ( target - durationF );
+      durationF = clamp( durationF, minDuration, maxDuration );
+      params.duration = (uint16_t)( durationF + 0.5 );
+
+      // interval: hill climbing on the discovery rate. One round is too noisy to judge a step
+      // (and the EWMA lags behind the interval it measures), so each interval is held for
+      // dwellRounds and judged on its pooled rate. A drop turns back with half the step so the
+      // climb settles around the peak, a clear gain grows the step again
+      dwellDevices += m.newDevices;
+      dwellSeconds += roundSeconds;
+      if( ++dwellCount >= dwellRounds ) {
+        float dwellRate = dwellDevices / dwellSeconds;
+        float stepSize = intervalStep < 0 ? -intervalStep : intervalStep;
+        if( lastDiscoveryRate > 0 && dwellRate < lastDiscoveryRate * 0.98 ) {
+          stepSize = clamp( stepSize * 0.5, minIntervalStep, maxIntervalStep );
+          intervalStep = intervalStep > 0 ? -stepSize : stepSize;
+        } else if( lastDiscoveryRate > 0 && dwellRate > lastDiscoveryRate * 1.02 ) {
+          stepSize = clamp( stepSize * 1.2, minIntervalStep, maxIntervalStep );
+          intervalStep = intervalStep > 0 ? stepSize : -stepSize;
+        }
+        lastDiscoveryRate = dwellRate;
+        dwellDevices = 0;
+        dwellSeconds = 0;
+        dwellCount   = 0;
+        intervalF = clamp( intervalF * ( 1 + intervalStep ), minInterval, maxInterval );
+        // a bound gives no feedback (the rate can't drop), come back from it
+        if( intervalF <= minInterval || intervalF >= maxInterval ) {
+          intervalStep = intervalF <= minInterval ? stepSize : -stepSize;
+        }
+      }
+      params.interval = (uint16_t)( intervalF + 0.5 );
+
+      // duty cycle: back off when the pipeline or the DB can't keep up, otherwise listen more
+      isOverloaded = load > maxLoad || writeRate > maxDBWrites;
+      if( isOverloaded ) {
+        duty *= 0.8;
+      } else if( m.devices < slots ) {
+        duty *= 1.1; // slots left unfilled: listen more
+      }
+      duty = clamp( duty, minDuty, maxDuty );
+      params.window = (uint16_t)( params.interval * duty );
+      if( params.window < 4 ) params.window = 4; // controller minimum (2.5ms)
+
+      // passive scan halves the air time per device and spares scan responses
+      params.active = !isOverloaded;
+
+      return params;
+    }
+
+    const ScanParams &get() { return params; }
+
+    bool overloaded() {
+      return isOverloaded;
+    }
+
+  private:
+
+    uint16_t minDuration;
+    uint16_t maxDuration;
+    uint16_t slots;
+    float durationF = 20;
+    float intervalF = 0x50;
+    float lastDiscoveryRate = 0; // pooled over the dwell of the previous interval
+    uint32_t dwellDevices = 0;
+    float dwellSeconds = 0;
+    uint16_t dwellCount = 0;
+    ScanParams params;
+
+    void smooth( float &avg, float sample ) {
+      avg = rounds == 0 ? sample : alpha * sample + ( 1 - alpha ) * avg;
+    }
+
+    static float clamp( float value, float low, float high ) {
+      if( value < low ) return low;
+      if( value > high ) return high;
+      return value;
+    }
+
+};
+
+
+
+/*
+ * Hybrid passive/active scan scheduling
+ *
+ * Rounds are passive by default. Unseen devices, or devices still missing
+ * a name/uuid after populate, request a short active burst so their scan
+ * response gets captured. Every address is probed once (small ring of
+ * hashes), and bursts are capped to a share of the scan time so a crowd of
+ * random/anonymous addresses can't keep the scanner active.
+ *
+ */
+
+#ifndef SCAN_PROBED_RING_SIZE
+#define SCAN_PROBED_RING_SIZE 32 // recently probed addresses
+#endif
+
+class ScanModeScheduler {
+  public:
+
+    uint16_t burstDuration  = 5;   // seconds, active burst length
+    float    maxActiveShare = 0.3; // active time budget (share of total scan time)
+
+    // statistics
+    uint32_t activeMillis  = 0;
+    uint32_t passiveMillis = 0;
+    uint32_t bursts        = 0;
+    uint32_t requests      = 0;
+    uint32_t latencySum    = 0; // ms between first sighting and the end of the burst that probed it
+    uint32_t latencyCount  = 0;
+    uint32_t latencyMax    = 0;
+
+    // a device is unseen or lacks a name/uuid, firstSeen is a millis() timestamp
+    void request( const char* address, uint32_t firstSeen ) {
+      uint32_t addressHash = hash( address );
+      for( uint16_t i=0; i<SCAN_PROBED_RING_SIZE; i++ ) {
+        if( probed[i] == addressHash ) return; // already had its chance
+      }
+      probed[probedIndex++] = addressHash;
+      probedIndex = probedIndex % SCAN_PROBED_RING_SIZE;
+      pendingCount++;
+      pendingFirstSeenSum += firstSeen;
+      if( pendingOldest == 0 || firstSeen < pendingOldest ) {
+        pendingOldest = firstSeen;
+      }
+      requests++;
+    }
+
+    // decides the mode of the next round
+    bool nextIsActive( bool overloaded ) {
+      if( pendingCount == 0 || overloaded ) return false;
+      return activeShare() < maxActiveShare;
+    }
+
+    void roundDone( bool wasActive, uint32_t scanMillis, uint32_t now ) {
+      if( !wasActive ) {
+        passiveMillis += scanMillis;
+        return;
+      }
+      activeMillis += scanMillis;
+      bursts++;
+      if( pendingCount > 0 ) {
+        latencySum   += pendingCount * now - pendingFirstSeenSum;
+        latencyCount += pendingCount;
+        if( now - pendingOldest > latencyMax ) {
+          latencyMax = now - pendingOldest;
+        }
+      }
+      pendingCount        = 0;
+      pendingFirstSeenSum = 0;
+      pendingOldest       = 0;
+    }
+
+    float activeShare() {
+      uint32_t total = activeMillis + passiveMillis;
+      return total > 0 ? (float)activeMillis / total : 0;
+    }
+
+    uint32_t averageLatency() {
+      return latencyCount > 0 ? latencySum / latencyCount : 0;
+    }
+
+    uint16_t pending() {
+      return pendingCount;
+    }
+
+  private:
+
+    uint32_t probed[SCAN_PROBED_RING_SIZE] = {0};
+    uint16_t probedIndex = 0;
+    uint16_t pendingCount = 0;
+    uint32_t pendingFirstSeenSum = 0;
+    uint32_t pendingOldest = 0;
+
+    static uint32_t hash( const char* str ) {
+      uint32_t h = 2166136261UL;
+      while( *str ) {
+        h ^= (uint8_t)*str++;
+        h *= 16777619UL;
+      }
+      return h;
+    }
+
+};
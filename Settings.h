@@ -52,8 +52,24 @@ int8_t timeZone = 1; // 1 = GMT+1, 2 = GMT+2, etc
 const char* NTP_SERVER = "europe.pool.ntp.org";
 
 byte SCAN_DURATION = 20; // seconds, will be adjusted upon scan results
+bool ScanAdaptive = true; // let ScanTuner adjust duration, interval, window and active/passive mode
+bool ScanHybrid = true; // mostly passive scans, short active bursts when unseen/unnamed devices show up
 #define MIN_SCAN_DURATION 10 // seconds min
 #define MAX_SCAN_DURATION 120 // seconds max
+bool     ScanActive   = false; // active scan uses more power, but get results faster
+uint16_t ScanInterval = 0x50; // in 0.625ms units
+uint16_t ScanWindow   = 0x30; // in 0.625ms units
+byte     ScanDuplMode = 0; // 0 = off, 1 = controller drops repeated adverts (see ScanDuplicateModes in BLE.h)
+uint16_t SCAN_DUPL_RESET_PERIOD = 15; // seconds, controller duplicate filter reset period (= per-device refresh cadence)
+uint16_t DUPFILTER_WINDOW = 60; // seconds, repeated adverts within this window only bump hits/rssi (0 = disabled)
+byte DB_PROFILE = 1; // 0 = safe, 1 = balanced, 2 = fast, see DBProfiles in DB.h (persistent)
+uint16_t SIGHTINGS_INTERVAL = 60; // seconds, at most one sighting row per device per interval (0 = disabled)
+uint16_t RETENTION_MAX_AGE = 30; // days, rolled up daily DB files older than this are removed (0 = no limit)
+uint16_t RETENTION_MAX_SIZE = 1024; // MB, oldest rolled up daily DB files are removed above this (0 = no limit)
+bool RetentionArchive = false; // move retired daily DB files to /archive instead of deleting them
+byte STORAGE_BACKEND = 0; // 0 = SQLite, 1 = append-only sighting log, see BLEStorage.h (persistent)
+#define MEMDB_ENABLED true // PSRAM boards only: today's DB lives in PSRAM and is backed up to the SD
+uint16_t MEMDB_MAX_LOSS = 300; // seconds, max data loss window of the PSRAM DB (0 = hourly/daily/restart only)
 #define VENDORCACHE_SIZE 16 // use some heap to cache vendor query responses, min = 5, max = 256
 #define OUICACHE_SIZE 8 // use some heap to cache mac query responses, min = 16, max = 4096
 #define MAX_FIELD_LEN 32 // max chars returned by field
@@ -197,6 +213,9 @@ Preferences preferences;
 // SQLite stack
 #include <sqlite3.h> // https://github.com/siara-cc/esp32_arduino_sqlite3_lib
 
+// file sharing hashes
+#include <mbedtls/sha256.h>
+
 // used to disable brownout detector
 #include "soc/soc.h"
 #include "soc/rtc_cntl_reg.h"
@@ -227,9 +246,26 @@ static byte prune_trigger   = 0; // incremented on every insertion, reset on pru
 
 // load stack
 #include "BLECache.h" // data struct
+#include "DupFilter.h" // duplicate adverts filter core
+#include "ScanController.h" // adaptive scan parameters
+#include "LatencyStats.h" // per-stage latency histograms
+#include "DBStats.h" // sqlite I/O counters
 #include "ScrollPanel.h" // scrolly methods
 #include "TimeUtils.h"
 #include "UI.h"
 #include "DB.h"
+#include "BLEIndex.h" // long-term device index
+#include "BLEStorage.h" // storage backends
+#include "Sightings.h" // per-sighting time series
+#include "BLEFilter.h" // duplicate adverts filter
+#include "Retention.h" // daily DB rollup and retention
+#include "Export.h" // NDJSON/CSV export over serial
+#include "Query.h" // on-device query console
+#include "Salvage.h" // row salvage from quarantined DBs
+#include "Compression.h" // LZSS stream codec for file sharing
+#include "RecordSync.h" // record-level merge between collectors
+#include "FileSharingProtocol.h" // binary messages on the file sharing route
+#include "FileSharingWindow.h" // credit window for the file sharing data chunks
+#include "FileSharingDelta.h" // block hashes and patches for the delta sync
 #include "BLEFileSharing.h"
 #include "BLE.h"
@@ -0,0 +1,153 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * Per-sighting time series
+ *
+ * blemacs only keeps cumulative hits, this keeps individual sightings in
+ * today's collector DB:
+ *
+ *   devices( id INTEGER PRIMARY KEY, address TEXT UNIQUE ) -- dimension
+ *   sightings( device_id INTEGER, ts INTEGER, rssi INTEGER )
+ *
+ * Sightings are downsampled to one per device per SIGHTINGS_INTERVAL
+ * seconds, queued during the scan round and written in a single
+ * transaction before the next one.
+ *
+ */
+
+#define SIGHTINGS_PENDING_SIZE 32 // flushed early when full
+#define SIGHTINGS_DOWNSAMPLE_SLOTS 256 // direct-mapped last-seen timestamps
+
+#define sightingsCreateTablesQuery "CREATE TABLE IF NOT EXISTS devices( id INTEGER PRIMARY KEY, address TEXT UNIQUE ); \
+CREATE TABLE IF NOT EXISTS sightings( device_id INTEGER, ts INTEGER, rssi INTEGER ); \
+CREATE INDEX IF NOT EXISTS sightings_device_ts ON sightings( device_id, ts )"
+#define sightingsDeviceTemplate "INSERT OR IGNORE INTO devices( address ) VALUES( '%s' )"
+#define sightingsInsertTemplate "INSERT INTO sightings( device_id, ts, rssi ) SELECT id, %u, %d FROM devices WHERE address='%s'"
+
+
+struct PendingSighting {
+  char     address[MAC_LEN+1];
+  uint32_t ts   = 0;
+  int16_t  rssi = 0;
+};
+
+struct DownsampleSlot {
+  uint32_t hash = 0;
+  uint32_t ts   = 0;
+};
+
+
+class SightingsUtils {
+  public:
+
+    // statistics
+    uint32_t added        = 0;
+    uint32_t downsampled  = 0; // dropped, too close to the previous sighting
+    uint32_t written      = 0;
+    uint32_t transactions = 0;
+
+    void add( const char* address, int rssi ) {
+      if( SIGHTINGS_INTERVAL == 0 || isEmpty( address ) ) return;
+      uint32_t ts = nowDateTime.unixtime();
+      uint32_t hash = addressHash( address );
+      DownsampleSlot &slot = Slots[hash % SIGHTINGS_DOWNSAMPLE_SLOTS];
+      if( slot.hash == hash && ts - slot.ts < SIGHTINGS_INTERVAL ) {
+        downsampled++;
+        return;
+      }
+      slot.hash = hash; // a collision only means an extra row
+      slot.ts   = ts;
+      if( pendingCount >= SIGHTINGS_PENDING_SIZE ) {
+        flush();
+      }
+      PendingSighting &sighting = Pending[pendingCount++];
+      copy( sighting.address, address, MAC_LEN+1 );
+      sighting.ts   = ts;
+      sighting.rssi = rssi;
+      added++;
+    }
+
+    void flush() {
+      if( pendingCount == 0 ) return;
+      char query[sizeof(sightingsInsertTemplate) + MAC_LEN + 24];
+      DB.open( DBUtils::BLE_COLLECTOR_DB, false );
+      if( strcmp( tablesPath, DB.BLEMacsDbFSPath ) != 0 ) {
+        // first flush on this DB file
+        if( DB.DBExec( DB.BLECollectorDB, sightingsCreateTablesQuery ) == SQLITE_OK ) {
+          copy( tablesPath, DB.BLEMacsDbFSPath, sizeof(tablesPath)-1 );
+        }
+      }
+      DB.DBExec( DB.BLECollectorDB, "BEGIN" );
+      for( uint8_t i=0; i<pendingCount; i++ ) {
+        sprintf( query, sightingsDeviceTemplate, Pending[i].address );
+        DB.DBExec( DB.BLECollectorDB, query );
+        sprintf( query, sightingsInsertTemplate, Pending[i].ts, Pending[i].rssi, Pending[i].address );
+        if( DB.DBExec( DB.BLECollectorDB, query ) == SQLITE_OK ) {
+          written++;
+        }
+      }
+      DB.DBExec( DB.BLECollectorDB, "COMMIT" );
+      DB.close( DBUtils::BLE_COLLECTOR_DB );
+      transactions++;
+      pendingCount = 0;
+    }
+
+    void dumpStats() {
+      Serial.printf("[Sightings] interval: %ds, added: %d, downsampled: %d, written: %d in %d transactions, pending: %d\n",
+        SIGHTINGS_INTERVAL,
+        added,
+        downsampled,
+        written,
+        transactions,
+        pendingCount
+      );
+    }
+
+  private:
+
+    PendingSighting Pending[SIGHTINGS_PENDING_SIZE];
+    uint8_t pendingCount = 0;
+    DownsampleSlot Slots[SIGHTINGS_DOWNSAMPLE_SLOTS];
+    char tablesPath[32] = {'\0'}; // DB file where the tables were last checked
+
+    static uint32_t addressHash( const char* address ) {
+      uint32_t hash = 2166136261UL;
+      for( const char* c=address; *c; c++ ) {
+        hash = ( hash ^ (uint8_t)*c ) * 16777619UL;
+      }
+      return hash | 1; // 0 = empty slot
+    }
+
+};
+
+
+SightingsUtils Sightings;
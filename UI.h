@@ -209,7 +209,11 @@ class UIUtils {
         tft_fillGradientHRect( 0, headerHeight, Out.width/2, scrollHeight, colorstart, colorend );
         tft_fillGradientHRect( Out.width/2, headerHeight, Out.width/2, scrollHeight, colorend, colorstart );
         // clear heap map
-        for (uint16_t i = 0; i < heapMapBuffLen; i++) heapmap[i] = 0;
+        for (uint16_t i = 0; i < heapMapBuffLen; i++) {
+          heapmap[i] = 0;
+          sqlmemmap[i] = 0;
+          oommap[i] = 0;
+        }
       }
       tft.fillRect(0, 0, Out.width, headerHeight, HEADER_BGCOLOR);// fill header
       tft.fillRect(0, footerBottomPosY - footerHeight, Out.width, footerHeight, FOOTER_BGCOLOR);// fill footer
@@ -828,6 +832,9 @@ class UIUtils {
         return;
       }
       devCountWasUpdated = false;
+      sqlmemmap[heapindex] = DBStats.memoryUsed();
+      oommap[heapindex] = min( DBStats.ooms - lastooms, (uint32_t)255 );
+      lastooms = DBStats.ooms;
       heapmap[heapindex++] = freeheap;
       heapindex = heapindex % heapMapBuffLen;
       lastfreeheap = freeheap;
@@ -904,6 +911,32 @@ class UIUtils {
       heapGraphSprite.drawFastHLine( 0, graphLineHeight - toleranceline, graphLineWidth, BLE_LIGHTGREY );
       heapGraphSprite.drawFastHLine( 0, graphLineHeight - minline, graphLineWidth, BLE_RED );
 
+      // sqlite memory overlay (own scale), with out of memory errors as pink columns
+      uint32_t sqlMin = 0xffffffff;
+      uint32_t sqlMax = 0;
+      for (uint8_t i = 0; i < graphLineWidth; i++) {
+        uint32_t sqlval = sqlmemmap[int(heapindex - graphLineWidth + i + heapMapBuffLen) % heapMapBuffLen];
+        if ( sqlval == 0 ) continue;
+        if ( sqlval < sqlMin ) sqlMin = sqlval;
+        if ( sqlval > sqlMax ) sqlMax = sqlval;
+      }
+      int16_t sqlLastY = -1;
+      for (uint8_t i = 0; i < graphLineWidth; i++) {
+        int thisindex = int(heapindex - graphLineWidth + i + heapMapBuffLen) % heapMapBuffLen;
+        if ( oommap[thisindex] > 0 ) {
+          heapGraphSprite.drawFastVLine( i, 0, graphLineHeight, BLE_PINK );
+        }
+        if ( sqlmemmap[thisindex] == 0 || sqlMax == sqlMin ) {
+          sqlLastY = -1;
+          continue;
+        }
+        int16_t sqlY = graphLineHeight - 1 - map( sqlmemmap[thisindex], sqlMin, sqlMax, 0, graphLineHeight - 1 );
+        if ( sqlLastY >= 0 ) {
+          heapGraphSprite.drawLine( i - 1, sqlLastY, i, sqlY, BLE_PURPLE );
+        }
+        sqlLastY = sqlY;
+      }
+
       if( devGraphStartedSince > devGraphPeriodLong ) {
         // 1mn of data => calc devices per minute
         size_t totalCount = 0;
@@ -1655,6 +1688,8 @@ class UIUtils {
       log_w("Will allocate heapgraph buffer to %d", heapMapBuffLen );
       devCountPerMinutePerPeriod = (uint16_t*)calloc( heapMapBuffLen, sizeof( uint16_t ) );
       heapmap = (uint32_t*)calloc( heapMapBuffLen, sizeof( uint32_t ) );
+      sqlmemmap = (uint32_t*)calloc( heapMapBuffLen, sizeof( uint32_t ) );
+      oommap = (uint8_t*)calloc( heapMapBuffLen, sizeof( uint8_t ) );
       log_w("Allocation successful");
 
     }
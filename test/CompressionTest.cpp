@@ -0,0 +1,138 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * Host round-trip test for Compression.h: make -C test
+ *
+ * Blocks are fed to the encoder the way BLEFileSharing.h does (read into
+ * e->data + e->prevLen), the compressed stream is handed to the decoder in
+ * pieces of varying sizes, like BLE writes that split tokens anywhere.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "../Compression.h"
+
+static int failures = 0;
+
+#define CHECK( cond ) do { if ( !( cond ) ) { printf( "%s:%d: CHECK( %s ) failed\n", __FILE__, __LINE__, #cond ); failures++; } } while ( 0 )
+
+
+static std::vector<uint8_t> compress( const std::vector<uint8_t> &input, size_t blockSize ) {
+  static LZSSEncoder encoder; // too big for some default stacks
+  static uint8_t out[LZSS_MAX_OUTPUT( LZSS_WINDOW )];
+  std::vector<uint8_t> stream;
+  LZSSEncoderInit( &encoder );
+  size_t pos = 0;
+  do {
+    size_t n = input.size() - pos < blockSize ? input.size() - pos : blockSize;
+    if ( n > 0 ) memcpy( encoder.data + encoder.prevLen, input.data() + pos, n );
+    pos += n;
+    size_t outLen = LZSSCompress( &encoder, n, pos == input.size(), out );
+    CHECK( outLen <= LZSS_MAX_OUTPUT( n ) );
+    stream.insert( stream.end(), out, out + outLen );
+  } while ( pos < input.size() );
+  return stream;
+}
+
+
+static std::vector<uint8_t> decompress( const std::vector<uint8_t> &stream, size_t maxPiece ) {
+  static LZSSDecoder decoder;
+  std::vector<uint8_t> output;
+  LZSSDecoderInit( &decoder );
+  size_t pos = 0;
+  while ( pos < stream.size() ) {
+    size_t piece = 1 + rand() % maxPiece;
+    if ( piece > stream.size() - pos ) piece = stream.size() - pos;
+    LZSSDecompress( &decoder, stream.data() + pos, piece, [&output]( uint8_t b ) { output.push_back( b ); } );
+    pos += piece;
+  }
+  return output;
+}
+
+
+static void roundTrip( const char* name, const std::vector<uint8_t> &input ) {
+  const size_t blockSizes[] = { LZSS_WINDOW, 1000, 17 };
+  for ( size_t blockSize : blockSizes ) {
+    std::vector<uint8_t> stream = compress( input, blockSize );
+    std::vector<uint8_t> output = decompress( stream, 1 + blockSize % 200 );
+    bool same = output == input;
+    CHECK( same );
+    if ( !same ) {
+      printf( "  %s: %zu bytes, blocks of %zu, %zu bytes back\n", name, input.size(), blockSize, output.size() );
+    } else if ( blockSize == LZSS_WINDOW ) {
+      printf( "  %-8s %7zu => %7zu bytes\n", name, input.size(), stream.size() );
+    }
+  }
+}
+
+
+int main() {
+  srand( 1 );
+  std::vector<uint8_t> data;
+
+  roundTrip( "empty", data );
+
+  data.assign( 1, 'x' );
+  roundTrip( "1 byte", data );
+
+  data.assign( 50000, 0 ); // empty DB pages, long matches at distance 1
+  roundTrip( "zeros", data );
+
+  data.clear();
+  for ( int i = 0; i < 30000; i++ ) data.push_back( rand() );
+  roundTrip( "random", data );
+
+  // blemacs-like rows: repeated field names and vendors, varying addresses
+  data.clear();
+  const char* vendors[] = { "Apple, Inc.", "Samsung Electronics Co. Ltd.", "Microsoft", "Google" };
+  char row[128];
+  for ( int i = 0; i < 2000; i++ ) {
+    int len = snprintf( row, sizeof( row ), "%02x:%02x:%02x:%02x:%02x:%02x|%s|%d|2019-05-%02d\n",
+      rand() & 0xff, rand() & 0xff, rand() & 0xff, rand() & 0xff, rand() & 0xff, rand() & 0xff,
+      vendors[rand() % 4], -30 - rand() % 70, 1 + i % 28 );
+    data.insert( data.end(), row, row + len );
+  }
+  roundTrip( "rows", data );
+
+  // matches exactly one window back
+  data.clear();
+  for ( int i = 0; i < LZSS_WINDOW; i++ ) data.push_back( rand() );
+  data.insert( data.end(), data.begin(), data.begin() + LZSS_WINDOW );
+  roundTrip( "window", data );
+
+  printf( "Compression: %s\n", failures == 0 ? "ok" : "FAILED" );
+  return failures == 0 ? 0 : 1;
+}
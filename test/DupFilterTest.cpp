@@ -0,0 +1,210 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * Host benchmark for DupFilter.h: make -C test
+ *
+ *  - measured false-positive rate (fresh MACs reported as repeats) against
+ *    the fill-ratio estimate shown by the 'dupfilter' serial command
+ *  - CPU per advert: filter check vs a stand-in for the store()/reset()
+ *    string copy path it skips
+ *  - no hit lost: the counters are bumped by one thread (BLE callback) and
+ *    taken by another (scan task)
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+// FreeRTOS critical section stand-in
+typedef std::atomic_flag portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED ATOMIC_FLAG_INIT
+#define portENTER_CRITICAL( mux ) while ( ( mux )->test_and_set( std::memory_order_acquire ) ) { }
+#define portEXIT_CRITICAL( mux ) ( mux )->clear( std::memory_order_release )
+
+#include "../DupFilter.h"
+
+static int failures = 0;
+
+#define CHECK( cond ) do { if ( !( cond ) ) { printf( "%s:%d: CHECK( %s ) failed\n", __FILE__, __LINE__, #cond ); failures++; } } while ( 0 )
+
+#define MAX_FIELD_LEN 32
+#define MAC_LEN 17
+
+
+static void macOf( uint32_t device, uint8_t* mac ) {
+  uint32_t h = DupFilter::fnv1a( (const uint8_t*)&device, sizeof( device ) );
+  mac[0] = 0x24; mac[1] = 0x0a;
+  memcpy( mac + 2, &h, 4 );
+}
+
+
+static uint32_t payloadOf( uint32_t device ) {
+  return 2166136261UL ^ ( device % 7 ); // a few payload variants
+}
+
+
+static double nowUs() {
+  return std::chrono::duration<double, std::micro>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+
+static void testFalsePositives( uint32_t devices ) {
+  // probes are inserted when missed, so each trial only probes a few fresh MACs
+  const uint32_t trials = 200, probes = 50;
+  uint32_t falsePositives = 0;
+  float fill = 0, estimated = 0;
+  uint8_t mac[6];
+  for ( uint32_t t = 0; t < trials; t++ ) {
+    DupFilter filter;
+    CHECK( filter.init( 0 ) );
+    for ( uint32_t d = 0; d < devices; d++ ) { // one window worth of devices
+      macOf( t * 100000 + d, mac );
+      filter.absorb( mac, payloadOf( d ), -60, 0 );
+    }
+    fill      += filter.fillRatio();
+    estimated += filter.falsePositiveRate();
+    for ( uint32_t p = 0; p < probes; p++ ) {
+      macOf( 50000000 + t * 100000 + p, mac ); // never seen
+      if ( filter.absorb( mac, payloadOf( p ), -60, 0 ) ) falsePositives++;
+    }
+  }
+  float measured = (float)falsePositives / ( trials * probes );
+  printf( "  %5u devices: fill %.1f%%, false positives measured %.3f%%, estimated %.3f%%\n",
+    devices, fill / trials * 100, measured * 100, estimated / trials * 100 );
+  if ( devices <= 1000 ) {
+    CHECK( measured < 0.01 ); // sized for ~1000 devices per generation
+  }
+}
+
+
+struct StoredDevice { // store() copies these from the advert
+  char address[MAC_LEN+1], name[MAX_FIELD_LEN+1], ouiname[MAX_FIELD_LEN+1], manufname[MAX_FIELD_LEN+1], uuid[MAX_FIELD_LEN+1];
+  int rssi, manufid;
+};
+
+
+static volatile uint32_t sink = 0;
+
+// stand-in for reset() + store() + the string copies, no populate/DB work
+static void storePath( StoredDevice &item, const uint8_t* mac, uint32_t device ) {
+  memset( &item, 0, sizeof( item ) );
+  snprintf( item.address, sizeof( item.address ), "%02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5] );
+  snprintf( item.name, sizeof( item.name ), "Device %u", device );
+  strncpy( item.ouiname, "[unpopulated]", MAX_FIELD_LEN );
+  strncpy( item.manufname, "[unpopulated]", MAX_FIELD_LEN );
+  snprintf( item.uuid, sizeof( item.uuid ), "0x%04x", device & 0xffff ); // 16 bit service uuid
+  item.rssi = -60;
+  item.manufid = device & 0xff;
+  sink += item.address[3] + item.uuid[5];
+}
+
+
+static void testCpuSaved() {
+  const uint32_t devices = 300, rounds = 200, roundMillis = 20000;
+  DupFilter filter;
+  filter.windowMillis = 60000;
+  CHECK( filter.init( 0 ) );
+  StoredDevice item;
+  uint8_t mac[6];
+  uint32_t adverts = 0, stores = 0;
+  double filterUs = 0, storeUs = 0;
+  for ( uint32_t r = 0; r < rounds; r++ ) {
+    uint32_t now = r * roundMillis;
+    for ( uint32_t d = 0; d < devices; d++ ) { // BLEScan reports each address once per round
+      if ( ( d + r ) % 5 == 0 ) continue; // some devices miss a round
+      macOf( d, mac );
+      double start = nowUs();
+      bool absorbed = filter.absorb( mac, payloadOf( d ), -60, now );
+      filterUs += nowUs() - start;
+      adverts++;
+      if ( !absorbed ) {
+        start = nowUs();
+        storePath( item, mac, d );
+        storeUs += nowUs() - start;
+        stores++;
+      }
+    }
+    BLEDupCounter out[DUPFILTER_COUNTERS_SIZE];
+    filter.take( out, DUPFILTER_COUNTERS_SIZE );
+  }
+  double storeEach = storeUs / stores;
+  double without = adverts * storeEach;
+  double with = filterUs + storeUs;
+  printf( "  %u adverts, absorbed %.1f%%, collisions %u: filter %.3f us/advert, store path %.3f us/advert, CPU saved %.1f%%\n",
+    adverts, filter.absorbed * 100.0 / adverts, filter.collisions, filterUs / adverts, storeEach, ( 1 - with / without ) * 100 );
+  CHECK( filter.absorbed + stores == adverts );
+  CHECK( filter.absorbed > 0 );
+  CHECK( with < without );
+}
+
+
+static void testNoHitLost() {
+  DupFilter filter;
+  CHECK( filter.init( 0 ) );
+  const uint32_t devices = 40, adverts = 200000;
+  std::atomic<bool> done( false );
+  uint64_t taken = 0;
+  std::thread scanTask( [&]() {
+    BLEDupCounter out[DUPFILTER_COUNTERS_SIZE];
+    while ( !done.load() ) {
+      uint16_t count = filter.take( out, DUPFILTER_COUNTERS_SIZE );
+      for ( uint16_t i = 0; i < count; i++ ) taken += out[i].hits;
+    }
+    uint16_t count = filter.take( out, DUPFILTER_COUNTERS_SIZE );
+    for ( uint16_t i = 0; i < count; i++ ) taken += out[i].hits;
+  } );
+  uint8_t mac[6];
+  for ( uint32_t a = 0; a < adverts; a++ ) { // BLE callback
+    uint32_t d = a % devices;
+    macOf( d, mac );
+    filter.absorb( mac, payloadOf( d ), -60, 0 );
+  }
+  done = true;
+  scanTask.join();
+  printf( "  %u adverts: absorbed %u, taken %llu, collisions %u\n", adverts, filter.absorbed, (unsigned long long)taken, filter.collisions );
+  CHECK( taken == filter.absorbed );
+}
+
+
+int main() {
+  testFalsePositives( 500 );
+  testFalsePositives( 1000 );
+  testFalsePositives( 2000 );
+  testCpuSaved();
+  testNoHitLost();
+  printf( "DupFilter: %s\n", failures == 0 ? "ok" : "FAILED" );
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,503 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * Host two-process test for FileSharingDelta.h: make -C test
+ *
+ * The parent is the client (sender) and a forked child is the server
+ * (receiver), each with its own file. Two SOCK_SEQPACKET socketpairs stand
+ * for the characteristics: route (requests and notifications, framed with
+ * FileSharingProtocol.h) and data (chunks written without response, through
+ * FileSharingWindowSender). Like BLEFileSharing.h, the client sends
+ * FS_OP_CHECK with the sha256 of its copy, and runs the delta sync when the
+ * server says it needs the file: block hashes, patches, whole file verify.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+
+// ESP32 ROM crc (rom/crc.h), reflected crc32 with the caller's initial value
+static uint32_t crc32_le( uint32_t crc, const uint8_t* buf, uint32_t len ) {
+  crc = ~crc;
+  while ( len-- ) {
+    crc ^= *buf++;
+    for ( int k = 0; k < 8; k++ ) crc = crc & 1 ? ( crc >> 1 ) ^ 0xedb88320 : crc >> 1;
+  }
+  return ~crc;
+}
+
+// the mbedtls calls of FileSharingDelta.h (mbedtls/sha256.h), on OpenSSL
+struct mbedtls_sha256_context {
+  EVP_MD_CTX* md;
+};
+static void mbedtls_sha256_init( mbedtls_sha256_context* ctx ) { ctx->md = EVP_MD_CTX_new(); }
+static void mbedtls_sha256_free( mbedtls_sha256_context* ctx ) { EVP_MD_CTX_free( ctx->md ); }
+static int mbedtls_sha256_starts( mbedtls_sha256_context* ctx, int ) { return EVP_DigestInit_ex( ctx->md, EVP_sha256(), NULL ) == 1 ? 0 : -1; }
+static int mbedtls_sha256_update( mbedtls_sha256_context* ctx, const unsigned char* in, size_t len ) { return EVP_DigestUpdate( ctx->md, in, len ) == 1 ? 0 : -1; }
+static int mbedtls_sha256_finish( mbedtls_sha256_context* ctx, unsigned char out[32] ) { return EVP_DigestFinal_ex( ctx->md, out, NULL ) == 1 ? 0 : -1; }
+static int mbedtls_sha256( const unsigned char* in, size_t len, unsigned char out[32], int ) { return EVP_Digest( in, len, out, NULL, EVP_sha256(), NULL ) == 1 ? 0 : -1; }
+
+#include "../FileSharingProtocol.h"
+#include "../FileSharingWindow.h"
+#include "../FileSharingDelta.h"
+
+static int failures = 0;
+
+#define CHECK( cond ) do { if ( !( cond ) ) { printf( "%s:%d: CHECK( %s ) failed\n", __FILE__, __LINE__, #cond ); failures++; } } while ( 0 )
+
+#define TIMEOUT 5000 // ms, like fileSharingClientTimeout but shorter
+
+
+// the part of fs::File the delta sync uses
+struct HostFile {
+  FILE* f = NULL;
+
+  HostFile( const char* path, const char* mode ) { f = fopen( path, mode ); }
+  ~HostFile() { if ( f ) fclose( f ); }
+  explicit operator bool() const { return f != NULL; }
+  size_t read( uint8_t* buf, size_t len ) { return fread( buf, 1, len, f ); }
+  bool seek( uint32_t pos ) { return fseek( f, pos, SEEK_SET ) == 0; }
+  size_t write( const uint8_t* buf, size_t len ) { return fwrite( buf, 1, len, f ); }
+  size_t size() {
+    long pos = ftell( f );
+    fseek( f, 0, SEEK_END );
+    long end = ftell( f );
+    fseek( f, pos, SEEK_SET );
+    return end;
+  }
+};
+
+
+static uint32_t nowMillis() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static void sendFrame( int fd, const FileSharingFrame &frame ) {
+  if ( send( fd, frame.data, frame.len, 0 ) != (ssize_t)frame.len ) {
+    perror( "send" );
+  }
+}
+
+
+static void notify( int fd, uint8_t op, const void* payload = NULL, uint16_t len = 0 ) {
+  FileSharingFrame frame;
+  frame.put( op, payload, len );
+  sendFrame( fd, frame );
+}
+
+
+static void notifyU32( int fd, uint8_t op, uint32_t value ) {
+  FileSharingFrame frame;
+  frame.putU32( op, value );
+  sendFrame( fd, frame );
+}
+
+
+/******************************************************
+  Server (child process), like the receiver side of BLEFileSharing.h
+******************************************************/
+
+struct Server {
+  int route, data;
+  const char* path;
+  char name[40] = ""; // FS_OP_FILE, stands for path
+  HostFile* target = NULL;
+  uint32_t expectedSize = 0;
+  uint32_t receivedSize = 0;
+  uint16_t expectedSeq = 0;
+  bool desync = false;
+  FileSharingAcker acks;
+  uint8_t block[FILESHARING_BLOCK_SIZE];
+
+  void check( const FileSharingMessage &msg ) {
+    uint8_t answer[2] = { FileSharingU8( msg ), 1 };
+    HostFile copy( path, "rb" );
+    uint8_t digest[FILESHARING_DIGEST_SIZE];
+    if ( copy ) {
+      FileSharingDigest( copy, block, digest );
+      if ( FileSharingSameDigest( msg, 1, digest ) ) answer[1] = 0;
+    }
+    notify( route, FS_OP_CHECK_RESULT, answer, sizeof(answer) );
+  }
+
+  void delta() {
+    uint32_t blocks = 0;
+    {
+      HostFile copy( path, "rb" );
+      // a shorter source would need a truncate, leave that to a full transfer
+      if ( name[0] != '\0' && copy && copy.size() > 0 && copy.size() <= expectedSize ) {
+        int fd = route;
+        blocks = FileSharingHashBlocks( copy, block, [fd]( const uint8_t* payload, size_t len ) {
+          notify( fd, FS_OP_HASHES, payload, len );
+        });
+      }
+    }
+    if ( blocks > 0 ) {
+      target = new HostFile( path, "r+b" );
+      acks.begin();
+      receivedSize = 0;
+      expectedSeq = 0;
+      desync = false;
+    }
+    notifyU32( route, FS_OP_HASHDONE, blocks );
+  }
+
+  void chunk( uint8_t* packet, size_t len ) {
+    if ( target == NULL || desync || len <= sizeof(FileSharingChunkHeader) ) return;
+    FileSharingChunkHeader header;
+    memcpy( &header, packet, sizeof(header) );
+    uint8_t* payload = packet + sizeof(header);
+    size_t remaining = len - sizeof(header);
+    if ( header.seq != expectedSeq || header.crc != crc32_le( 0, payload, remaining ) ) {
+      desync = true;
+      notifyU32( route, FS_OP_NACK, acks.wire );
+      return;
+    }
+    expectedSeq++;
+    uint32_t offset;
+    if ( !FileSharingPatch( payload, remaining, offset ) ) return;
+    target->seek( offset );
+    target->write( payload, remaining );
+    receivedSize += remaining;
+    if ( acks.received( remaining, receivedSize >= expectedSize ) ) {
+      notifyU32( route, FS_OP_ACK, acks.wire );
+    }
+  }
+
+  void verify( const FileSharingMessage &msg ) {
+    uint8_t answer = 0;
+    if ( target != NULL ) {
+      uint8_t digest[FILESHARING_DIGEST_SIZE];
+      fflush( target->f );
+      target->seek( 0 );
+      FileSharingDigest( *target, block, digest );
+      answer = !desync && FileSharingSameDigest( msg, 0, digest ) ? 1 : 0;
+      delete target;
+      target = NULL;
+    }
+    notify( route, FS_OP_VERIFY, &answer, sizeof(answer) );
+  }
+
+  // until the client hangs up
+  int run() {
+    uint8_t packet[FILESHARING_FRAME_SIZE];
+    for ( ;; ) {
+      struct pollfd fds[2] = { { data, POLLIN, 0 }, { route, POLLIN, 0 } };
+      if ( poll( fds, 2, TIMEOUT ) <= 0 ) return 1;
+      // the client writes the chunks before FS_OP_SHA256, apply them first
+      ssize_t len;
+      while ( ( len = recv( data, packet, sizeof(packet), MSG_DONTWAIT ) ) > 0 ) {
+        chunk( packet, len );
+      }
+      if ( !( fds[1].revents & ( POLLIN | POLLHUP ) ) ) continue;
+      len = recv( route, packet, sizeof(packet), 0 );
+      if ( len <= 0 ) return 0;
+      const uint8_t* cursor = packet;
+      size_t left = len;
+      FileSharingMessage msg;
+      while ( FileSharingParse( cursor, left, msg ) ) {
+        switch ( msg.op ) {
+          case FS_OP_CHECK:  check( msg ); break;
+          case FS_OP_FILE:   if ( !FileSharingString( msg, name, sizeof(name) ) ) name[0] = '\0'; break;
+          case FS_OP_SIZE:   expectedSize = FileSharingU32( msg ); break;
+          case FS_OP_DELTA:  delta(); break;
+          case FS_OP_SHA256: verify( msg ); break;
+        }
+      }
+    }
+  }
+};
+
+
+/******************************************************
+  Client (parent process), like FileSharingClientTask and FileSharingSendDelta
+******************************************************/
+
+struct Client;
+
+struct SocketLink {
+  Client* client;
+  bool write( const uint8_t* packet, size_t len );
+  uint32_t millis() { return nowMillis(); }
+  void wait();
+};
+
+struct Client {
+  int route, data;
+  SocketLink link;
+  FileSharingWindowSender<SocketLink> sender;
+  std::vector<uint8_t> hashes;
+  int needed = -1;
+  int32_t remoteBlocks = -1;
+  int verified = -1;
+
+  Client( int _route, int _data ) : route( _route ), data( _data ), link{ this }, sender( link ) { }
+
+  // dispatches the notifications, like FileSharingRouterCallbacks
+  void pump( int timeout ) {
+    struct pollfd fds = { route, POLLIN, 0 };
+    if ( poll( &fds, 1, timeout ) <= 0 ) return;
+    uint8_t packet[FILESHARING_FRAME_SIZE];
+    ssize_t len = recv( route, packet, sizeof(packet), 0 );
+    if ( len <= 0 ) return;
+    const uint8_t* cursor = packet;
+    size_t left = len;
+    FileSharingMessage msg;
+    while ( FileSharingParse( cursor, left, msg ) ) {
+      switch ( msg.op ) {
+        case FS_OP_ACK:          sender.onAck( FileSharingU32( msg ) ); break;
+        case FS_OP_NACK:         sender.onNack( FileSharingU32( msg ) ); break;
+        case FS_OP_CHECK_RESULT: needed = FileSharingU8( msg, 1 ); break;
+        case FS_OP_HASHES:       CHECK( FileSharingStoreHashes( msg, hashes.data(), hashes.size() / FILESHARING_BLOCK_HASH_SIZE ) ); break;
+        case FS_OP_HASHDONE:     remoteBlocks = FileSharingU32( msg ); break;
+        case FS_OP_VERIFY:       verified = FileSharingU8( msg ); break;
+      }
+    }
+  }
+
+  template <typename Done>
+  bool waitFor( Done done ) {
+    uint32_t start = nowMillis();
+    while ( !done() && nowMillis() - start < TIMEOUT ) pump( 10 );
+    return done();
+  }
+};
+
+bool SocketLink::write( const uint8_t* packet, size_t len ) {
+  return send( client->data, packet, len, 0 ) == (ssize_t)len;
+}
+
+void SocketLink::wait() {
+  client->pump( 1 );
+}
+
+
+struct Outcome {
+  int     needed = -1;
+  int32_t remoteBlocks = -1;
+  size_t  patched = 0; // blocks
+  size_t  sent = 0;    // bytes
+  int     verified = -1;
+  std::vector<uint8_t> result; // the server's file afterwards
+};
+
+
+static void writeFile( const char* path, const std::vector<uint8_t> &content ) {
+  HostFile file( path, "wb" );
+  file.write( content.data(), content.size() );
+}
+
+
+static std::vector<uint8_t> readFile( const char* path ) {
+  HostFile file( path, "rb" );
+  std::vector<uint8_t> content( file.size() );
+  file.read( content.data(), content.size() );
+  return content;
+}
+
+
+// one session: check, then a delta sync when the server needs the file;
+// skipBlock leaves one differing block out, like a stale patch
+static Outcome session( const std::vector<uint8_t> &source, const std::vector<uint8_t> &copy, bool skipBlock = false ) {
+  Outcome outcome;
+  char sourcePath[] = "/tmp/fs-delta-source-XXXXXX";
+  char copyPath[]   = "/tmp/fs-delta-copy-XXXXXX";
+  close( mkstemp( sourcePath ) );
+  close( mkstemp( copyPath ) );
+  writeFile( sourcePath, source );
+  writeFile( copyPath, copy );
+
+  int route[2], data[2];
+  if ( socketpair( AF_UNIX, SOCK_SEQPACKET, 0, route ) != 0 || socketpair( AF_UNIX, SOCK_SEQPACKET, 0, data ) != 0 ) {
+    perror( "socketpair" );
+    exit( 1 );
+  }
+  fflush( stdout );
+  pid_t pid = fork();
+  if ( pid == 0 ) {
+    close( route[0] );
+    close( data[0] );
+    Server server;
+    server.route = route[1];
+    server.data  = data[1];
+    server.path  = copyPath;
+    _exit( server.run() );
+  }
+  close( route[1] );
+  close( data[1] );
+
+  Client client( route[0], data[0] );
+  static uint8_t block[FILESHARING_BLOCK_SIZE];
+  HostFile file( sourcePath, "rb" );
+  size_t blocks = ( source.size() + FILESHARING_BLOCK_SIZE - 1 ) / FILESHARING_BLOCK_SIZE;
+
+  // u8 FS_FILE_*, sha256 of the local copy
+  uint8_t query[1 + FILESHARING_DIGEST_SIZE] = { FS_FILE_VENDORS };
+  FileSharingDigest( file, block, query + 1 );
+  FileSharingFrame frame;
+  frame.put( FS_OP_CHECK, query, sizeof(query) );
+  sendFrame( client.route, frame );
+  CHECK( client.waitFor( [&]() { return client.needed >= 0; } ) );
+  outcome.needed = client.needed;
+
+  if ( client.needed == 1 ) {
+    client.hashes.assign( blocks * FILESHARING_BLOCK_HASH_SIZE, 0 );
+    frame.clear();
+    frame.putString( FS_OP_FILE, "/ble-oui.db" );
+    frame.putU32( FS_OP_SIZE, source.size() );
+    frame.put( FS_OP_DELTA );
+    sendFrame( client.route, frame );
+    CHECK( client.waitFor( [&]() { return client.remoteBlocks >= 0; } ) );
+    outcome.remoteBlocks = client.remoteBlocks;
+  }
+
+  if ( outcome.remoteBlocks > 0 ) {
+    size_t chunkSize = FileSharingChunkSize( FILESHARING_MAX_PACKET, BLE_LL_MAX_DATA_LEN, sizeof(uint32_t) );
+    uint8_t digest[FILESHARING_DIGEST_SIZE];
+    FileSharingBlockDiff diff;
+    diff.begin( client.hashes.data(), std::min( (size_t)client.remoteBlocks, blocks ) );
+    client.sender.begin();
+    file.seek( 0 );
+    for ( size_t i = 0; i < blocks; i++ ) {
+      size_t len = file.read( block, FILESHARING_BLOCK_SIZE );
+      if ( !diff.differs( block, len ) ) continue;
+      if ( skipBlock ) {
+        skipBlock = false;
+        continue;
+      }
+      outcome.patched++;
+      for ( size_t offset = 0; offset < len; offset += chunkSize ) {
+        size_t chunk = std::min( chunkSize, len - offset );
+        uint32_t pos = i * FILESHARING_BLOCK_SIZE + offset;
+        CHECK( client.sender.send( block + offset, chunk, (const uint8_t*)&pos, sizeof(pos) ) == FS_SEND_OK );
+        outcome.sent += chunk;
+      }
+    }
+    diff.finish( digest );
+    frame.clear();
+    frame.put( FS_OP_SHA256, digest, sizeof(digest) );
+    sendFrame( client.route, frame );
+    CHECK( client.waitFor( [&]() { return client.verified >= 0; } ) );
+    outcome.verified = client.verified;
+  }
+
+  close( route[0] );
+  close( data[0] );
+  int status = -1;
+  waitpid( pid, &status, 0 );
+  CHECK( WIFEXITED( status ) && WEXITSTATUS( status ) == 0 );
+  outcome.result = readFile( copyPath );
+  unlink( sourcePath );
+  unlink( copyPath );
+  return outcome;
+}
+
+
+static std::vector<uint8_t> randomBytes( size_t len ) {
+  std::vector<uint8_t> bytes( len );
+  for ( size_t i = 0; i < len; i++ ) bytes[i] = rand();
+  return bytes;
+}
+
+
+static void report( const char* name, const Outcome &outcome, size_t size ) {
+  printf( "  %-36s needed %d, %3zu blocks patched, %7zu / %7zu bytes sent, verified %d\n",
+    name, outcome.needed, outcome.patched, outcome.sent, size, outcome.verified );
+}
+
+
+int main() {
+  srand( 1 );
+  const size_t size = 64 * FILESHARING_BLOCK_SIZE;
+  std::vector<uint8_t> source = randomBytes( size );
+
+  // same size, different content: was never synced when only the size was checked
+  std::vector<uint8_t> copy = source;
+  copy[3 * FILESHARING_BLOCK_SIZE + 100] ^= 0xff;
+  copy[40 * FILESHARING_BLOCK_SIZE] ^= 0xff;
+  copy[size - 1] ^= 0xff;
+  Outcome sameSize = session( source, copy );
+  report( "same size, 3 pages differ", sameSize, size );
+  CHECK( sameSize.needed == 1 );
+  CHECK( sameSize.remoteBlocks == 64 );
+  CHECK( sameSize.patched == 3 );
+  CHECK( sameSize.verified == 1 );
+  CHECK( sameSize.result == source );
+
+  Outcome identical = session( source, source );
+  report( "identical", identical, size );
+  CHECK( identical.needed == 0 );
+  CHECK( identical.remoteBlocks == -1 );
+  CHECK( identical.result == source );
+
+  // the source grew by 4 pages and a partial one, and one old page changed
+  std::vector<uint8_t> grown = source;
+  std::vector<uint8_t> tail = randomBytes( 4 * FILESHARING_BLOCK_SIZE + 100 );
+  grown.insert( grown.end(), tail.begin(), tail.end() );
+  grown[10 * FILESHARING_BLOCK_SIZE + 7] ^= 0x55;
+  Outcome grew = session( grown, source );
+  report( "source grew, 1 page differs", grew, grown.size() );
+  CHECK( grew.needed == 1 );
+  CHECK( grew.remoteBlocks == 64 );
+  CHECK( grew.patched == 6 );
+  CHECK( grew.verified == 1 );
+  CHECK( grew.result == grown );
+
+  // a shorter source needs a full transfer
+  Outcome shrunk = session( source, grown );
+  report( "source shrunk", shrunk, size );
+  CHECK( shrunk.needed == 1 );
+  CHECK( shrunk.remoteBlocks == 0 );
+  CHECK( shrunk.result == grown );
+
+  // a missing patch must not verify
+  Outcome stale = session( source, copy, true );
+  report( "one patch missing", stale, size );
+  CHECK( stale.patched == 2 );
+  CHECK( stale.verified == 0 );
+  CHECK( stale.result != source );
+
+  printf( "FileSharingDelta: %s\n", failures == 0 ? "ok" : "FAILED" );
+  return failures == 0 ? 0 : 1;
+}
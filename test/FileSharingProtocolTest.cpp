@@ -0,0 +1,148 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * Host round-trip test for FileSharingProtocol.h: make -C test
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "../FileSharingProtocol.h"
+
+static int failures = 0;
+
+#define CHECK( cond ) do { if ( !( cond ) ) { printf( "%s:%d: CHECK( %s ) failed\n", __FILE__, __LINE__, #cond ); failures++; } } while ( 0 )
+
+
+// several messages in one frame, with zero bytes inside the payloads
+static void testRoundTrip() {
+  FileSharingFrame frame;
+  uint8_t time[12] = { 0xe3, 0x07, 0, 5, 0, 0, 0, 0, 0, 0, 0, 2 };
+  CHECK( frame.putString( FS_OP_FILE, "/ble-oui.db" ) );
+  CHECK( frame.putU32( FS_OP_SIZE, 123456 ) );
+  CHECK( frame.put( FS_OP_TIME, time, sizeof( time ) ) );
+  CHECK( frame.putU32( FS_OP_FILEID, 0xdeadbeef, true, FS_FLAG_LZSS ) );
+  CHECK( frame.putU32( FS_OP_OFFSET, 0, true, FS_FLAG_REFUSED ) );
+  CHECK( frame.put( FS_OP_CLOSE ) );
+
+  const uint8_t* data = frame.data;
+  size_t len = frame.len;
+  FileSharingMessage msg;
+  char path[32];
+  int count = 0;
+  while ( FileSharingParse( data, len, msg ) ) {
+    switch ( count++ ) {
+      case 0:
+        CHECK( msg.op == FS_OP_FILE );
+        CHECK( FileSharingString( msg, path, sizeof( path ) ) && strcmp( path, "/ble-oui.db" ) == 0 );
+        CHECK( !FileSharingString( msg, path, 5 ) ); // doesn't fit
+      break;
+      case 1:
+        CHECK( msg.op == FS_OP_SIZE && FileSharingU32( msg ) == 123456 );
+      break;
+      case 2:
+        CHECK( msg.op == FS_OP_TIME && msg.len == sizeof( time ) && memcmp( msg.payload, time, sizeof( time ) ) == 0 );
+      break;
+      case 3:
+        CHECK( msg.op == FS_OP_FILEID && FileSharingU32( msg ) == 0xdeadbeef && FileSharingU8( msg, 4 ) == FS_FLAG_LZSS );
+        CHECK( FileSharingU32( msg, 4 ) == 0 ); // reads past the payload give 0
+      break;
+      case 4:
+        CHECK( msg.op == FS_OP_OFFSET && FileSharingU8( msg, 4 ) & FS_FLAG_REFUSED );
+      break;
+      case 5:
+        CHECK( msg.op == FS_OP_CLOSE && msg.len == 0 && FileSharingU8( msg ) == 0 );
+      break;
+    }
+  }
+  CHECK( count == 6 && len == 0 );
+}
+
+
+// a truncated frame stops before the incomplete message
+static void testTruncated() {
+  FileSharingFrame frame;
+  CHECK( frame.putU32( FS_OP_ACK, 1024 ) );
+  CHECK( frame.putU32( FS_OP_ACK, 2048 ) );
+  for ( size_t cut = 0; cut < frame.len; cut++ ) {
+    const uint8_t* data = frame.data;
+    size_t len = cut;
+    FileSharingMessage msg;
+    int count = 0;
+    while ( FileSharingParse( data, len, msg ) ) count++;
+    CHECK( count == ( cut < 8 ? 0 : 1 ) );
+  }
+}
+
+
+// other versions and the old string markers are not parsed
+static void testForeign() {
+  FileSharingMessage msg;
+  uint8_t otherVersion[4] = { FILESHARING_PROTO_VERSION + 1, FS_OP_HELLO, 0, 0 };
+  const uint8_t* data = otherVersion;
+  size_t len = sizeof( otherVersion );
+  CHECK( !FileSharingParse( data, len, msg ) );
+  const char* marker = "checkBLEOUI";
+  data = (const uint8_t*)marker;
+  len = strlen( marker );
+  CHECK( !FileSharingParse( data, len, msg ) );
+  uint8_t hashes[] = { FILESHARING_PROTO_VERSION, FS_OP_HASHES, 3, 0, 0x34, 0x12, 9 };
+  data = hashes;
+  len = sizeof( hashes );
+  CHECK( FileSharingParse( data, len, msg ) && FileSharingU16( msg ) == 0x1234 && FileSharingU16( msg, 2 ) == 0 );
+}
+
+
+// a frame never grows past one attribute
+static void testOverflow() {
+  FileSharingFrame frame;
+  uint8_t payload[FILESHARING_FRAME_SIZE] = { 0 };
+  uint16_t room = FILESHARING_FRAME_SIZE - FILESHARING_MESSAGE_HEADER_SIZE;
+  CHECK( !frame.put( FS_OP_RECORDS, payload, room + 1 ) );
+  CHECK( frame.len == 0 );
+  CHECK( frame.put( FS_OP_RECORDS, payload, room ) );
+  CHECK( frame.len == FILESHARING_FRAME_SIZE );
+  CHECK( !frame.put( FS_OP_CLOSE ) );
+  frame.clear();
+  CHECK( frame.put( FS_OP_CLOSE ) );
+}
+
+
+int main() {
+  testRoundTrip();
+  testTruncated();
+  testForeign();
+  testOverflow();
+  printf( "FileSharingProtocol: %s\n", failures == 0 ? "ok" : "FAILED" );
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,353 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * Host loopback test for FileSharingWindow.h: make -C test
+ *
+ * The sender and FileSharingAcker talk over a simulated BLE link (1M PHY
+ * air time, connection events, stack TX buffers, acks notified back in the
+ * next event). The same link carries the transfer of the old sender:
+ * 512-byte writes, each waited for, then vTaskDelay(10) (and once more per
+ * progress percent). It reports the speedup for a 933KB file (ble-oui.db
+ * size): random bytes, and vendor rows sent LZSS compressed like
+ * FileSharingReadTask does.
+ *
+ * Link assumptions, see LinkConfig: no LL packet cap per event other than
+ * the interval, writes block when the stack holds TX_SLOTS packets.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+// ESP32 ROM crc (rom/crc.h), reflected crc32 with the caller's initial value
+static uint32_t crc32_le( uint32_t crc, const uint8_t* buf, uint32_t len ) {
+  crc = ~crc;
+  while ( len-- ) {
+    crc ^= *buf++;
+    for ( int k = 0; k < 8; k++ ) crc = crc & 1 ? ( crc >> 1 ) ^ 0xedb88320 : crc >> 1;
+  }
+  return ~crc;
+}
+
+#include "../FileSharingWindow.h"
+#include "../Compression.h"
+
+static int failures = 0;
+
+#define CHECK( cond ) do { if ( !( cond ) ) { printf( "%s:%d: CHECK( %s ) failed\n", __FILE__, __LINE__, #cond ); failures++; } } while ( 0 )
+
+#define FILE_SIZE  ( 933 * 1024 )
+#define TX_SLOTS   10 // ATT packets the stack buffers before a write blocks
+
+
+struct LinkConfig {
+  const char* name;
+  uint32_t intervalUs; // connection interval
+  uint16_t llPayload;  // 27, or 251 with data length extension
+  uint16_t mtu;
+};
+
+
+// checks and counts what arrives, notifies credit like BLEFileSharing.h does
+struct Receiver {
+  const uint8_t* source;
+  size_t   size = FILE_SIZE;
+  bool     chunked  = true; // FileSharingChunkHeader framing, false for the old sender
+  size_t   received = 0;
+  uint16_t expectedSeq = 0;
+  bool     corrupt  = false;
+  FileSharingAcker acks;
+  std::vector<uint32_t> notifications;
+
+  void receive( const uint8_t* packet, size_t len ) {
+    const uint8_t* data = packet;
+    if ( chunked ) {
+      FileSharingChunkHeader header;
+      memcpy( &header, packet, sizeof( header ) );
+      data += sizeof( header );
+      len  -= sizeof( header );
+      if ( header.seq != expectedSeq++ || header.crc != crc32_le( 0, data, len ) ) corrupt = true;
+    }
+    if ( received + len > size || memcmp( source + received, data, len ) != 0 ) corrupt = true;
+    received += len;
+    if ( chunked && acks.received( len, received >= size ) ) {
+      notifications.push_back( acks.wire );
+    }
+  }
+};
+
+
+class SimLink;
+typedef FileSharingWindowSender<SimLink> Sender;
+
+class SimLink {
+  public:
+
+    uint64_t now = 0; // us
+    Sender*  sender = NULL;
+
+    SimLink( const LinkConfig &_config, Receiver &_receiver ) : config( _config ), receiver( _receiver ), nextEvent( _config.intervalUs ) { }
+
+    bool write( uint8_t* packet, size_t len ) {
+      while ( tx.size() >= TX_SLOTS ) advanceTo( nextEvent );
+      tx.push_back( std::vector<uint8_t>( packet, packet + len ) );
+      return true;
+    }
+
+    uint32_t millis() { return now / 1000; }
+    void wait() { advanceTo( now + 1000 ); } // vTaskDelay(1)
+    void sleep( uint32_t ms ) { advanceTo( now + ms * 1000 ); }
+
+    // writeValue() returning once the packet is on air
+    void flush() {
+      while ( !tx.empty() ) advanceTo( nextEvent );
+    }
+
+  private:
+
+    LinkConfig config;
+    Receiver &receiver;
+    uint64_t nextEvent;
+    std::deque<std::vector<uint8_t>> tx;
+    size_t headSent = 0; // bytes of tx.front() already on air, L2CAP + ATT headers included
+    std::vector<uint32_t> inbound; // notifications for the sender, delivered next event
+
+    // 1M PHY: preamble, access address, header, crc + payload, IFS, empty ack, IFS
+    static uint32_t pduMicros( uint16_t payload ) {
+      return ( 10 + payload ) * 8 + 150 + 80 + 150;
+    }
+
+    void advanceTo( uint64_t t ) {
+      while ( nextEvent <= t ) {
+        now = nextEvent;
+        connectionEvent();
+        nextEvent += config.intervalUs;
+      }
+      now = t;
+    }
+
+    void connectionEvent() {
+      for ( uint32_t credit : inbound ) {
+        if ( sender != NULL ) sender->onAck( credit );
+      }
+      inbound.clear();
+      uint32_t airtime = 0;
+      while ( !tx.empty() ) {
+        size_t total = L2CAP_HEADER_SIZE + ATT_HEADER_SIZE + tx.front().size();
+        uint16_t pdu = (uint16_t)( total - headSent < config.llPayload ? total - headSent : config.llPayload );
+        if ( airtime + pduMicros( pdu ) > config.intervalUs ) break; // next event
+        airtime  += pduMicros( pdu );
+        headSent += pdu;
+        if ( headSent == total ) {
+          receiver.receive( tx.front().data(), tx.front().size() );
+          tx.pop_front();
+          headSent = 0;
+        }
+      }
+      inbound.swap( receiver.notifications );
+    }
+
+};
+
+
+static uint64_t sendWindowed( const LinkConfig &config, const uint8_t* source, Receiver &receiver, size_t size = FILE_SIZE ) {
+  receiver.source = source;
+  receiver.size = size;
+  SimLink link( config, receiver );
+  Sender sender( link );
+  link.sender = &sender;
+  sender.begin();
+  receiver.acks.begin();
+  size_t chunkSize = FileSharingChunkSize( config.mtu, config.llPayload );
+  for ( size_t offset = 0; offset < size; offset += chunkSize ) {
+    size_t len = size - offset < chunkSize ? size - offset : chunkSize;
+    if ( sender.send( source + offset, len ) != FS_SEND_OK ) break;
+  }
+  link.flush();
+  CHECK( sender.windowed );
+  return link.now;
+}
+
+
+// FileSharingSendFile before the credit window
+static uint64_t sendStopAndWait( const LinkConfig &config, const uint8_t* source, Receiver &receiver ) {
+  receiver.source = source;
+  receiver.chunked = false;
+  SimLink link( config, receiver );
+  int lastpercent = 0;
+  for ( size_t offset = 0; offset < FILE_SIZE; offset += 512 ) {
+    size_t len = FILE_SIZE - offset < 512 ? FILE_SIZE - offset : 512;
+    link.write( (uint8_t*)source + offset, len );
+    link.flush();
+    int percent = ( ( offset + len ) * 100 ) / FILE_SIZE;
+    if ( lastpercent != percent ) {
+      link.sleep( 10 );
+      lastpercent = percent;
+    }
+    link.sleep( 10 );
+  }
+  return link.now;
+}
+
+
+// ble-oui.db like content, compressed in FILESHARING_READ_BUFFSIZE blocks
+static std::vector<uint8_t> vendorRows( std::vector<uint8_t> &stream ) {
+  static LZSSEncoder encoder;
+  static uint8_t out[LZSS_MAX_OUTPUT( 4096 )];
+  const char* vendors[] = { "Apple, Inc.", "Samsung Electronics Co.,Ltd", "Cisco Systems, Inc", "Huawei Technologies Co.,Ltd", "Intel Corporate", "Private" };
+  std::vector<uint8_t> rows;
+  char row[96];
+  for ( uint32_t i = 0; rows.size() < FILE_SIZE; i++ ) {
+    int len = snprintf( row, sizeof( row ), "%02X%02X%02X%s", rand() & 0xff, rand() & 0xff, rand() & 0xff, vendors[rand() % 6] );
+    rows.insert( rows.end(), row, row + len );
+  }
+  rows.resize( FILE_SIZE );
+  LZSSEncoderInit( &encoder );
+  for ( size_t pos = 0; pos < rows.size(); ) {
+    size_t n = rows.size() - pos < 4096 ? rows.size() - pos : 4096;
+    memcpy( encoder.data + encoder.prevLen, rows.data() + pos, n );
+    pos += n;
+    size_t outLen = LZSSCompress( &encoder, n, pos == rows.size(), out );
+    stream.insert( stream.end(), out, out + outLen );
+  }
+  return rows;
+}
+
+
+static void report( const char* name, uint64_t us ) {
+  printf( "  %-44s %7.2f s, %6.1f KB/s\n", name, us / 1e6, FILE_SIZE / 1024.0 / ( us / 1e6 ) );
+}
+
+
+// a receiver that never acks gets the file unthrottled after the timeout
+static void testNoAcks( const uint8_t* source ) {
+  LinkConfig config = { "", 7500, 251, 517 };
+  Receiver receiver;
+  receiver.source = source;
+  SimLink link( config, receiver );
+  Sender sender( link ); // never told about acks
+  sender.begin();
+  size_t sent = 0;
+  for ( size_t offset = 0; offset < 64 * 1024; offset += 489 ) {
+    CHECK( sender.send( source + offset, 489 ) == FS_SEND_OK );
+    sent += 489;
+  }
+  CHECK( !sender.windowed );
+  CHECK( sender.wire == sent );
+  CHECK( link.millis() >= FILESHARING_ACK_TIMEOUT );
+}
+
+
+static void testNack( const uint8_t* source ) {
+  LinkConfig config = { "", 7500, 251, 517 };
+  Receiver receiver;
+  SimLink link( config, receiver );
+  Sender sender( link );
+  sender.begin();
+  CHECK( sender.send( source, 100 ) == FS_SEND_OK );
+  sender.onNack( 0 );
+  CHECK( sender.send( source, 100 ) == FS_SEND_NACKED );
+  sender.begin();
+  CHECK( sender.send( source, 100 ) == FS_SEND_OK );
+  CHECK( sender.send( source, FILESHARING_MAX_PACKET ) == FS_SEND_WRITE_FAILED );
+}
+
+
+static void testChunkSize() {
+  CHECK( FileSharingChunkSize( 517, 251 ) == 489 ); // 2 full LL packets
+  CHECK( FileSharingChunkSize( 517, 251, 4 ) == 485 );
+  CHECK( FileSharingChunkSize( 517, 27 ) == 500 ); // 19 full LL packets
+  CHECK( FileSharingChunkSize( 23, 27 ) == 14 );
+  CHECK( FileSharingChunkSize( 185, 251 ) == 176 ); // fits one LL packet
+}
+
+
+int main() {
+  std::vector<uint8_t> source( FILE_SIZE );
+  srand( 1 );
+  for ( size_t i = 0; i < source.size(); i++ ) source[i] = rand();
+
+  // Bluedroid's default 30-50ms interval and 27-byte packets, what the old sender got
+  LinkConfig defaults30 = { "30ms interval, 27B LL, MTU 517", 30000, 27, 517 };
+  LinkConfig defaults50 = { "50ms interval, 27B LL, MTU 517", 50000, 27, 517 };
+  // what FileSharingClientTask asks for
+  LinkConfig fast75 = { "7.5ms interval, 251B LL, MTU 517", 7500, 251, 517 };
+  LinkConfig fast15 = { "15ms interval, 251B LL, MTU 517", 15000, 251, 517 };
+
+  Receiver r1, r2, r3, r4, r5, r6;
+  uint64_t old30 = sendStopAndWait( defaults30, source.data(), r1 );
+  uint64_t old50 = sendStopAndWait( defaults50, source.data(), r2 );
+  uint64_t oldFast = sendStopAndWait( fast15, source.data(), r3 );
+  uint64_t new75 = sendWindowed( fast75, source.data(), r4 );
+  uint64_t new15 = sendWindowed( fast15, source.data(), r5 );
+  uint64_t newSlow = sendWindowed( defaults30, source.data(), r6 );
+  std::vector<uint8_t> stream;
+  std::vector<uint8_t> rows = vendorRows( stream );
+  Receiver r7, r8;
+  uint64_t oldRows = sendStopAndWait( defaults30, rows.data(), r7 );
+  uint64_t newRows = sendWindowed( fast15, stream.data(), r8, stream.size() );
+  // what went on air decodes back to the rows
+  static LZSSDecoder decoder;
+  std::vector<uint8_t> decoded;
+  LZSSDecoderInit( &decoder );
+  LZSSDecompress( &decoder, stream.data(), stream.size(), [&decoded]( uint8_t b ) { decoded.push_back( b ); } );
+  CHECK( decoded == rows );
+  Receiver* receivers[] = { &r1, &r2, &r3, &r4, &r5, &r6, &r7, &r8 };
+  for ( Receiver* r : receivers ) {
+    CHECK( r->received == r->size && !r->corrupt );
+  }
+
+  printf( "  933KB file:\n" );
+  report( "old 512B stop-and-wait, 30ms/27B", old30 );
+  report( "old 512B stop-and-wait, 50ms/27B", old50 );
+  report( "old 512B stop-and-wait, 15ms/251B", oldFast );
+  report( "window, 30ms/27B", newSlow );
+  report( "window, 15ms/251B", new15 );
+  report( "window, 7.5ms/251B", new75 );
+  printf( "  933KB of vendor rows, %d%% once compressed:\n", (int)( stream.size() * 100 / FILE_SIZE ) );
+  report( "old 512B stop-and-wait, 30ms/27B", oldRows );
+  report( "window + LZSS, 15ms/251B", newRows );
+  printf( "  speedup: random %.1fx to %.1fx (old on default params, new on negotiated ones), %.1fx from the sender alone (15ms/251B), rows %.1fx\n",
+    (double)old30 / new15, (double)old50 / new75, (double)oldFast / new15, (double)oldRows / newRows );
+  CHECK( new15 < old30 );
+  CHECK( new15 < oldFast );
+
+  testNoAcks( source.data() );
+  testNack( source.data() );
+  testChunkSize();
+
+  printf( "FileSharingWindow: %s\n", failures == 0 ? "ok" : "FAILED" );
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,121 @@
+/*
+
+  ESP32 BLE Collector - A BLE scanner with sqlite data persistence on the SD Card
+  Source: https://github.com/tobozo/ESP32-BLECollector
+
+  MIT License
+
+  Copyright (c) 2019 tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  -----------------------------------------------------------------------------
+
+*/
+
+/*
+ * Host test for ScanController.h: make -C test
+ *
+ * Simulated arrivals: a crowd of returning devices fills every scan slot
+ * whatever the interval, while new devices show up at a rate that peaks
+ * around interval 0x40 (+/-10% noise per round). The controller must climb to that peak from the
+ * new devices alone, and stay within its bounds.
+ */
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include "../ScanController.h"
+
+static int failures = 0;
+
+#define CHECK( cond ) do { if ( !( cond ) ) { printf( "%s:%d: CHECK( %s ) failed\n", __FILE__, __LINE__, #cond ); failures++; } } while ( 0 )
+
+#define SLOTS     64
+#define PEAK      0x40
+#define PEAK_RATE 3.0 // new devices per scan second at the peak
+
+
+static float newDevicesRate( uint16_t interval ) {
+  float rate = PEAK_RATE - fabs( (float)interval - PEAK ) / 40.0;
+  return rate > 0 ? rate : 0;
+}
+
+
+static ScanRoundMeasure simulate( const ScanParams &p ) {
+  ScanRoundMeasure m;
+  m.scanMillis    = p.duration * 1000;
+  m.processMillis = 500;
+  m.devices       = SLOTS; // returning devices saturate the slots
+  float noise     = 0.9 + 0.2 * ( rand() % 1000 ) / 1000.0; // +/-10%
+  m.newDevices    = (uint16_t)( newDevicesRate( p.interval ) * p.duration * noise );
+  m.dbWrites      = m.newDevices;
+  return m;
+}
+
+
+static void testClimbsToPeak( uint16_t startInterval ) {
+  ScanController controller( 5, 30, SLOTS );
+  controller.maxDBWrites = 100; // keep the duty cycle out of the way
+  ScanParams initial;
+  initial.interval = startInterval;
+  initial.window   = startInterval / 2;
+  controller.begin( initial );
+
+  uint16_t lowest = 0xffff, highest = 0;
+  for ( int round = 0; round < 150; round++ ) {
+    const ScanParams &p = controller.next( simulate( controller.get() ) );
+    CHECK( p.interval >= controller.minInterval && p.interval <= controller.maxInterval );
+    CHECK( p.window <= p.interval );
+    if ( round >= 100 ) { // settled: oscillates around the peak
+      if ( p.interval < lowest )  lowest  = p.interval;
+      if ( p.interval > highest ) highest = p.interval;
+    }
+  }
+  printf( "  start 0x%02x: settled in [0x%02x, 0x%02x], %.2f new devices/s\n", startInterval, lowest, highest, controller.discoveryRate );
+  CHECK( lowest  >= PEAK * 0.75 );
+  CHECK( highest <= PEAK * 1.25 );
+  CHECK( controller.discoveryRate > PEAK_RATE * 0.8 * 0.9 ); // round time includes the pipeline
+}
+
+
+static void testReturningDevicesDontCount() {
+  ScanController controller( 5, 30, SLOTS );
+  controller.begin( ScanParams() );
+  ScanRoundMeasure m;
+  m.scanMillis = 20000;
+  m.devices    = SLOTS;
+  m.newDevices = 0;
+  controller.next( m );
+  CHECK( controller.discoveryRate == 0 );
+  CHECK( controller.arrivalRate > 0 );
+}
+
+
+int main() {
+  srand( 1 );
+  testClimbsToPeak( 0x50 );
+  testClimbsToPeak( 0x20 );
+  testClimbsToPeak( 0xA0 );
+  testReturningDevicesDontCount();
+  printf( "ScanController: %s\n", failures == 0 ? "ok" : "FAILED" );
+  return failures == 0 ? 0 : 1;
+}